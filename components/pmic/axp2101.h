@@ -4,6 +4,7 @@
 #define APX2101_REG_PMU_STAT_1      0x00
 
 #define APX2101_REG_CHARGE_EN   0x18
+#define APX2101_REG_LOW_BATT_WARN   0x1A
 
 #define APX2101_REG_MON_VBAT_BASE   0x34
 #define APX2101_REG_MON_TS_BASE     0x36
@@ -14,6 +15,8 @@
 #define APX2101_REG_SLEEP_WAKE  0x26
 #define APX2101_REG_LEVEL_DUR   0x27
 #define APX2101_REG_ADC_EN      0x30
+#define APX2101_REG_INTEN1      0x40    // to INTEN3 at 0x42
+#define APX2101_REG_INTSTS1     0x48    // to INTSTS3 at 0x4A, write 1 to clear
 #define APX2101_REG_MAIN_CHARGE_VOLT 0x64
 #define APX2101_REG_CHGLED_CNT  0x69
 #define APX2101_REG_BUTTON_TERM_VOLT 0x6A
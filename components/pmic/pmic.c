@@ -1,61 +1,183 @@
 #include "axp2101.h"
 #include "pmic.h"
 #include <string.h>
+#ifndef UNIT_TEST
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_attr.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#endif
 
 #define I2C_READ_WAIT       pdMS_TO_TICKS(500)
 
 typedef uint8_t u8;
 typedef uint16_t u16;
+typedef uint32_t u32;
 
 // global i2c device handler
 i2c_master_dev_handle_t i2cDevPmic;
 
+/*
+ * With a trans_queue_depth set, every transaction on the bus is async: i2c_master_transmit() and co.
+ * return once it's queued, and on_trans_done tells when it's done. Whatever a transaction sends or
+ * receives is kept here rather than on the stack, it must outlive a caller that gave up waiting
+ */
+static SemaphoreHandle_t pmicMutex;         // one user of the buffers below at a time
+static SemaphoreHandle_t pmicXferDone;      // given by every transaction done
+static volatile bool pmicXferFailed;        // a transaction since pmicXferBegin() didn't get an ACK
+static u8 xferBuf[1 + PMIC_IRQ_REGS];         // the register address, then what's written
+static u8 xferRead[PMIC_IRQ_REGS];
+static pmicTelemetry telemBuf;
+// the telemetry registers are in three places, a burst each, see pmicTelemetry
+static const u8 telemRegs[3] = {APX2101_REG_PMU_STAT_1, APX2101_REG_MON_VBAT_BASE, APX2101_REG_BATT_PERC};
+
 esp_err_t axp2101RegRead(u8 reg, u8 *val);
 esp_err_t axp2101RegWrite(u8 reg, u8 val);
 
+static bool IRAM_ATTR pmicXferDoneCb(i2c_master_dev_handle_t dev, const i2c_master_event_data_t *evt, void *arg){
+    BaseType_t woken = pdFALSE;
+
+    (void)dev;
+    (void)arg;
+    if(evt->event != I2C_EVENT_DONE){
+        pmicXferFailed = true;
+    }
+    xSemaphoreGiveFromISR(pmicXferDone, &woken);
+    return woken == pdTRUE;
+}
+
+/**
+ * Starts a set of transactions, must hold pmicMutex
+ */
+static void pmicXferBegin(void){
+    // the completion of one given up on before
+    while(xSemaphoreTake(pmicXferDone, 0) == pdTRUE){
+    }
+    pmicXferFailed = false;
+}
+
+/**
+ * Sleeps until the cnt transactions queued since pmicXferBegin() are done
+ */
+static esp_err_t pmicXferWait(u32 cnt){
+    for(u32 i = 0; i < cnt; i++){
+        if(xSemaphoreTake(pmicXferDone, I2C_READ_WAIT) != pdTRUE){
+            return ESP_ERR_TIMEOUT;
+        }
+    }
+    return pmicXferFailed ? ESP_FAIL : ESP_OK;
+}
+
+/**
+ * Reads len registers from reg in a single burst, up to PMIC_IRQ_REGS
+ */
+static esp_err_t pmicBurstRead(u8 reg, u8 *val, u32 len){
+    esp_err_t ret;
+
+    xSemaphoreTake(pmicMutex, portMAX_DELAY);
+    pmicXferBegin();
+    xferBuf[0] = reg;
+    ret = i2c_master_transmit_receive(i2cDevPmic, xferBuf, 1, xferRead, len, I2C_READ_WAIT);
+    if(ret == ESP_OK){
+        ret = pmicXferWait(1);
+    }
+    if(ret == ESP_OK){
+        memcpy(val, xferRead, len);
+    }
+    xSemaphoreGive(pmicMutex);
+    return ret;
+}
+
+/**
+ * Writes len registers from reg in a single burst, up to PMIC_IRQ_REGS
+ */
+static esp_err_t pmicBurstWrite(u8 reg, const u8 *val, u32 len){
+    esp_err_t ret;
+
+    xSemaphoreTake(pmicMutex, portMAX_DELAY);
+    pmicXferBegin();
+    xferBuf[0] = reg;
+    memcpy(&xferBuf[1], val, len);
+    ret = i2c_master_transmit(i2cDevPmic, xferBuf, 1 + len, I2C_READ_WAIT);
+    if(ret == ESP_OK){
+        ret = pmicXferWait(1);
+    }
+    xSemaphoreGive(pmicMutex);
+    return ret;
+}
+
 esp_err_t axp2101RegRead(u8 reg, u8 *val){
-    return i2c_master_transmit_receive(i2cDevPmic, &reg, 1, val, 1, I2C_READ_WAIT);
+    return pmicBurstRead(reg, val, 1);
 }
 
 esp_err_t axp2101RegWrite(u8 reg, u8 val){
-    const u8 toWrite[2] = {reg, val};
-    return i2c_master_transmit(i2cDevPmic, toWrite, 2, I2C_READ_WAIT);
+    return pmicBurstWrite(reg, &val, 1);
 }
 
-#define MACRO_GET_VOLT_FROM_REG(_OUT, _REG, _OFF) \
-    tmp16 = ((u16)_REG[_OFF] << 8) | _REG[_OFF+1];   \
-    tmp16 &= 0x1FFF;                                \
-    _OUT = (tmp16 / 1000.0);                      \
+esp_err_t pmicGetTelemetry(pmicTelemetry *telemetry){
+    u8 * const dst[3] = {telemBuf.stat, telemBuf.adc, &telemBuf.battPct};
+    const size_t len[3] = {sizeof(telemBuf.stat), sizeof(telemBuf.adc), sizeof(telemBuf.battPct)};
+    esp_err_t ret = ESP_OK;
+    esp_err_t waitRet;
+    u32 queued = 0;
+
+    xSemaphoreTake(pmicMutex, portMAX_DELAY);
+    pmicXferBegin();
+    // queued back to back, then a single sleep until the last one is done
+    for(u32 i = 0; i < 3 && ret == ESP_OK; i++){
+        ret = i2c_master_transmit_receive(i2cDevPmic, &telemRegs[i], 1, dst[i], len[i], I2C_READ_WAIT);
+        if(ret == ESP_OK){
+            queued++;
+        }
+    }
+    waitRet = pmicXferWait(queued);
+    if(ret == ESP_OK){
+        ret = waitRet;
+    }
+    if(ret == ESP_OK){
+        memcpy(telemetry, &telemBuf, sizeof(pmicTelemetry));
+    }
+    xSemaphoreGive(pmicMutex);
+    return ret;
+}
 
-void pmicGetTelemetry(pmicTelemetry *telemetry){
-    u8 voltsRegs[2*4];
-    u8 reg = APX2101_REG_MON_VBAT_BASE;
-    u16 tmp16;
-    u8 tmp8;
+esp_err_t pmicIrqEnable(u32 mask){
+    const u8 en[PMIC_IRQ_REGS] = {mask & 0xFF, (mask >> 8) & 0xFF, (mask >> 16) & 0xFF};
+    const u8 all[PMIC_IRQ_REGS] = {0xFF, 0xFF, 0xFF};
+    esp_err_t ret;
 
-    i2c_master_transmit_receive(i2cDevPmic, &reg, 1, voltsRegs, 8, I2C_READ_WAIT);
+    ret = pmicBurstWrite(APX2101_REG_INTEN1, en, PMIC_IRQ_REGS);
+    if(ret == ESP_OK){
+        ret = pmicBurstWrite(APX2101_REG_INTSTS1, all, PMIC_IRQ_REGS);
+    }
+    return ret;
+}
 
-    MACRO_GET_VOLT_FROM_REG(telemetry->battVolt, voltsRegs, 0);
-    MACRO_GET_VOLT_FROM_REG(telemetry->vBusVolt, voltsRegs, 4);
-    MACRO_GET_VOLT_FROM_REG(telemetry->sysVolt, voltsRegs, 6);
+esp_err_t pmicIrqReadClear(u32 *irqs){
+    u8 sts[PMIC_IRQ_REGS];
+    esp_err_t ret;
 
-    axp2101RegRead(APX2101_REG_BATT_PERC, &tmp8);
-    telemetry->battPercentage = tmp8;
+    *irqs = 0;
+    ret = pmicBurstRead(APX2101_REG_INTSTS1, sts, PMIC_IRQ_REGS);
+    if(ret != ESP_OK){
+        return ret;
+    }
+    *irqs = sts[0] | ((u32)sts[1] << 8) | ((u32)sts[2] << 16);
+    if(*irqs == 0){
+        return ESP_OK;
+    }
+    // only what was read, so one raised since then keeps the IRQ pin low
+    return pmicBurstWrite(APX2101_REG_INTSTS1, sts, PMIC_IRQ_REGS);
+}
 
-    // yes I know it's not the voltage registers we are using, I am just re-using that same array :/
-    reg = APX2101_REG_PMU_STAT_1;
-    i2c_master_transmit_receive(i2cDevPmic, &reg, 1, voltsRegs, 2, I2C_READ_WAIT);
+void pmicLock(void){
+    xSemaphoreTake(pmicMutex, portMAX_DELAY);
+}
 
-    telemetry->vBusGood = ((voltsRegs[0] & (1 << 5)) != 0);
-    telemetry->battPresent = ((voltsRegs[0] & (1 << 3)) != 0);
-    telemetry->currLimited = ((voltsRegs[0] & (1 << 0)) != 0);
-    telemetry->chargeDir = (voltsRegs[1] >> 5) & 0b11;
-    telemetry->chargeStat = voltsRegs[1] & 0b111;
+void pmicUnlock(void){
+    xSemaphoreGive(pmicMutex);
 }
-#undef MACRO_GET_VOLT_FROM_REG
 
 void pmicDisableLDOs(void){
     axp2101RegWrite(APX2101_REG_LDO_EN0, 0x04);     // disable all LDOs except for e-ink one
@@ -84,6 +206,14 @@ void pmicInit(i2c_master_bus_handle_t *masterHandle){
     dev_cfg.scl_speed_hz    = 250000;
     ESP_ERROR_CHECK(i2c_master_bus_add_device(*masterHandle, &dev_cfg, &i2cDevPmic));
 
+    const i2c_master_event_callbacks_t cbs = {
+        .on_trans_done = pmicXferDoneCb,
+    };
+    pmicMutex = xSemaphoreCreateMutex();
+    pmicXferDone = xSemaphoreCreateCounting(PMIC_I2C_QUEUE_DEPTH, 0);
+    configASSERT( pmicMutex && pmicXferDone );
+    ESP_ERROR_CHECK(i2c_master_register_event_callbacks(i2cDevPmic, &cbs, NULL));
+
     // init device
     u8 wakeReg;
     ESP_ERROR_CHECK(axp2101RegRead(APX2101_REG_SLEEP_WAKE, &wakeReg));
@@ -98,6 +228,7 @@ void pmicInit(i2c_master_bus_handle_t *masterHandle){
     axp2101RegWrite(APX2101_REG_MAIN_CHARGE_VOLT, 0b010);        // 4.1v max charge
     axp2101RegWrite(APX2101_REG_BUTTON_TERM_VOLT, 0b111);        // 3.3v termination for button
     axp2101RegWrite(APX2101_REG_CHARGE_EN, 0b1110);         // enable gauge module, button charging, main cell charging, disable watchdog
+    axp2101RegWrite(APX2101_REG_LOW_BATT_WARN, ((PMIC_BATT_WARN_PCT - 5) << 4) | PMIC_BATT_CRITICAL_PCT);
     axp2101RegWrite(APX2101_REG_DCDCS_CTRL, 0x01);          // only enable DC1 output
     // set DC1 output to 3.3v
     axp2101RegWrite(APX2101_REG_DC1_VOLT, APX2101_DCDC_VOLT_3V3);
@@ -107,4 +238,4 @@ void pmicInit(i2c_master_bus_handle_t *masterHandle){
     // set LDO output voltages (3.3v)
     axp2101RegWrite(APX2101_REG_ALDO3_VOLT, APX2101_ALDO_VOLT_3V3);
     axp2101RegWrite(APX2101_REG_ALDO4_VOLT, APX2101_ALDO_VOLT_3V3);
-}
\ No newline at end of file
+}
@@ -1,8 +1,16 @@
 #ifndef PMIC_H
 #define PMIC_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#ifndef UNIT_TEST
 #include "driver/i2c_master.h"
+#else
+#include "mock.h"
+#endif
 
+// the telemetry is read with async transactions, the I2C bus needs a trans_queue_depth of at least this
+#define PMIC_I2C_QUEUE_DEPTH    4
 
 typedef enum{
     PMIC_CHR_DIR_STANDBY = 0,
@@ -19,23 +27,81 @@ typedef enum{
     PMIC_CHR_STAT_NO_CHARGE = 5,
 }pmicChrStat;
 
+/**
+ * The telemetry registers as read from the AXP2101, decoded with the pmicXxx() helpers below when needed
+ */
 typedef struct{
-    float battVolt;
-    float vBusVolt;
-    float sysVolt;
-    uint8_t battPercentage;
-    uint8_t vBusGood;
-    uint8_t battPresent;
-    uint8_t currLimited;
-    pmicChrDir_e chargeDir;
-    pmicChrStat chargeStat;
+    uint8_t stat[2];            // PMU_STAT_1 and 2
+    uint8_t adc[8];             // from MON_VBAT_BASE: VBAT, TS, VBUS and VSYS, 14 bits big endian each
+    uint8_t battPct;            // BATT_PERC
 }pmicTelemetry;
 
+// offsets in pmicTelemetry.adc
+#define PMIC_ADC_VBAT       0
+#define PMIC_ADC_VBUS       4
+#define PMIC_ADC_VSYS       6
+#define PMIC_ADC_MASK       0x1FFF  // the voltages are 1 mV a bit
+
+static inline uint16_t pmicAdcMv(const pmicTelemetry *t, uint32_t off){
+    return (((uint16_t)t->adc[off] << 8) | t->adc[off + 1]) & PMIC_ADC_MASK;
+}
+
+static inline uint16_t pmicBattMv(const pmicTelemetry *t){ return pmicAdcMv(t, PMIC_ADC_VBAT); }
+static inline uint16_t pmicVBusMv(const pmicTelemetry *t){ return pmicAdcMv(t, PMIC_ADC_VBUS); }
+static inline uint16_t pmicSysMv(const pmicTelemetry *t){ return pmicAdcMv(t, PMIC_ADC_VSYS); }
+static inline uint8_t pmicBattPct(const pmicTelemetry *t){ return t->battPct; }
+static inline bool pmicVBusGood(const pmicTelemetry *t){ return (t->stat[0] & (1 << 5)) != 0; }
+static inline bool pmicBattPresent(const pmicTelemetry *t){ return (t->stat[0] & (1 << 3)) != 0; }
+static inline bool pmicCurrLimited(const pmicTelemetry *t){ return (t->stat[0] & (1 << 0)) != 0; }
+static inline pmicChrDir_e pmicChargeDir(const pmicTelemetry *t){ return (t->stat[1] >> 5) & 0b11; }
+static inline pmicChrStat pmicChargeStat(const pmicTelemetry *t){ return t->stat[1] & 0b111; }
+
+/*
+ * The IRQs of pmicIrqEnable() and pmicIrqReadClear(), INTSTS1 to 3 as one, INTSTS1 in the low byte. The
+ * IRQ pin is low while any enabled one is raised
+ */
+#define PMIC_IRQ_BATT_WARN      (1UL << 6)      // the fuel gauge dropped to PMIC_BATT_WARN_PCT
+#define PMIC_IRQ_BATT_CRITICAL  (1UL << 7)      // and to PMIC_BATT_CRITICAL_PCT
+#define PMIC_IRQ_KEY_LONG       (1UL << 10)     // the power key
+#define PMIC_IRQ_KEY_SHORT      (1UL << 11)
+#define PMIC_IRQ_BATT_REMOVE    (1UL << 12)
+#define PMIC_IRQ_BATT_INSERT    (1UL << 13)
+#define PMIC_IRQ_VBUS_REMOVE    (1UL << 14)
+#define PMIC_IRQ_VBUS_INSERT    (1UL << 15)
+#define PMIC_IRQ_CHARGE_START   (1UL << 19)
+#define PMIC_IRQ_CHARGE_DONE    (1UL << 20)
+#define PMIC_IRQ_REGS           3
+
+#define PMIC_BATT_WARN_PCT      10          // %, 5 to 20
+#define PMIC_BATT_CRITICAL_PCT  5           // %, 0 to 15
+
 void pmicInit(i2c_master_bus_handle_t *masterHandle);
-void pmicGetTelemetry(pmicTelemetry *telemetry);
+
+/**
+ * Enables the IRQs of mask and disables the rest, clearing any raised before
+ */
+esp_err_t pmicIrqEnable(uint32_t mask);
+
+/**
+ * Reads the raised IRQs and clears them, the ones raised in between stay raised
+ */
+esp_err_t pmicIrqReadClear(uint32_t *irqs);
+
+/**
+ * Reads the telemetry registers, the calling task sleeps until they're in
+ *
+ * Returns ESP_OK, or an error with telemetry left as it was
+ */
+esp_err_t pmicGetTelemetry(pmicTelemetry *telemetry);
+
+/**
+ * Holds off every other PMIC transaction, so a task using the PMIC can be deleted between two of them
+ */
+void pmicLock(void);
+void pmicUnlock(void);
 
 void pmicDisableLDOs(void);
 void pmicEnableLDOs(void);
 void pmicDisableLDOsAll(void);
 
-#endif
\ No newline at end of file
+#endif
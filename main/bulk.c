@@ -0,0 +1,337 @@
+#include <string.h>
+#include <errno.h>
+#ifndef UNIT_TEST
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+#else
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "mock.h"
+#endif
+
+#include "common.h"
+#include "main.h"
+#include "bulk.h"
+#include "eink.h"
+#include "fileSys.h"
+#include "trace.h"
+#include "wifiPwr.h"
+
+static const char *TAG = "bulk";
+
+static u8 bulkChunkBuff[BULK_CHUNK_SIZE];      // for payloads not received straight to their destination
+
+/********** CRC **********/
+static u32 crcTable[256];
+static bool crcTableInit = false;
+
+u32 bulkCrc32(u32 crc, const u8 *dat, u32 len){
+    if(!crcTableInit){
+        for(u32 i = 0; i < 256; i++){
+            u32 c = i;
+            for(int k = 0; k < 8; k++){
+                c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+            }
+            crcTable[i] = c;
+        }
+        crcTableInit = true;
+    }
+
+    crc = ~crc;
+    while(len--){
+        crc = crcTable[(crc ^ *dat++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/********** Socket helpers **********/
+static u32 getLe32(const u8 *p){
+    return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static void putLe32(u8 *p, u32 val){
+    p[0] = val;
+    p[1] = val >> 8;
+    p[2] = val >> 16;
+    p[3] = val >> 24;
+}
+
+/**
+ * Receives exactly len bytes
+ *
+ * Returns 0 on success, 1 if the peer closed the connection before any byte, -1 on error
+ */
+static int recvAll(int sock, u8 *buff, u32 len){
+    u32 got = 0;
+    int r;
+
+    while(got < len){
+        r = recv(sock, buff + got, len - got, 0);
+        if(r == 0){
+            return got == 0 ? 1 : -1;
+        }
+        if(r < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        got += r;
+    }
+    return 0;
+}
+
+static int sendAck(int sock, u8 type, bulkStat_e stat, u32 crc){
+    u8 raw[BULK_ACK_LEN];
+    u32 sent = 0;
+    int r;
+
+    raw[0] = BULK_MAGIC & 0xFF;
+    raw[1] = BULK_MAGIC >> 8;
+    raw[2] = type;
+    raw[3] = stat;
+    putLe32(&raw[4], crc);
+
+    while(sent < sizeof(raw)){
+        r = send(sock, raw + sent, sizeof(raw) - sent, 0);
+        if(r < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        sent += r;
+    }
+    return 0;
+}
+
+/**
+ * Receives and throws away a payload, so the stream stays in sync after a message is refused
+ */
+static int recvDrain(int sock, u32 len, u32 *crc){
+    u32 toRead;
+
+    while(len > 0){
+        toRead = len < BULK_CHUNK_SIZE ? len : BULK_CHUNK_SIZE;
+        if(recvAll(sock, bulkChunkBuff, toRead)){
+            return -1;
+        }
+        *crc = bulkCrc32(*crc, bulkChunkBuff, toRead);
+        len -= toRead;
+    }
+    return 0;
+}
+
+/********** Message handlers **********/
+/**
+ * Received straight into the display frame buffer, the CRC is only known once it was written. A bad
+ * CRC leaves the region corrupted, but the display is not updated so it can just be sent again
+ */
+static int handleRegion(int sock, const bulkHeader_t *hdr, bulkStat_e *stat, u32 *crc){
+    u8 *fb;
+
+    fb = takeDispFb(pdMS_TO_TICKS(1000));
+    if(fb == NULL){
+        *stat = BULK_STAT_BUSY;
+        return recvDrain(sock, hdr->len, crc);
+    }
+
+    if(recvAll(sock, fb + hdr->offset, hdr->len)){
+        releaseDispFb();
+        return -1;
+    }
+    *crc = bulkCrc32(0, fb + hdr->offset, hdr->len);
+    releaseDispFb();
+
+    *stat = *crc == hdr->crc ? BULK_STAT_OK : BULK_STAT_BAD_CRC;
+    return 0;
+}
+
+static int handleFile(int sock, const bulkHeader_t *hdr, bulkStat_e *stat, u32 *crc){
+    static fSysImgWriter_t writer;
+    char imgName[MAX_IMAGE_NAME_LEN];
+    u32 remaining;
+    u32 toRead;
+    bool writing;
+    fSysRet fSysStat;
+    int ret = 0;
+
+    if(recvAll(sock, (u8 *)imgName, MAX_IMAGE_NAME_LEN)){
+        return -1;
+    }
+    *crc = bulkCrc32(0, (u8 *)imgName, MAX_IMAGE_NAME_LEN);
+    imgName[MAX_IMAGE_NAME_LEN-1] = '\0';
+
+    fSysStat = fileSysImageWriteBegin(imgName, &writer);
+    writing = fSysStat == FILE_SYS_RET_OK;
+    if(writing){
+        *stat = BULK_STAT_OK;
+    } else {
+        *stat = fSysStat == FILE_SYS_INVALID_NAME ? BULK_STAT_BAD_NAME : BULK_STAT_IO_ERR;
+    }
+
+    // the payload is still received on errors, to stay in sync
+    remaining = hdr->len - MAX_IMAGE_NAME_LEN;
+    while(remaining > 0){
+        toRead = remaining < BULK_CHUNK_SIZE ? remaining : BULK_CHUNK_SIZE;
+        if(recvAll(sock, bulkChunkBuff, toRead)){
+            ret = -1;
+            break;
+        }
+        *crc = bulkCrc32(*crc, bulkChunkBuff, toRead);
+        if(writing && fileSysImageWriteChunk(&writer, bulkChunkBuff, toRead)){
+            fileSysImageWriteEnd(&writer, false);
+            writing = false;
+            *stat = BULK_STAT_IO_ERR;
+        }
+        remaining -= toRead;
+    }
+
+    if(writing){
+        // only replace the image if all of it made it intact
+        if(ret == 0 && *crc != hdr->crc){
+            *stat = BULK_STAT_BAD_CRC;
+        }
+        if(fileSysImageWriteEnd(&writer, ret == 0 && *stat == BULK_STAT_OK)){
+            *stat = BULK_STAT_IO_ERR;
+        }
+    }
+    return ret;
+}
+
+/**
+ * Checks that a header can be processed
+ */
+static bulkStat_e checkHeader(const bulkHeader_t *hdr){
+    if(hdr->magic != BULK_MAGIC){
+        return BULK_STAT_BAD_MAGIC;
+    }
+    switch(hdr->type){
+        case BULK_MSG_REGION:
+            if(hdr->len > DISP_FB_SIZE || hdr->offset > DISP_FB_SIZE - hdr->len){
+                return BULK_STAT_BAD_LEN;
+            }
+            return BULK_STAT_OK;
+        case BULK_MSG_FILE:
+            if(hdr->len != MAX_IMAGE_NAME_LEN + DISP_FB_SIZE){
+                return BULK_STAT_BAD_LEN;
+            }
+            return BULK_STAT_OK;
+        case BULK_MSG_CMD:
+            if(hdr->len != 0){
+                return BULK_STAT_BAD_LEN;
+            }
+            if(hdr->offset != BULK_CMD_PING && hdr->offset != BULK_CMD_UPDATE){
+                return BULK_STAT_BAD_TYPE;
+            }
+            return BULK_STAT_OK;
+        default:
+            return BULK_STAT_BAD_TYPE;
+    }
+}
+
+int bulkServeConn(int sock){
+    u8 raw[BULK_HEADER_LEN];
+    bulkHeader_t hdr;
+    bulkStat_e stat;
+    u32 crc;
+    int r;
+    struct timeval timeout = {
+        .tv_sec = BULK_RECV_TIMEOUT_MS / 1000,
+        .tv_usec = (BULK_RECV_TIMEOUT_MS % 1000) * 1000,
+    };
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    for(EVER){
+        r = recvAll(sock, raw, BULK_HEADER_LEN);
+        if(r){
+            return r > 0 ? 0 : -1;
+        }
+        hdr.magic = raw[0] | (raw[1] << 8);
+        hdr.type = raw[2];
+        hdr.flags = raw[3];
+        hdr.offset = getLe32(&raw[4]);
+        hdr.len = getLe32(&raw[8]);
+        hdr.crc = getLe32(&raw[12]);
+
+        stat = checkHeader(&hdr);
+        if(stat != BULK_STAT_OK){
+            // can't tell where the next message starts, give up on the connection
+            ESP_LOGW(TAG, "Invalid message header, stat %d", stat);
+            sendAck(sock, hdr.type, stat, 0);
+            return -1;
+        }
+
+        crc = 0;
+        TRACE_BEGIN("bulkMsg");
+        switch(hdr.type){
+            case BULK_MSG_REGION:
+                r = handleRegion(sock, &hdr, &stat, &crc);
+                break;
+            case BULK_MSG_FILE:
+                r = handleFile(sock, &hdr, &stat, &crc);
+                break;
+            default:
+                r = 0;
+                if(hdr.offset == BULK_CMD_UPDATE){
+                    dispRequestUpdate(DISP_PRIO_INTERACTIVE);
+                }
+                break;
+        }
+        TRACE_END("bulkMsg");
+        if(r){
+            ESP_LOGW(TAG, "Connection lost while receiving a payload");
+            return -1;
+        }
+
+        if(stat == BULK_STAT_OK && (hdr.flags & BULK_FLAG_UPDATE)){
+            dispRequestUpdate(DISP_PRIO_INTERACTIVE);
+        }
+        if(sendAck(sock, hdr.type, stat, crc)){
+            return -1;
+        }
+    }
+}
+
+#if defined(CONFIG_APP_BULK_PORT_ENABLE) && !defined(UNIT_TEST)
+/**
+ * Accepts connections on the bulk port, serving one at a time
+ */
+static void taskBulkServer(void *args){
+    struct sockaddr_in addr = {0};
+    int listenSock;
+    int sock;
+
+    listenSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(CONFIG_APP_BULK_PORT);
+    if(listenSock < 0 || bind(listenSock, (struct sockaddr *)&addr, sizeof(addr)) || listen(listenSock, 1)){
+        ESP_LOGE(TAG, "Unable to listen on port %d", CONFIG_APP_BULK_PORT);
+        vTaskDelete(NULL);
+        return;
+    }
+    ESP_LOGI(TAG, "Listening on port %d", CONFIG_APP_BULK_PORT);
+
+    for(EVER){
+        sock = accept(listenSock, NULL, NULL);
+        if(sock < 0){
+            delayMs(100);
+            continue;
+        }
+        ESP_LOGI(TAG, "Client connected");
+        wifiPwrBusyBegin();
+        bulkServeConn(sock);
+        wifiPwrBusyEnd();
+        close(sock);
+        ESP_LOGI(TAG, "Client disconnected");
+    }
+}
+#endif
+
+void bulkInit(void){
+#if defined(CONFIG_APP_BULK_PORT_ENABLE) && !defined(UNIT_TEST)
+    xTaskCreatePinnedToCore(taskBulkServer, "bulk", 4096, NULL, 3,
+                            NULL, 0);
+#endif
+}
@@ -0,0 +1,83 @@
+#ifndef BULK_H
+#define BULK_H
+
+#include "common.h"
+
+/**
+ * Bulk frame port, a length prefixed binary protocol on its own TCP port to push frames faster than
+ * the http API can. Enabled with CONFIG_APP_BULK_PORT_ENABLE
+ *
+ * Every message is a bulkHeader_t followed by len bytes of payload. Each message is answered with a
+ * bulkAck_t. All fields are little endian. See tests/bulkClient.py for a reference client
+ */
+
+#define BULK_MAGIC              0x4B42      // "BK"
+#define BULK_HEADER_LEN         16          // bytes, on the wire
+#define BULK_ACK_LEN            8           // bytes, on the wire
+#define BULK_RECV_TIMEOUT_MS    10000       // mS, a connection is dropped if it stays silent for longer
+#define BULK_CHUNK_SIZE         4096        // bytes, how much payload is received at a time for files
+
+typedef enum{
+    BULK_MSG_REGION = 1,        // payload goes to the display frame buffer at offset. A whole frame is
+                                // a region of DISP_FB_SIZE at offset 0
+    BULK_MSG_FILE = 2,          // payload is a MAX_IMAGE_NAME_LEN name (NUL padded) followed by a frame
+                                // buffer, saved as an image file. Only saved if the CRC matches
+    BULK_MSG_CMD = 3,           // no payload, offset is the bulkCmd_e to execute
+}bulkMsgType_e;
+
+typedef enum{
+    BULK_FLAG_UPDATE = 0x01,    // update the display once the message is successfully processed
+}bulkFlags_e;
+
+typedef enum{
+    BULK_CMD_PING = 0,          // does nothing but ack
+    BULK_CMD_UPDATE = 1,        // update the display
+}bulkCmd_e;
+
+typedef enum{
+    BULK_STAT_OK = 0,
+    BULK_STAT_BAD_MAGIC,        // the header is not valid, the connection is closed
+    BULK_STAT_BAD_TYPE,         // unknown message type or command, the connection is closed
+    BULK_STAT_BAD_LEN,          // the length or offset is out of range, the connection is closed
+    BULK_STAT_BAD_CRC,          // the payload CRC did not match
+    BULK_STAT_BUSY,             // the display frame buffer could not be taken, the payload was dropped
+    BULK_STAT_IO_ERR,           // unable to write the image file
+    BULK_STAT_BAD_NAME,         // the image name can't be saved, see fileSysImageNameValid(), the payload was dropped
+}bulkStat_e;
+
+typedef struct{
+    u16 magic;                  // BULK_MAGIC
+    u8 type;                    // bulkMsgType_e
+    u8 flags;                   // bulkFlags_e
+    u32 offset;                 // depends on type
+    u32 len;                    // payload length
+    u32 crc;                    // CRC-32 (same as zlib's) of the payload
+}bulkHeader_t;
+
+typedef struct{
+    u16 magic;                  // BULK_MAGIC
+    u8 type;                    // the message type being answered
+    u8 stat;                    // bulkStat_e
+    u32 crc;                    // the CRC computed over the received payload
+}bulkAck_t;
+
+/**
+ * Starts the bulk port's listening task, if enabled in the config
+ */
+void bulkInit(void);
+
+/**
+ * Serves messages from a connected socket until it is closed or a fatal error occurs
+ *
+ * Returns 0 if the peer closed the connection, non-zero on a protocol or socket error
+ */
+int bulkServeConn(int sock);
+
+/**
+ * Computes a CRC-32, the same as zlib's crc32()
+ *
+ * @param crc The CRC of the previous data, 0 to start
+ */
+u32 bulkCrc32(u32 crc, const u8 *dat, u32 len);
+
+#endif
@@ -46,8 +46,6 @@
 
 #define MAX_IMAGE_NAME_LEN      32
 
-#define MAX_PLAYLIST_IMG       10                  // up to how many images can be added to a playlist
-
 #define MIN_PLAYLIST_DUR        0.5                 // min, minimum duration for playlist
 
 #define DEFAULT_SCAN_IMAGE_DUR_MIN      5           // min, the default duration for the image scan mode
@@ -56,14 +54,23 @@
                                                     // rest of the firmware. This is used to allow programming if we screw
                                                     // up sleep or other runtime settings in the firmware, and to allow
                                                     // reconnection of the serial port in deep sleep debugging
+                                                    // Skipped by holding the button, and never done on a low power playlist wake
+#define BOOT_DELAY_BUTTON_POLL          50          // mS, how often the button is checked during the boot delay
 
 #define PMIC_TELEMETRY_ACQ_DELAY        5000        // mS, how long to wait between each measurement of PMIC stats
+
+#define DISP_LOW_PRIO_DELAY_MS          1000        // mS, how long a playlist refresh waits for other requests to join it,
+                                                    // an interactive request starts it right away
+#define DISP_WAIT_TIMEOUT_MS            45000       // mS, how long a request waits on its refresh when asked to, a
+                                                    // refresh takes a good 20 sec
 ////////// Other defines
 #define EVER    ;;
 
 ////////// Sane typedefs
 typedef uint8_t u8;
+typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
 
 ////////// macros
 #define delayMs(_X)     vTaskDelay(_X / portTICK_PERIOD_MS)
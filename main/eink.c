@@ -8,6 +8,7 @@
 #include "common.h"
 #include "fileSys.h"
 #include "ff.h"
+#include "trace.h"
 
 #define RESET_DISPLAY() gpio_set_level(IO_DISP_RST, 0)
 #define UNRST_DISPLAY() gpio_set_level(IO_DISP_RST, 1)
@@ -87,6 +88,7 @@ void dispInit(void){
 }
 
 void dispBoot(void){
+    TRACE_BEGIN("dispBoot");
     spi_device_acquire_bus(dispSpi, portMAX_DELAY);
 
     memset(&spiTransactSett, 0 ,sizeof(spiTransactSett));
@@ -175,6 +177,7 @@ void dispBoot(void){
     dispWaitBusy();         //waiting for the electronic paper IC to release the idle signal
 
     spi_device_release_bus(dispSpi);
+    TRACE_END("dispBoot");
 }
 
 void dispFillColor(dispColor_e color){
@@ -223,10 +226,12 @@ int setFrameBuffRaw(u8 *data, u32 len, u32 offset){
 }
 
 void dispUpdate(void){
+    TRACE_BEGIN("dispUpdate");
     spi_device_acquire_bus(dispSpi, portMAX_DELAY);
 
     u8 *dat = takeDispFb(portMAX_DELAY);
     if(dat == NULL){
+        TRACE_END("dispUpdate");
         return;
     }
     dispBeginCmd(0x10);
@@ -247,6 +252,7 @@ void dispUpdate(void){
     dispWaitBusy();
 
     spi_device_release_bus(dispSpi);
+    TRACE_END("dispUpdate");
 }
 
 u8* takeDispFb(TickType_t timeout){
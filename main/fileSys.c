@@ -1,40 +1,176 @@
+#include <string.h>
+#include <stdlib.h>
+#ifndef UNIT_TEST
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "ff.h"
 #include "diskio_sdmmc.h"
 #include "esp_log.h"
 #include "esp_task_wdt.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+#else
+#include "mock.h"
+#endif
 
 #include "common.h"
 #include "main.h"
 #include "fileSys.h"
 #include "eink.h"
+#include "trace.h"
 
 static FATFS fs;     /* Pointer to the filesystem object */
 
 static const char *TAG = "fileSys";
 
-WORD_ALIGNED_ATTR EXT_RAM_BSS_ATTR u8 sdCardFrameBuff[DISP_FB_SIZE];
+// image streaming, the stream task fills a buffer while the other is being consumed. The buffers
+// circulate between the two queues by index
+typedef struct{
+    u8 idx;                 // which of streamBuff
+    int len;                // bytes in it, 0 for the end of the stream or negative on a read error
+}streamChunk_t;
+
+static WORD_ALIGNED_ATTR u8 streamBuff[2][FILE_SYS_STREAM_CHUNK_SIZE];
+static FIL streamFile;
+static u32 streamRemaining;             // bytes left to read, only touched by the stream task while running
+static volatile bool streamAbort;       // set to have the stream task end early
+static bool streamDone;                 // the consumer got the end of the stream
+static u8 streamCurrIdx;                // the buffer currently held by the consumer
+static QueueHandle_t streamFreeQueue;   // buffer indexes ready to be filled
+static QueueHandle_t streamFullQueue;   // filled chunks, streamChunk_t
+static TaskHandle_t streamTask_h;
+
+// the free space. FatFS keeps its free cluster count up to date as files are written and removed once it
+// knows it, from the FSINFO sector of FAT32 or from counting the whole FAT, which on a large card takes
+// seconds. The counting is left to a low priority task so a request never waits on it
+#if FF_MAX_SS != FF_MIN_SS
+#define SECTOR_SIZE             (fs.ssize)
+#else
+#define SECTOR_SIZE             FF_MAX_SS
+#endif
+static TaskHandle_t storageTask_h;
+static volatile bool storageScanning;
+static volatile bool storageStale;      // the count from FSINFO can't be trusted, see fileSysIndexSync()
+static u32 storageScans;
+
+// the image index, a file of image records where the position of a record is the image's ID. IDs are never
+// reused, a removed image leaves an empty record behind, so whatever refers to an ID can't end up on
+// another image
+//
+// Images with the same content share a file. The first one keeps its file in the image directory, the
+// others only point to its ID. Deleting the one with the file hands it over to one of the others with a
+// rename, so the content goes with the last of them
+#define INDEX_PATH              PLAYLIST_DIR "/IMAGES.IDX"
+#define INDEX_TMP_PATH          PLAYLIST_DIR "/IMAGES.TMP"     // the index being upgraded
+#define INDEX_MAGIC             0x58444949      // "IIDX"
+#define INDEX_VERSION           2
+#define INDEX_V1_REC_LEN        MAX_IMAGE_NAME_LEN  // version 1 only had the names, it's upgraded in place
+#define INDEX_READ_RECS         8               // records read at once when searching the index
+#define INDEX_REC_HASHED        0x01            // the hash is set, images found by fileSysIndexSync() get it there
+
+typedef struct{
+    u32 magic;
+    u16 version;
+    u16 recLen;                 // sizeof(indexRec_t)
+    fSysIndexInfo_t info;
+}indexHeader_t;
+
+typedef struct{
+    char name[MAX_IMAGE_NAME_LEN];      // empty for a removed image
+    u8 hash[FILE_SYS_HASH_LEN];         // SHA-256 of the content, with INDEX_REC_HASHED
+    u32 owner;                          // ID of the image with the file, its own ID if it has it
+    u32 flags;                          // INDEX_REC_*
+}indexRec_t;
+
+// picks records in indexScanLocked()
+typedef bool (*indexMatch_t)(const indexRec_t *rec, u32 id, const void *arg);
+
+static indexHeader_t indexHdr;          // cached header of the index file, valid once mounted
+static bool indexLoaded = false;
+static SemaphoreHandle_t indexMutex;    // protects the index file, indexHdr, and the image file count
+static u32 imgFiles;                    // images with a file of their own, for fileSysGetStorageInfo()
+static bool imgFilesKnown = false;      // counted from the index, then kept up to date as images change
+
+static fSysRet indexLoad(void);
+static fSysRet indexReadRec(FIL *file, u32 id, indexRec_t *rec);
+static fSysRet indexScanLocked(FIL *file, u32 fromId, indexMatch_t match, const void *arg, u32 *id, indexRec_t *rec);
+static bool matchName(const indexRec_t *rec, u32 id, const void *arg);
+static fSysRet imageStore(const char *imgName, const u8 *hash, const u8 *dat, const char *tmpPath, bool *deduped);
+static fSysRet imageRemove(const char *imgName);
 
 
 static void getImagePath(const char *imgName, char *outName, u32 maxLen){
     snprintf(outName, maxLen, IMAGE_DIR "/%s.RAW", imgName);
 }
 
+bool fileSysImageNameValid(const char *imgName){
+    u32 len;
+
+    for(len = 0; imgName[len]; len++){
+        if(len >= MAX_IMAGE_NAME_LEN - 1 || (unsigned char)imgName[len] < 0x20 || strchr("/\\:*?\"<>|", imgName[len])){
+            return false;
+        }
+    }
+    return len > 0;
+}
+
+// where an image is written to by fileSysImageWriteBegin() until it is complete, numbered so each writer
+// has its own
+#define IMAGE_WRITE_TMP_FMT     IMAGE_DIR "/~W%lu.TMP"
+#define IMAGE_WRITE_TMP_PREFIX  "~W"
+
+static u32 writeTmpSeq;
+
 static void getWebPath(const char *imgName, char *outName, u32 maxLen){
     snprintf(outName, maxLen, WEB_DIR "%s", imgName);
 }
 
 void initFs(void){
     ff_diskio_register_sdmmc(0, &sdCard);
+    if(indexMutex == NULL){
+        indexMutex = xSemaphoreCreateMutex();
+        configASSERT( indexMutex );
+    }
+}
+
+/**
+ * Deletes the temporary files of image writers that never finished, such as from a reset mid upload
+ */
+static void removeWriteTmps(void){
+    char path[128];
+    FF_DIR imageDir;
+    FILINFO fno;
+
+    if(f_opendir(&imageDir, IMAGE_DIR) != FR_OK){
+        return;
+    }
+    for(EVER){
+        if(f_readdir(&imageDir, &fno) != FR_OK || fno.fname[0] == 0){
+            break;
+        }
+        if(strncmp(fno.fname, IMAGE_WRITE_TMP_PREFIX, strlen(IMAGE_WRITE_TMP_PREFIX)) == 0 &&
+           strlen(fno.fname) > 4 && strcmp(fno.fname + strlen(fno.fname) - 4, ".TMP") == 0){
+            snprintf(path, sizeof(path), IMAGE_DIR "/%s", fno.fname);
+            f_unlink(path);
+        }
+    }
+    f_closedir(&imageDir);
 }
 
 fSysRet mountFs(void){
     FILINFO fno;
     FRESULT fsStat;
 
+    TRACE_BEGIN("mountFs");
+
     // mounts the sd card fatfs
     fsStat = f_mount(&fs, "", 1);
     if(fsStat != FR_OK){
         ESP_LOGW(TAG, "Unable to mount fatFS file system");
+        TRACE_END("mountFs");
         return FILE_SYS_UNABLE_MOUNT;
     }
 
@@ -50,9 +186,19 @@ fSysRet mountFs(void){
             break;
         default:
             ESP_LOGD(TAG, "An error occured. (%d)\n", fsStat);
+            TRACE_END("mountFs");
             return FILE_SYS_RET_FAIL;
     }
 
+    removeWriteTmps();
+
+    // the image index and playlists, f_mkdir() just fails if it's already there
+    f_mkdir(PLAYLIST_DIR);
+    if(indexLoad()){
+        ESP_LOGW(TAG, "Unable to load or create the image index");
+    }
+
+    TRACE_END("mountFs");
     return FILE_SYS_RET_OK;
 }
 
@@ -111,6 +257,70 @@ fSysRet fileSysOpenWebAsset(const char *fileName, FIL *file){
     return FILE_SYS_RET_OK;
 }
 
+/**
+ * Lists the images from the index, the only place images sharing a file show up. A manifest has an object
+ * for each, see fileSysIndexGetManifest(), otherwise it's just the names
+ */
+static fSysRet indexListImages(cJSON *jsonArr, u32 *count, bool manifest, fSysIndexInfo_t *info){
+    indexRec_t recs[INDEX_READ_RECS];
+    char hashHex[FILE_SYS_HASH_LEN * 2 + 1];
+    cJSON *jImg;
+    FIL file;
+    UINT nRead;
+    u32 n;
+    fSysRet ret = FILE_SYS_RET_OK;
+
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    if(f_open(&file, INDEX_PATH, FA_READ) != FR_OK){
+        xSemaphoreGive(indexMutex);
+        return FILE_SYS_UNABLE_OPEN;
+    }
+    if(f_lseek(&file, sizeof(indexHeader_t)) != FR_OK){
+        ret = FILE_SYS_UNABLE_READ;
+    }
+    for(u32 base = 0; ret == FILE_SYS_RET_OK && base < indexHdr.info.slots; base += n){
+        n = indexHdr.info.slots - base < INDEX_READ_RECS ? indexHdr.info.slots - base : INDEX_READ_RECS;
+        if(f_read(&file, recs, n * sizeof(indexRec_t), &nRead) != FR_OK || nRead != n * sizeof(indexRec_t)){
+            ret = FILE_SYS_UNABLE_READ;
+            break;
+        }
+        for(u32 i = 0; i < n; i++){
+            if(recs[i].name[0] == '\0'){
+                continue;
+            }
+            recs[i].name[MAX_IMAGE_NAME_LEN-1] = '\0';
+            if(jsonArr && manifest){
+                jImg = cJSON_CreateObject();
+                cJSON_AddNumberToObject(jImg, "id", base + i);
+                cJSON_AddStringToObject(jImg, "name", recs[i].name);
+                // only frame buffers are ever indexed
+                cJSON_AddNumberToObject(jImg, "size", DISP_FB_SIZE);
+                if(recs[i].flags & INDEX_REC_HASHED){
+                    for(u32 j = 0; j < FILE_SYS_HASH_LEN; j++){
+                        sprintf(&hashHex[j*2], "%02x", recs[i].hash[j]);
+                    }
+                    cJSON_AddStringToObject(jImg, "sha256", hashHex);
+                } else {
+                    cJSON_AddNullToObject(jImg, "sha256");
+                }
+                cJSON_AddItemToArray(jsonArr, jImg);
+            } else if(jsonArr){
+                cJSON_AddItemToArray(jsonArr, cJSON_CreateString(recs[i].name));
+            }
+            if(count){
+                (*count)++;
+            }
+        }
+    }
+    // taken under the same lock, so the caller knows exactly which index the list is from
+    if(info){
+        memcpy(info, &indexHdr.info, sizeof(fSysIndexInfo_t));
+    }
+    f_close(&file);
+    xSemaphoreGive(indexMutex);
+    return ret;
+}
+
 fSysRet fileSysGetAvailableImages(cJSON *jsonArr, u32 *count){
     FRESULT fsStat;
     FF_DIR imageDir;
@@ -119,6 +329,10 @@ fSysRet fileSysGetAvailableImages(cJSON *jsonArr, u32 *count){
     cJSON *string_item;
     char *dotIdx;
 
+    if(indexLoaded){
+        return indexListImages(jsonArr, count, false, NULL);
+    }
+
     fsStat = f_opendir(&imageDir, IMAGE_DIR);
     if(fsStat != FR_OK){
         ESP_LOGW(TAG, "Unable to open image directory, even though one should have been made");
@@ -156,36 +370,109 @@ fSysRet fileSysGetAvailableImages(cJSON *jsonArr, u32 *count){
     return FILE_SYS_RET_OK;
 }
 
-fSysRet fileSysIsImageValid(const char *imgName){
-    FILINFO fno;
+/**
+ * Finds the file with the content of an image, its own or the one it shares, and checks it's a frame buffer
+ *
+ * @param path set to the path of the file
+ */
+static fSysRet findImageFile(const char *imgName, char *path, u32 maxLen, FILINFO *fno){
+    FIL file;
+    indexRec_t rec;
+    u32 id;
     FRESULT fsStat;
-    char imagePath[128];
 
-    getImagePath(imgName, imagePath, sizeof(imagePath));
-
-    fsStat = f_stat(imagePath, &fno);
+    // the index has the say on which file an image has, even if there's one with its name. Only an image
+    // copied to the card since the last sync isn't in it, and that one has its own
+    getImagePath(imgName, path, maxLen);
+    if(indexLoaded){
+        xSemaphoreTake(indexMutex, portMAX_DELAY);
+        if(f_open(&file, INDEX_PATH, FA_READ) == FR_OK){
+            if(indexScanLocked(&file, 0, matchName, imgName, &id, &rec) == FILE_SYS_RET_OK && rec.owner != id &&
+               indexReadRec(&file, rec.owner, &rec) == FILE_SYS_RET_OK){
+                getImagePath(rec.name, path, maxLen);
+            }
+            f_close(&file);
+        }
+        // before a delete can hand the file over
+        fsStat = f_stat(path, fno);
+        xSemaphoreGive(indexMutex);
+    } else {
+        fsStat = f_stat(path, fno);
+    }
     if(fsStat != FR_OK){
-        ESP_LOGW(TAG, "File does not exist, exiting");
         return FILE_SYS_NO_FILE_FOUND;
     }
-    if(fno.fsize != DISP_FB_SIZE){
-        ESP_LOGW(TAG, "File size is not that of a frame buffer, exiting!");
+    if(fno->fsize != DISP_FB_SIZE){
         return FILE_SYS_INVALID_FILE;
     }
-
     return FILE_SYS_RET_OK;
 }
 
+/**
+ * findImageFile() for an image ID, a seek and a read of its record (and the one of the image with its
+ * file) rather than a search of the index
+ *
+ * @param imgName set to the name of the image, MAX_IMAGE_NAME_LEN long
+ */
+static fSysRet findImageFileById(u32 id, char *imgName, char *path, u32 maxLen, FILINFO *fno){
+    FIL file;
+    indexRec_t rec;
+    fSysRet ret;
+
+    if(!indexLoaded){
+        return FILE_SYS_RET_FAIL;
+    }
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    if(f_open(&file, INDEX_PATH, FA_READ) != FR_OK){
+        xSemaphoreGive(indexMutex);
+        return FILE_SYS_UNABLE_OPEN;
+    }
+    ret = indexReadRec(&file, id, &rec);
+    if(ret == FILE_SYS_RET_OK && rec.name[0] == '\0'){
+        ret = FILE_SYS_NO_FILE_FOUND;
+    }
+    if(ret == FILE_SYS_RET_OK){
+        memcpy(imgName, rec.name, MAX_IMAGE_NAME_LEN);
+        if(rec.owner != id){
+            ret = indexReadRec(&file, rec.owner, &rec);
+        }
+    }
+    f_close(&file);
+    if(ret == FILE_SYS_RET_OK){
+        getImagePath(rec.name, path, maxLen);
+        if(f_stat(path, fno) != FR_OK){
+            ret = FILE_SYS_NO_FILE_FOUND;
+        } else if(fno->fsize != DISP_FB_SIZE){
+            ret = FILE_SYS_INVALID_FILE;
+        }
+    }
+    xSemaphoreGive(indexMutex);
+    return ret;
+}
+
+fSysRet fileSysIsImageValid(const char *imgName){
+    FILINFO fno;
+    char imagePath[128];
+    fSysRet ret;
+
+    ret = findImageFile(imgName, imagePath, sizeof(imagePath), &fno);
+    if(ret == FILE_SYS_NO_FILE_FOUND){
+        ESP_LOGW(TAG, "File does not exist, exiting");
+    } else if(ret){
+        ESP_LOGW(TAG, "File size is not that of a frame buffer, exiting!");
+    }
+    return ret;
+}
+
 fSysRet fileSysOpenImage(const char *imgName, FIL *file){
     FRESULT fsStat;
+    FILINFO fno;
     fSysRet stat;
     char imagePath[128];
 
-    stat = fileSysIsImageValid(imgName);
+    stat = findImageFile(imgName, imagePath, sizeof(imagePath), &fno);
     if(stat) return stat;
 
-    // yes the last function already got the name...too bad!
-    getImagePath(imgName, imagePath, sizeof(imagePath));
     fsStat = f_open(file, imagePath, FA_READ);
     if(fsStat != FR_OK){
         ESP_LOGW(TAG, "Unable to open file for reading");
@@ -195,28 +482,18 @@ fSysRet fileSysOpenImage(const char *imgName, FIL *file){
     return FILE_SYS_RET_OK;
 }
 
-fSysRet fileSysLoadImage(const char* imgName, u8 *datOut, bool isNameDirect){
+/**
+ * Reads a whole frame buffer from an image file
+ */
+static fSysRet readImageFile(const char *imagePath, u8 *datOut){
     FRESULT fsStat;
     FIL file;
-    char imagePath[128];
     UINT nRead;
     fSysRet ret = FILE_SYS_RET_OK;
 
-    ESP_LOGI(TAG, "Loading image %s", imgName);
-
-    if(isNameDirect){
-        snprintf(imagePath, sizeof(imagePath), IMAGE_DIR "/%s", imgName);
-    } else {
-        ret = fileSysIsImageValid(imgName);
-        if(ret){
-            return ret;
-        }
-        getImagePath(imgName, imagePath, sizeof(imagePath));
-    }
-
     fsStat = f_open(&file, imagePath, FA_READ);
     if(fsStat != FR_OK){
-        ESP_LOGW(TAG, "Unable to open file for writing");
+        ESP_LOGW(TAG, "Unable to open file for reading");
         return FILE_SYS_UNABLE_OPEN;
     }
     fsStat = f_read(&file, datOut, DISP_FB_SIZE, &nRead);
@@ -229,86 +506,1243 @@ fSysRet fileSysLoadImage(const char* imgName, u8 *datOut, bool isNameDirect){
     return ret;
 }
 
-fSysRet fileSysLoadNextImageFromIdx(u32 imgIdx, u8 *datOut){
-    FRESULT fsStat;
+fSysRet fileSysLoadImage(const char* imgName, u8 *datOut, bool isNameDirect){
     FILINFO fno;
-    fSysRet ret;
-    FF_DIR imageDir;
-    int fileCnt = 0;
+    char imagePath[128];
+    fSysRet ret = FILE_SYS_RET_OK;
 
-    fsStat = f_opendir(&imageDir, IMAGE_DIR);
-    if(fsStat != FR_OK){
-        ESP_LOGW(TAG, "Unable to open image directory, even though one should have been made");
-        return FILE_SYS_INVALID_DIR;
-    }
-    while(1){   // todo: timeout
-        fsStat = f_readdir(&imageDir, &fno);
-        if (fno.fname[0] == 0){         // no file around
-            break;
-        }
-        if (fno.fattrib & AM_DIR) {
-            // skip directories for now, a flag structure
-            // todo: maybe allow for sub-structures
-            continue;
+    ESP_LOGI(TAG, "Loading image %s", imgName);
+    TRACE_BEGIN("fileSysLoadImage");
+
+    if(isNameDirect){
+        snprintf(imagePath, sizeof(imagePath), IMAGE_DIR "/%s", imgName);
+    } else {
+        ret = findImageFile(imgName, imagePath, sizeof(imagePath), &fno);
+        if(ret){
+            ESP_LOGW(TAG, "Image %s is missing or not a frame buffer", imgName);
+            TRACE_END("fileSysLoadImage");
+            return ret;
         }
-        if(fileCnt == imgIdx) break;
-        fileCnt++;
     }
-    f_closedir(&imageDir);
 
-    if(fileCnt < imgIdx){
-        return FILE_SYS_NO_FILE_FOUND;
+    ret = readImageFile(imagePath, datOut);
+    TRACE_END("fileSysLoadImage");
+    return ret;
+}
+
+fSysRet fileSysLoadImageById(u32 id, u8 *datOut){
+    FILINFO fno;
+    char imgName[MAX_IMAGE_NAME_LEN];
+    char imagePath[128];
+    fSysRet ret;
+
+    TRACE_BEGIN("fileSysLoadImage");
+    ret = findImageFileById(id, imgName, imagePath, sizeof(imagePath), &fno);
+    if(ret){
+        ESP_LOGW(TAG, "Image %lu is missing or not a frame buffer", id);
+        TRACE_END("fileSysLoadImage");
+        return ret;
     }
+    ESP_LOGI(TAG, "Loading image %s", imgName);
 
-    ret = fileSysLoadImage((const char *)fno.fname, datOut, true);
+    ret = readImageFile(imagePath, datOut);
+    TRACE_END("fileSysLoadImage");
     return ret;
 }
 
-
-fSysRet fileSysSaveImage(const char* imgName){
+/**
+ * Writes the content of an image to its file, from a buffer or the temporary file of
+ * fileSysImageWriteBegin() at tmpPath
+ */
+static fSysRet writeImageFile(const char *imagePath, const u8 *dat, const char *tmpPath){
     FRESULT fsStat;
     FIL file;
-    char imagePath[128];
     UINT nWritten;
 
-    getImagePath(imgName, imagePath, sizeof(imagePath));
-
-    ESP_LOGI(TAG, "Started write to file %s", imagePath);
+    if(tmpPath){
+        // f_rename won't overwrite, so the old image has to go first
+        f_unlink(imagePath);
+        if(f_rename(tmpPath, imagePath) != FR_OK){
+            ESP_LOGW(TAG, "Unable to rename written image to %s", imagePath);
+            f_unlink(tmpPath);
+            return FILE_SYS_UNABLE_WRITE;
+        }
+        return FILE_SYS_RET_OK;
+    }
 
     fsStat = f_open(&file, imagePath, FA_CREATE_ALWAYS | FA_WRITE);
     if(fsStat != FR_OK){
         ESP_LOGW(TAG, "Unable to open file for writing");
         return FILE_SYS_UNABLE_OPEN;
     }
-
-    fsStat = f_write(&file, sdCardFrameBuff, DISP_FB_SIZE, &nWritten);
-    if(nWritten != DISP_FB_SIZE){
+    fsStat = f_write(&file, dat, DISP_FB_SIZE, &nWritten);
+    f_close(&file);
+    if(fsStat != FR_OK || nWritten != DISP_FB_SIZE){
         ESP_LOGW(TAG, "Did it completely write the file");
         return FILE_SYS_UNABLE_WRITE;
     }
+    return FILE_SYS_RET_OK;
+}
 
-    ESP_LOGI(TAG, "Done with write operation");
-    f_close(&file);
+fSysRet fileSysSaveImage(const char* imgName, const u8 *dat){
+    u8 hash[FILE_SYS_HASH_LEN];
+    bool deduped;
+    fSysRet ret;
+
+    if(!fileSysImageNameValid(imgName)){
+        return FILE_SYS_INVALID_NAME;
+    }
+    ESP_LOGI(TAG, "Started write of image %s", imgName);
+
+    // hashed first, so content that's already on the card isn't written again
+    mbedtls_sha256(dat, DISP_FB_SIZE, hash, 0);
+    ret = imageStore(imgName, hash, dat, NULL, &deduped);
+    if(ret == FILE_SYS_RET_OK){
+        ESP_LOGI(TAG, "Done with write operation%s", deduped ? ", the content was already there" : "");
+    }
+    return ret;
+}
+
+fSysRet fileSysImageWriteBegin(const char *imgName, fSysImgWriter_t *writer){
+    FRESULT fsStat;
+
+    memset(writer, 0, sizeof(fSysImgWriter_t));
+    if(!fileSysImageNameValid(imgName)){
+        return FILE_SYS_INVALID_NAME;
+    }
+    strncpy(writer->imgName, imgName, MAX_IMAGE_NAME_LEN-1);
+    snprintf(writer->tmpPath, sizeof(writer->tmpPath), IMAGE_WRITE_TMP_FMT,
+             __atomic_fetch_add(&writeTmpSeq, 1, __ATOMIC_RELAXED));
+
+    fsStat = f_open(&writer->file, writer->tmpPath, FA_CREATE_ALWAYS | FA_WRITE);
+    if(fsStat != FR_OK){
+        ESP_LOGW(TAG, "Unable to open file for writing");
+        return FILE_SYS_UNABLE_OPEN;
+    }
+    mbedtls_sha256_init(&writer->sha);
+    mbedtls_sha256_starts(&writer->sha, 0);
     return FILE_SYS_RET_OK;
 }
 
+fSysRet fileSysImageWriteChunk(fSysImgWriter_t *writer, const u8 *dat, u32 len){
+    FRESULT fsStat;
+    UINT nWritten;
 
-fSysRet fileSysDelImage(const char *imgName){
+    if(writer->written + len > DISP_FB_SIZE){
+        return FILE_SYS_INVALID_FILE;
+    }
+    fsStat = f_write(&writer->file, dat, len, &nWritten);
+    if(fsStat != FR_OK || nWritten != len){
+        ESP_LOGW(TAG, "Unable to write image chunk");
+        return FILE_SYS_UNABLE_WRITE;
+    }
+    // while it's still in the cache, rather than reading the file back at the end
+    mbedtls_sha256_update(&writer->sha, dat, len);
+    writer->written += len;
+    return FILE_SYS_RET_OK;
+}
+
+fSysRet fileSysImageWriteEnd(fSysImgWriter_t *writer, bool commit){
+    u8 hash[FILE_SYS_HASH_LEN];
     FRESULT fsStat;
-    char imagePath[128];
+    fSysRet ret;
+
+    fsStat = f_close(&writer->file);
+    mbedtls_sha256_finish(&writer->sha, hash);
+    mbedtls_sha256_free(&writer->sha);
+    if(!commit || fsStat != FR_OK || writer->written != DISP_FB_SIZE){
+        f_unlink(writer->tmpPath);
+        return commit ? FILE_SYS_UNABLE_WRITE : FILE_SYS_RET_OK;
+    }
+
+    ret = imageStore(writer->imgName, hash, NULL, writer->tmpPath, &writer->deduped);
+    if(ret == FILE_SYS_RET_OK){
+        ESP_LOGI(TAG, "Done writing image %s%s", writer->imgName,
+                 writer->deduped ? ", the content was already there" : "");
+    }
+    return ret;
+}
+
+fSysRet fileSysGetImageInfo(const char *imgName, u32 *size, u32 *modTime){
     FILINFO fno;
+    char imagePath[128];
+    fSysRet ret;
+
+    ret = findImageFile(imgName, imagePath, sizeof(imagePath), &fno);
+    if(ret){
+        return ret;
+    }
+    *size = fno.fsize;
+    *modTime = ((u32)fno.fdate << 16) | fno.ftime;
+    return FILE_SYS_RET_OK;
+}
+
+/**
+ * Reads the file of the current stream into whichever buffer is free, until the stream is done
+ */
+static void taskFileSysStream(void *args){
+    streamChunk_t chunk;
+    FRESULT fsStat;
+    UINT nRead;
+    u32 toRead;
+
+    for(EVER){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        for(EVER){
+            xQueueReceive(streamFreeQueue, &chunk.idx, portMAX_DELAY);
+            if(streamAbort || streamRemaining == 0){
+                chunk.len = 0;
+                xQueueSend(streamFullQueue, &chunk, portMAX_DELAY);
+                break;
+            }
+
+            toRead = streamRemaining < FILE_SYS_STREAM_CHUNK_SIZE ? streamRemaining : FILE_SYS_STREAM_CHUNK_SIZE;
+            fsStat = f_read(&streamFile, streamBuff[chunk.idx], toRead, &nRead);
+            if(fsStat != FR_OK || nRead != toRead){
+                ESP_LOGW(TAG, "Image stream read failed, stat %d", fsStat);
+                chunk.len = -1;
+                xQueueSend(streamFullQueue, &chunk, portMAX_DELAY);
+                break;
+            }
+            streamRemaining -= nRead;
+            chunk.len = nRead;
+            xQueueSend(streamFullQueue, &chunk, portMAX_DELAY);
+        }
+    }
+}
+
+void fileSysStreamInit(void){
+    streamFreeQueue = xQueueCreate(2, sizeof(u8));
+    streamFullQueue = xQueueCreate(2, sizeof(streamChunk_t));
+    configASSERT( streamFreeQueue && streamFullQueue );
+    streamDone = true;
+
+    xTaskCreatePinnedToCore(taskFileSysStream, "imgStream", 4096, NULL, 4,
+                            &streamTask_h, 0);
+}
+
+fSysRet fileSysStreamStart(const char *imgName, u32 offset, u32 len){
+    fSysRet ret;
+    u8 idx;
+
+    ret = fileSysOpenImage(imgName, &streamFile);
+    if(ret){
+        return ret;
+    }
+    if(f_lseek(&streamFile, offset) != FR_OK){
+        f_close(&streamFile);
+        return FILE_SYS_UNABLE_READ;
+    }
+
+    streamRemaining = len;
+    streamAbort = false;
+    streamDone = false;
+    xQueueReset(streamFullQueue);
+    xQueueReset(streamFreeQueue);
+    for(idx = 0; idx < 2; idx++){
+        xQueueSend(streamFreeQueue, &idx, 0);
+    }
+    xTaskNotifyGive(streamTask_h);
+    return FILE_SYS_RET_OK;
+}
+
+int fileSysStreamGetChunk(const u8 **dat){
+    streamChunk_t chunk;
+
+    if(streamDone){
+        return 0;
+    }
+    xQueueReceive(streamFullQueue, &chunk, portMAX_DELAY);
+    streamCurrIdx = chunk.idx;
+    if(chunk.len <= 0){
+        // the stream task is done with this stream, nothing to give back
+        streamDone = true;
+        return chunk.len;
+    }
+    *dat = streamBuff[chunk.idx];
+    return chunk.len;
+}
+
+void fileSysStreamReleaseChunk(void){
+    xQueueSend(streamFreeQueue, &streamCurrIdx, portMAX_DELAY);
+}
+
+void fileSysStreamStop(void){
+    const u8 *dat;
+
+    // drain what the task already read, until it acknowledges the abort
+    streamAbort = true;
+    while(fileSysStreamGetChunk(&dat) > 0){
+        fileSysStreamReleaseChunk();
+    }
+    f_close(&streamFile);
+}
+
+fSysRet fileSysDelImage(const char *imgName){
     fSysRet ret;
 
     ret = fileSysIsImageValid(imgName);
     if(ret){
         return ret;
     }
-    getImagePath(imgName, imagePath, sizeof(imagePath));
+    return imageRemove(imgName);
+}
 
-    fsStat = f_unlink(imagePath);
-    if(fsStat != FR_OK){
-        ESP_LOGW(TAG, "Unable to delete image file");
+fSysRet fileSysImageLink(const char *imgName, const u8 *hash){
+    bool deduped;
+
+    if(!fileSysImageNameValid(imgName)){
+        return FILE_SYS_INVALID_NAME;
+    }
+    // there's nothing to link to without the hashes
+    if(!indexLoaded){
         return FILE_SYS_RET_FAIL;
     }
+    return imageStore(imgName, hash, NULL, NULL, &deduped);
+}
+
+/********** IMAGE INDEX **********/
+static fSysRet indexWriteHeader(FIL *file){
+    UINT nWritten;
+
+    if(f_lseek(file, 0) != FR_OK || f_write(file, &indexHdr, sizeof(indexHdr), &nWritten) != FR_OK ||
+       nWritten != sizeof(indexHdr)){
+        return FILE_SYS_UNABLE_WRITE;
+    }
     return FILE_SYS_RET_OK;
-}
\ No newline at end of file
+}
+
+static void indexRecInit(indexRec_t *rec, const char *imgName, u32 id){
+    memset(rec, 0, sizeof(indexRec_t));
+    strncpy(rec->name, imgName, MAX_IMAGE_NAME_LEN-1);
+    rec->owner = id;
+}
+
+/**
+ * Reads the record of an ID. Must hold indexMutex
+ */
+static fSysRet indexReadRec(FIL *file, u32 id, indexRec_t *rec){
+    UINT nRead;
+
+    if(id >= indexHdr.info.slots){
+        return FILE_SYS_NO_FILE_FOUND;
+    }
+    if(f_lseek(file, sizeof(indexHeader_t) + id * sizeof(indexRec_t)) != FR_OK ||
+       f_read(file, rec, sizeof(indexRec_t), &nRead) != FR_OK || nRead != sizeof(indexRec_t)){
+        return FILE_SYS_UNABLE_READ;
+    }
+    rec->name[MAX_IMAGE_NAME_LEN-1] = '\0';
+    return FILE_SYS_RET_OK;
+}
+
+/**
+ * Writes the record of an ID, an empty name removes it. Must hold indexMutex
+ */
+static fSysRet indexWriteRec(FIL *file, u32 id, const indexRec_t *rec){
+    UINT nWritten;
+
+    if(f_lseek(file, sizeof(indexHeader_t) + id * sizeof(indexRec_t)) != FR_OK ||
+       f_write(file, rec, sizeof(indexRec_t), &nWritten) != FR_OK || nWritten != sizeof(indexRec_t)){
+        return FILE_SYS_UNABLE_WRITE;
+    }
+    return FILE_SYS_RET_OK;
+}
+
+static bool matchName(const indexRec_t *rec, u32 id, const void *arg){
+    return rec->name[0] != '\0' && strncmp(rec->name, arg, MAX_IMAGE_NAME_LEN) == 0;
+}
+
+// only images with a file, the ones sharing it point to them
+static bool matchHash(const indexRec_t *rec, u32 id, const void *arg){
+    return rec->name[0] != '\0' && rec->owner == id && (rec->flags & INDEX_REC_HASHED) &&
+           memcmp(rec->hash, arg, FILE_SYS_HASH_LEN) == 0;
+}
+
+static bool matchSharing(const indexRec_t *rec, u32 id, const void *arg){
+    return rec->name[0] != '\0' && rec->owner != id && rec->owner == *(const u32*)arg;
+}
+
+/**
+ * Looks for the first record at or after an ID that matches, linearly. Must hold indexMutex
+ *
+ * @param rec set to the record found, can be NULL
+ */
+static fSysRet indexScanLocked(FIL *file, u32 fromId, indexMatch_t match, const void *arg, u32 *id, indexRec_t *rec){
+    indexRec_t recs[INDEX_READ_RECS];
+    UINT nRead;
+    u32 n;
+
+    if(fromId >= indexHdr.info.slots){
+        return FILE_SYS_NO_FILE_FOUND;
+    }
+    if(f_lseek(file, sizeof(indexHeader_t) + fromId * sizeof(indexRec_t)) != FR_OK){
+        return FILE_SYS_UNABLE_READ;
+    }
+    for(u32 base = fromId; base < indexHdr.info.slots; base += n){
+        n = indexHdr.info.slots - base < INDEX_READ_RECS ? indexHdr.info.slots - base : INDEX_READ_RECS;
+        if(f_read(file, recs, n * sizeof(indexRec_t), &nRead) != FR_OK || nRead != n * sizeof(indexRec_t)){
+            return FILE_SYS_UNABLE_READ;
+        }
+        for(u32 i = 0; i < n; i++){
+            recs[i].name[MAX_IMAGE_NAME_LEN-1] = '\0';
+            if(match(&recs[i], base + i, arg)){
+                *id = base + i;
+                if(rec){
+                    memcpy(rec, &recs[i], sizeof(indexRec_t));
+                }
+                return FILE_SYS_RET_OK;
+            }
+        }
+    }
+    return FILE_SYS_NO_FILE_FOUND;
+}
+
+/**
+ * Points the images sharing the file of an ID to another. If that other one was sharing it too, it ends up
+ * pointing to itself, as the one with the file. Must hold indexMutex
+ */
+static fSysRet indexRepointLocked(FIL *file, u32 fromId, u32 toId){
+    indexRec_t rec;
+    u32 id = 0;
+    fSysRet ret;
+
+    while((ret = indexScanLocked(file, id, matchSharing, &fromId, &id, &rec)) == FILE_SYS_RET_OK){
+        rec.owner = toId;
+        ret = indexWriteRec(file, id, &rec);
+        if(ret){
+            return ret;
+        }
+        id++;
+    }
+    return ret == FILE_SYS_NO_FILE_FOUND ? FILE_SYS_RET_OK : ret;
+}
+
+/**
+ * Takes an image off its content, before it's removed or gets other content. If others share its file,
+ * the file is renamed to the first of them rather than copied. Must hold indexMutex
+ *
+ * @param hasFile set if the image still has its file, for the caller to remove or overwrite
+ */
+static fSysRet indexDetachLocked(FIL *file, u32 id, const indexRec_t *rec, bool *hasFile){
+    char fromPath[128];
+    char toPath[128];
+    indexRec_t sharing;
+    u32 sharingId;
+    fSysRet ret;
+
+    *hasFile = false;
+    if(rec->owner != id){
+        return FILE_SYS_RET_OK;
+    }
+    ret = indexScanLocked(file, 0, matchSharing, &id, &sharingId, &sharing);
+    if(ret == FILE_SYS_NO_FILE_FOUND){
+        *hasFile = true;
+        return FILE_SYS_RET_OK;
+    }
+    if(ret){
+        return ret;
+    }
+
+    getImagePath(rec->name, fromPath, sizeof(fromPath));
+    getImagePath(sharing.name, toPath, sizeof(toPath));
+    if(f_rename(fromPath, toPath) != FR_OK){
+        ESP_LOGW(TAG, "Unable to hand the file of %s over to %s", rec->name, sharing.name);
+        return FILE_SYS_UNABLE_WRITE;
+    }
+    return indexRepointLocked(file, id, sharingId);
+}
+
+/**
+ * Removes the record of an ID. Must hold indexMutex
+ */
+static fSysRet indexClearLocked(FIL *file, u32 id){
+    indexRec_t rec = {0};
+    fSysRet ret;
+
+    ret = indexWriteRec(file, id, &rec);
+    if(ret){
+        return ret;
+    }
+    indexHdr.info.count--;
+    indexHdr.info.generation++;
+    return indexWriteHeader(file);
+}
+
+/**
+ * Saves content as an image, or if an image already has the same content, points the image to its file
+ * instead. The content is either in dat, or in the temporary file of fileSysImageWriteBegin() at tmpPath.
+ * With neither, it has to be on the card already
+ *
+ * @param deduped set if the content was already on the card, and nothing was written
+ */
+static fSysRet imageStore(const char *imgName, const u8 *hash, const u8 *dat, const char *tmpPath, bool *deduped){
+    char imagePath[128];
+    indexRec_t rec;
+    FIL file;
+    u32 id;
+    u32 sameId;
+    bool exists;
+    bool same;
+    bool hasFile = false;
+    fSysRet ret;
+
+    *deduped = false;
+    getImagePath(imgName, imagePath, sizeof(imagePath));
+    if(!indexLoaded){
+        return dat || tmpPath ? writeImageFile(imagePath, dat, tmpPath) : FILE_SYS_RET_FAIL;
+    }
+
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    if(f_open(&file, INDEX_PATH, FA_READ | FA_WRITE) != FR_OK){
+        xSemaphoreGive(indexMutex);
+        ESP_LOGW(TAG, "Unable to open the image index");
+        return dat || tmpPath ? writeImageFile(imagePath, dat, tmpPath) : FILE_SYS_UNABLE_OPEN;
+    }
+
+    ret = indexScanLocked(&file, 0, matchName, imgName, &id, &rec);
+    exists = ret == FILE_SYS_RET_OK;
+    if(ret == FILE_SYS_RET_OK || ret == FILE_SYS_NO_FILE_FOUND){
+        ret = indexScanLocked(&file, 0, matchHash, hash, &sameId, NULL);
+        same = ret == FILE_SYS_RET_OK;
+    }
+    if(ret != FILE_SYS_RET_OK && ret != FILE_SYS_NO_FILE_FOUND){
+        goto cleanup;
+    }
+    ret = FILE_SYS_RET_OK;
+
+    if(exists && same && rec.owner == sameId){
+        // saved again as it was
+        *deduped = true;
+        goto cleanup;
+    }
+    if(!same && dat == NULL && tmpPath == NULL){
+        ret = FILE_SYS_NO_FILE_FOUND;
+        goto cleanup;
+    }
+
+    if(exists){
+        ret = indexDetachLocked(&file, id, &rec, &hasFile);
+        if(ret){
+            goto cleanup;
+        }
+    } else {
+        id = indexHdr.info.slots;
+    }
+    indexRecInit(&rec, imgName, id);
+    memcpy(rec.hash, hash, FILE_SYS_HASH_LEN);
+    rec.flags = INDEX_REC_HASHED;
+
+    if(same){
+        if(hasFile && f_unlink(imagePath) == FR_OK){
+            imgFiles--;
+        }
+        rec.owner = sameId;
+        *deduped = true;
+    } else {
+        ret = writeImageFile(imagePath, dat, tmpPath);
+        if(ret){
+            // it was already taken off its old content, there's nothing left for it to point to
+            if(exists){
+                indexClearLocked(&file, id);
+            }
+            // whatever is left of its file is counted again
+            imgFilesKnown = false;
+            goto cleanup;
+        }
+        if(!hasFile){
+            imgFiles++;
+        }
+    }
+
+    ret = indexWriteRec(&file, id, &rec);
+    if(ret == FILE_SYS_RET_OK && !exists){
+        indexHdr.info.slots++;
+        indexHdr.info.count++;
+        indexHdr.info.generation++;
+        ret = indexWriteHeader(&file);
+    }
+
+cleanup:
+    if(tmpPath){
+        // still there if it wasn't needed
+        f_unlink(tmpPath);
+    }
+    f_close(&file);
+    xSemaphoreGive(indexMutex);
+    return ret;
+}
+
+/**
+ * Removes an image, and its file if no other image shares it
+ */
+static fSysRet imageRemove(const char *imgName){
+    char imagePath[128];
+    indexRec_t rec;
+    FIL file;
+    u32 id;
+    bool hasFile = false;
+    bool indexed = false;
+    fSysRet ret = FILE_SYS_RET_OK;
+
+    getImagePath(imgName, imagePath, sizeof(imagePath));
+    if(indexLoaded){
+        xSemaphoreTake(indexMutex, portMAX_DELAY);
+        if(f_open(&file, INDEX_PATH, FA_READ | FA_WRITE) != FR_OK){
+            xSemaphoreGive(indexMutex);
+            ESP_LOGW(TAG, "Unable to open the image index");
+            return FILE_SYS_UNABLE_OPEN;
+        }
+        ret = indexScanLocked(&file, 0, matchName, imgName, &id, &rec);
+        if(ret == FILE_SYS_NO_FILE_FOUND){
+            // copied to the card since the last sync
+            hasFile = true;
+            ret = FILE_SYS_RET_OK;
+        } else if(ret == FILE_SYS_RET_OK){
+            indexed = true;
+            ret = indexDetachLocked(&file, id, &rec, &hasFile);
+            if(ret == FILE_SYS_RET_OK){
+                ret = indexClearLocked(&file, id);
+            }
+        }
+        f_close(&file);
+    } else {
+        hasFile = true;
+    }
+
+    if(ret == FILE_SYS_RET_OK && hasFile){
+        if(f_unlink(imagePath) != FR_OK){
+            ESP_LOGW(TAG, "Unable to delete image file");
+            ret = FILE_SYS_RET_FAIL;
+        } else if(indexed){
+            imgFiles--;
+        }
+    }
+    if(indexLoaded){
+        xSemaphoreGive(indexMutex);
+    }
+    return ret;
+}
+
+/**
+ * Rewrites a version 1 index, of names only, with the records of this version. The IDs and epoch are kept,
+ * so the playlists are still good, and the hashes are filled in by fileSysIndexSync(). Must hold indexMutex
+ */
+static fSysRet indexUpgradeLocked(void){
+    char name[INDEX_V1_REC_LEN];
+    indexRec_t rec;
+    FIL oldFile;
+    FIL newFile;
+    UINT n;
+    fSysRet ret;
+
+    ESP_LOGI(TAG, "Upgrading the image index, %lu images", indexHdr.info.count);
+    if(f_open(&oldFile, INDEX_PATH, FA_READ) != FR_OK){
+        return FILE_SYS_UNABLE_OPEN;
+    }
+    if(f_open(&newFile, INDEX_TMP_PATH, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK){
+        f_close(&oldFile);
+        return FILE_SYS_UNABLE_OPEN;
+    }
+
+    indexHdr.version = INDEX_VERSION;
+    indexHdr.recLen = sizeof(indexRec_t);
+    ret = indexWriteHeader(&newFile);
+    if(ret == FILE_SYS_RET_OK && f_lseek(&oldFile, sizeof(indexHeader_t)) != FR_OK){
+        ret = FILE_SYS_UNABLE_READ;
+    }
+    for(u32 id = 0; ret == FILE_SYS_RET_OK && id < indexHdr.info.slots; id++){
+        if(f_read(&oldFile, name, sizeof(name), &n) != FR_OK || n != sizeof(name)){
+            ret = FILE_SYS_UNABLE_READ;
+            break;
+        }
+        name[INDEX_V1_REC_LEN-1] = '\0';
+        indexRecInit(&rec, name, id);
+        if(f_write(&newFile, &rec, sizeof(rec), &n) != FR_OK || n != sizeof(rec)){
+            ret = FILE_SYS_UNABLE_WRITE;
+        }
+    }
+    f_close(&oldFile);
+    if(f_close(&newFile) != FR_OK && ret == FILE_SYS_RET_OK){
+        ret = FILE_SYS_UNABLE_WRITE;
+    }
+
+    if(ret == FILE_SYS_RET_OK && (f_unlink(INDEX_PATH) != FR_OK || f_rename(INDEX_TMP_PATH, INDEX_PATH) != FR_OK)){
+        ret = FILE_SYS_UNABLE_WRITE;
+    }
+    if(ret){
+        f_unlink(INDEX_TMP_PATH);
+    }
+    return ret;
+}
+
+/**
+ * Loads the index header, or creates the index from the images on the card if it's missing
+ */
+static fSysRet indexLoad(void){
+    FIL file;
+    UINT nRead;
+    bool upgrade = false;
+    fSysRet ret = FILE_SYS_RET_OK;
+
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    indexLoaded = false;
+    if(f_open(&file, INDEX_PATH, FA_READ) == FR_OK){
+        if(f_read(&file, &indexHdr, sizeof(indexHdr), &nRead) == FR_OK && nRead == sizeof(indexHdr) &&
+           indexHdr.magic == INDEX_MAGIC){
+            if(indexHdr.version == INDEX_VERSION && indexHdr.recLen == sizeof(indexRec_t)){
+                indexLoaded = true;
+            } else if(indexHdr.version == 1 && indexHdr.recLen == INDEX_V1_REC_LEN){
+                upgrade = true;
+            }
+        }
+        f_close(&file);
+    }
+    if(upgrade){
+        indexLoaded = indexUpgradeLocked() == FILE_SYS_RET_OK;
+    }
+
+    if(!indexLoaded){
+        // a new epoch, as any ID saved from a previous index is meaningless now
+        ESP_LOGI(TAG, "Creating the image index");
+        memset(&indexHdr, 0, sizeof(indexHdr));
+        indexHdr.magic = INDEX_MAGIC;
+        indexHdr.version = INDEX_VERSION;
+        indexHdr.recLen = sizeof(indexRec_t);
+        indexHdr.info.epoch = esp_random();
+        if(f_open(&file, INDEX_PATH, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK){
+            ret = FILE_SYS_UNABLE_OPEN;
+        } else {
+            ret = indexWriteHeader(&file);
+            f_close(&file);
+        }
+        indexLoaded = ret == FILE_SYS_RET_OK;
+    }
+    xSemaphoreGive(indexMutex);
+
+    // a new index is filled from what's on the card, an upgraded one hashed
+    if(ret == FILE_SYS_RET_OK && (indexHdr.info.slots == 0 || upgrade)){
+        ret = fileSysIndexSync();
+    }
+    return ret;
+}
+
+/**
+ * Hashes the file of an image, a chunk at a time into buff
+ */
+static fSysRet hashImageFile(const char *imgName, u8 *buff, u8 *hash){
+    mbedtls_sha256_context sha;
+    char imagePath[128];
+    FIL file;
+    UINT nRead;
+    u32 total = 0;
+    fSysRet ret = FILE_SYS_RET_OK;
+
+    getImagePath(imgName, imagePath, sizeof(imagePath));
+    if(f_open(&file, imagePath, FA_READ) != FR_OK){
+        return FILE_SYS_UNABLE_OPEN;
+    }
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    for(EVER){
+        if(f_read(&file, buff, FILE_SYS_STREAM_CHUNK_SIZE, &nRead) != FR_OK){
+            ret = FILE_SYS_UNABLE_READ;
+            break;
+        }
+        if(nRead == 0){
+            break;
+        }
+        mbedtls_sha256_update(&sha, buff, nRead);
+        total += nRead;
+    }
+    mbedtls_sha256_finish(&sha, hash);
+    mbedtls_sha256_free(&sha);
+    f_close(&file);
+
+    // only frame buffers are ever shared
+    if(ret == FILE_SYS_RET_OK && total != DISP_FB_SIZE){
+        ret = FILE_SYS_INVALID_FILE;
+    }
+    return ret;
+}
+
+static bool matchOwner(const indexRec_t *rec, u32 id, const void *arg){
+    return rec->name[0] != '\0' && rec->owner == id;
+}
+
+/**
+ * Counts the images with a file of their own. Must hold indexMutex
+ */
+static void indexCountFilesLocked(FIL *file){
+    u32 id = 0;
+    u32 n = 0;
+    fSysRet ret;
+
+    while((ret = indexScanLocked(file, id, matchOwner, NULL, &id, NULL)) == FILE_SYS_RET_OK){
+        n++;
+        id++;
+    }
+    if(ret == FILE_SYS_NO_FILE_FOUND){
+        imgFiles = n;
+        imgFilesKnown = true;
+    }
+}
+
+/**
+ * Hashes the images with a file that aren't yet, such as ones copied to the card. One with the same content
+ * as another gives up its file for the other's. Must hold indexMutex
+ */
+static void indexHashLocked(FIL *file){
+    indexRec_t rec;
+    char imagePath[128];
+    u8 *buff;
+    u32 sameId;
+    u32 hashed = 0;
+    u32 deduped = 0;
+
+    buff = malloc(FILE_SYS_STREAM_CHUNK_SIZE);
+    if(buff == NULL){
+        return;
+    }
+    for(u32 id = 0; id < indexHdr.info.slots; id++){
+        if(indexReadRec(file, id, &rec) != FILE_SYS_RET_OK){
+            break;
+        }
+        if(rec.name[0] == '\0' || rec.owner != id || (rec.flags & INDEX_REC_HASHED) ||
+           hashImageFile(rec.name, buff, rec.hash) != FILE_SYS_RET_OK){
+            continue;
+        }
+        rec.flags |= INDEX_REC_HASHED;
+        hashed++;
+
+        // the same picture copied in twice
+        if(indexScanLocked(file, 0, matchHash, rec.hash, &sameId, NULL) == FILE_SYS_RET_OK){
+            getImagePath(rec.name, imagePath, sizeof(imagePath));
+            if(f_unlink(imagePath) == FR_OK){
+                rec.owner = sameId;
+                deduped++;
+            }
+        }
+        indexWriteRec(file, id, &rec);
+    }
+    free(buff);
+
+    if(hashed){
+        ESP_LOGI(TAG, "Hashed %lu images, %lu of them were already on the card", hashed, deduped);
+    }
+}
+
+fSysRet fileSysIndexSync(void){
+    FIL file;
+    FF_DIR imageDir;
+    FILINFO fno;
+    UINT nRead;
+    char *dotIdx;
+    indexRec_t *recs = NULL;
+    indexRec_t rec;
+    u8 *seen = NULL;
+    u32 oldSlots;
+    u32 owner;
+    u32 i;
+    fSysRet ret = FILE_SYS_RET_OK;
+    bool changed = false;
+
+    if(!indexLoaded){
+        return FILE_SYS_RET_FAIL;
+    }
+
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    if(f_open(&file, INDEX_PATH, FA_READ | FA_WRITE) != FR_OK){
+        xSemaphoreGive(indexMutex);
+        return FILE_SYS_UNABLE_OPEN;
+    }
+
+    // the whole index is brought in memory, so the directory only has to be walked once
+    oldSlots = indexHdr.info.slots;
+    if(oldSlots){
+        recs = malloc(oldSlots * sizeof(indexRec_t));
+        seen = calloc(oldSlots, 1);
+        if(recs == NULL || seen == NULL){
+            ret = FILE_SYS_RET_FAIL;
+            goto cleanup;
+        }
+        if(f_lseek(&file, sizeof(indexHeader_t)) != FR_OK ||
+           f_read(&file, recs, oldSlots * sizeof(indexRec_t), &nRead) != FR_OK ||
+           nRead != oldSlots * sizeof(indexRec_t)){
+            ret = FILE_SYS_UNABLE_READ;
+            goto cleanup;
+        }
+    }
+
+    if(f_opendir(&imageDir, IMAGE_DIR) != FR_OK){
+        ret = FILE_SYS_INVALID_DIR;
+        goto cleanup;
+    }
+    for(EVER){
+        if(f_readdir(&imageDir, &fno) != FR_OK || fno.fname[0] == 0){
+            break;
+        }
+        dotIdx = strrchr(fno.fname, '.');
+        if((fno.fattrib & AM_DIR) || dotIdx == NULL || strcmp(dotIdx, ".RAW") != 0 ||
+           dotIdx - fno.fname >= MAX_IMAGE_NAME_LEN){
+            continue;
+        }
+        *dotIdx = '\0';
+
+        for(i = 0; i < oldSlots; i++){
+            if(!seen[i] && strncmp(recs[i].name, fno.fname, MAX_IMAGE_NAME_LEN) == 0){
+                seen[i] = 1;
+                break;
+            }
+        }
+        if(i == oldSlots){
+            indexRecInit(&rec, fno.fname, indexHdr.info.slots);
+            if(indexWriteRec(&file, indexHdr.info.slots, &rec) == FILE_SYS_RET_OK){
+                indexHdr.info.slots++;
+                indexHdr.info.count++;
+                changed = true;
+            }
+        } else if(recs[i].owner != i){
+            // it was sharing a file, and got one of its own copied in since
+            recs[i].owner = i;
+            recs[i].flags = 0;
+            indexWriteRec(&file, i, &recs[i]);
+        }
+    }
+    f_closedir(&imageDir);
+
+    // images that are gone, removed while the card was out, then the ones that were sharing their file
+    for(i = 0; i < oldSlots; i++){
+        if(recs[i].name[0] != '\0' && recs[i].owner == i && !seen[i]){
+            memset(&recs[i], 0, sizeof(indexRec_t));
+            if(indexWriteRec(&file, i, &recs[i]) == FILE_SYS_RET_OK){
+                indexHdr.info.count--;
+                changed = true;
+            }
+        }
+    }
+    for(i = 0; i < oldSlots; i++){
+        owner = recs[i].owner;
+        if(recs[i].name[0] != '\0' && owner != i &&
+           (owner >= oldSlots || recs[owner].name[0] == '\0' || recs[owner].owner != owner)){
+            memset(&recs[i], 0, sizeof(indexRec_t));
+            if(indexWriteRec(&file, i, &recs[i]) == FILE_SYS_RET_OK){
+                indexHdr.info.count--;
+                changed = true;
+            }
+        }
+    }
+
+    if(changed){
+        indexHdr.info.generation++;
+        ret = indexWriteHeader(&file);
+        ESP_LOGI(TAG, "Image index synced, %lu images", indexHdr.info.count);
+        // the card was written to elsewhere, which may not have kept its free count right
+        storageStale = true;
+    }
+    indexHashLocked(&file);
+    indexCountFilesLocked(&file);
+
+cleanup:
+    f_close(&file);
+    xSemaphoreGive(indexMutex);
+    free(recs);
+    free(seen);
+    return ret;
+}
+
+fSysRet fileSysFindHash(const u8 *hash, char *imgName){
+    indexRec_t rec;
+    FIL file;
+    u32 id;
+    fSysRet ret;
+
+    if(!indexLoaded){
+        return FILE_SYS_RET_FAIL;
+    }
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    if(f_open(&file, INDEX_PATH, FA_READ) != FR_OK){
+        ret = FILE_SYS_UNABLE_OPEN;
+    } else {
+        ret = indexScanLocked(&file, 0, matchHash, hash, &id, &rec);
+        f_close(&file);
+    }
+    xSemaphoreGive(indexMutex);
+
+    if(ret == FILE_SYS_RET_OK){
+        memcpy(imgName, rec.name, MAX_IMAGE_NAME_LEN);
+    }
+    return ret;
+}
+
+fSysRet fileSysGetImageHash(const char *imgName, u8 *hash){
+    indexRec_t rec;
+    FIL file;
+    u32 id;
+    fSysRet ret;
+
+    if(!indexLoaded){
+        return FILE_SYS_RET_FAIL;
+    }
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    if(f_open(&file, INDEX_PATH, FA_READ) != FR_OK){
+        ret = FILE_SYS_UNABLE_OPEN;
+    } else {
+        ret = indexScanLocked(&file, 0, matchName, imgName, &id, &rec);
+        if(ret == FILE_SYS_RET_OK && rec.owner != id){
+            ret = indexReadRec(&file, rec.owner, &rec);
+        }
+        f_close(&file);
+    }
+    xSemaphoreGive(indexMutex);
+
+    if(ret == FILE_SYS_RET_OK){
+        if(!(rec.flags & INDEX_REC_HASHED)){
+            return FILE_SYS_NO_FILE_FOUND;
+        }
+        memcpy(hash, rec.hash, FILE_SYS_HASH_LEN);
+    }
+    return ret;
+}
+
+fSysRet fileSysIndexGetName(u32 id, char *imgName){
+    indexRec_t rec;
+    FIL file;
+    fSysRet ret;
+
+    if(!indexLoaded){
+        return FILE_SYS_RET_FAIL;
+    }
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    if(f_open(&file, INDEX_PATH, FA_READ) != FR_OK){
+        ret = FILE_SYS_UNABLE_OPEN;
+    } else {
+        ret = indexReadRec(&file, id, &rec);
+        f_close(&file);
+    }
+    xSemaphoreGive(indexMutex);
+
+    if(ret == FILE_SYS_RET_OK){
+        if(rec.name[0] == '\0'){
+            return FILE_SYS_NO_FILE_FOUND;
+        }
+        memcpy(imgName, rec.name, MAX_IMAGE_NAME_LEN);
+    }
+    return ret;
+}
+
+fSysRet fileSysIndexFind(const char *imgName, u32 *id){
+    FIL file;
+    fSysRet ret;
+
+    if(!indexLoaded){
+        return FILE_SYS_RET_FAIL;
+    }
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    if(f_open(&file, INDEX_PATH, FA_READ) != FR_OK){
+        ret = FILE_SYS_UNABLE_OPEN;
+    } else {
+        ret = indexScanLocked(&file, 0, matchName, imgName, id, NULL);
+        f_close(&file);
+    }
+    xSemaphoreGive(indexMutex);
+    return ret;
+}
+
+fSysRet fileSysIndexNext(u32 *id, u32 *imgId){
+    indexRec_t recs[INDEX_READ_RECS];
+    FIL file;
+    UINT nRead;
+    u32 base;
+    u32 n;
+    fSysRet ret = FILE_SYS_NO_FILE_FOUND;
+
+    if(!indexLoaded){
+        return FILE_SYS_RET_FAIL;
+    }
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    if(indexHdr.info.count == 0){
+        xSemaphoreGive(indexMutex);
+        return FILE_SYS_NO_FILE_FOUND;
+    }
+    if(f_open(&file, INDEX_PATH, FA_READ) != FR_OK){
+        xSemaphoreGive(indexMutex);
+        return FILE_SYS_UNABLE_OPEN;
+    }
+
+    // there is at least one image, so this ends within a lap of the index
+    base = *id < indexHdr.info.slots ? *id : 0;
+    for(u32 tried = 0; tried < indexHdr.info.slots; tried += n){
+        n = indexHdr.info.slots - base < INDEX_READ_RECS ? indexHdr.info.slots - base : INDEX_READ_RECS;
+        if(f_lseek(&file, sizeof(indexHeader_t) + base * sizeof(indexRec_t)) != FR_OK ||
+           f_read(&file, recs, n * sizeof(indexRec_t), &nRead) != FR_OK || nRead != n * sizeof(indexRec_t)){
+            ret = FILE_SYS_UNABLE_READ;
+            break;
+        }
+        for(u32 i = 0; i < n; i++){
+            if(recs[i].name[0] != '\0'){
+                *imgId = base + i;
+                *id = (base + i + 1) % indexHdr.info.slots;
+                ret = FILE_SYS_RET_OK;
+                break;
+            }
+        }
+        if(ret == FILE_SYS_RET_OK){
+            break;
+        }
+        base = (base + n) % indexHdr.info.slots;
+    }
+
+    f_close(&file);
+    xSemaphoreGive(indexMutex);
+    return ret;
+}
+
+fSysRet fileSysIndexGetIds(u32 *ids, u32 maxIds, u32 *count, fSysIndexInfo_t *info){
+    indexRec_t recs[INDEX_READ_RECS];
+    FIL file;
+    UINT nRead;
+    u32 n;
+    fSysRet ret = FILE_SYS_RET_OK;
+
+    if(!indexLoaded){
+        return FILE_SYS_RET_FAIL;
+    }
+    *count = 0;
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    if(f_open(&file, INDEX_PATH, FA_READ) != FR_OK){
+        xSemaphoreGive(indexMutex);
+        return FILE_SYS_UNABLE_OPEN;
+    }
+    if(f_lseek(&file, sizeof(indexHeader_t)) != FR_OK){
+        ret = FILE_SYS_UNABLE_READ;
+    }
+    for(u32 base = 0; ret == FILE_SYS_RET_OK && base < indexHdr.info.slots; base += n){
+        n = indexHdr.info.slots - base < INDEX_READ_RECS ? indexHdr.info.slots - base : INDEX_READ_RECS;
+        if(f_read(&file, recs, n * sizeof(indexRec_t), &nRead) != FR_OK || nRead != n * sizeof(indexRec_t)){
+            ret = FILE_SYS_UNABLE_READ;
+            break;
+        }
+        for(u32 i = 0; i < n && *count < maxIds; i++){
+            if(recs[i].name[0] != '\0'){
+                ids[(*count)++] = base + i;
+            }
+        }
+    }
+    // taken under the same lock, so the caller knows exactly which index the IDs are from
+    if(info){
+        memcpy(info, &indexHdr.info, sizeof(fSysIndexInfo_t));
+    }
+    f_close(&file);
+    xSemaphoreGive(indexMutex);
+    return ret;
+}
+
+fSysRet fileSysIndexGetManifest(cJSON *jsonArr, fSysIndexInfo_t *info){
+    if(!indexLoaded){
+        return FILE_SYS_RET_FAIL;
+    }
+    return indexListImages(jsonArr, NULL, true, info);
+}
+
+fSysRet fileSysIndexGetInfo(fSysIndexInfo_t *info){
+    if(!indexLoaded){
+        return FILE_SYS_RET_FAIL;
+    }
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    memcpy(info, &indexHdr.info, sizeof(fSysIndexInfo_t));
+    xSemaphoreGive(indexMutex);
+    return FILE_SYS_RET_OK;
+}
+
+/********** STORAGE **********/
+static bool storageFreeKnown(void){
+    return fs.fs_type != 0 && fs.free_clst <= fs.n_fatent - 2;
+}
+
+/**
+ * Counts the free clusters when FatFS doesn't know them, or they were found to be stale
+ */
+static void taskFileSysStorage(void *args){
+    FATFS *fsOut;
+    DWORD freeClst;
+    int64_t startUs;
+    FRESULT fsStat;
+
+    for(EVER){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if(fs.fs_type == 0 || (storageFreeKnown() && !storageStale)){
+            continue;
+        }
+
+        storageScanning = true;
+        startUs = esp_timer_get_time();
+        if(storageStale){
+            // has f_getfree() count it over rather than trust FSINFO, FatFS only checks it's in range
+            storageStale = false;
+            fs.free_clst = 0xFFFFFFFF;
+        }
+        fsStat = f_getfree("", &freeClst, &fsOut);
+        storageScanning = false;
+        storageScans++;
+        if(fsStat != FR_OK){
+            ESP_LOGW(TAG, "Unable to count the free space, stat %d", fsStat);
+        } else {
+            ESP_LOGI(TAG, "Counted %lu free clusters in %lld mS", freeClst, (esp_timer_get_time() - startUs) / 1000);
+        }
+    }
+}
+
+void fileSysStorageInit(void){
+    xTaskCreatePinnedToCore(taskFileSysStorage, "fsFree", 3072, NULL, 1,
+                            &storageTask_h, 0);
+    fileSysStorageRevalidate(false);
+}
+
+void fileSysStorageRevalidate(bool force){
+    if(force){
+        storageStale = true;
+    }
+    if(storageTask_h){
+        xTaskNotifyGive(storageTask_h);
+    }
+}
+
+fSysRet fileSysGetStorageInfo(fSysStorageInfo_t *out){
+    FIL file;
+    u64 clusterBytes;
+    u64 imgBytes;
+
+    memset(out, 0, sizeof(fSysStorageInfo_t));
+    if(fs.fs_type == 0){
+        return FILE_SYS_UNABLE_MOUNT;
+    }
+
+    clusterBytes = (u64)fs.csize * SECTOR_SIZE;
+    // an image takes whole clusters
+    imgBytes = (DISP_FB_SIZE + clusterBytes - 1) / clusterBytes * clusterBytes;
+    out->totalBytes = (u64)(fs.n_fatent - 2) * clusterBytes;
+    out->scanning = storageScanning;
+    out->scans = storageScans;
+    out->freeKnown = storageFreeKnown() && !storageStale;
+    if(out->freeKnown){
+        out->freeBytes = (u64)fs.free_clst * clusterBytes;
+        out->imagesLeft = out->freeBytes / imgBytes;
+    } else if(!storageScanning){
+        fileSysStorageRevalidate(false);
+    }
+
+    // the file count is only worked out here if nothing else has the index, otherwise the last one will do
+    if(indexLoaded && xSemaphoreTake(indexMutex, 0) == pdTRUE){
+        if(!imgFilesKnown && !storageScanning && f_open(&file, INDEX_PATH, FA_READ) == FR_OK){
+            indexCountFilesLocked(&file);
+            f_close(&file);
+        }
+        out->imageCount = indexHdr.info.count;
+        out->imageFiles = imgFiles;
+        out->filesKnown = imgFilesKnown;
+        xSemaphoreGive(indexMutex);
+    }
+    out->imageBytes = (u64)out->imageFiles * imgBytes;
+    return FILE_SYS_RET_OK;
+}
@@ -7,10 +7,15 @@
 
 #ifndef UNIT_TEST
 #include "ff.h"
+#include "mbedtls/sha256.h"
 #endif
 
 #define IMAGE_DIR       "IMG"
 #define WEB_DIR       "WEB"
+#define PLAYLIST_DIR    "PL"        // the image index and playlists
+
+#define FILE_SYS_STREAM_CHUNK_SIZE      8192    // bytes, size of each of the two image streaming buffers
+#define FILE_SYS_HASH_LEN               32      // bytes, SHA-256 of an image's content
 
 typedef enum{
     FILE_SYS_RET_OK = 0,            // all is good
@@ -22,12 +27,51 @@ typedef enum{
     FILE_SYS_NO_FILE_FOUND,         // the desired file cannot be found on disk
     FILE_SYS_INVALID_DIR,            // the desired directory is missing
     FILE_SYS_INVALID_FILE,          // the file to be loaded is invalid, for example an image file isn't of the right size
+    FILE_SYS_INVALID_NAME,          // the image name can't be a file name or doesn't fit in the index, see fileSysImageNameValid()
 }fSysRet;
 
 /**
- * The local image buffer. Right now only used to buffer what to write to the SD card
+ * An image file being written a chunk at a time, see fileSysImageWriteBegin()
+ */
+typedef struct{
+    FIL file;
+    char imgName[MAX_IMAGE_NAME_LEN];
+    char tmpPath[24];               // its own temporary file, so writers running at once don't share one
+    u32 written;                    // bytes written so far
+    mbedtls_sha256_context sha;     // of what was written so far
+    bool deduped;                   // set by fileSysImageWriteEnd() if the content was already on the card
+}fSysImgWriter_t;
+
+/**
+ * The image index gives each image a number (its ID) that stays the same for as long as the image
+ * exists, so an image can be referred to in 4 bytes rather than by name, and found without walking
+ * the image directory. Images saved or deleted through this module are kept in the index
+ *
+ * The index also has the hash of each image's content, so the same content is only stored once. The
+ * other images with it are references to the first one's file, and are kept as long as one of them is
+ */
+typedef struct{
+    u32 slots;                      // IDs given out, IDs are 0 to slots - 1
+    u32 count;                      // IDs still pointing to an image
+    u32 generation;                 // incremented every time images are added or removed
+    u32 epoch;                      // random, changes when the index is created over, invalidating all IDs
+}fSysIndexInfo_t;
+
+/**
+ * How full the card is, see fileSysGetStorageInfo()
  */
-extern u8 sdCardFrameBuff[DISP_FB_SIZE];
+typedef struct{
+    u64 totalBytes;
+    u64 freeBytes;                  // only if freeKnown
+    bool freeKnown;                 // false until the free space is counted, see fileSysStorageInit()
+    bool scanning;                  // the free space is being counted
+    u32 scans;                      // times it was counted since boot
+    u32 imageCount;                 // images in the index, some may share a file
+    u32 imageFiles;                 // files they take, only if filesKnown
+    bool filesKnown;
+    u64 imageBytes;                 // taken by the image files, in whole clusters
+    u32 imagesLeft;                 // estimate of how many more image files fit, only if freeKnown
+}fSysStorageInfo_t;
 
 /**
  * Initializes the file system
@@ -48,6 +92,12 @@ fSysRet mountFs(void);
  */
 fSysRet fileSysGetAvailableImages(cJSON *jsonArr, u32 *count);
 
+/**
+ * Checks that an image name can be saved: not empty, shorter than MAX_IMAGE_NAME_LEN, and without control
+ * characters or any a FAT file name can't have, such as path separators
+ */
+bool fileSysImageNameValid(const char *imgName);
+
 /**
  * Returns 0 if the image name given is a valid and available file
  */
@@ -58,20 +108,180 @@ fSysRet fileSysOpenImage(const char *imgName, FIL *file);
 fSysRet fileSysLoadImage(const char* imgName, u8 *datOut, bool isNameDirect);
 
 /**
- * Loads an image from a given file index to the buffer datOut
+ * Loads an image by its ID (see the image index below), without searching the index for its name
+ *
+ * Returns FILE_SYS_NO_FILE_FOUND if the ID is not (or no longer) an image
  */
-fSysRet fileSysLoadNextImageFromIdx(u32 imgIdx, u8 *datOut);
+fSysRet fileSysLoadImageById(u32 id, u8 *datOut);
 
 /**
- * Saves the local image buffer (sdCardFrameBuff) to an image file
+ * Saves a frame buffer, such as an upload slot (see imgSlot.h), to an image file, or as a reference to the
+ * file of an image with the same content if there is one
  */
-fSysRet fileSysSaveImage(const char* imgName);
+fSysRet fileSysSaveImage(const char* imgName, const u8 *dat);
 
 /**
- * Deletes an image file
+ * Starts writing an image file a chunk at a time, for when the data is not all in memory yet (such as
+ * while it is being received). The data goes to a temporary file until fileSysImageWriteEnd() is
+ * called, so an interrupted write never replaces an existing image
+ */
+fSysRet fileSysImageWriteBegin(const char *imgName, fSysImgWriter_t *writer);
+
+/**
+ * Appends a chunk of data to an image file started with fileSysImageWriteBegin()
+ */
+fSysRet fileSysImageWriteChunk(fSysImgWriter_t *writer, const u8 *dat, u32 len);
+
+/**
+ * Finishes an image file started with fileSysImageWriteBegin()
+ *
+ * @param commit If true and a whole frame buffer was written, the file replaces the image. Otherwise
+ *               the written data is discarded. It is also discarded if the content was already on the
+ *               card, see fSysImgWriter_t.deduped
+ */
+fSysRet fileSysImageWriteEnd(fSysImgWriter_t *writer, bool commit);
+
+/**
+ * Gets the size and last modification time (FatFS date in the upper 16 bits, time in the lower) of
+ * a valid image file
+ */
+fSysRet fileSysGetImageInfo(const char *imgName, u32 *size, u32 *modTime);
+
+/**
+ * Creates the task streaming image files for fileSysStreamStart()
+ */
+void fileSysStreamInit(void);
+
+/**
+ * Starts streaming part of an image file. A task reads the file into one buffer while the caller
+ * is consuming the other, see fileSysStreamGetChunk(). Only one stream can be active at a time, and
+ * it must always be ended with fileSysStreamStop()
+ *
+ * @param offset The first byte to stream
+ * @param len How many bytes to stream
+ */
+fSysRet fileSysStreamStart(const char *imgName, u32 offset, u32 len);
+
+/**
+ * Waits for the next chunk of a stream. The chunk must be given back with fileSysStreamReleaseChunk()
+ *
+ * Returns the chunk length, 0 when the stream is done, or negative if the file could not be read
+ */
+int fileSysStreamGetChunk(const u8 **dat);
+
+/**
+ * Gives back a chunk taken with fileSysStreamGetChunk() so it can be refilled
+ */
+void fileSysStreamReleaseChunk(void);
+
+/**
+ * Ends a stream, stopping it early if it was not done
+ */
+void fileSysStreamStop(void);
+
+/**
+ * Deletes an image. Its content stays on the card for as long as another image has it
  */
 fSysRet fileSysDelImage(const char *imgName);
 
+/**
+ * Saves an image with the content of another, by the hash of that content, without the content having
+ * to be sent again
+ *
+ * Returns FILE_SYS_NO_FILE_FOUND if no image has that content
+ */
+fSysRet fileSysImageLink(const char *imgName, const u8 *hash);
+
+/**
+ * Gets the name of an image with some content, to know if it has to be sent at all
+ *
+ * @param hash FILE_SYS_HASH_LEN long
+ * @param imgName MAX_IMAGE_NAME_LEN long
+ *
+ * Returns FILE_SYS_NO_FILE_FOUND if no image has that content
+ */
+fSysRet fileSysFindHash(const u8 *hash, char *imgName);
+
+/**
+ * Gets the hash of an image's content, from the record of the image with its file
+ *
+ * @param hash FILE_SYS_HASH_LEN long
+ *
+ * Returns FILE_SYS_NO_FILE_FOUND if the image is not in the index or was not hashed yet, see
+ * fileSysIndexSync()
+ */
+fSysRet fileSysGetImageHash(const char *imgName, u8 *hash);
+
+/********** IMAGE INDEX **********/
+/**
+ * Brings the image index up to date with the image directory, for images copied to or deleted from
+ * the card by something else. Walks the whole directory and hashes the new images, so not something
+ * to do on every wake
+ */
+fSysRet fileSysIndexSync(void);
+
+/**
+ * Gets the name of the image with an ID
+ *
+ * @param imgName MAX_IMAGE_NAME_LEN long
+ *
+ * Returns FILE_SYS_NO_FILE_FOUND if the ID is not (or no longer) an image
+ */
+fSysRet fileSysIndexGetName(u32 id, char *imgName);
+
+/**
+ * Gets the ID of an image, this one has to search through the index
+ */
+fSysRet fileSysIndexFind(const char *imgName, u32 *id);
+
+/**
+ * Gets the first image at or after an ID, wrapping around the end of the index. Deleted images are
+ * skipped, which is the only reason this would read more than one record
+ *
+ * @param id the ID to start from, set to the ID after the returned image
+ * @param imgId set to the ID of the returned image, to load it with fileSysLoadImageById()
+ */
+fSysRet fileSysIndexNext(u32 *id, u32 *imgId);
+
+/**
+ * Gets the IDs of all the images, in order
+ *
+ * @param ids filled with up to maxIds IDs, there are at most fSysIndexInfo_t.count of them
+ * @param count set to how many were filled in
+ * @param info set to the index info the IDs are from, can be NULL
+ */
+fSysRet fileSysIndexGetIds(u32 *ids, u32 maxIds, u32 *count, fSysIndexInfo_t *info);
+
+/**
+ * Adds an object for each image to a cJSON array, with its ID, name, size, and the hex SHA-256 of its
+ * content (null until fileSysIndexSync() hashed it). Only reads the index, not the image files
+ *
+ * @param info set to the index info the manifest is from, can be NULL
+ */
+fSysRet fileSysIndexGetManifest(cJSON *jsonArr, fSysIndexInfo_t *info);
+
+fSysRet fileSysIndexGetInfo(fSysIndexInfo_t *info);
+
+/********** STORAGE **********/
+/**
+ * Creates the task counting the free space, and has it count it if the file system doesn't know it yet
+ * (FAT32 usually has it in its FSINFO sector). Counting can take seconds on a large card
+ */
+void fileSysStorageInit(void);
+
+/**
+ * Has the free space counted in the background, if it's not known
+ *
+ * @param force Count it even if it is, when it may be wrong, such as after the card was used elsewhere
+ */
+void fileSysStorageRevalidate(bool force);
+
+/**
+ * Gets how full the card is and how many more images fit. Never waits on the free space being counted,
+ * freeKnown is false until it's done
+ */
+fSysRet fileSysGetStorageInfo(fSysStorageInfo_t *out);
+
 /********** WEB RELATED **********/
 fSysRet fileSysGetIfWebAsset(const char *fileName);
 fSysRet fileSysOpenWebAsset(const char *fileName, FIL *file);
@@ -0,0 +1,219 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "common.h"
+#include "eink.h"
+#include "imgSlot.h"
+
+static const char *TAG = "imgSlot";
+
+typedef struct{
+    u8 *buff;                   // DISP_FB_SIZE, in PSRAM
+    u32 id;                     // 0 when free
+    u32 users;                  // imgSlotTake() without its imgSlotGive() yet
+    bool hasFrame;
+    bool receiving;             // taken to receive into, users is 1
+    bool closing;               // freed on the last imgSlotGive()
+    int64_t expiresUs;          // esp_timer time, only while users is 0
+}imgSlot_t;
+
+static SemaphoreHandle_t slotMutex;             // protects everything below, but not the content of the buffers
+static imgSlot_t slots[CONFIG_APP_IMG_SLOTS_MAX];
+static u32 slotCount;
+static u32 nextId = 1;
+static u32 opens;
+static u32 expired;
+static u32 exhausted;
+
+/**
+ * Call holding slotMutex
+ */
+static void slotFree(imgSlot_t *slot){
+    slot->id = 0;
+    slot->users = 0;
+    slot->hasFrame = false;
+    slot->receiving = false;
+    slot->closing = false;
+}
+
+/**
+ * Frees the slot if it sat unused past its expiry. Call holding slotMutex
+ *
+ * Returns true if it did
+ */
+static bool slotExpire(imgSlot_t *slot, int64_t nowUs){
+    if(slot->id == 0 || slot->users || nowUs < slot->expiresUs){
+        return false;
+    }
+    ESP_LOGD(TAG, "Slot %lu expired", slot->id);
+    slotFree(slot);
+    expired++;
+    return true;
+}
+
+/**
+ * Call holding slotMutex
+ */
+static imgSlot_t* slotFind(u32 id){
+    if(id == 0){
+        return NULL;
+    }
+    for(u32 i = 0; i < slotCount; i++){
+        if(slots[i].id == id){
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+void imgSlotInit(void){
+    size_t freeBytes;
+    u32 want;
+
+    slotMutex = xSemaphoreCreateMutex();
+    configASSERT( slotMutex );
+
+    freeBytes = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    want = freeBytes > IMG_SLOT_PSRAM_RESERVE ? (freeBytes - IMG_SLOT_PSRAM_RESERVE) / DISP_FB_SIZE : 0;
+    if(want > CONFIG_APP_IMG_SLOTS_MAX){
+        want = CONFIG_APP_IMG_SLOTS_MAX;
+    }
+    // uploads need at least one, even if it eats into the reserve
+    if(want == 0){
+        want = 1;
+    }
+
+    // one at a time, so a fragmented heap still gives what it can
+    for(slotCount = 0; slotCount < want; slotCount++){
+        slots[slotCount].buff = heap_caps_malloc(DISP_FB_SIZE, MALLOC_CAP_SPIRAM);
+        if(slots[slotCount].buff == NULL){
+            break;
+        }
+    }
+
+    if(slotCount == 0){
+        ESP_LOGE(TAG, "Unable to allocate an upload slot, uploads won't work");
+    } else {
+        ESP_LOGI(TAG, "%lu upload slots, %zu bytes of PSRAM were free", slotCount, freeBytes);
+    }
+}
+
+u32 imgSlotOpen(void){
+    imgSlot_t *slot = NULL;
+    int64_t nowUs = esp_timer_get_time();
+    u32 id = 0;
+
+    xSemaphoreTake(slotMutex, portMAX_DELAY);
+    for(u32 i = 0; i < slotCount; i++){
+        if(slots[i].id == 0 || slotExpire(&slots[i], nowUs)){
+            slot = &slots[i];
+            break;
+        }
+    }
+    if(slot){
+        id = nextId;
+        nextId++;
+        if(nextId == 0) nextId = 1;
+        slot->id = id;
+        slot->expiresUs = nowUs + (int64_t)IMG_SLOT_TTL_S * 1000000;
+        opens++;
+    } else {
+        exhausted++;
+    }
+    xSemaphoreGive(slotMutex);
+
+    return id;
+}
+
+imgSlotRet_e imgSlotTake(u32 id, bool receive, u8 **buff){
+    imgSlot_t *slot;
+    imgSlotRet_e ret;
+
+    xSemaphoreTake(slotMutex, portMAX_DELAY);
+    slot = slotFind(id);
+    if(slot == NULL || slot->closing || slotExpire(slot, esp_timer_get_time())){
+        ret = IMG_SLOT_NOT_FOUND;
+    } else if(slot->receiving || (receive && slot->users)){
+        // a frame arriving over one being saved, or another arriving, would mix the two
+        ret = IMG_SLOT_BUSY;
+    } else if(!receive && !slot->hasFrame){
+        ret = IMG_SLOT_NO_FRAME;
+    } else {
+        slot->users++;
+        slot->receiving = receive;
+        *buff = slot->buff;
+        ret = IMG_SLOT_RET_OK;
+    }
+    xSemaphoreGive(slotMutex);
+
+    return ret;
+}
+
+u8* imgSlotBuff(u32 id){
+    imgSlot_t *slot;
+    u8 *buff = NULL;
+
+    xSemaphoreTake(slotMutex, portMAX_DELAY);
+    slot = slotFind(id);
+    if(slot && slot->users){
+        buff = slot->buff;
+    }
+    xSemaphoreGive(slotMutex);
+
+    return buff;
+}
+
+void imgSlotGive(u32 id, bool hasFrame){
+    imgSlot_t *slot;
+
+    xSemaphoreTake(slotMutex, portMAX_DELAY);
+    slot = slotFind(id);
+    if(slot && slot->users){
+        slot->users--;
+        slot->hasFrame = hasFrame;
+        slot->receiving = false;
+        slot->expiresUs = esp_timer_get_time() + (int64_t)IMG_SLOT_TTL_S * 1000000;
+        if(slot->closing && slot->users == 0){
+            slotFree(slot);
+        }
+    }
+    xSemaphoreGive(slotMutex);
+}
+
+void imgSlotClose(u32 id){
+    imgSlot_t *slot;
+
+    xSemaphoreTake(slotMutex, portMAX_DELAY);
+    slot = slotFind(id);
+    if(slot){
+        if(slot->users){
+            slot->closing = true;
+        } else {
+            slotFree(slot);
+        }
+    }
+    xSemaphoreGive(slotMutex);
+}
+
+void imgSlotGetInfo(imgSlotInfo_t *out){
+    memset(out, 0, sizeof(imgSlotInfo_t));
+
+    xSemaphoreTake(slotMutex, portMAX_DELAY);
+    out->count = slotCount;
+    for(u32 i = 0; i < slotCount; i++){
+        if(slots[i].id){
+            out->open++;
+        }
+        if(slots[i].users){
+            out->busy++;
+        }
+    }
+    out->opens = opens;
+    out->expired = expired;
+    out->exhausted = exhausted;
+    xSemaphoreGive(slotMutex);
+}
@@ -0,0 +1,85 @@
+#ifndef IMG_SLOT_H
+#define IMG_SLOT_H
+
+#ifndef UNIT_TEST
+#include "sdkconfig.h"
+#endif
+
+#include <stdbool.h>
+#include "common.h"
+
+/**
+ * Upload slots, frame sized buffers in PSRAM that /img/upload receives into and /img/save writes out from.
+ * Each upload opens a slot and is told its ID, which the save then names, so clients uploading at the same
+ * time don't overwrite each other's frame. A slot left alone for IMG_SLOT_TTL_S expires and is reused
+ *
+ * How many there are is worked out at boot from the free PSRAM, keeping IMG_SLOT_PSRAM_RESERVE for the rest
+ * of the firmware, up to CONFIG_APP_IMG_SLOTS_MAX
+ */
+
+#ifndef CONFIG_APP_IMG_SLOTS_MAX
+#define CONFIG_APP_IMG_SLOTS_MAX    4
+#endif
+
+#define IMG_SLOT_TTL_S              120                 // S, a slot expires this long after it was last used
+#define IMG_SLOT_PSRAM_RESERVE      (1024 * 1024)       // bytes, of PSRAM left to everything else
+
+typedef enum{
+    IMG_SLOT_RET_OK = 0,
+    IMG_SLOT_NOT_FOUND,         // unknown or expired ID
+    IMG_SLOT_BUSY,              // being received into, or being saved from when taken to receive into
+    IMG_SLOT_NO_FRAME,          // no whole frame was received into it yet
+}imgSlotRet_e;
+
+typedef struct{
+    u32 count;                  // slots allocated at boot
+    u32 open;                   // held by an upload, expired ones are only counted once reused
+    u32 busy;                   // being received into or saved from
+    u32 opens;                  // since boot
+    u32 expired;                // since boot, reused after IMG_SLOT_TTL_S without a save
+    u32 exhausted;              // since boot, uploads turned away with every slot open
+}imgSlotInfo_t;
+
+/**
+ * Allocates the slots. Call once at boot, before the http server
+ */
+void imgSlotInit(void);
+
+/**
+ * Opens a free slot, reusing an expired one if need be
+ *
+ * Returns the slot ID, or 0 if they are all open
+ */
+u32 imgSlotOpen(void);
+
+/**
+ * Takes a slot to receive into or save from, so it can't expire or be reused until imgSlotGive(). Also
+ * pushes its expiry back. Receiving has the slot to itself, while saves can share it with each other
+ *
+ * @param id The slot ID from imgSlotOpen()
+ * @param receive Take it to receive a frame into, otherwise to save the whole frame it has
+ * @param buff Set to the slot's DISP_FB_SIZE buffer
+ */
+imgSlotRet_e imgSlotTake(u32 id, bool receive, u8 **buff);
+
+/**
+ * Gets the buffer of a slot taken with imgSlotTake(), for whoever it was taken for. NULL if it isn't taken
+ */
+u8* imgSlotBuff(u32 id);
+
+/**
+ * Gives back a slot taken with imgSlotTake()
+ *
+ * @param id The slot ID
+ * @param hasFrame Whether the slot now holds a whole frame, a failed upload leaves it without one
+ */
+void imgSlotGive(u32 id, bool hasFrame);
+
+/**
+ * Frees a slot, once the last imgSlotGive() if it's taken
+ */
+void imgSlotClose(u32 id);
+
+void imgSlotGetInfo(imgSlotInfo_t *out);
+
+#endif
@@ -0,0 +1,208 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "common.h"
+#include "main.h"
+#include "jobs.h"
+#include "eink.h"
+#include "fileSys.h"
+#include "imgSlot.h"
+#include "playlist.h"
+
+static const char *TAG = "jobs";
+
+// jobs are stored in a ring indexed by their ID, so a job can be looked up after it finished until
+// JOB_HISTORY_LEN other jobs were submitted after it
+static job_t jobTable[JOB_HISTORY_LEN];
+static u32 jobNextId = 1;                   // 0 is reserved as "no job"
+
+static SemaphoreHandle_t jobsMutex;         // protects jobTable and jobNextId
+static QueueHandle_t jobsQueue;             // the IDs of jobs to be executed by the worker
+static TaskHandle_t jobsTask_h;
+
+static StaticEventGroup_t jobsEvents_staticData;
+static EventGroupHandle_t jobsEvents;
+enum{
+    JOB_EVENT_DONE = 0x01,      // set every time the worker finishes a job
+};
+
+static void taskJobWorker(void *args);
+
+void jobsInit(void){
+    memset(jobTable, 0, sizeof(jobTable));
+    jobsMutex = xSemaphoreCreateMutex();
+    jobsQueue = xQueueCreate(JOB_QUEUE_LEN, sizeof(u32));
+    jobsEvents = xEventGroupCreateStatic(&jobsEvents_staticData);
+    configASSERT( jobsMutex && jobsQueue && jobsEvents );
+
+    xTaskCreatePinnedToCore(taskJobWorker, "jobs", 4096, NULL, 3,
+                            &jobsTask_h, 0);
+}
+
+u32 jobSubmit(jobType_e type, const char *imgName, mode_e mode, u32 slot){
+    job_t *job;
+    u32 id;
+
+    xSemaphoreTake(jobsMutex, portMAX_DELAY);
+    id = jobNextId;
+    job = &jobTable[id % JOB_HISTORY_LEN];
+    // the oldest slot is still in use, we have too many jobs in flight
+    if(job->stat == JOB_STAT_QUEUED || job->stat == JOB_STAT_RUNNING){
+        xSemaphoreGive(jobsMutex);
+        return 0;
+    }
+    memset(job, 0, sizeof(job_t));
+    job->id = id;
+    job->type = type;
+    job->stat = JOB_STAT_QUEUED;
+    job->mode = mode;
+    job->slot = slot;
+    job->queuedUs = esp_timer_get_time();
+    if(imgName){
+        strncpy(job->imgName, imgName, MAX_IMAGE_NAME_LEN-1);
+    }
+
+    if(xQueueSend(jobsQueue, &id, 0) != pdTRUE){
+        job->stat = JOB_STAT_FREE;
+        xSemaphoreGive(jobsMutex);
+        return 0;
+    }
+    jobNextId++;
+    if(jobNextId == 0) jobNextId = 1;
+    xSemaphoreGive(jobsMutex);
+
+    ESP_LOGD(TAG, "Queued job %lu of type %s", id, jobTypeToStr(type));
+    return id;
+}
+
+int jobGet(u32 id, job_t *out){
+    int ret = -1;
+    const job_t *job;
+
+    if(id == 0){
+        return -1;
+    }
+
+    xSemaphoreTake(jobsMutex, portMAX_DELAY);
+    job = &jobTable[id % JOB_HISTORY_LEN];
+    if(job->id == id && job->stat != JOB_STAT_FREE){
+        memcpy(out, job, sizeof(job_t));
+        ret = 0;
+    }
+    xSemaphoreGive(jobsMutex);
+    return ret;
+}
+
+int jobWait(u32 id, TickType_t timeout, job_t *out){
+    TickType_t start = xTaskGetTickCount();
+    TickType_t elapsed;
+
+    for(EVER){
+        // clear before checking, so a job finishing between the check and the wait is not missed
+        xEventGroupClearBits(jobsEvents, JOB_EVENT_DONE);
+        if(jobGet(id, out)){
+            return -1;
+        }
+        if(out->stat == JOB_STAT_DONE){
+            return 0;
+        }
+        elapsed = xTaskGetTickCount() - start;
+        if(elapsed >= timeout){
+            return -2;
+        }
+        xEventGroupWaitBits(jobsEvents, JOB_EVENT_DONE, pdFALSE, pdTRUE, timeout - elapsed);
+    }
+}
+
+const char* jobTypeToStr(jobType_e type){
+    switch(type){
+        case JOB_TYPE_IMG_SAVE:     return "imgSave";
+        case JOB_TYPE_IMG_LOAD:     return "imgLoad";
+        case JOB_TYPE_IMG_DELETE:   return "imgDelete";
+        case JOB_TYPE_SET_MODE:     return "setMode";
+        default:                    return "error";
+    }
+}
+
+const char* jobStatToStr(jobStat_e stat){
+    switch(stat){
+        case JOB_STAT_QUEUED:       return "queued";
+        case JOB_STAT_RUNNING:      return "running";
+        case JOB_STAT_DONE:         return "done";
+        default:                    return "error";
+    }
+}
+
+static int jobExecute(const job_t *job){
+    const u8 *srcBuff;
+    u8 *destBuff;
+    int ret;
+
+    switch(job->type){
+        case JOB_TYPE_IMG_SAVE:
+            srcBuff = imgSlotBuff(job->slot);
+            if(srcBuff == NULL){
+                return JOB_RESULT_NO_SLOT;
+            }
+            ret = fileSysSaveImage(job->imgName, srcBuff);
+            imgSlotGive(job->slot, true);
+            return ret;
+        case JOB_TYPE_IMG_LOAD:
+            // unlike the http handler, the worker can afford to wait on whoever has the framebuffer
+            destBuff = takeDispFb(pdMS_TO_TICKS(1000));
+            if(destBuff == NULL){
+                return JOB_RESULT_FB_BUSY;
+            }
+            ret = fileSysLoadImage(job->imgName, destBuff, false);
+            releaseDispFb();
+            return ret;
+        case JOB_TYPE_IMG_DELETE:
+            return playlistDeleteImageFile(job->imgName);
+        case JOB_TYPE_SET_MODE:
+            return setMode(job->mode);
+        default:
+            return -1;
+    }
+}
+
+/**
+ * The worker task, executes the slow (SD card) jobs queued by the http handlers one at a time
+ */
+static void taskJobWorker(void *args){
+    u32 id;
+    job_t *job;
+    job_t toRun;
+    int result;
+    int64_t endUs;
+
+    for(EVER){
+        xQueueReceive(jobsQueue, &id, portMAX_DELAY);
+
+        xSemaphoreTake(jobsMutex, portMAX_DELAY);
+        job = &jobTable[id % JOB_HISTORY_LEN];
+        job->stat = JOB_STAT_RUNNING;
+        job->startUs = esp_timer_get_time();
+        memcpy(&toRun, job, sizeof(job_t));
+        xSemaphoreGive(jobsMutex);
+
+        // run without the mutex held, so the job state can be queried while the operation is running
+        result = jobExecute(&toRun);
+        endUs = esp_timer_get_time();
+
+        xSemaphoreTake(jobsMutex, portMAX_DELAY);
+        job->result = result;
+        job->endUs = endUs;
+        job->stat = JOB_STAT_DONE;
+        xSemaphoreGive(jobsMutex);
+        xEventGroupSetBits(jobsEvents, JOB_EVENT_DONE);
+
+        ESP_LOGI(TAG, "Job %lu (%s) done with result %d in %lld uS", id, jobTypeToStr(toRun.type), result,
+                                                                     endUs - toRun.startUs);
+    }
+}
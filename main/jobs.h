@@ -0,0 +1,83 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#ifndef UNIT_TEST
+#include "freertos/FreeRTOS.h"
+#else
+#include "mock.h"
+#endif
+
+#include "common.h"
+#include "main.h"
+
+#define JOB_QUEUE_LEN           8       // how many jobs can be waiting on the worker at once
+#define JOB_HISTORY_LEN         16      // how many jobs (queued, running, or finished) are kept to be queried
+                                        // must be larger than JOB_QUEUE_LEN
+
+#define JOB_WAIT_TIMEOUT_MS     10000   // mS, how long a handler will wait on a job when the caller asked to
+
+#define JOB_RESULT_FB_BUSY      (-1)    // job result if the display framebuffer could not be taken
+#define JOB_RESULT_NO_SLOT      (-2)    // job result if the upload slot to save from isn't taken
+
+typedef enum{
+    JOB_TYPE_IMG_SAVE,          // save an upload slot to an image file
+    JOB_TYPE_IMG_LOAD,          // load an image file into the display framebuffer
+    JOB_TYPE_IMG_DELETE,        // delete an image file
+    JOB_TYPE_SET_MODE,          // change the operation mode (see setMode())
+}jobType_e;
+
+typedef enum{
+    JOB_STAT_FREE = 0,          // slot is not in use
+    JOB_STAT_QUEUED,            // waiting on the worker
+    JOB_STAT_RUNNING,           // worker is currently executing it
+    JOB_STAT_DONE,              // finished, see result
+}jobStat_e;
+
+typedef struct{
+    u32 id;
+    jobType_e type;
+    jobStat_e stat;
+    int result;                     // the return of the operation, either a fSysRet or setModeRet_e depending on type
+    char imgName[MAX_IMAGE_NAME_LEN];
+    mode_e mode;
+    u32 slot;                       // the upload slot for JOB_TYPE_IMG_SAVE, see imgSlot.h
+    int64_t queuedUs;               // esp_timer timestamps for when this job was queued, started, and finished
+    int64_t startUs;
+    int64_t endUs;
+}job_t;
+
+/**
+ * Creates the job queue and the worker task
+ */
+void jobsInit(void);
+
+/**
+ * Queues a job to the worker
+ *
+ * @param type The job type
+ * @param imgName The image name for image jobs, can be NULL otherwise
+ * @param mode The mode to set to for JOB_TYPE_SET_MODE, ignored otherwise
+ * @param slot The upload slot to save from for JOB_TYPE_IMG_SAVE, ignored otherwise. The caller takes it with
+ *             imgSlotTake(), the worker gives it back once done, and the caller if the job couldn't be queued
+ * @return The job ID, or 0 if the queue is full
+ */
+u32 jobSubmit(jobType_e type, const char *imgName, mode_e mode, u32 slot);
+
+/**
+ * Gets a copy of a job's state
+ *
+ * Returns 0 on success, non-zero if the job ID is unknown (never existed or too old)
+ */
+int jobGet(u32 id, job_t *out);
+
+/**
+ * Waits for a job to finish, then gets a copy of it's state
+ *
+ * Returns 0 if the job finished, non-zero if the job ID is unknown or the timeout was reached
+ */
+int jobWait(u32 id, TickType_t timeout, job_t *out);
+
+const char* jobTypeToStr(jobType_e type);
+const char* jobStatToStr(jobStat_e stat);
+
+#endif
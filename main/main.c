@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <time.h>
 #include "sdkconfig.h"
 
 #include "driver/gpio.h"
@@ -30,23 +31,51 @@
 #include "esp_pm.h"
 #include "esp_sleep.h"
 #include "nvs_flash.h"
-#include "esp_random.h"
+#include "esp_timer.h"
+#include "esp_system.h"
 
 #include "common.h"
 #include "main.h"
 #include "eink.h"
 #include "network.h"
 #include "fileSys.h"
+#include "jobs.h"
+#include "bulk.h"
+#include "trace.h"
+#include "persist.h"
+#include "playlist.h"
+#include "pwrStats.h"
+#include "pmicHist.h"
+#include "pmicEvt.h"
+#include "schedule.h"
+#include "timeSync.h"
+#include "seqlock.h"
+#include "imgSlot.h"
 
 // configure as part of RTC NOINIT RAM due to deep sleep
-RTC_NOINIT_ATTR imgPlaylist_t imgPlaylist = { 0 };
-RTC_NOINIT_ATTR mode_e runMode;
+RTC_NOINIT_ATTR static runState_t runState;          // only through runStateGet() and runStateEdit()
+RTC_NOINIT_ATTR static wakeTimings_t wakeTimings;     // of the last low power playlist wake
+#define WAKE_TIMINGS_MAGIC      0x57414B45
 
 spi_device_handle_t dispSpi;        // global spi device
 i2c_master_bus_handle_t i2cHandle;
 sdmmc_card_t sdCard;
 
-pmicTelemetry pmicTelem;
+static pmicTelemetry pmicTelem;                 // the latest sample, only through pmicTelemGet()
+static seqlock_t pmicTelemSeq = SEQLOCK_INIT;
+
+// the measured charge of a refresh, for the schedule policy of low power wakes which don't measure it
+typedef struct{
+    u32 magic;                  // SCHED_ENERGY_MAGIC if the rest is valid
+    float refreshMah;
+    float baselineMa;
+}schedEnergy_t;
+RTC_NOINIT_ATTR static schedEnergy_t schedEnergy;
+#define SCHED_ENERGY_MAGIC      0x454E5247
+
+static playlistSched_t playlistSched;           // only through playlistGetSchedule()
+static seqlock_t playlistSchedSeq = SEQLOCK_INIT;
+static bool isFastWake;
 
 // the display updater task starter/handler
 TaskHandle_t dispTask_h;
@@ -54,13 +83,25 @@ StaticEventGroup_t dispEvents_staticData;
 EventGroupHandle_t dispEvents;
 enum{
     RTOS_DISP_EVENT_COMPLETE = 0x01,    // set when we finish updating the display, cleared when we are using the display
+    RTOS_DISP_EVENT_DONE     = 0x02,    // pulsed every time a refresh is done, for dispWaitTicket()
 };
 
+// the display refresh requests, see dispRequestUpdate()
+static SemaphoreHandle_t dispQueueMutex;
+static dispQueueStats_t dispQueue;
+static dispPrio_e dispQueuePrio;        // the highest priority of the requests merged into the pending refresh
+
 TaskHandle_t pmicTelemTask_h;
-SemaphoreHandle_t pmicTelemetryMutex;
+
+static seqlock_t runStateSeq = SEQLOCK_INIT;
+static StaticSemaphore_t runStateMutex_staticData;
+static SemaphoreHandle_t runStateMutex;            // keeps runState writers apart
+static TimerHandle_t playlistTimer;
 
 void taskTimerImagePlaylist(TimerHandle_t xTimer);
 void taskPmicTelemetry(void *args);
+static void pmicEventHandler(void *arg, esp_event_base_t base, int32_t id, void *data);
+static u32 playlistNextPeriodS(const runState_t *st);
 void taskDispUpdate(void *args);
 int imagePlaylistLoad(void);
 void deepSleepDisplayUpdate(void);
@@ -68,7 +109,9 @@ void waitForDisplay(TickType_t timeout);
 
 static const char *TAG = "main";
 
-void mcuInit(void){
+static int64_t wakePhaseStartUs;    // when the current wake phase started
+
+static void mcuInitPm(void){
     // configure Dynamic Frequency Scaling (DFS) settings
     esp_pm_config_t pm_config = {
             .max_freq_mhz = 160,
@@ -80,7 +123,9 @@ void mcuInit(void){
 #endif
     };
     ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
+}
 
+static void mcuInitGpio(void){
     // init IO
     gpio_config_t gpio_conf;
     gpio_conf.intr_type     = GPIO_INTR_DISABLE;
@@ -99,11 +144,18 @@ void mcuInit(void){
     gpio_conf.pin_bit_mask = ((uint64_t) 0x01 << IO_DISP_BUSY);
     gpio_conf.pull_up_en   = GPIO_PULLUP_ENABLE;        // enable pull-up for busy, shouldn't be really needed but alas...
     ESP_ERROR_CHECK(gpio_config(&gpio_conf));
+    // init IO as input, button. It was left held as an RTC IO as a wake source when going to sleep
+    rtc_gpio_hold_dis(IO_BUTTON);
+    rtc_gpio_deinit(IO_BUTTON);
+    gpio_conf.pin_bit_mask = ((uint64_t) 0x01 << IO_BUTTON);
+    ESP_ERROR_CHECK(gpio_config(&gpio_conf));
 
     // turn on the power LED on by default, other one can be off
     gpio_set_level(IO_DBG_LED1, LED_LVL_ON);
     gpio_set_level(IO_DBG_LED2, LED_LVL_OFF);
+}
 
+static void mcuInitSpi(void){
     // init spi
     spi_bus_config_t buscfg = {0};
     buscfg.miso_io_num = -1;
@@ -122,7 +174,9 @@ void mcuInit(void){
     devcfg.flags = SPI_DEVICE_HALFDUPLEX;
     ESP_ERROR_CHECK(spi_bus_initialize(SPI3_HOST, &buscfg, SPI_DMA_CH_AUTO));
     ESP_ERROR_CHECK(spi_bus_add_device(SPI3_HOST, &devcfg, &dispSpi));
+}
 
+static void mcuInitI2c(void){
     // init i2c
     i2c_master_bus_config_t i2c_bus_cfg;
     memset(&i2c_bus_cfg, 0, sizeof(i2c_bus_cfg));
@@ -132,8 +186,11 @@ void mcuInit(void){
     i2c_bus_cfg.sda_io_num = IO_I2C_SDA;
     i2c_bus_cfg.glitch_ignore_cnt = 7;
     i2c_bus_cfg.flags.enable_internal_pullup = true;
+    i2c_bus_cfg.trans_queue_depth = PMIC_I2C_QUEUE_DEPTH;   // async, the tasks sleep through transactions
     ESP_ERROR_CHECK(i2c_new_master_bus(&i2c_bus_cfg, &i2cHandle));
+}
 
+static void mcuInitSd(void){
     // init sd card
     ESP_ERROR_CHECK(sdmmc_host_init());
     sdmmc_slot_config_t sdmmcConf = {
@@ -158,7 +215,9 @@ void mcuInit(void){
     // host.max_freq_khz = SDMMC_FREQ_DEFAULT;
     host.max_freq_khz = SDMMC_FREQ_HIGHSPEED;
     sdmmc_card_init(&host, &sdCard);
+}
 
+static void mcuInitNvs(void){
     // init nvs flash, which is used for some wifi stuff
     esp_err_t err = nvs_flash_init();
     if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -168,18 +227,26 @@ void mcuInit(void){
         err = nvs_flash_init();
     }
     ESP_ERROR_CHECK(err);
+}
 
+void mcuInit(void){
+    TRACE_BEGIN("mcuInit");
+    mcuInitPm();
+    mcuInitGpio();
+    mcuInitSpi();
+    mcuInitI2c();
+    mcuInitSd();
+    mcuInitNvs();
+    TRACE_END("mcuInit");
 }
 
-void app_main(void){
+/**
+ * Mounts the SD card's file system, if the card is there
+ */
+static void sdCardMount(void){
     esp_err_t stat;
 
-    printf("Hello world!\n");
-    mcuInit();
-    pmicInit(&i2cHandle);
-    dispInit();
-
-    // load SD card
+    playlistInit();
     stat = sdmmc_get_status(&sdCard);
     if(stat == ESP_OK){
         initFs();
@@ -192,55 +259,176 @@ void app_main(void){
         // todo: handle hot plug?
         ESP_LOGW(TAG, "SD card status not good! code %d", stat);
     }
+}
 
-    delayMs(INITIAL_BOOT_SLEEP_DELAY);      // debug, remove when firmware is tested
+/**
+ * Ends the current wake phase, saving how long it took
+ */
+static void wakePhaseDone(wakePhase_e phase){
+    int64_t now = esp_timer_get_time();
+    wakeTimings.phaseUs[phase] = now - wakePhaseStartUs;
+    wakePhaseStartUs = now;
+}
 
-    // at this point we check if we were in "low power cycle" mode, or if
-    // in low power cycle mode, check wake source. If timer, put on next image and exit.
-    // if from button, revert mode to standby
+/**
+ * The low power playlist wake, only the peripherals needed to show the next image are initialized
+ */
+static void fastWake(void){
+    pmicTelemetry telem;
+
+    isFastWake = true;
+    // esp_timer starts counting early in the startup code, so the time up to now is (most of) the boot
+    wakePhaseStartUs = 0;
+    if(wakeTimings.magic != WAKE_TIMINGS_MAGIC){
+        memset(&wakeTimings, 0, sizeof(wakeTimings));
+        wakeTimings.magic = WAKE_TIMINGS_MAGIC;
+    }
+    wakeTimings.wakeCnt++;
+    wakePhaseDone(WAKE_PHASE_BOOT);
+    // the refresh windows are in local time
+    timeSyncWake();
+
+    mcuInitPm();
+    mcuInitGpio();
+    mcuInitSpi();
+    mcuInitI2c();
+    pmicInit(&i2cHandle);
+    dispInit();
+    wakePhaseDone(WAKE_PHASE_PERIPH);
+
+    // the telemetry task doesn't run here, a sample per wake keeps the history going
+    if(pmicGetTelemetry(&telem) == ESP_OK){
+        seqlockWrite(&pmicTelemSeq, &pmicTelem, &telem, sizeof(pmicTelemetry));
+        pmicHistAddLp(&telem);
+    }
+
+    mcuInitSd();
+    sdCardMount();
+    wakePhaseDone(WAKE_PHASE_SD);
+
+    deepSleepDisplayUpdate();
+}
+
+/**
+ * Waits a bit after boot for debugging, see INITIAL_BOOT_SLEEP_DELAY. Holding the button skips it
+ */
+static void bootDebugDelay(void){
+    for(u32 waited = 0; waited < INITIAL_BOOT_SLEEP_DELAY; waited += BOOT_DELAY_BUTTON_POLL){
+        if(gpio_get_level(IO_BUTTON) == 0){
+            ESP_LOGI(TAG, "Button held, skipping boot delay");
+            return;
+        }
+        delayMs(BOOT_DELAY_BUTTON_POLL);
+    }
+}
+
+void app_main(void){
+    const wakeTimings_t *lastWake;
+    mode_e resumeMode = MODE_STANDBY;
+    runState_t st;
+
+    printf("Hello world!\n");
+
+    runStateMutex = xSemaphoreCreateMutexStatic(&runStateMutex_staticData);
+
+    // check the wake source first, a low power playlist wake only shows the next image and goes back to sleep
     esp_sleep_wakeup_cause_t wakeSource = esp_sleep_get_wakeup_cause();
     ESP_LOGI(TAG, "sleep source: %d", wakeSource);
-    if(wakeSource == ESP_SLEEP_WAKEUP_TIMER){
-        if(runMode == MODE_IMAGE_PLAYLIST_LP){
-            deepSleepDisplayUpdate();
-            return;         // never reached due to deep sleep
-        }
+    runStateGet(&st);
+    if(wakeSource == ESP_SLEEP_WAKEUP_TIMER && st.runMode == MODE_IMAGE_PLAYLIST_LP){
+        fastWake();
+        return;         // never reached due to deep sleep
+    }
+
+    // RTC memory is garbage after a power on
+    if(esp_reset_reason() == ESP_RST_POWERON){
+        wakeTimings.magic = 0;
+        schedEnergy.magic = 0;
+    }
+
+    mcuInit();
+    // the pmic component doesn't know about the trace, so it's traced from here
+    TRACE_BEGIN("pmicInit");
+    pmicInit(&i2cHandle);
+    TRACE_END("pmicInit");
+    dispInit();
+
+    // load SD card
+    sdCardMount();
+
+    // pick up images copied to or deleted from the card elsewhere, too slow for the low power wake
+    fileSysIndexSync();
+
+    bootDebugDelay();      // debug, remove when firmware is tested
+
+    lastWake = getLastWakeTimings();
+    if(lastWake){
+        ESP_LOGI(TAG, "Last of %lu low power wakes: boot %lu uS, periph %lu uS, sd %lu uS, load %lu uS, disp %lu uS, "
+                      "total %lu uS", lastWake->wakeCnt, lastWake->phaseUs[WAKE_PHASE_BOOT],
+                      lastWake->phaseUs[WAKE_PHASE_PERIPH], lastWake->phaseUs[WAKE_PHASE_SD],
+                      lastWake->phaseUs[WAKE_PHASE_IMG_LOAD], lastWake->phaseUs[WAKE_PHASE_DISP], lastWake->totalUs);
     }
-    else if(wakeSource == ESP_SLEEP_WAKEUP_EXT1){
+
+    // if from button, revert mode to standby
+    runStateEdit(&st);
+    if(wakeSource == ESP_SLEEP_WAKEUP_EXT1){
         // if we manually woke the thing up, assume standby mode so we can connect to it over WiFi and other stuff
         // todo: is it better to assume MODE_IMAGE_PLAYLIST instead? So we can keep the picture frame while
         //       allowing WiFi connectivity?
         ESP_LOGI(TAG, "Manually woke up device with EXT0, switching to standby mode");
-        runMode = MODE_STANDBY;
+        st.runMode = MODE_STANDBY;
     }
-    else{
-        runMode = MODE_STANDBY;
+    else if(wakeSource != ESP_SLEEP_WAKEUP_TIMER){
+        st.runMode = MODE_STANDBY;
     }
 
-    // todo: load these configs from NVM
-    imgPlaylist.period_ticks = configTICK_RATE_HZ * 60 * DEFAULT_SCAN_IMAGE_DUR_MIN;
-    imgPlaylist.mode = PLAYLIST_MODE_RANDOM;
-
-    // setup WiFi and http server
-    wifiInit();
-    startHttpServer();
-
-    // create FreeRTOS objects
-    memset(&pmicTelem, 0, sizeof(pmicTelem));
-    pmicTelemetryMutex = xSemaphoreCreateMutex();
+    // deep sleep keeps the playlist in RTC memory, otherwise restore the saved one over the defaults
+    persistInit();
+    if(wakeSource == ESP_SLEEP_WAKEUP_UNDEFINED){
+        memset(&st.playlist, 0, sizeof(st.playlist));
+        st.playlist.period_ticks = configTICK_RATE_HZ * 60 * DEFAULT_SCAN_IMAGE_DUR_MIN;
+        st.playlist.mode = PLAYLIST_MODE_RANDOM;
+        if(persistPlaylistLoad(&st.playlist, &resumeMode) == 0){
+            ESP_LOGI(TAG, "Restored the saved playlist config");
+        }
+        // only pick the playlist back up after a power loss, other resets are likely a crash
+        if(esp_reset_reason() != ESP_RST_POWERON){
+            resumeMode = MODE_STANDBY;
+        }
+    }
+    runStateCommit(&st);
 
+    // the display queue, its task and the playlist timer, before anything that can take a request
     dispEvents = xEventGroupCreateStatic(&dispEvents_staticData);
-    configASSERT( dispEvents );
-
-    // create FreeRTOS tasks and timers
-    imgPlaylist.timerHandler = xTimerCreate("playlist", imgPlaylist.period_ticks, pdTRUE, ( void * )0, taskTimerImagePlaylist);
+    dispQueueMutex = xSemaphoreCreateMutex();
+    configASSERT( dispEvents && dispQueueMutex );
+    playlistTimer = xTimerCreate("playlist", st.playlist.period_ticks, pdTRUE, ( void * )0, taskTimerImagePlaylist);
 
     xTaskCreatePinnedToCore(taskDispUpdate, "display", 4096, NULL, 4,
                             &dispTask_h, 0);
 
+    // setup the upload slots, job worker, image streaming and free space counting for the http server's slow
+    // requests, then WiFi and http server
+    pwrStatsInit();
+    pmicHistInit();
+    imgSlotInit();
+    jobsInit();
+    fileSysStreamInit();
+    fileSysStorageInit();
+    wifiInit();
+    timeSyncInit();
+    pmicEvtInit();
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(PMIC_EVENT, ESP_EVENT_ANY_ID, pmicEventHandler, NULL, NULL));
+    startHttpServer();
+    bulkInit();
+
     xTaskCreatePinnedToCore(taskPmicTelemetry, "pmicTelem", 4096, NULL, 4,
                             &pmicTelemTask_h, 0);
 
+    if(resumeMode != MODE_STANDBY){
+        ESP_LOGI(TAG, "Resuming the playlist mode %d from before the power loss, stat %d", resumeMode, setMode(resumeMode));
+    }
+
     printf("Done with init\n");
 
     // dev notes: adding logic to disable ES7210 doesn't make a difference
@@ -268,11 +456,17 @@ void app_main(void){
  * Can be worked up either by timer (if we are in playlist mode), or with the KEY button
  */
 void goDeepSleep(void){
+    runState_t st;
+    u32 periodS;
+
     ESP_LOGI(TAG, "Commanded to go to deep sleep");
-    if(runMode == MODE_IMAGE_PLAYLIST_LP){
+    persistFlush();         // the playlist survives deep sleep, but not a power loss while sleeping
+    runStateGet(&st);
+    if(st.runMode == MODE_IMAGE_PLAYLIST_LP){
         // with the internal 136kHz clock into the 48-bit RTC timer, we have...*pulls up confuser***...65 years of
-        ESP_LOGI(TAG, "Setting timer to %d mS", imgPlaylist.period_ticks);      // debug
-        esp_sleep_enable_timer_wakeup((uint64_t)imgPlaylist.period_ticks * 1000 * 1000 / configTICK_RATE_HZ);
+        periodS = playlistNextPeriodS(&st);
+        ESP_LOGI(TAG, "Setting timer to %lu S", periodS);      // debug
+        esp_sleep_enable_timer_wakeup((uint64_t)periodS * 1000 * 1000);
     }
     // always enable the boot button as a valid wakeup source
     // we must use EXT1 as the button is a pulldown, while EXT0 only supports when the IO goes high
@@ -289,12 +483,23 @@ void goDeepSleep(void){
     esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_PERIPH, ESP_PD_OPTION_ON);
 
     // disable all LDOs and wait for I2C to finish operations
-    vTaskDelete(pmicTelemTask_h);
+    // the telemetry task and display handler don't exist on a low power playlist wake
+    if(pmicTelemTask_h){
+        // not in the middle of a transaction, or the display task could never get the PMIC again
+        pmicLock();
+        vTaskDelete(pmicTelemTask_h);
+        pmicTelemTask_h = NULL;
+        pmicEvtStop();
+        pmicUnlock();
+    }
+    pmicHistSave();
     i2c_master_bus_wait_all_done(i2cHandle, 100);
 
     // wait for display handler to finish
-    ESP_LOGI(TAG, "Waiting for display to finish updating before going to low power mode");
-    waitForDisplay(portMAX_DELAY);
+    if(dispEvents){
+        ESP_LOGI(TAG, "Waiting for display to finish updating before going to low power mode");
+        waitForDisplay(portMAX_DELAY);
+    }
 
     ESP_LOGI(TAG, "Good night");
     GOOD_NIGHT();
@@ -306,62 +511,227 @@ void deepSleepDisplayUpdate(void){
     ESP_LOGI(TAG, "Booted up from low power while we have a playlist, load the next image and go back to sleep");
     // put the next image up and bail instantly!
     imagePlaylistLoad();
+    wakePhaseDone(WAKE_PHASE_IMG_LOAD);
 
     pmicEnableLDOs();
     delayMs(100);            // some boot up time, todo: instrument
     dispBoot();
     dispUpdate();
+    wakePhaseDone(WAKE_PHASE_DISP);
 
+    wakeTimings.totalUs = esp_timer_get_time();
     goDeepSleep();
 }
 
+const wakeTimings_t* getLastWakeTimings(void){
+    return wakeTimings.magic == WAKE_TIMINGS_MAGIC ? &wakeTimings : NULL;
+}
+
+const char* wakePhaseToStr(wakePhase_e phase){
+    switch(phase){
+        case WAKE_PHASE_BOOT:       return "boot";
+        case WAKE_PHASE_PERIPH:     return "periph";
+        case WAKE_PHASE_SD:         return "sd";
+        case WAKE_PHASE_IMG_LOAD:   return "imgLoad";
+        case WAKE_PHASE_DISP:       return "disp";
+        default:                    return "error";
+    }
+}
+
 setModeRet_e setMode(mode_e newMode){
+    runState_t st;
+
+    runStateEdit(&st);
     if(newMode == MODE_IMAGE_PLAYLIST || newMode == MODE_IMAGE_PLAYLIST_LP){
-        // set totalImg before going into the mode
-        if(fileSysGetAvailableImages(NULL, &imgPlaylist.totalImg)){
+        fSysIndexInfo_t indexInfo;
+        if(fileSysIndexGetInfo(&indexInfo)){
+            runStateAbort();
             return RET_SET_MODE_ERR;
         }
         // check we have images available. Should be at least 2 for an image playlist to work as a playlist
-        if(imgPlaylist.totalImg < 2){
+        if(indexInfo.count < 2){
+            runStateAbort();
             return RET_SET_MODE_IMG_NO_IMG;
         }
         // check we have images selected if in selection mode
-        if(imgPlaylist.mode == PLAYLIST_MODE_SELECT){
-            u32 sum = 0;    // really cheeky way to see if we have any image available. because the available variable
-                            // will just be 1 or 0, we can just sum the array and check if the sum is 0, meaning no image
-                            // is present
-            for(int i=0;i<MAX_PLAYLIST_IMG;i++){
-                sum += imgPlaylist.imgSelectEn[i];
-            }
-            if(sum == 0){
+        if(st.playlist.mode == PLAYLIST_MODE_SELECT){
+            playlistInfo_t plInfo;
+            if(playlistGetInfo(st.playlist.playlistId, &plInfo) || plInfo.count == 0){
+                runStateAbort();
                 return RET_SET_MODE_IMG_PL_NONE_SET;
             }
         }
         // if we are in deep sleep mode, when we set the mode immediately jump to sleep
-        if(runMode == MODE_IMAGE_PLAYLIST_LP){
+        if(st.runMode == MODE_IMAGE_PLAYLIST_LP){
+            runStateAbort();
             goDeepSleep();
             return RET_SET_MODE_SLEEP;
         }
-        imgPlaylist.currIdx = 0;
-        xTimerChangePeriod(imgPlaylist.timerHandler, imgPlaylist.period_ticks, pdTICKS_TO_MS(100));
-        // xTimerStart(imgPlaylist.timerHandler, 0);        // above change period causes it to start
+        st.playlist.currIdx = 0;
+        xTimerChangePeriod(playlistTimer, playlistNextPeriodS(&st) * configTICK_RATE_HZ, pdTICKS_TO_MS(100));
+        // xTimerStart(playlistTimer, 0);        // above change period causes it to start
     } else {
-        xTimerStop(imgPlaylist.timerHandler, 0);
+        xTimerStop(playlistTimer, 0);
     }
-    runMode = newMode;
+    st.runMode = newMode;
+    runStateCommit(&st);
+    persistPlaylistSave();
     return RET_SET_MODE_OK;
 }
 
-int dispTrigUpdate(void){
-    u32 prevVal;
-    xTaskNotifyAndQuery(dispTask_h, 0, eIncrement, &prevVal);
-    if(prevVal != 0){
-        return 1;
+void runStateGet(runState_t *out){
+    seqlockRead(&runStateSeq, out, &runState, sizeof(runState_t));
+}
+
+void runStateEdit(runState_t *st){
+    xSemaphoreTake(runStateMutex, portMAX_DELAY);
+    // no other writer, so no need for the seqlock
+    memcpy(st, &runState, sizeof(runState_t));
+}
+
+void runStateCommit(const runState_t *st){
+    seqlockWrite(&runStateSeq, &runState, st, sizeof(runState_t));
+    xSemaphoreGive(runStateMutex);
+}
+
+void runStateAbort(void){
+    xSemaphoreGive(runStateMutex);
+}
+
+dispTicket_t dispRequestUpdate(dispPrio_e prio){
+    dispTicket_t ticket;
+
+    xSemaphoreTake(dispQueueMutex, portMAX_DELAY);
+    dispQueue.requests++;
+    if(dispQueue.pending){
+        // the refresh did not start yet, so it will show this request's frame buffer too
+        if(prio > dispQueuePrio){
+            dispQueuePrio = prio;
+        }
+    } else {
+        dispQueue.last++;
+        dispQueue.pending = true;
+        dispQueuePrio = prio;
+        xEventGroupClearBits(dispEvents, RTOS_DISP_EVENT_COMPLETE);
     }
-    return 0;
+    ticket = dispQueue.last;
+    xSemaphoreGive(dispQueueMutex);
+
+    // the task reads the priority back from dispQueuePrio, a value here could be overwritten by a lower one
+    xTaskNotify(dispTask_h, 0, eNoAction);
+    return ticket;
+}
+
+bool dispTicketDone(dispTicket_t ticket){
+    bool done;
+
+    xSemaphoreTake(dispQueueMutex, portMAX_DELAY);
+    done = dispQueue.done >= ticket;
+    xSemaphoreGive(dispQueueMutex);
+    return done;
+}
+
+int dispWaitTicket(dispTicket_t ticket, TickType_t timeout){
+    TimeOut_t timeOut;
+
+    vTaskSetTimeOutState(&timeOut);
+    for(EVER){
+        if(dispTicketDone(ticket)){
+            return 0;
+        }
+        // COMPLETE as well, in case the DONE pulse came between the check above and here while the display
+        // then went idle
+        if(xTaskCheckForTimeOut(&timeOut, &timeout) == pdTRUE){
+            return 1;
+        }
+        xEventGroupWaitBits(dispEvents, RTOS_DISP_EVENT_DONE | RTOS_DISP_EVENT_COMPLETE, pdFALSE, pdFALSE, timeout);
+    }
+}
+
+void dispGetQueueStats(dispQueueStats_t *out){
+    xSemaphoreTake(dispQueueMutex, portMAX_DELAY);
+    memcpy(out, &dispQueue, sizeof(dispQueueStats_t));
+    xSemaphoreGive(dispQueueMutex);
+}
+
+/**
+ * The period until the next playlist image, the configured one as the schedule policy has it now
+ */
+static u32 playlistNextPeriodS(const runState_t *st){
+    schedPolicy_t policy;
+    schedInput_t in;
+    pmicTelemetry telem;
+    playlistSched_t sched;
+    time_t now = time(NULL);
+    time_t wakeAt;
+    struct tm tm;
+
+    schedPolicyDefault(&policy, PWR_BATT_CAPACITY_MAH);
+    memset(&in, 0, sizeof(in));
+    in.basePeriodS = st->playlist.period_ticks / configTICK_RATE_HZ;
+    pmicTelemGet(&telem);
+    in.vBusGood = pmicVBusGood(&telem);
+    in.battPresent = pmicBattPresent(&telem);
+    in.battPct = pmicBattPct(&telem);
+
+    // a low power wake goes by what the last normal boot measured
+    if(!isFastWake && pwrStatsGetEnergy(&in.refreshMah, &in.baselineMa)){
+        schedEnergy.refreshMah = in.refreshMah;
+        schedEnergy.baselineMa = in.baselineMa;
+        schedEnergy.magic = SCHED_ENERGY_MAGIC;
+    } else if(schedEnergy.magic == SCHED_ENERGY_MAGIC){
+        in.refreshMah = schedEnergy.refreshMah;
+        in.baselineMa = schedEnergy.baselineMa;
+    }
+
+    policy.calendar = &st->playlist.calendar;
+    localtime_r(&now, &tm);
+    in.timeValid = timeSyncIsValid();
+    in.localTimeS = tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+    in.weekday = tm.tm_wday;
+
+    sched.basePeriodS = in.basePeriodS;
+    sched.periodS = schedNextPeriodS(&policy, &in, &sched.reason);
+    // a window wake is at a local time, which may go to or from DST before it comes
+    if(sched.reason == SCHED_REASON_WINDOW){
+        tm.tm_sec += sched.periodS;
+        tm.tm_isdst = -1;
+        wakeAt = mktime(&tm);
+        if(wakeAt > now){
+            sched.periodS = wakeAt - now;
+        }
+    }
+    seqlockWrite(&playlistSchedSeq, &playlistSched, &sched, sizeof(playlistSched_t));
+    if(sched.periodS != sched.basePeriodS){
+        ESP_LOGI(TAG, "Next image in %lu S rather than %lu S, %s", sched.periodS, sched.basePeriodS,
+                 schedReasonToStr(sched.reason));
+    }
+    return sched.periodS;
+}
+
+void playlistReschedule(void){
+    runState_t st;
+    TickType_t ticks;
+
+    // the clock can be set before the timer is created
+    if(playlistTimer == NULL){
+        return;
+    }
+    // as a writer, so setMode() can't stop the timer in between
+    runStateEdit(&st);
+    if(st.runMode == MODE_IMAGE_PLAYLIST){
+        ticks = playlistNextPeriodS(&st) * configTICK_RATE_HZ;
+        if(ticks != xTimerGetPeriod(playlistTimer)){
+            xTimerChangePeriod(playlistTimer, ticks, 0);
+        }
+    }
+    runStateAbort();
+}
+
+void playlistGetSchedule(playlistSched_t *out){
+    seqlockRead(&playlistSchedSeq, out, &playlistSched, sizeof(playlistSched_t));
 }
 
-#define s imgPlaylist      // nice macro as I don't feel like calling the long struct name for the function below
 void taskTimerImagePlaylist(TimerHandle_t xTimer){
     u32 stat;
 
@@ -369,17 +739,17 @@ void taskTimerImagePlaylist(TimerHandle_t xTimer){
     stat = imagePlaylistLoad();
     if(stat){
         ESP_LOGW(TAG, "Failed to load image playlist, stat=%d", stat);
-        return;
-    }
-    stat = dispTrigUpdate();
-    if(stat){
-        ESP_LOGW(TAG, "This was already updating the display");
+    } else {
+        dispRequestUpdate(DISP_PRIO_PLAYLIST);
     }
+    playlistReschedule();
 }
 
 int imagePlaylistLoad(void){
     fSysRet stat;
-    u32 n;
+    runState_t st;
+    imgPlaylist_t *s = &st.playlist;
+    u32 imgId;
 
     u8 *destBuff = takeDispFb(pdTICKS_TO_MS(100));
     if(destBuff == NULL){
@@ -387,49 +757,34 @@ int imagePlaylistLoad(void){
         return -1;
     }
 
-    // todo: should fileSysGetAvailableImages be called here? if an image is added AFTER the mode is started, they are not
-    //       taken into account
+    // held while picking, so a playlist change from the API waits for the pick rather than being undone by it
+    runStateEdit(&st);
 
-    // if in all mode, cycle through all images on the SD card
-    switch(s.mode){
+    // images are picked through the image index, so an image added after the mode started is picked too and
+    // there is no need to walk the image directory
+    switch(s->mode){
         case PLAYLIST_MODE_ALL:
-            stat = fileSysLoadNextImageFromIdx(s.currIdx, destBuff);
-            s.currIdx++;
-            s.currIdx %= s.totalImg;
+            // skips images deleted from the card, moves currIdx to the ID after the one picked
+            stat = fileSysIndexNext(&s->currIdx, &imgId);
             break;
         case PLAYLIST_MODE_RANDOM:
-            u32 newIdx;
-            n = 20;        // just some upper limiter rather than while(1)
-            // ensure the next random image is different from the current one
-            while(n--){
-                newIdx = esp_random() % s.totalImg;
-                if(newIdx != s.currIdx) break;
-            }
-            s.currIdx = newIdx;
-            stat = fileSysLoadNextImageFromIdx(s.currIdx, destBuff);
+            // every image once, in a random order, before any is shown again
+            stat = playlistShuffleNext(&s->shuffleSeed, &s->shufflePos, &imgId) ? FILE_SYS_NO_FILE_FOUND : FILE_SYS_RET_OK;
             break;
         case PLAYLIST_MODE_SELECT:
-            n = MAX_PLAYLIST_IMG;
-            while(n--){
-                if(s.imgSelectEn[s.currIdx]){
-                    break;
-                }
-                s.currIdx++;
-                s.currIdx %= MAX_PLAYLIST_IMG;
-            }
-            if(n == 0){
-                // this should never occur, there always should be the next image to load if wrapping around the entire list
-                abort();
-            }
-            stat = fileSysLoadImage(s.imgSelect[s.currIdx], destBuff, false);
-            s.currIdx++;
-            s.currIdx %= MAX_PLAYLIST_IMG;
+            // skips images deleted from the card, moves currIdx past the one picked
+            stat = playlistNextImage(s->playlistId, &s->currIdx, &imgId) ? FILE_SYS_NO_FILE_FOUND : FILE_SYS_RET_OK;
             break;
         default:
             abort();
             break;
     }
+    runStateCommit(&st);
 
+    // by the ID it was picked with, a seek and a read of its index record rather than a search for its name
+    if(stat == FILE_SYS_RET_OK){
+        stat = fileSysLoadImageById(imgId, destBuff);
+    }
     releaseDispFb();
 
     if(stat != FILE_SYS_RET_OK){
@@ -439,18 +794,57 @@ int imagePlaylistLoad(void){
     return 0;
 }
 
-#undef s
+void pmicTelemGet(pmicTelemetry *out){
+    seqlockRead(&pmicTelemSeq, out, &pmicTelem, sizeof(pmicTelemetry));
+}
+
+/**
+ * Samples the telemetry right away on a change of the power source or the battery, rather than at the
+ * next sample
+ */
+static void pmicEventHandler(void *arg, esp_event_base_t base, int32_t id, void *data){
+    switch(id){
+        case PMIC_EVT_KEY_SHORT:
+        case PMIC_EVT_KEY_LONG:
+            break;
+        case PMIC_EVT_BATT_CRITICAL:
+            ESP_LOGW(TAG, "Battery critically low");
+            // fall through
+        default:
+            if(pmicTelemTask_h){
+                xTaskNotifyGive(pmicTelemTask_h);
+            }
+            break;
+    }
+}
 
 /**
- * A task that reads telemetry from the power IC
- * Reads every 5sec
+ * A task that reads telemetry from the power IC, and polls its events
+ * Reads more often while charging or refreshing than idle on battery, see pmicHistNextDelayMs()
  */
 void taskPmicTelemetry(void *args){
+    pmicTelemetry telem;
+    bool lastVBusGood = false;
+
+    memset(&telem, 0, sizeof(telem));
     for(EVER){
-        xSemaphoreTake(pmicTelemetryMutex, portMAX_DELAY);
-        pmicGetTelemetry(&pmicTelem);
-        xSemaphoreGive(pmicTelemetryMutex);
-        vTaskDelay(pdMS_TO_TICKS(PMIC_TELEMETRY_ACQ_DELAY));
+        // a failed read keeps the last sample, and tries again after the usual delay
+        if(pmicGetTelemetry(&telem) == ESP_OK){
+            seqlockWrite(&pmicTelemSeq, &pmicTelem, &telem, sizeof(pmicTelemetry));
+            pwrStatsTelemetry(&telem);
+            pmicHistAdd(&telem);
+            // back to the configured period once plugged in, rather than after a long one on battery
+            if(pmicVBusGood(&telem) != lastVBusGood){
+                lastVBusGood = pmicVBusGood(&telem);
+                playlistReschedule();
+            }
+        }else{
+            ESP_LOGW(TAG, "Failed to read the PMIC telemetry");
+        }
+        // the only way to get them without the IRQ pin, otherwise in case one got lost
+        pmicEvtPoll();
+        // a refresh starting notifies, to sample it from the start
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(pmicHistNextDelayMs(&telem, isDisplayUpdating())));
     }
 }
 
@@ -462,15 +856,59 @@ void taskPmicTelemetry(void *args){
 void taskDispUpdate(void *args){
     esp_pm_lock_handle_t sleepLockHandle;
     ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "disp", &sleepLockHandle));
+    dispTicket_t ticket;
+    dispPrio_e prio;
+    bool pending;
     for(EVER){
-        // clear flags before going back to waiting
+        // only idle once no refresh is pending, a request clears it again under the same mutex
+        xSemaphoreTake(dispQueueMutex, portMAX_DELAY);
+        pending = dispQueue.pending;
+        if(!pending){
+            xEventGroupSetBits(dispEvents, RTOS_DISP_EVENT_COMPLETE);
+        }
+        xSemaphoreGive(dispQueueMutex);
+        // wait for a request, unless one came in during the last refresh
+        if(!pending){
+            xTaskNotifyWait(ULONG_MAX, ULONG_MAX, NULL, portMAX_DELAY);
+        }
+
+        // give more requests a chance to join a playlist refresh, until an interactive one comes
+        xSemaphoreTake(dispQueueMutex, portMAX_DELAY);
+        prio = dispQueuePrio;
+        xSemaphoreGive(dispQueueMutex);
+        if(prio == DISP_PRIO_PLAYLIST){
+            TimeOut_t timeOut;
+            TickType_t wait = pdMS_TO_TICKS(DISP_LOW_PRIO_DELAY_MS);
+            vTaskSetTimeOutState(&timeOut);
+            while(xTaskCheckForTimeOut(&timeOut, &wait) == pdFALSE){
+                if(xTaskNotifyWait(ULONG_MAX, ULONG_MAX, NULL, wait) != pdTRUE){
+                    continue;
+                }
+                xSemaphoreTake(dispQueueMutex, portMAX_DELAY);
+                prio = dispQueuePrio;
+                xSemaphoreGive(dispQueueMutex);
+                if(prio == DISP_PRIO_INTERACTIVE){
+                    break;
+                }
+            }
+        }
+
+        // from here on, requests get the next ticket
+        xSemaphoreTake(dispQueueMutex, portMAX_DELAY);
+        pending = dispQueue.pending;
+        ticket = dispQueue.last;
+        dispQueue.pending = false;
+        xSemaphoreGive(dispQueueMutex);
         xTaskNotifyStateClear(NULL);
-        xEventGroupSetBits(dispEvents, RTOS_DISP_EVENT_COMPLETE);
-        // wait for us to signal to update the display in this task
-        xTaskNotifyWait(ULONG_MAX, 0, NULL, portMAX_DELAY);
-        xEventGroupClearBits(dispEvents, RTOS_DISP_EVENT_COMPLETE);
+        if(!pending){
+            continue;
+        }
 
         esp_pm_lock_acquire(sleepLockHandle);
+        pwrStatsRefreshBegin();
+        if(pmicTelemTask_h){
+            xTaskNotifyGive(pmicTelemTask_h);
+        }
 #ifdef DEBUG_DISABLE_DISPLAY_UPDATE
         ESP_LOGI(TAG, "Mock updating display");
 #else
@@ -480,7 +918,15 @@ void taskDispUpdate(void *args){
         dispUpdate();
         pmicDisableLDOs();      // after we are done, shut down the display for power savings
 #endif
+        pwrStatsRefreshEnd();
         esp_pm_lock_release(sleepLockHandle);       // we-allow sleep mode
+
+        xSemaphoreTake(dispQueueMutex, portMAX_DELAY);
+        dispQueue.done = ticket;
+        dispQueue.refreshes++;
+        xSemaphoreGive(dispQueueMutex);
+        xEventGroupSetBits(dispEvents, RTOS_DISP_EVENT_DONE);
+        xEventGroupClearBits(dispEvents, RTOS_DISP_EVENT_DONE);
     }
 }
 
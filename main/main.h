@@ -9,6 +9,7 @@
 #include "sdmmc_cmd.h"
 
 #include "pmic.h"
+#include "schedule.h"
 
 typedef enum{
     MODE_STANDBY,
@@ -19,7 +20,7 @@ typedef enum{
 typedef enum{
     PLAYLIST_MODE_SELECT,        // cycle through pre-selected images
     PLAYLIST_MODE_ALL,           // cycle through all images on the SD card
-    PLAYLIST_MODE_RANDOM,        // randomly get an image per cycle to display
+    PLAYLIST_MODE_RANDOM,        // shuffle all images on the SD card, each shows once before any repeats
 }imgPlaylistMode_e;
 
 typedef enum{
@@ -33,26 +34,106 @@ typedef enum{
 typedef struct{
     imgPlaylistMode_e mode;
     TickType_t period_ticks;      // the duration of the cycle in rtos ticks. Must NOT be less than 12-15 seconds due to display refresh rate
-    char imgSelect[MAX_PLAYLIST_IMG][MAX_IMAGE_NAME_LEN];
-    u32 imgSelectEn[MAX_PLAYLIST_IMG];        // if an image in index X is used (1) or not (0)
-                                                    // this allows to remove images at any index
+    u32 playlistId;               // the playlist of the select mode and the playlist API, see playlist.h
     // internal variables
-    u32 totalImg;       // total number of images available
-    u32 currIdx;           // the current image index
-    TimerHandle_t timerHandler;
+    u32 currIdx;           // the next image index ID, or position in the playlist for the select mode
+    u32 shuffleSeed;       // the shuffle order of the random mode, see playlistShuffleNext()
+    u32 shufflePos;        // kept apart from currIdx so changing modes does not restart the shuffle
+    schedCalendar_t calendar;     // the refresh windows, none to change images every period_ticks
 }imgPlaylist_t;
 
+/**
+ * The run mode and the playlist, kept together so they're always seen as one consistent state
+ */
+typedef struct{
+    mode_e runMode;
+    imgPlaylist_t playlist;
+}runState_t;
+
+typedef enum{
+    WAKE_PHASE_BOOT,            // from reset to app_main
+    WAKE_PHASE_PERIPH,          // SPI, I2C, PMIC, and display init
+    WAKE_PHASE_SD,              // SD card init and mount
+    WAKE_PHASE_IMG_LOAD,        // loading the next image to the frame buffer
+    WAKE_PHASE_DISP,            // powering, booting, and refreshing the display
+    WAKE_PHASE_CNT,
+}wakePhase_e;
+
+/**
+ * The timing of a low power playlist wake, kept in RTC memory to be reported on the next normal boot
+ */
+typedef struct{
+    u32 magic;                  // WAKE_TIMINGS_MAGIC if the rest is valid
+    u32 wakeCnt;                // low power wakes since power on
+    u32 phaseUs[WAKE_PHASE_CNT];    // uS, of the last wake
+    u32 totalUs;                // uS, from reset to going back to sleep on the last wake
+}wakeTimings_t;
+
+typedef u32 dispTicket_t;           // refreshes are numbered from 1, in the order they're done
+
+typedef enum{
+    DISP_PRIO_PLAYLIST,         // can wait a bit for other requests to join it
+    DISP_PRIO_INTERACTIVE,      // someone is looking at it, starts as soon as the display is free
+}dispPrio_e;
+
+typedef struct{
+    dispTicket_t last;          // the last ticket given out
+    dispTicket_t done;          // the last ticket refreshed
+    bool pending;               // the last ticket is waiting on the display
+    u32 requests;               // since boot
+    u32 refreshes;              // since boot, the requests minus the ones merged
+}dispQueueStats_t;
+
+/**
+ * The last playlist period picked by the schedule policy, see schedule.h
+ */
+typedef struct{
+    u32 periodS;                // S, until the image after the last one
+    u32 basePeriodS;            // S, the configured period
+    schedReason_e reason;
+}playlistSched_t;
+
 extern spi_device_handle_t dispSpi;             // global spi device
 extern i2c_master_bus_handle_t i2cHandle;       // global i2c handler
 extern sdmmc_card_t sdCard;                     // global sdcard handler
 
-extern pmicTelemetry pmicTelem;                        // global pmic telemetry struct
-                                                // todo: move it so a dedicated function returns a pointer to it or None if busy
-extern SemaphoreHandle_t pmicTelemetryMutex;           // mutex for pmic telemetry
+/**
+ * Gets a copy of the latest PMIC telemetry, never blocks. For the ones before, see pmicHist.h
+ */
+void pmicTelemGet(pmicTelemetry *out);
 
-// todo: lock this from threading, OR have dedicated functions to access it's variables
-extern imgPlaylist_t imgPlaylist;
-extern mode_e runMode;
+/**
+ * Gets a copy of the run state. Never blocks, not even on a writer between runStateEdit() and
+ * runStateCommit()
+ */
+void runStateGet(runState_t *out);
+
+/**
+ * Starts a change of the run state, filling st with the current one. Other writers wait until
+ * runStateCommit() or runStateAbort(), readers don't
+ */
+void runStateEdit(runState_t *st);
+
+/**
+ * Makes the changes to st since runStateEdit() seen all at once, and lets the next writer in
+ */
+void runStateCommit(const runState_t *st);
+
+/**
+ * Ends a runStateEdit() without changing anything
+ */
+void runStateAbort(void);
+
+/**
+ * Gets the last playlist period picked, all 0 if none was yet
+ */
+void playlistGetSchedule(playlistSched_t *out);
+
+/**
+ * Restarts the playlist timer with the period the schedule policy has now, if the playlist is running. Call
+ * when something it goes by changed, such as the power source or the clock
+ */
+void playlistReschedule(void);
 
 /**
  * Gets the firmware operation mode
@@ -60,11 +141,23 @@ extern mode_e runMode;
 setModeRet_e setMode(mode_e newMode);
 
 /**
- * Triggers a display refresh
+ * Requests a display refresh of the frame buffer as it is when the refresh starts. Requests made before
+ * the refresh starts are merged into it, so a burst of requests during a refresh adds a single one
+ *
+ * Returns the ticket of the refresh that covers this request, see dispWaitTicket()
+ */
+dispTicket_t dispRequestUpdate(dispPrio_e prio);
+
+/**
+ * Waits for the refresh of a ticket to be done
  *
- * Returns non-zero if the display update was already happening when we triggered it
+ * Returns 0 if done, non-zero on timeout
  */
-int dispTrigUpdate(void);
+int dispWaitTicket(dispTicket_t ticket, TickType_t timeout);
+
+bool dispTicketDone(dispTicket_t ticket);
+
+void dispGetQueueStats(dispQueueStats_t *out);
 
 /**
  *
@@ -73,4 +166,13 @@ int isDisplayUpdating(void);
 
 void goDeepSleep(void);
 
+/**
+ * Gets the timings of the last low power playlist wake
+ *
+ * Returns NULL if there was no such wake since the device was powered on
+ */
+const wakeTimings_t* getLastWakeTimings(void);
+
+const char* wakePhaseToStr(wakePhase_e phase);
+
 #endif
\ No newline at end of file
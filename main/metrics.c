@@ -0,0 +1,183 @@
+#include <string.h>
+#include <errno.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_http_server.h"
+#include "lwip/sockets.h"
+
+#include "common.h"
+#include "metrics.h"
+#include "trace.h"
+#include "timeSync.h"
+#include "wifiPwr.h"
+
+static const char *TAG = "metrics";
+
+// a registered URI handler, the wrapper is given a pointer to it as user_ctx
+typedef struct{
+    const char *uri;
+    httpd_method_t method;
+    esp_err_t (*handler)(httpd_req_t *req);
+    void *userCtx;                              // the handler's own user_ctx
+}uriSlot_t;
+
+// the counters a core updates for a handler
+typedef struct{
+    u32 count;
+    u32 errors;
+    u64 bytesIn;
+    u64 bytesOut;
+    u64 latencySumUs;
+    u32 latencyMaxUs;
+    u32 latencyBuckets[METRICS_LATENCY_BUCKETS];
+}coreMetrics_t;
+
+static uriSlot_t uriSlots[METRICS_MAX_URI];
+static u32 uriSlotCount;
+
+// each core only writes to its own copy, and the only writer is the http server task, so no locks or
+// atomics are needed. Readers sum the copies
+static coreMetrics_t coreMetrics[portNUM_PROCESSORS][METRICS_MAX_URI];
+
+static int currSlot = -1;                       // the handler being executed, to attribute sent bytes to
+static u32 firstRespUs;                         // uS since boot, 0 until a handler returned
+
+/**
+ * Gets the latency bucket of a duration, the position of its highest bit
+ */
+static inline u32 getLatencyBucket(u32 us){
+    u32 bucket;
+
+    if(us == 0){
+        return 0;
+    }
+    bucket = 31 - __builtin_clz(us);
+    return bucket < METRICS_LATENCY_BUCKETS ? bucket : METRICS_LATENCY_BUCKETS-1;
+}
+
+/**
+ * Wraps every registered handler to measure it, to take the clients' clock, and to boost the radio
+ */
+static esp_err_t metricsHandler(httpd_req_t *req){
+    uriSlot_t *slot = req->user_ctx;
+    u32 idx = slot - uriSlots;
+    coreMetrics_t *m;
+    int64_t startUs;
+    u32 us;
+    esp_err_t ret;
+
+    req->user_ctx = slot->userCtx;
+    // any request can bring the client's clock, see timeSync.h
+    timeSyncFromReq(req);
+    currSlot = idx;
+    // the radio stays boosted for the whole of an upload, see wifiPwr.h
+    wifiPwrBusyBegin();
+    startUs = esp_timer_get_time();
+    TRACE_BEGIN(slot->uri);
+    ret = slot->handler(req);
+    TRACE_END(slot->uri);
+    us = esp_timer_get_time() - startUs;
+    wifiPwrBusyEnd();
+    currSlot = -1;
+    if(firstRespUs == 0){
+        firstRespUs = startUs + us;
+    }
+
+    m = &coreMetrics[xPortGetCoreID()][idx];
+    m->count++;
+    if(ret != ESP_OK){
+        m->errors++;
+    }
+    m->bytesIn += req->content_len;
+    m->latencySumUs += us;
+    if(us > m->latencyMaxUs){
+        m->latencyMaxUs = us;
+    }
+    m->latencyBuckets[getLatencyBucket(us)]++;
+    return ret;
+}
+
+/**
+ * Same as the http server's default send function, but counts the bytes sent for the current handler
+ */
+static int metricsSend(httpd_handle_t hd, int sockfd, const char *buf, size_t bufLen, int flags){
+    int ret;
+
+    if(buf == NULL){
+        return HTTPD_SOCK_ERR_INVALID;
+    }
+    ret = send(sockfd, buf, bufLen, flags);
+    if(ret < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+            return HTTPD_SOCK_ERR_TIMEOUT;
+        }
+        return HTTPD_SOCK_ERR_FAIL;
+    }
+    if(currSlot >= 0){
+        coreMetrics[xPortGetCoreID()][currSlot].bytesOut += ret;
+    }
+    return ret;
+}
+
+esp_err_t metricsSessOpen(httpd_handle_t hd, int sockfd){
+    return httpd_sess_set_send_override(hd, sockfd, metricsSend);
+}
+
+esp_err_t metricsRegisterUri(httpd_handle_t server, const httpd_uri_t *uri){
+    httpd_uri_t wrapped;
+    uriSlot_t *slot;
+
+    if(uriSlotCount >= METRICS_MAX_URI){
+        ESP_LOGW(TAG, "No metrics slot left for %s, registering without", uri->uri);
+        return httpd_register_uri_handler(server, uri);
+    }
+    slot = &uriSlots[uriSlotCount];
+    slot->uri = uri->uri;
+    slot->method = uri->method;
+    slot->handler = uri->handler;
+    slot->userCtx = uri->user_ctx;
+
+    memcpy(&wrapped, uri, sizeof(httpd_uri_t));
+    wrapped.handler = metricsHandler;
+    wrapped.user_ctx = slot;
+    if(httpd_register_uri_handler(server, &wrapped) != ESP_OK){
+        return ESP_FAIL;
+    }
+    uriSlotCount++;
+    return ESP_OK;
+}
+
+u32 metricsGetFirstRespUs(void){
+    return firstRespUs;
+}
+
+u32 metricsGetUriCount(void){
+    return uriSlotCount;
+}
+
+int metricsGetUri(u32 idx, uriMetrics_t *out){
+    const coreMetrics_t *m;
+
+    if(idx >= uriSlotCount){
+        return -1;
+    }
+    memset(out, 0, sizeof(uriMetrics_t));
+    out->uri = uriSlots[idx].uri;
+    out->method = uriSlots[idx].method;
+    for(int core = 0; core < portNUM_PROCESSORS; core++){
+        m = &coreMetrics[core][idx];
+        out->count += m->count;
+        out->errors += m->errors;
+        out->bytesIn += m->bytesIn;
+        out->bytesOut += m->bytesOut;
+        out->latencySumUs += m->latencySumUs;
+        if(m->latencyMaxUs > out->latencyMaxUs){
+            out->latencyMaxUs = m->latencyMaxUs;
+        }
+        for(int i = 0; i < METRICS_LATENCY_BUCKETS; i++){
+            out->latencyBuckets[i] += m->latencyBuckets[i];
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#ifndef UNIT_TEST
+#include "esp_http_server.h"
+#else
+#include "mock.h"
+#endif
+
+#include "common.h"
+#include "network.h"
+
+#define METRICS_MAX_URI             HTTPD_MAX_URI_HANDLERS      // one slot per registered handler
+#define METRICS_LATENCY_BUCKETS     24      // log2 buckets of uS, bucket i holds [2^i, 2^(i+1)) uS,
+                                            // the last one everything above ~8.4 S
+
+/**
+ * The metrics of a single URI handler, summed over all cores
+ */
+typedef struct{
+    const char *uri;
+    httpd_method_t method;
+    u32 count;                                  // requests handled
+    u32 errors;                                 // requests where the handler returned an error
+    u64 bytesIn;                                // request bodies
+    u64 bytesOut;                               // everything sent on the socket, headers included
+    u64 latencySumUs;
+    u32 latencyMaxUs;
+    u32 latencyBuckets[METRICS_LATENCY_BUCKETS];
+}uriMetrics_t;
+
+/**
+ * Registers a URI handler with the http server, wrapped so its requests are measured
+ *
+ * Use instead of httpd_register_uri_handler(). The handler's user_ctx is taken by the wrapper
+ */
+esp_err_t metricsRegisterUri(httpd_handle_t server, const httpd_uri_t *uri);
+
+/**
+ * To be set as the http server's open_fn, so the bytes sent on each session can be counted
+ */
+esp_err_t metricsSessOpen(httpd_handle_t hd, int sockfd);
+
+/**
+ * When the first request since boot was answered, uS since boot. 0 if none was yet
+ */
+u32 metricsGetFirstRespUs(void);
+
+/**
+ * How many URI handlers were registered
+ */
+u32 metricsGetUriCount(void);
+
+/**
+ * Gets the metrics of a registered URI handler
+ *
+ * Returns 0 on success, non-zero if the index is out of range
+ */
+int metricsGetUri(u32 idx, uriMetrics_t *out);
+
+#endif
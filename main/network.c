@@ -1,6 +1,7 @@
 
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
 #ifndef UNIT_TEST
 #include "esp_wifi.h"
 #include "esp_event.h"
@@ -11,6 +12,7 @@
 #include "nvs_flash.h"
 #include "esp_http_server.h"
 #include "esp_heap_caps.h"
+#include "esp_timer.h"
 #include "mdns.h"
 #include "ff.h"
 #else
@@ -24,12 +26,25 @@
 #include "common.h"
 #include "eink.h"
 #include "main.h"
+#include "jobs.h"
+#include "metrics.h"
+#include "trace.h"
+#include "persist.h"
+#include "playlist.h"
+#include "pwrStats.h"
+#include "pmicHist.h"
+#include "pmicEvt.h"
+#include "timeSync.h"
+#include "wifiPwr.h"
+#include "imgSlot.h"
 
 /* FreeRTOS event group to signal when we are connected*/
 #ifndef UNIT_TEST
 EventGroupHandle_t wifiEvents;
 wifi_config_t wifiConfig;               // the esp internal wifi configuration
 static nvs_handle_t wifiNvsHandle;      // the handle for nvm
+static esp_netif_t *netifSta;
+static wifiFastConn_t fastConn;         // the AP last connected to, see network.h
 
 httpd_handle_t server = NULL;
 #endif
@@ -41,8 +56,14 @@ struct{
     char staSsid[MAX_WIFI_INFO_STRLEN];
     char staPass[MAX_WIFI_INFO_STRLEN];
     wifi_auth_mode_t authMode;
+    u32 staticIp;                       // network order, 0 for DHCP
+    u32 netmask;
+    u32 gateway;
+    u32 dns;                            // 0 for the gateway
 }wifiNvmConf;                           // a local configuration for wifi that is saved/loaded from nvm
 
+static wifiConnTimes_t connTimes;       // of the first STA connect since boot
+
 void wifiStartAP(void);
 void wifiStartSTA(void *arg);
 void saveWifiNvmConf(void);
@@ -65,14 +86,25 @@ esp_err_t getJsonFromReq(httpd_req_t *req, char **contextBuff, cJSON **jRoot){
     esp_err_t ret = ESP_OK;
 
     int remaining = req->content_len;   // total bytes expected
+    int r = 0;
     *contextBuff = malloc(req->content_len);
-    int r = httpd_req_recv(req, (char*)*contextBuff, remaining);
-    if(r < 0){
+    // a larger body, such as a batch, may come in more than one piece
+    while(remaining > 0){
+        r = httpd_req_recv(req, *contextBuff + req->content_len - remaining, remaining);
+        if(r == HTTPD_SOCK_ERR_TIMEOUT){
+            continue;
+        }
+        if(r <= 0){
+            break;
+        }
+        remaining -= r;
+    }
+    if(remaining > 0){
         httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"Error while receiving info\"}");
         ret = ESP_FAIL;
     }
     else{
-        *jRoot = cJSON_Parse(*contextBuff);
+        *jRoot = cJSON_ParseWithLength(*contextBuff, req->content_len);
 
         if(*jRoot == NULL){
             const char *error_ptr = cJSON_GetErrorPtr();
@@ -89,6 +121,205 @@ esp_err_t getJsonFromReq(httpd_req_t *req, char **contextBuff, cJSON **jRoot){
     return ret;
 }
 
+/**
+ * Returns true if the request was given the query "wait=1", meaning the caller wants the queued
+ * job to be finished before getting a response
+ */
+static bool reqWantsWait(httpd_req_t *req){
+    char urlQuery[64];
+    char val[4];
+
+    if(httpd_req_get_url_query_str(req, urlQuery, sizeof(urlQuery)) != ESP_OK){
+        return false;
+    }
+    if(httpd_query_key_value(urlQuery, "wait", val, sizeof(val)) != ESP_OK){
+        return false;
+    }
+    return strcmp(val, "1") == 0;
+}
+
+/**
+ * Gets a 0/1 flag from a url query, or defVal if the key is not present
+ */
+static bool getQueryFlag(const char *urlQuery, const char *key, bool defVal){
+    char val[4];
+
+    if(httpd_query_key_value(urlQuery, key, val, sizeof(val)) != ESP_OK){
+        return defVal;
+    }
+    return strcmp(val, "1") == 0;
+}
+
+/**
+ * Gets an image name from a url query and URL decodes it, as httpd_query_key_value() doesn't. Names that
+ * can't be saved are refused, see fileSysImageNameValid()
+ *
+ * Returns 0 on success, non-zero if the key is missing or the name isn't valid
+ */
+static int getQueryImgName(const char *urlQuery, const char *key, char *imgName){
+    char raw[MAX_IMAGE_NAME_LEN * 3];       // every character may be percent encoded
+    unsigned int byte;
+    u32 len = 0;
+    char c;
+
+    if(httpd_query_key_value(urlQuery, key, raw, sizeof(raw)) != ESP_OK){
+        return -1;
+    }
+    for(const char *in = raw; *in; in++){
+        c = *in;
+        if(c == '%'){
+            if(!isxdigit((unsigned char)in[1]) || !isxdigit((unsigned char)in[2]) ||
+               sscanf(in + 1, "%2x", &byte) != 1 || byte == 0){
+                return -1;
+            }
+            c = byte;
+            in += 2;
+        }
+        else if(c == '+'){
+            c = ' ';
+        }
+        if(len >= MAX_IMAGE_NAME_LEN - 1){
+            return -1;
+        }
+        imgName[len++] = c;
+    }
+    imgName[len] = '\0';
+    return !fileSysImageNameValid(imgName);
+}
+
+/**
+ * Responds with the error of a playlist operation
+ */
+static esp_err_t sendPlaylistErr(httpd_req_t *req, playlistRet_e stat){
+    switch(stat){
+        case PLAYLIST_RET_NOT_FOUND:
+            httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "{\"stat\": \"playlist not found\"}");
+            break;
+        case PLAYLIST_RET_IMG_NOT_FOUND:
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"image not found\"}");
+            break;
+        case PLAYLIST_RET_EXISTS:
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"image already exists in playlist\"}");
+            break;
+        case PLAYLIST_RET_FULL:
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"No more room for a playlist\"}");
+            break;
+        default:
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"playlist file error\"}");
+            break;
+    }
+    return ESP_FAIL;
+}
+
+/**
+ * Gets the playlist a request is for, its "playlist" field or the current one
+ */
+static u32 getPlaylistIdFromJson(const cJSON *jRoot){
+    const cJSON *jId = cJSON_GetObjectItem(jRoot, "playlist");
+
+    if(cJSON_IsNumber(jId) && jId->valueint >= 0){
+        return jId->valueint;
+    }
+    runState_t st;
+    runStateGet(&st);
+    return st.playlist.playlistId;
+}
+
+/**
+ * Gets the http error code and message for a finished job, matching what the handlers used to
+ * respond with when the operation was executed in the handler itself
+ *
+ * Returns 0 if the job was successful, in which case code and msg are not touched
+ */
+static int getJobError(const job_t *job, httpd_err_code_t *code, const char **msg){
+    if(job->result == 0){
+        return 0;
+    }
+    if(job->result == JOB_RESULT_FB_BUSY){
+        *code = HTTPD_500_INTERNAL_SERVER_ERROR;
+        *msg = "Could not take frame buffer mutex";
+        return 1;
+    }
+    if(job->result == JOB_RESULT_NO_SLOT){
+        *code = HTTPD_500_INTERNAL_SERVER_ERROR;
+        *msg = "upload slot was lost";
+        return 1;
+    }
+
+    if(job->type == JOB_TYPE_SET_MODE){
+        if(job->result == RET_SET_MODE_IMG_PL_NONE_SET){
+            *code = HTTPD_400_BAD_REQUEST;
+            *msg = "no images selected for playlist mode";
+        } else {
+            *code = HTTPD_500_INTERNAL_SERVER_ERROR;
+            *msg = "internal error";
+        }
+        return 1;
+    }
+
+    // everything else is a file system job
+    if(job->result == FILE_SYS_NO_FILE_FOUND){
+        *code = HTTPD_400_BAD_REQUEST;
+        *msg = "image does not exist";
+    }
+    else if(job->result == FILE_SYS_INVALID_FILE){
+        *code = HTTPD_400_BAD_REQUEST;
+        *msg = "invalid image file";
+    }
+    else if(job->result == FILE_SYS_INVALID_NAME){
+        *code = HTTPD_400_BAD_REQUEST;
+        *msg = "invalid image name";
+    }
+    else{
+        *code = HTTPD_500_INTERNAL_SERVER_ERROR;
+        switch(job->type){
+            case JOB_TYPE_IMG_SAVE:     *msg = "unable to save frame buffer to file"; break;
+            case JOB_TYPE_IMG_LOAD:     *msg = "error reading file"; break;
+            case JOB_TYPE_IMG_DELETE:   *msg = "error deleting file"; break;
+            default:                    *msg = "internal error"; break;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Common response for handlers that queued a job to the worker
+ *
+ * By default responds with 202 and the job ID, to be polled with /jobs/{id}. If the request was given
+ * "wait=1", waits for the job to finish and responds as if the operation was done in the handler
+ */
+static esp_err_t respondWithJob(httpd_req_t *req, u32 jobId){
+    char tmp[128];
+    job_t job;
+    httpd_err_code_t errCode;
+    const char *errMsg;
+
+    if(jobId == 0){
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_sendstr(req, "{\"stat\": \"job queue is full, try again later\"}");
+        return ESP_FAIL;
+    }
+
+    if(!reqWantsWait(req)){
+        httpd_resp_set_status(req, "202 Accepted");
+        snprintf(tmp, sizeof(tmp), "{\"stat\": \"ok\", \"job\": %lu}", jobId);
+        httpd_resp_sendstr(req, tmp);
+        return ESP_OK;
+    }
+
+    if(jobWait(jobId, pdMS_TO_TICKS(JOB_WAIT_TIMEOUT_MS), &job)){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"timed out waiting on job\"}");
+        return ESP_FAIL;
+    }
+    if(getJobError(&job, &errCode, &errMsg)){
+        snprintf(tmp, sizeof(tmp), "{\"stat\": \"%s\"}", errMsg);
+        httpd_resp_send_err(req, errCode, tmp);
+        return ESP_FAIL;
+    }
+    httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
+    return ESP_OK;
+}
+
 /********** URI match handlers **********/
 static esp_err_t handleUriGetVersion(httpd_req_t *req){
     char tmp[128];
@@ -108,7 +339,17 @@ static esp_err_t handleUriGetCoffee(httpd_req_t *req){
 static esp_err_t handleUriGetStatus(httpd_req_t *req){
     esp_err_t ret;
     cJSON *jRoot;
+    cJSON *jWake;
+    cJSON *jPhases;
+    cJSON *jNvs;
+    cJSON *jPwr;
+    cJSON *jStates;
     char *jsonPrint;
+    const wakeTimings_t *lastWake;
+    cJSON *jSched;
+    persistStats_t nvsStats;
+    pwrStats_t pwr;
+    playlistSched_t sched;
 
     httpd_resp_set_type(req, "application/json");
     jRoot = cJSON_CreateObject();
@@ -116,6 +357,59 @@ static esp_err_t handleUriGetStatus(httpd_req_t *req){
     cJSON_AddStringToObject(jRoot, "stat", "ok");
     cJSON_AddBoolToObject(jRoot, "dispBusy", isDisplayUpdating());
 
+    lastWake = getLastWakeTimings();
+    if(lastWake){
+        jWake = cJSON_AddObjectToObject(jRoot, "lastLpWake");
+        cJSON_AddNumberToObject(jWake, "count", lastWake->wakeCnt);
+        cJSON_AddNumberToObject(jWake, "totalUs", lastWake->totalUs);
+        jPhases = cJSON_AddObjectToObject(jWake, "phasesUs");
+        for(int i = 0; i < WAKE_PHASE_CNT; i++){
+            cJSON_AddNumberToObject(jPhases, wakePhaseToStr(i), lastWake->phaseUs[i]);
+        }
+    }
+
+    persistGetStats(&nvsStats);
+    jNvs = cJSON_AddObjectToObject(jRoot, "nvs");
+    cJSON_AddNumberToObject(jNvs, "saves", nvsStats.saves);
+    cJSON_AddNumberToObject(jNvs, "writes", nvsStats.writes);
+    cJSON_AddNumberToObject(jNvs, "skipped", nvsStats.skipped);
+    cJSON_AddNumberToObject(jNvs, "errors", nvsStats.errors);
+    cJSON_AddNumberToObject(jNvs, "lifetimeWrites", nvsStats.lifetimeWrites);
+    cJSON_AddBoolToObject(jNvs, "pending", nvsStats.pending);
+
+    pwrStatsGet(&pwr);
+    jPwr = cJSON_AddObjectToObject(jRoot, "power");
+    cJSON_AddNumberToObject(jPwr, "uptimeUs", pwr.uptimeUs);
+    if(pwr.cpuValid){
+        jStates = cJSON_AddObjectToObject(jPwr, "cpuUs");
+        for(int i = 0; i < PWR_CPU_MODE_CNT; i++){
+            cJSON_AddNumberToObject(jStates, pwrCpuModeToStr(i), pwr.cpuUs[i]);
+        }
+        jStates = cJSON_AddObjectToObject(jPwr, "cpuMhz");
+        for(int i = 0; i < PWR_CPU_MODE_CNT; i++){
+            cJSON_AddNumberToObject(jStates, pwrCpuModeToStr(i), pwr.cpuMhz[i]);
+        }
+    }
+    cJSON_AddNumberToObject(jPwr, "dispUs", pwr.dispUs);
+    jStates = cJSON_AddObjectToObject(jPwr, "wifiUs");
+    for(int i = 0; i < PWR_WIFI_STATE_CNT; i++){
+        cJSON_AddNumberToObject(jStates, pwrWifiStateToStr(i), pwr.wifiUs[i]);
+    }
+    cJSON_AddBoolToObject(jPwr, "onBattery", pwr.onBattery);
+    cJSON_AddNumberToObject(jPwr, "refreshes", pwr.refreshes);
+    cJSON_AddNumberToObject(jPwr, "refreshesMeasured", pwr.refreshesMeasured);
+    cJSON_AddNumberToObject(jPwr, "lastDropMv", pwr.lastDropMv);
+    cJSON_AddNumberToObject(jPwr, "refreshMah", pwr.refreshMah);
+    cJSON_AddNumberToObject(jPwr, "drainMa", pwr.drainMa);
+    cJSON_AddNumberToObject(jPwr, "baselineMa", pwr.baselineMa);
+    cJSON_AddNumberToObject(jPwr, "projectedH", pwr.projectedH);
+
+    playlistGetSchedule(&sched);
+    jSched = cJSON_AddObjectToObject(jRoot, "schedule");
+    cJSON_AddNumberToObject(jSched, "periodS", sched.periodS);
+    cJSON_AddNumberToObject(jSched, "basePeriodS", sched.basePeriodS);
+    cJSON_AddStringToObject(jSched, "reason", schedReasonToStr(sched.reason));
+
     jsonPrint = cJSON_PrintUnformatted(jRoot);
     if(jsonPrint == NULL){
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"CJSON Fail\"}");
@@ -141,24 +435,24 @@ static esp_err_t handleUriGetPmicInfo(httpd_req_t *req){
     cJSON *jRoot;
     char *jsonPrint;
     const char *strToFill;
+    pmicTelemetry pmicTelem;
+    cJSON *jEvents;
+    u32 evtCounts[PMIC_EVT_CNT];
 
     httpd_resp_set_type(req, "application/json");
     jRoot = cJSON_CreateObject();
 
-    if(xSemaphoreTake(pmicTelemetryMutex, pdMS_TO_TICKS(500)) != pdTRUE){
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"Could not take semephore for pmic struct\"}");
-        return ESP_FAIL;
-    }
+    pmicTelemGet(&pmicTelem);
     cJSON_AddStringToObject(jRoot, "stat", "ok");
-    cJSON_AddNumberToObject(jRoot, "battVolt", pmicTelem.battVolt);
-    cJSON_AddNumberToObject(jRoot, "sysVolt", pmicTelem.sysVolt);
-    cJSON_AddNumberToObject(jRoot, "vBusVolt", pmicTelem.vBusVolt);
-    cJSON_AddNumberToObject(jRoot, "battPercentage", pmicTelem.battPercentage);
-    cJSON_AddBoolToObject(jRoot, "vBusGood", pmicTelem.vBusGood);
-    cJSON_AddBoolToObject(jRoot, "battPresent", pmicTelem.battPresent);
-    cJSON_AddBoolToObject(jRoot, "currLimited", pmicTelem.currLimited);
-
-    switch(pmicTelem.chargeDir){
+    cJSON_AddNumberToObject(jRoot, "battVolt", pmicBattMv(&pmicTelem) / 1000.0);
+    cJSON_AddNumberToObject(jRoot, "sysVolt", pmicSysMv(&pmicTelem) / 1000.0);
+    cJSON_AddNumberToObject(jRoot, "vBusVolt", pmicVBusMv(&pmicTelem) / 1000.0);
+    cJSON_AddNumberToObject(jRoot, "battPercentage", pmicBattPct(&pmicTelem));
+    cJSON_AddBoolToObject(jRoot, "vBusGood", pmicVBusGood(&pmicTelem));
+    cJSON_AddBoolToObject(jRoot, "battPresent", pmicBattPresent(&pmicTelem));
+    cJSON_AddBoolToObject(jRoot, "currLimited", pmicCurrLimited(&pmicTelem));
+
+    switch(pmicChargeDir(&pmicTelem)){
         case PMIC_CHR_DIR_STANDBY:
             strToFill = "Standby";
             break;
@@ -174,7 +468,7 @@ static esp_err_t handleUriGetPmicInfo(httpd_req_t *req){
     }
     cJSON_AddStringToObject(jRoot, "chargeDir", strToFill);
 
-    switch(pmicTelem.chargeStat){
+    switch(pmicChargeStat(&pmicTelem)){
         case PMIC_CHR_STAT_TRI:
             strToFill = "Tri-State";
             break;
@@ -199,7 +493,12 @@ static esp_err_t handleUriGetPmicInfo(httpd_req_t *req){
     }
     cJSON_AddStringToObject(jRoot, "chargeState", strToFill);
 
-    xSemaphoreGive(pmicTelemetryMutex);
+    pmicEvtGetCounts(evtCounts);
+    cJSON_AddBoolToObject(jRoot, "eventsByIrq", pmicEvtHasIrq());
+    jEvents = cJSON_AddObjectToObject(jRoot, "events");
+    for(u32 i = 0; i < PMIC_EVT_CNT; i++){
+        cJSON_AddNumberToObject(jEvents, pmicEvtToStr(i), evtCounts[i]);
+    }
 
     jsonPrint = cJSON_PrintUnformatted(jRoot);
     if(jsonPrint == NULL){
@@ -214,6 +513,75 @@ static esp_err_t handleUriGetPmicInfo(httpd_req_t *req){
     return ret;
 }
 
+#define PMIC_HIST_JSON_LINE_LEN 64      // bytes, the most a sample takes in /pmic/history JSON
+
+/**
+ * Gets a tier of the PMIC telemetry history, oldest first. "tier" is sec, min (the default) or hour, and
+ * "format=bin" gets the samples as they're stored (pmicSample_t, little endian) instead of JSON
+ */
+static esp_err_t handleUriGetPmicHistory(httpd_req_t *req){
+    char urlQuery[48] = "";
+    char val[8];
+    char buf[1024];
+    pmicHistTier_e tier = PMIC_HIST_TIER_MIN;
+    pmicSample_t *samples;
+    const pmicSample_t *sp;
+    u32 cnt;
+    u32 len;
+    esp_err_t ret = ESP_OK;
+
+    httpd_req_get_url_query_str(req, urlQuery, sizeof(urlQuery));
+    if(httpd_query_key_value(urlQuery, "tier", val, sizeof(val)) == ESP_OK){
+        for(tier = 0; tier < PMIC_HIST_TIER_CNT; tier++){
+            if(strcmp(val, pmicHistTierToStr(tier)) == 0){
+                break;
+            }
+        }
+        if(tier == PMIC_HIST_TIER_CNT){
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"tier must be sec, min or hour\"}");
+            return ESP_FAIL;
+        }
+    }
+
+    samples = malloc(pmicHistTierLen(tier) * sizeof(pmicSample_t));
+    if(samples == NULL){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"out of memory\"}");
+        return ESP_FAIL;
+    }
+    cnt = pmicHistGetTier(tier, samples, pmicHistTierLen(tier));
+
+    if(httpd_query_key_value(urlQuery, "format", val, sizeof(val)) == ESP_OK && strcmp(val, "bin") == 0){
+        httpd_resp_set_type(req, "application/octet-stream");
+        ret = httpd_resp_send(req, (const char *)samples, cnt * sizeof(pmicSample_t));
+        free(samples);
+        return ret;
+    }
+
+    // a day of minutes is too much JSON to build at once, so it's sent a chunk at a time
+    httpd_resp_set_type(req, "application/json");
+    len = snprintf(buf, sizeof(buf), "{\"stat\": \"ok\", \"tier\": \"%s\", \"periodS\": %lu, \"nowS\": %lu, "
+                   "\"fields\": [\"tsS\", \"battMv\", \"sysMv\", \"vBusMv\", \"battPct\", \"flags\"], \"samples\": [",
+                   pmicHistTierToStr(tier), pmicHistTierPeriodS(tier), (u32)time(NULL));
+    for(u32 i = 0; i < cnt && ret == ESP_OK; i++){
+        sp = &samples[i];
+        len += snprintf(buf + len, sizeof(buf) - len, "%s[%lu,%u,%u,%u,%u,%u]", i ? "," : "", sp->tsS, sp->battMv,
+                        sp->sysMv, sp->vBusMv, sp->battPct, sp->flags);
+        if(len > sizeof(buf) - PMIC_HIST_JSON_LINE_LEN){
+            ret = httpd_resp_send_chunk(req, buf, len);
+            len = 0;
+        }
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, "]}");
+    if(ret == ESP_OK){
+        ret = httpd_resp_send_chunk(req, buf, len);
+    }
+    if(ret == ESP_OK){
+        ret = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    free(samples);
+    return ret;
+}
+
 static esp_err_t handleUriGetImgAvailable(httpd_req_t *req){
     esp_err_t ret;
     cJSON *jRoot;
@@ -244,6 +612,80 @@ static esp_err_t handleUriGetImgAvailable(httpd_req_t *req){
     return ret;
 }
 
+/**
+ * Sends raw data on the request's socket, as httpd_send() may only send part of it
+ *
+ * Returns 0 on success
+ */
+static int httpSendAll(httpd_req_t *req, const char *dat, size_t len){
+    int n;
+
+    while(len > 0){
+        n = httpd_send(req, dat, len);
+        if(n == HTTPD_SOCK_ERR_TIMEOUT){
+            continue;
+        }
+        if(n <= 0){
+            return -1;
+        }
+        dat += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Parses a single "bytes=" Range header value for a resource of the given size
+ *
+ * Returns 0 with the first byte and length of the range, or non-zero if the range is not satisfiable
+ */
+static int parseByteRange(const char *range, u32 size, u32 *start, u32 *len){
+    char *end;
+    unsigned long first, last;
+
+    if(strncmp(range, "bytes=", 6) != 0 || strchr(range, ',') != NULL){
+        return -1;          // only single byte ranges are supported
+    }
+    range += 6;
+
+    if(*range == '-'){
+        // suffix range, the last N bytes
+        last = strtoul(range+1, &end, 10);
+        if(end == range+1 || *end != '\0' || last == 0){
+            return -1;
+        }
+        if(last > size) last = size;
+        *start = size - last;
+        *len = last;
+        return 0;
+    }
+
+    first = strtoul(range, &end, 10);
+    if(end == range || *end != '-' || first >= size){
+        return -1;
+    }
+    range = end+1;
+    if(*range == '\0'){
+        last = size-1;
+    }
+    else{
+        last = strtoul(range, &end, 10);
+        if(*end != '\0' || last < first){
+            return -1;
+        }
+        if(last >= size) last = size-1;
+    }
+    *start = first;
+    *len = last - first + 1;
+    return 0;
+}
+
+/**
+ * Streams an image file from the SD card. The file is read in chunks into a double buffer, so the
+ * SD card reads overlap with the socket writes and no frame buffer sized buffer is used.
+ *
+ * Supports single "Range" requests and "If-None-Match" with the returned ETag
+ */
 static esp_err_t handleUriImgGet(httpd_req_t *req){
     esp_err_t ret;
     esp_err_t espStat;
@@ -251,6 +693,15 @@ static esp_err_t handleUriImgGet(httpd_req_t *req){
     char *urlQuery;
     char imgName[32+1];
     int urlQueryLen;
+    u8 hash[FILE_SYS_HASH_LEN];
+    char etag[FILE_SYS_HASH_LEN * 2 + 3];
+    char hdrVal[80];
+    char header[320];
+    u32 size, modTime;
+    u32 start, len;
+    bool isRange = false;
+    const u8 *chunk;
+    int chunkLen;
 
     httpd_resp_set_type(req, "application/json");
 
@@ -264,32 +715,99 @@ static esp_err_t handleUriImgGet(httpd_req_t *req){
         goto cleanup;
     }
 
-    espStat = httpd_query_key_value(urlQuery, "name", imgName, 32);
-    if(espStat){
+    if(getQueryImgName(urlQuery, "name", imgName)){
         httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"name was not valid\"}");
         ret = ESP_FAIL;
         goto cleanup;
     }
 
-    fSysStat = fileSysLoadImage(imgName, sdCardFrameBuff, false);
+    fSysStat = fileSysGetImageInfo(imgName, &size, &modTime);
     if(fSysStat != FILE_SYS_RET_OK){
         if(fSysStat == FILE_SYS_NO_FILE_FOUND){
             httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"image does not exist\"}");
         }
-        else if(fSysStat == FILE_SYS_INVALID_FILE){
-            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"invalid image file\"}");
-        }
         else{
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"error reading file\"}");
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"invalid image file\"}");
         }
         ret = ESP_FAIL;
         goto cleanup;
     }
+    // the hash of the content, the file's time can stay the same when it's saved again, and images can
+    // share a file. Without one (not hashed until fileSysIndexSync()) there's no ETag, nothing to match
+    etag[0] = '\0';
+    if(fileSysGetImageHash(imgName, hash) == FILE_SYS_RET_OK){
+        etag[0] = '"';
+        for(u32 i = 0; i < FILE_SYS_HASH_LEN; i++){
+            sprintf(&etag[1 + i*2], "%02x", hash[i]);
+        }
+        strcat(etag, "\"");
+    }
+
+    if(etag[0] && httpd_req_get_hdr_value_str(req, "If-None-Match", hdrVal, sizeof(hdrVal)) == ESP_OK &&
+       strcmp(hdrVal, etag) == 0){
+        snprintf(header, sizeof(header), "HTTP/1.1 304 Not Modified\r\n"
+                                         "ETag: %s\r\n"
+                                         "Content-Length: 0\r\n\r\n", etag);
+        httpSendAll(req, header, strlen(header));
+        ret = ESP_OK;
+        goto cleanup;
+    }
+
+    start = 0;
+    len = size;
+    if(httpd_req_get_hdr_value_str(req, "Range", hdrVal, sizeof(hdrVal)) == ESP_OK){
+        if(parseByteRange(hdrVal, size, &start, &len)){
+            snprintf(header, sizeof(header), "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                                             "Content-Range: bytes */%lu\r\n"
+                                             "Content-Length: 0\r\n\r\n", size);
+            httpSendAll(req, header, strlen(header));
+            ret = ESP_FAIL;
+            goto cleanup;
+        }
+        isRange = true;
+    }
 
+    fSysStat = fileSysStreamStart(imgName, start, len);
+    if(fSysStat != FILE_SYS_RET_OK){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"error reading file\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
 
-    httpd_resp_set_type(req, "application/octet-stream");
-    httpd_resp_send(req, (char *)sdCardFrameBuff, DISP_FB_SIZE);
+    // the header is written by hand, as httpd_resp_send_chunk() can't give a Content-Length
+    if(isRange){
+        snprintf(header, sizeof(header), "HTTP/1.1 206 Partial Content\r\n"
+                                         "Content-Range: bytes %lu-%lu/%lu\r\n", start, start+len-1, size);
+    }
+    else{
+        snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n");
+    }
+    snprintf(header + strlen(header), sizeof(header) - strlen(header),
+             "Content-Type: application/octet-stream\r\n"
+             "Content-Length: %lu\r\n"
+             "Accept-Ranges: bytes\r\n", len);
+    if(etag[0]){
+        snprintf(header + strlen(header), sizeof(header) - strlen(header), "ETag: %s\r\n", etag);
+    }
+    snprintf(header + strlen(header), sizeof(header) - strlen(header), "Cache-Control: no-cache\r\n\r\n");
     ret = ESP_OK;
+    if(httpSendAll(req, header, strlen(header))){
+        ret = ESP_FAIL;
+    }
+
+    while(ret == ESP_OK){
+        chunkLen = fileSysStreamGetChunk(&chunk);
+        if(chunkLen <= 0){
+            // a read error after the header was sent, all we can do is drop the connection
+            if(chunkLen < 0) ret = ESP_FAIL;
+            break;
+        }
+        if(httpSendAll(req, (const char *)chunk, chunkLen)){
+            ret = ESP_FAIL;
+        }
+        fileSysStreamReleaseChunk();
+    }
+    fileSysStreamStop();
 
 cleanup:
     free(urlQuery);
@@ -302,14 +820,43 @@ static esp_err_t handleUriGetPlaylistImages(httpd_req_t *req){
     cJSON *jRoot;
     char *jsonPrint;
     cJSON *string_item;
+    char urlQuery[32];
+    char idStr[12];
+    char imgName[MAX_IMAGE_NAME_LEN];
+    playlistInfo_t plInfo;
+    runState_t st;
+    u32 id;
+    playlistRet_e plStat;
 
     httpd_resp_set_type(req, "application/json");
+
+    runStateGet(&st);
+    id = st.playlist.playlistId;
+
+    if(httpd_req_get_url_query_str(req, urlQuery, sizeof(urlQuery)) == ESP_OK &&
+       httpd_query_key_value(urlQuery, "id", idStr, sizeof(idStr)) == ESP_OK){
+        id = strtoul(idStr, NULL, 10);
+    }
+
+    // the default playlist reads as empty until something is added to it
+    plStat = playlistGetInfo(id, &plInfo);
+    if(plStat == PLAYLIST_RET_NOT_FOUND && id == PLAYLIST_DEFAULT_ID){
+        memset(&plInfo, 0, sizeof(plInfo));
+        plStat = PLAYLIST_RET_OK;
+    }
+    if(plStat){
+        return sendPlaylistErr(req, plStat);
+    }
+
     jRoot = cJSON_CreateObject();
     cJSON_AddStringToObject(jRoot, "stat", "ok");
+    cJSON_AddNumberToObject(jRoot, "id", id);
+    cJSON_AddStringToObject(jRoot, "name", plInfo.name);
     cJSON * jArr = cJSON_AddArrayToObject(jRoot, "img");
-    for(int i=0;i<MAX_PLAYLIST_IMG;i++){
-        if(imgPlaylist.imgSelectEn[i]){
-            string_item = cJSON_CreateString(imgPlaylist.imgSelect[i]);
+    for(u32 i = 0; i < plInfo.count; i++){
+        // images deleted from the card are left out
+        if(playlistGetImage(id, i, imgName) == PLAYLIST_RET_OK){
+            string_item = cJSON_CreateString(imgName);
             cJSON_AddItemToArray(jArr, string_item);
         }
     }
@@ -320,6 +867,7 @@ static esp_err_t handleUriGetPlaylistImages(httpd_req_t *req){
         ret = ESP_FAIL;
     } else {
         httpd_resp_sendstr(req, jsonPrint);
+        free(jsonPrint);
         ret = ESP_OK;
     }
 
@@ -327,7 +875,47 @@ static esp_err_t handleUriGetPlaylistImages(httpd_req_t *req){
     return ret;
 }
 
+/**
+ * Adds an IPv4 address in dotted form, or an empty string for 0
+ */
+static void addIp4ToObject(cJSON *jObj, const char *name, u32 addr){
+    esp_ip4_addr_t ip = {.addr = addr};
+    char str[16];
+
+    cJSON_AddStringToObject(jObj, name, addr != 0 ? esp_ip4addr_ntoa(&ip, str, sizeof(str)) : "");
+}
+
+/**
+ * Parses the optional static IP of a POST /wifi/info, in the order of wifiNvmConf: "ip", "netmask",
+ * "gateway" and "dns". The DNS is optional, and an empty "ip" is back to DHCP
+ *
+ * Returns 0 on success, non-zero if an address is invalid or missing
+ */
+static int parseStaticIp(const cJSON *jRoot, u32 addrs[4]){
+    static const char *names[4] = {"ip", "netmask", "gateway", "dns"};
+    const cJSON *jAddr;
+    esp_ip4_addr_t ip;
+
+    memset(addrs, 0, 4 * sizeof(u32));
+    jAddr = cJSON_GetObjectItem(jRoot, "ip");
+    if(cJSON_IsString(jAddr) && jAddr->valuestring[0] == '\0'){
+        return 0;
+    }
+    for(u32 i = 0; i < 4; i++){
+        jAddr = cJSON_GetObjectItem(jRoot, names[i]);
+        if(i == 3 && jAddr == NULL){
+            break;
+        }
+        if(!cJSON_IsString(jAddr) || esp_netif_str_to_ip4(jAddr->valuestring, &ip) != ESP_OK){
+            return -1;
+        }
+        addrs[i] = ip.addr;
+    }
+    return addrs[0] == 0 || addrs[1] == 0 ? -1 : 0;
+}
+
 static esp_err_t handleUriGetWifiInfo(httpd_req_t *req){
+    wifiConnTimes_t times;
     wifi_mode_t wifiM;
     esp_err_t ret;
     char wifiModeStr[32];
@@ -348,6 +936,19 @@ static esp_err_t handleUriGetWifiInfo(httpd_req_t *req){
     cJSON_AddStringToObject(jRoot, "currentMode", wifiModeStr);
     cJSON_AddStringToObject(jRoot, "staSSID", wifiNvmConf.staSsid);
     cJSON_AddStringToObject(jRoot, "staPass", wifiNvmConf.staPass);
+    addIp4ToObject(jRoot, "ip", wifiNvmConf.staticIp);
+    addIp4ToObject(jRoot, "netmask", wifiNvmConf.netmask);
+    addIp4ToObject(jRoot, "gateway", wifiNvmConf.gateway);
+    addIp4ToObject(jRoot, "dns", wifiNvmConf.dns);
+
+    wifiGetConnTimes(&times);
+    cJSON *jConn = cJSON_AddObjectToObject(jRoot, "connect");
+    cJSON_AddStringToObject(jConn, "kind", wifiConnKindToStr(times.kind));
+    cJSON_AddBoolToObject(jConn, "staticIp", times.staticIp);
+    cJSON_AddNumberToObject(jConn, "startUs", times.startUs);
+    cJSON_AddNumberToObject(jConn, "connectedUs", times.connectedUs);
+    cJSON_AddNumberToObject(jConn, "gotIpUs", times.gotIpUs);
+    cJSON_AddNumberToObject(jConn, "firstRespUs", times.firstRespUs);
 
     httpd_resp_set_type(req, "application/json");
     jsonPrint = cJSON_PrintUnformatted(jRoot);
@@ -369,6 +970,7 @@ static esp_err_t handleUriPostWifiSta(httpd_req_t *req){
     cJSON *jRoot = NULL;
     const cJSON *jSSID = NULL;
     const cJSON *jPass = NULL;
+    u32 addrs[4];
 
     httpd_resp_set_type(req, "application/json");
 
@@ -392,6 +994,19 @@ static esp_err_t handleUriPostWifiSta(httpd_req_t *req){
         goto cleanup;
     }
 
+    // without "ip" the static IP is left as it is
+    if(cJSON_GetObjectItem(jRoot, "ip") != NULL){
+        if(parseStaticIp(jRoot, addrs)){
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: ip, netmask, gateway or dns\"}");
+            ret = ESP_FAIL;
+            goto cleanup;
+        }
+        wifiNvmConf.staticIp = addrs[0];
+        wifiNvmConf.netmask = addrs[1];
+        wifiNvmConf.gateway = addrs[2];
+        wifiNvmConf.dns = addrs[3];
+    }
+
     strcpy(wifiNvmConf.staSsid, jSSID->valuestring);
     strcpy(wifiNvmConf.staPass, jPass->valuestring);
     // todo: for now just allow psk, allow more auth options
@@ -421,35 +1036,16 @@ static esp_err_t handleUriPostWifiStaConn(httpd_req_t *req){
 }
 
 
-static esp_err_t handleUriPostSetFbCommon(httpd_req_t *req, u32 dest){
-    u8 *destBuff;
-
-    httpd_resp_set_type(req, "application/json");
-
-    if(req->content_len != DISP_FB_SIZE){
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"Frame buffer size invalid\"}");
-        return ESP_FAIL;
-    }
-
-    if(dest == 0x00){
-        destBuff = takeDispFb(0);
-        if(destBuff == NULL){
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"Could not take frame buffer mutex\"}");
-            return ESP_FAIL;
-        }
-    }
-    else if(dest == 0x01){
-        destBuff = sdCardFrameBuff;
-    }
-    else{
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"internal error, invalid dest\"}");
-        return ESP_FAIL;
-    }
-
+/**
+ * Receives a whole frame buffer, DISP_FB_SIZE bytes, into destBuff
+ *
+ * Returns 0 on success, non-zero if the connection was lost before all of it arrived
+ */
+static int recvFrame(httpd_req_t *req, u8 *destBuff){
     const size_t chunkReadSize = 16384;
 
     int remaining = req->content_len;   // total bytes expected
-    while(1){
+    while(remaining > 0){
         int to_read = remaining < chunkReadSize ? remaining : chunkReadSize;
 
         int r = httpd_req_recv(req, (char*)destBuff, to_read);
@@ -457,7 +1053,6 @@ static esp_err_t handleUriPostSetFbCommon(httpd_req_t *req, u32 dest){
             destBuff += r;
             remaining -= r;
         }
-        // todo: handle other errors
         else if (r == HTTPD_SOCK_ERR_TIMEOUT) {
             // client is slow; retry
         }
@@ -465,13 +1060,7 @@ static esp_err_t handleUriPostSetFbCommon(httpd_req_t *req, u32 dest){
             break;
         }
     }
-
-    if(dest == 0x00){
-        releaseDispFb();
-    }
-    httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
-
-    return ESP_OK;
+    return remaining != 0;
 }
 
 
@@ -479,27 +1068,574 @@ static esp_err_t handleUriPostSetFbCommon(httpd_req_t *req, u32 dest){
  * Set the internal display framebuffer
  */
 static esp_err_t handleUriPostSetDisplayFb(httpd_req_t *req){
-    return handleUriPostSetFbCommon(req, 0x00);
-}
-
-/**
- * Set the internal display framebuffer
- */
-static esp_err_t handleUriPostUploadSdImage(httpd_req_t *req){
-    return handleUriPostSetFbCommon(req, 0x01);
-}
+    u8 *destBuff;
 
-static esp_err_t handleUriPostUpdateDisplay(httpd_req_t *req){
     httpd_resp_set_type(req, "application/json");
-    u32 stat = dispTrigUpdate();
-    if(stat){
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"updating display, please wait\"}");
+
+    if(req->content_len != DISP_FB_SIZE){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"Frame buffer size invalid\"}");
         return ESP_FAIL;
     }
-    else{
-        httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
-        return ESP_OK;
+
+    destBuff = takeDispFb(0);
+    if(destBuff == NULL){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"Could not take frame buffer mutex\"}");
+        return ESP_FAIL;
+    }
+    if(recvFrame(req, destBuff)){
+        // nothing to respond to, what arrived stays in the frame buffer until the next one
+        releaseDispFb();
+        ESP_LOGW(TAG, "Frame buffer upload lost before the whole frame arrived");
+        return ESP_FAIL;
     }
+    releaseDispFb();
+    httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
+
+    return ESP_OK;
+}
+
+/**
+ * Receives a frame buffer into an upload slot, for /img/save to save. Opens a slot and responds with its
+ * ID, unless the client names one it already has open
+ *
+ * Query: slot=<ID> (optional)
+ */
+static esp_err_t handleUriPostUploadSdImage(httpd_req_t *req){
+    char urlQuery[64];
+    char slotStr[12];
+    char tmp[96];
+    u32 slotId;
+    bool opened = false;
+    u8 *destBuff;
+    imgSlotRet_e slotRet;
+    int recvRet;
+
+    httpd_resp_set_type(req, "application/json");
+
+    if(req->content_len != DISP_FB_SIZE){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"Frame buffer size invalid\"}");
+        return ESP_FAIL;
+    }
+
+    if(httpd_req_get_url_query_str(req, urlQuery, sizeof(urlQuery)) == ESP_OK &&
+       httpd_query_key_value(urlQuery, "slot", slotStr, sizeof(slotStr)) == ESP_OK){
+        slotId = strtoul(slotStr, NULL, 10);
+    }
+    else{
+        slotId = imgSlotOpen();
+        if(slotId == 0){
+            httpd_resp_set_status(req, "503 Service Unavailable");
+            httpd_resp_sendstr(req, "{\"stat\": \"every upload slot is in use, try again later\"}");
+            return ESP_FAIL;
+        }
+        opened = true;
+    }
+
+    slotRet = imgSlotTake(slotId, true, &destBuff);
+    if(slotRet == IMG_SLOT_BUSY){
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_sendstr(req, "{\"stat\": \"upload slot busy, being uploaded to or saved\"}");
+        return ESP_FAIL;
+    }
+    if(slotRet){
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "{\"stat\": \"upload slot not found or expired\"}");
+        return ESP_FAIL;
+    }
+    recvRet = recvFrame(req, destBuff);
+    imgSlotGive(slotId, recvRet == 0);
+    if(recvRet){
+        ESP_LOGW(TAG, "Upload to slot %lu lost before the whole frame arrived", slotId);
+        if(opened){
+            imgSlotClose(slotId);
+        }
+        return ESP_FAIL;
+    }
+
+    snprintf(tmp, sizeof(tmp), "{\"stat\": \"ok\", \"slot\": %lu, \"expiresS\": %d}", slotId, IMG_SLOT_TTL_S);
+    httpd_resp_sendstr(req, tmp);
+    return ESP_OK;
+}
+
+/**
+ * Receives a frame buffer and sends it to an image file and/or the display frame buffer while it is
+ * being received, then updates the display. Replaces doing /img/upload, /img/save, /img/load, and
+ * /disp/update one after the other, and does not need to read back the image from the SD card
+ *
+ * Query: name=<image name>, store=0/1 (default 1), show=0/1 (default 1)
+ */
+static esp_err_t handleUriPostImgPush(httpd_req_t *req){
+    esp_err_t ret;
+    char urlQuery[MAX_IMAGE_NAME_LEN * 3 + 64];     // room for a percent encoded name
+    char imgName[MAX_IMAGE_NAME_LEN];
+    char tmp[192];
+    bool store, show;
+    bool fbTaken = false;
+    bool writing = false;
+    bool deduped = false;
+    fSysImgWriter_t *writer = NULL;
+    fSysRet fSysStat = FILE_SYS_RET_OK;
+    u8 *destBuff;
+    u8 *chunkBuff = NULL;
+    int remaining;
+    int64_t startUs, t0;
+    int64_t recvUs = 0;
+    int64_t sdUs = 0;
+    int64_t totalUs;
+    const int chunkReadSize = 16384;
+
+    startUs = esp_timer_get_time();
+    httpd_resp_set_type(req, "application/json");
+
+    imgName[0] = '\0';
+    if(httpd_req_get_url_query_str(req, urlQuery, sizeof(urlQuery)) != ESP_OK){
+        urlQuery[0] = '\0';
+    }
+    store = getQueryFlag(urlQuery, "store", true);
+    show = getQueryFlag(urlQuery, "show", true);
+    if(store && getQueryImgName(urlQuery, "name", imgName)){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"name was not valid\"}");
+        return ESP_FAIL;
+    }
+    if(!store && !show){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"nothing to do, store and show are both 0\"}");
+        return ESP_FAIL;
+    }
+    if(req->content_len != DISP_FB_SIZE){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"Frame buffer size invalid\"}");
+        return ESP_FAIL;
+    }
+
+    // receive straight into the display frame buffer if showing it, the file is written from there.
+    // Otherwise a chunk at a time into a buffer of its own, so it doesn't hold an upload slot
+    if(show){
+        destBuff = takeDispFb(0);
+        if(destBuff == NULL){
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"Could not take frame buffer mutex\"}");
+            return ESP_FAIL;
+        }
+        fbTaken = true;
+    }
+    else{
+        chunkBuff = malloc(chunkReadSize);
+        if(chunkBuff == NULL){
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"out of memory\"}");
+            return ESP_FAIL;
+        }
+        destBuff = chunkBuff;
+    }
+
+    if(store){
+        writer = malloc(sizeof(fSysImgWriter_t));
+        if(writer == NULL){
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"out of memory\"}");
+            ret = ESP_FAIL;
+            goto cleanup;
+        }
+        if(fileSysImageWriteBegin(imgName, writer)){
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"unable to open image file\"}");
+            ret = ESP_FAIL;
+            goto cleanup;
+        }
+        writing = true;
+    }
+
+    // each chunk is written to the SD card as soon as it is received, while the next one is already
+    // being buffered by the TCP stack
+    remaining = req->content_len;
+    while(remaining > 0){
+        int toRead = remaining < chunkReadSize ? remaining : chunkReadSize;
+
+        t0 = esp_timer_get_time();
+        int r = httpd_req_recv(req, (char*)destBuff, toRead);
+        recvUs += esp_timer_get_time() - t0;
+        if(r == HTTPD_SOCK_ERR_TIMEOUT){
+            continue;       // client is slow; retry
+        }
+        if(r <= 0){
+            ESP_LOGW(TAG, "Image push connection lost with %d bytes remaining", remaining);
+            ret = ESP_FAIL;
+            goto cleanup;
+        }
+
+        if(writing){
+            t0 = esp_timer_get_time();
+            fSysStat = fileSysImageWriteChunk(writer, destBuff, r);
+            sdUs += esp_timer_get_time() - t0;
+            if(fSysStat){
+                httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"unable to write image file\"}");
+                ret = ESP_FAIL;
+                goto cleanup;
+            }
+        }
+        if(show){
+            destBuff += r;
+        }
+        remaining -= r;
+    }
+
+    if(writing){
+        t0 = esp_timer_get_time();
+        writing = false;
+        fSysStat = fileSysImageWriteEnd(writer, true);
+        sdUs += esp_timer_get_time() - t0;
+        deduped = writer->deduped;
+        if(fSysStat){
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"unable to save image file\"}");
+            ret = ESP_FAIL;
+            goto cleanup;
+        }
+    }
+
+    if(fbTaken){
+        releaseDispFb();
+        fbTaken = false;
+        dispRequestUpdate(DISP_PRIO_INTERACTIVE);
+    }
+
+    totalUs = esp_timer_get_time() - startUs;
+    snprintf(tmp, sizeof(tmp), "{\"stat\": \"ok\", \"stored\": %s, \"shown\": %s, \"deduped\": %s, "
+                               "\"recvMs\": %lld, \"sdMs\": %lld, \"totalMs\": %lld}",
+                               store ? "true" : "false", show ? "true" : "false", deduped ? "true" : "false",
+                               recvUs / 1000, sdUs / 1000, totalUs / 1000);
+    httpd_resp_sendstr(req, tmp);
+    ret = ESP_OK;
+
+cleanup:
+    if(writing){
+        fileSysImageWriteEnd(writer, false);
+    }
+    if(fbTaken){
+        releaseDispFb();
+    }
+    free(writer);
+    free(chunkBuff);
+    return ret;
+}
+
+/**
+ * Parses the hex SHA-256 of an image's content, as sent by clients
+ *
+ * Returns 0 on success, -1 if it isn't FILE_SYS_HASH_LEN bytes of hex
+ */
+static int parseImgHash(const char *hex, u8 *hash){
+    unsigned int byte;
+
+    if(strlen(hex) != FILE_SYS_HASH_LEN * 2){
+        return -1;
+    }
+    for(u32 i = 0; i < FILE_SYS_HASH_LEN; i++){
+        if(!isxdigit((unsigned char)hex[i*2]) || !isxdigit((unsigned char)hex[i*2 + 1]) ||
+           sscanf(&hex[i*2], "%2x", &byte) != 1){
+            return -1;
+        }
+        hash[i] = byte;
+    }
+    return 0;
+}
+
+/**
+ * Asks if the content of an image is already on the card, so it doesn't have to be pushed again. Linking
+ * a name to it with /img/link is enough
+ *
+ * Query: sha256, the hex hash of the content
+ */
+static esp_err_t handleUriGetImgHash(httpd_req_t *req){
+    char urlQuery[96];
+    char hex[FILE_SYS_HASH_LEN * 2 + 1];
+    char imgName[MAX_IMAGE_NAME_LEN];
+    char tmp[96];
+    u8 hash[FILE_SYS_HASH_LEN];
+    fSysRet fSysStat;
+
+    httpd_resp_set_type(req, "application/json");
+
+    if(httpd_req_get_url_query_str(req, urlQuery, sizeof(urlQuery)) != ESP_OK ||
+       httpd_query_key_value(urlQuery, "sha256", hex, sizeof(hex)) != ESP_OK || parseImgHash(hex, hash)){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"sha256 was not valid\"}");
+        return ESP_FAIL;
+    }
+
+    fSysStat = fileSysFindHash(hash, imgName);
+    if(fSysStat == FILE_SYS_NO_FILE_FOUND){
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "{\"stat\": \"no image has that content\"}");
+        return ESP_FAIL;
+    }
+    if(fSysStat){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"unable to read the image index\"}");
+        return ESP_FAIL;
+    }
+    snprintf(tmp, sizeof(tmp), "{\"stat\": \"ok\", \"name\": \"%s\"}", imgName);
+    httpd_resp_sendstr(req, tmp);
+    return ESP_OK;
+}
+
+/**
+ * Saves an image with content that's already on the card, see handleUriGetImgHash()
+ */
+static esp_err_t handleUriPostImgLink(httpd_req_t *req){
+    esp_err_t ret;
+    char *contextBuff;
+    cJSON *jRoot = NULL;
+    u8 hash[FILE_SYS_HASH_LEN];
+    fSysRet fSysStat;
+
+    httpd_resp_set_type(req, "application/json");
+
+    if(getJsonFromReq(req, &contextBuff, &jRoot)){
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    const cJSON *jImgName = cJSON_GetObjectItem(jRoot, "name");
+    const cJSON *jHash = cJSON_GetObjectItem(jRoot, "sha256");
+    if(!cJSON_IsString(jImgName) || !fileSysImageNameValid(jImgName->valuestring)){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: name not valid\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+    if(!cJSON_IsString(jHash) || parseImgHash(jHash->valuestring, hash)){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: sha256 not valid\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    fSysStat = fileSysImageLink(jImgName->valuestring, hash);
+    if(fSysStat == FILE_SYS_NO_FILE_FOUND){
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "{\"stat\": \"no image has that content\"}");
+        ret = ESP_FAIL;
+    } else if(fSysStat){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"unable to link image\"}");
+        ret = ESP_FAIL;
+    } else {
+        httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
+        ret = ESP_OK;
+    }
+
+cleanup:
+    cJSON_Delete(jRoot);
+    free(contextBuff);
+    return ret;
+}
+
+/**
+ * Lists the images with their content hashes and the index generation, from the index alone, for a client
+ * to work out what differs from its own copy of the library
+ */
+static esp_err_t handleUriGetImgManifest(httpd_req_t *req){
+    esp_err_t ret;
+    cJSON *jRoot;
+    cJSON *jArr;
+    char *jsonPrint;
+    fSysIndexInfo_t info;
+
+    httpd_resp_set_type(req, "application/json");
+    jRoot = cJSON_CreateObject();
+    cJSON_AddStringToObject(jRoot, "stat", "ok");
+    jArr = cJSON_CreateArray();
+
+    if(fileSysIndexGetManifest(jArr, &info)){
+        cJSON_Delete(jArr);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"unable to read the image index\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+    cJSON_AddNumberToObject(jRoot, "generation", info.generation);
+    cJSON_AddNumberToObject(jRoot, "epoch", info.epoch);
+    cJSON_AddNumberToObject(jRoot, "count", info.count);
+    cJSON_AddItemToObject(jRoot, "img", jArr);
+
+    jsonPrint = cJSON_PrintUnformatted(jRoot);
+    if(jsonPrint == NULL){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"CJSON Fail\"}");
+        ret = ESP_FAIL;
+    } else {
+        httpd_resp_sendstr(req, jsonPrint);
+        free(jsonPrint);
+        ret = ESP_OK;
+    }
+
+cleanup:
+    cJSON_Delete(jRoot);
+    return ret;
+}
+
+/**
+ * Applies one operation of a batch, see handleUriPostImgBatch()
+ *
+ * Returns the status to report for it
+ */
+static const char* imgBatchApply(const cJSON *jOp){
+    const cJSON *jType = cJSON_GetObjectItem(jOp, "op");
+    const cJSON *jImgName = cJSON_GetObjectItem(jOp, "name");
+    const cJSON *jHash = cJSON_GetObjectItem(jOp, "sha256");
+    u8 hash[FILE_SYS_HASH_LEN];
+    fSysRet fSysStat;
+
+    if(!cJSON_IsString(jType) || !cJSON_IsString(jImgName) || !fileSysImageNameValid(jImgName->valuestring)){
+        return "invalid";
+    }
+
+    if(strcmp(jType->valuestring, "link") == 0){
+        if(!cJSON_IsString(jHash) || parseImgHash(jHash->valuestring, hash)){
+            return "invalid";
+        }
+        fSysStat = fileSysImageLink(jImgName->valuestring, hash);
+    } else if(strcmp(jType->valuestring, "delete") == 0){
+        // right here like the links rather than through the worker like /img/delete, waiting on it for
+        // each would hold the http server for up to IMG_BATCH_MAX_OPS job timeouts
+        fSysStat = playlistDeleteImageFile(jImgName->valuestring);
+    } else {
+        return "invalid";
+    }
+
+    if(fSysStat == FILE_SYS_RET_OK){
+        return "ok";
+    }
+    return fSysStat == FILE_SYS_NO_FILE_FOUND ? "not found" : "failed";
+}
+
+/**
+ * Applies a list of link and delete operations in order, so a sync only sends the content that isn't on
+ * the card. An operation failing doesn't stop the others, each gets its own status
+ *
+ * Body: {"generation": the one of the manifest it was worked out from (optional, the batch is refused if
+ * the index changed since), "ops": [{"op": "link", "name", "sha256"} or {"op": "delete", "name"}]}
+ */
+static esp_err_t handleUriPostImgBatch(httpd_req_t *req){
+    esp_err_t ret;
+    char *contextBuff;
+    char *jsonPrint;
+    cJSON *jRoot = NULL;
+    cJSON *jResp = NULL;
+    cJSON *jResults;
+    cJSON *jResult;
+    const cJSON *jOp;
+    const cJSON *jGen;
+    const cJSON *jOps;
+    const cJSON *jImgName;
+    fSysIndexInfo_t info;
+
+    httpd_resp_set_type(req, "application/json");
+
+    if(getJsonFromReq(req, &contextBuff, &jRoot)){
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    jOps = cJSON_GetObjectItem(jRoot, "ops");
+    if(!cJSON_IsArray(jOps) || cJSON_GetArraySize(jOps) > IMG_BATCH_MAX_OPS){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: ops not an array, or too many of them\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+    if(fileSysIndexGetInfo(&info)){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"unable to read the image index\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+    jGen = cJSON_GetObjectItem(jRoot, "generation");
+    if(cJSON_IsNumber(jGen) && (u32)jGen->valuedouble != info.generation){
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_sendstr(req, "{\"stat\": \"the images changed since that generation, get the manifest again\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    jResp = cJSON_CreateObject();
+    cJSON_AddStringToObject(jResp, "stat", "ok");
+    jResults = cJSON_AddArrayToObject(jResp, "results");
+    cJSON_ArrayForEach(jOp, jOps){
+        jImgName = cJSON_GetObjectItem(jOp, "name");
+        jResult = cJSON_CreateObject();
+        cJSON_AddStringToObject(jResult, "name", cJSON_IsString(jImgName) ? jImgName->valuestring : "");
+        cJSON_AddStringToObject(jResult, "stat", imgBatchApply(jOp));
+        cJSON_AddItemToArray(jResults, jResult);
+    }
+    if(fileSysIndexGetInfo(&info) == FILE_SYS_RET_OK){
+        cJSON_AddNumberToObject(jResp, "generation", info.generation);
+    }
+
+    jsonPrint = cJSON_PrintUnformatted(jResp);
+    if(jsonPrint == NULL){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"CJSON Fail\"}");
+        ret = ESP_FAIL;
+    } else {
+        httpd_resp_sendstr(req, jsonPrint);
+        free(jsonPrint);
+        ret = ESP_OK;
+    }
+
+cleanup:
+    cJSON_Delete(jResp);
+    cJSON_Delete(jRoot);
+    free(contextBuff);
+    return ret;
+}
+
+/**
+ * Requests a display refresh. A request made while the display is refreshing is merged with any other
+ * made before the next refresh starts, so it never fails for the display being busy
+ *
+ * Query: wait=1 to respond once the refresh is done
+ */
+static esp_err_t handleUriPostUpdateDisplay(httpd_req_t *req){
+    char tmp[64];
+    dispTicket_t ticket;
+
+    httpd_resp_set_type(req, "application/json");
+    ticket = dispRequestUpdate(DISP_PRIO_INTERACTIVE);
+    if(reqWantsWait(req) && dispWaitTicket(ticket, pdMS_TO_TICKS(DISP_WAIT_TIMEOUT_MS))){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"timed out waiting on the display\"}");
+        return ESP_FAIL;
+    }
+
+    snprintf(tmp, sizeof(tmp), "{\"stat\": \"ok\", \"ticket\": %lu, \"done\": %s}", ticket,
+             dispTicketDone(ticket) ? "true" : "false");
+    httpd_resp_sendstr(req, tmp);
+    return ESP_OK;
+}
+
+/**
+ * Gets the state of the display refresh requests
+ *
+ * Query: ticket=<ticket> to also get if that refresh is done
+ */
+static esp_err_t handleUriGetUpdateDisplay(httpd_req_t *req){
+    esp_err_t ret;
+    cJSON *jRoot;
+    char *jsonPrint;
+    char urlQuery[32];
+    char val[12];
+    dispQueueStats_t stats;
+
+    httpd_resp_set_type(req, "application/json");
+    dispGetQueueStats(&stats);
+
+    jRoot = cJSON_CreateObject();
+    cJSON_AddStringToObject(jRoot, "stat", "ok");
+    cJSON_AddNumberToObject(jRoot, "last", stats.last);
+    cJSON_AddNumberToObject(jRoot, "done", stats.done);
+    cJSON_AddBoolToObject(jRoot, "pending", stats.pending);
+    cJSON_AddBoolToObject(jRoot, "busy", isDisplayUpdating());
+    cJSON_AddNumberToObject(jRoot, "requests", stats.requests);
+    cJSON_AddNumberToObject(jRoot, "refreshes", stats.refreshes);
+    if(httpd_req_get_url_query_str(req, urlQuery, sizeof(urlQuery)) == ESP_OK &&
+       httpd_query_key_value(urlQuery, "ticket", val, sizeof(val)) == ESP_OK){
+        cJSON_AddBoolToObject(jRoot, "ticketDone", dispTicketDone(strtoul(val, NULL, 10)));
+    }
+
+    jsonPrint = cJSON_PrintUnformatted(jRoot);
+    if(jsonPrint == NULL){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"CJSON Fail\"}");
+        ret = ESP_FAIL;
+    } else {
+        httpd_resp_sendstr(req, jsonPrint);
+        free(jsonPrint);
+        ret = ESP_OK;
+    }
+
+    cJSON_Delete(jRoot);
+    return ret;
 }
 
 static esp_err_t handleUriPostImageCheckerPattern(httpd_req_t *req){
@@ -514,14 +1650,574 @@ static esp_err_t handleUriPostImageCheckerPattern(httpd_req_t *req){
         goto cleanup;
     }
 
-    const cJSON *jCheckSize = cJSON_GetObjectItem(jRoot, "checkSize");
-    if (!cJSON_IsNumber(jCheckSize)){
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: checkSize not an integer\"}");
-        ret = ESP_FAIL;
-        goto cleanup;
+    const cJSON *jCheckSize = cJSON_GetObjectItem(jRoot, "checkSize");
+    if (!cJSON_IsNumber(jCheckSize)){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: checkSize not an integer\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    dispCheckerPattern(jCheckSize->valueint);
+    httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
+    ret = ESP_OK;
+
+cleanup:
+    cJSON_Delete(jRoot);
+    free(contextBuff);
+    return ret;
+}
+
+/**
+ * Saves an upload slot as an image. Body: name, slot (the ID /img/upload responded with), keep (optional,
+ * default false, keeps the slot open to save it again rather than freeing it)
+ */
+static esp_err_t handleUriSaveImage(httpd_req_t *req){
+    esp_err_t ret;
+    char *contextBuff;
+    cJSON *jRoot = NULL;
+    imgSlotRet_e slotRet;
+    u8 *slotBuff;
+    u32 slotId;
+    u32 jobId;
+
+    httpd_resp_set_type(req, "application/json");
+
+    if(getJsonFromReq(req, &contextBuff, &jRoot)){
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    // checked here too, the job only has room for MAX_IMAGE_NAME_LEN so a longer name would be cut
+    const cJSON *jImgName = cJSON_GetObjectItem(jRoot, "name");
+    if (!cJSON_IsString(jImgName) || !fileSysImageNameValid(jImgName->valuestring)){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: name not valid\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    // no default to the last upload, it could be another client's
+    const cJSON *jSlot = cJSON_GetObjectItem(jRoot, "slot");
+    if(!cJSON_IsNumber(jSlot)){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: slot not an integer\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+    slotId = jSlot->valuedouble;
+
+    // taken until the worker is done with it, so it can't expire while the job is queued
+    slotRet = imgSlotTake(slotId, false, &slotBuff);
+    if(slotRet == IMG_SLOT_BUSY){
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_sendstr(req, "{\"stat\": \"upload slot busy, a frame is being uploaded to it\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+    if(slotRet){
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "{\"stat\": \"upload slot not found, expired, or without a whole frame\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+    jobId = jobSubmit(JOB_TYPE_IMG_SAVE, jImgName->valuestring, MODE_STANDBY, slotId);
+    if(jobId == 0){
+        imgSlotGive(slotId, true);
+    }
+    else if(!cJSON_IsTrue(cJSON_GetObjectItem(jRoot, "keep"))){
+        imgSlotClose(slotId);
+    }
+    ret = respondWithJob(req, jobId);
+
+cleanup:
+    cJSON_Delete(jRoot);
+    free(contextBuff);
+    return ret;
+}
+
+
+static esp_err_t handleUriLoadImage(httpd_req_t *req){
+    esp_err_t ret;
+    char *contextBuff;
+    cJSON *jRoot = NULL;
+
+    httpd_resp_set_type(req, "application/json");
+
+    if(getJsonFromReq(req, &contextBuff, &jRoot)){
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    const cJSON *jImgName = cJSON_GetObjectItem(jRoot, "name");
+    if (!cJSON_IsString(jImgName)){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: imgName not a string\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    ret = respondWithJob(req, jobSubmit(JOB_TYPE_IMG_LOAD, jImgName->valuestring, MODE_STANDBY, 0));
+
+cleanup:
+    cJSON_Delete(jRoot);
+    free(contextBuff);
+    return ret;
+}
+
+static esp_err_t handleUriDeleteImage(httpd_req_t *req){
+    esp_err_t ret;
+    char *contextBuff;
+    cJSON *jRoot = NULL;
+
+    httpd_resp_set_type(req, "application/json");
+
+    if(getJsonFromReq(req, &contextBuff, &jRoot)){
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    const cJSON *jImgName = cJSON_GetObjectItem(jRoot, "name");
+    if (!cJSON_IsString(jImgName)){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: name not a string\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    ret = respondWithJob(req, jobSubmit(JOB_TYPE_IMG_DELETE, jImgName->valuestring, MODE_STANDBY, 0));
+
+cleanup:
+    cJSON_Delete(jRoot);
+    free(contextBuff);
+    return ret;
+
+}
+
+static esp_err_t handleUriPlaylistAdd(httpd_req_t *req){
+    esp_err_t ret;
+    char *contextBuff;
+    cJSON *jRoot = NULL;
+
+    httpd_resp_set_type(req, "application/json");
+
+    if(getJsonFromReq(req, &contextBuff, &jRoot)){
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    const cJSON *jImgName = cJSON_GetObjectItem(jRoot, "name");
+    if (!cJSON_IsString(jImgName)){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: name not a string\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+    if(fileSysIsImageValid(jImgName->valuestring)){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"invalid file, not on disk\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    // the playlist checks that it's not already in it
+    playlistRet_e plStat = playlistAddImage(getPlaylistIdFromJson(jRoot), jImgName->valuestring);
+    if(plStat){
+        ret = sendPlaylistErr(req, plStat);
+        goto cleanup;
+    }
+
+    httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
+    ret = ESP_OK;
+
+
+cleanup:
+    cJSON_Delete(jRoot);
+    free(contextBuff);
+    return ret;
+}
+
+
+static esp_err_t handleUriPlaylistDel(httpd_req_t *req){
+    esp_err_t ret;
+    char *contextBuff;
+    cJSON *jRoot = NULL;
+
+    httpd_resp_set_type(req, "application/json");
+
+    if(getJsonFromReq(req, &contextBuff, &jRoot)){
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    const cJSON *jImgName = cJSON_GetObjectItem(jRoot, "name");
+    if (!cJSON_IsString(jImgName)){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: name not a string\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    u32 playlistId = getPlaylistIdFromJson(jRoot);
+
+    // add check if we are currently in the playlist selected mode, don't allow deletion as it remove the last
+    //  available image, causing cascading of issues
+    runState_t st;
+    runStateGet(&st);
+    if(st.runMode == MODE_IMAGE_PLAYLIST && st.playlist.mode == PLAYLIST_MODE_SELECT && playlistId == st.playlist.playlistId){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"current running in mode, stop image cycling to remove\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    playlistRet_e plStat = playlistDelImage(playlistId, jImgName->valuestring);
+    if(plStat){
+        ret = sendPlaylistErr(req, plStat);
+        goto cleanup;
+    }
+
+    httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
+    ret = ESP_OK;
+
+
+cleanup:
+    cJSON_Delete(jRoot);
+    free(contextBuff);
+    return ret;
+}
+
+
+/**
+ * Lists the playlists on the SD card
+ */
+static esp_err_t handleUriGetPlaylists(httpd_req_t *req){
+    esp_err_t ret;
+    cJSON *jRoot;
+    cJSON *jArr;
+    cJSON *jPl;
+    char *jsonPrint;
+    playlistInfo_t plInfo;
+    runState_t st;
+
+    runStateGet(&st);
+    httpd_resp_set_type(req, "application/json");
+    jRoot = cJSON_CreateObject();
+    cJSON_AddStringToObject(jRoot, "stat", "ok");
+    cJSON_AddNumberToObject(jRoot, "current", st.playlist.playlistId);
+    jArr = cJSON_AddArrayToObject(jRoot, "playlists");
+    for(u32 id = 0; id < PLAYLIST_MAX_COUNT; id++){
+        if(playlistGetInfo(id, &plInfo)){
+            continue;
+        }
+        jPl = cJSON_CreateObject();
+        cJSON_AddNumberToObject(jPl, "id", plInfo.id);
+        cJSON_AddStringToObject(jPl, "name", plInfo.name);
+        cJSON_AddNumberToObject(jPl, "count", plInfo.count);
+        cJSON_AddItemToArray(jArr, jPl);
+    }
+
+    jsonPrint = cJSON_PrintUnformatted(jRoot);
+    if(jsonPrint == NULL){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"CJSON Fail\"}");
+        ret = ESP_FAIL;
+    } else {
+        httpd_resp_sendstr(req, jsonPrint);
+        free(jsonPrint);
+        ret = ESP_OK;
+    }
+
+    cJSON_Delete(jRoot);
+    return ret;
+}
+
+static esp_err_t handleUriPlaylistCreate(httpd_req_t *req){
+    esp_err_t ret;
+    char *contextBuff;
+    cJSON *jRoot = NULL;
+    char resp[48];
+    u32 id;
+
+    httpd_resp_set_type(req, "application/json");
+
+    if(getJsonFromReq(req, &contextBuff, &jRoot)){
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    const cJSON *jName = cJSON_GetObjectItem(jRoot, "name");
+    if(!cJSON_IsString(jName) || strlen(jName->valuestring) >= PLAYLIST_NAME_LEN){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: name not a string or too long\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    playlistRet_e plStat = playlistCreate(jName->valuestring, &id);
+    if(plStat){
+        ret = sendPlaylistErr(req, plStat);
+        goto cleanup;
+    }
+
+    snprintf(resp, sizeof(resp), "{\"stat\": \"ok\", \"id\": %lu}", id);
+    httpd_resp_sendstr(req, resp);
+    ret = ESP_OK;
+
+cleanup:
+    cJSON_Delete(jRoot);
+    free(contextBuff);
+    return ret;
+}
+
+static esp_err_t handleUriPlaylistRemove(httpd_req_t *req){
+    esp_err_t ret;
+    char *contextBuff;
+    cJSON *jRoot = NULL;
+
+    httpd_resp_set_type(req, "application/json");
+
+    if(getJsonFromReq(req, &contextBuff, &jRoot)){
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    const cJSON *jId = cJSON_GetObjectItem(jRoot, "id");
+    if(!cJSON_IsNumber(jId) || jId->valueint < 0){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: id not a number\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+    // checked and removed in one edit, so it can't be selected in between
+    runState_t st;
+    runStateEdit(&st);
+    if(st.runMode != MODE_STANDBY && st.playlist.mode == PLAYLIST_MODE_SELECT && (u32)jId->valueint == st.playlist.playlistId){
+        runStateAbort();
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"playlist in use, stop image cycling to remove\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    playlistRet_e plStat = playlistRemove(jId->valueint);
+    if(plStat){
+        runStateAbort();
+        ret = sendPlaylistErr(req, plStat);
+        goto cleanup;
+    }
+    if((u32)jId->valueint == st.playlist.playlistId){
+        st.playlist.playlistId = PLAYLIST_DEFAULT_ID;
+        st.playlist.currIdx = 0;
+        runStateCommit(&st);
+        persistPlaylistSave();
+    } else {
+        runStateAbort();
+    }
+
+    httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
+    ret = ESP_OK;
+
+cleanup:
+    cJSON_Delete(jRoot);
+    free(contextBuff);
+    return ret;
+}
+
+/**
+ * Sets the playlist used by the select mode and by the playlist API when none is given
+ */
+static esp_err_t handleUriPlaylistSelect(httpd_req_t *req){
+    esp_err_t ret;
+    char *contextBuff;
+    cJSON *jRoot = NULL;
+    playlistInfo_t plInfo;
+
+    httpd_resp_set_type(req, "application/json");
+
+    if(getJsonFromReq(req, &contextBuff, &jRoot)){
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    const cJSON *jId = cJSON_GetObjectItem(jRoot, "id");
+    if(!cJSON_IsNumber(jId) || jId->valueint < 0){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: id not a number\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    // the default playlist can be selected before it exists
+    playlistRet_e plStat = playlistGetInfo(jId->valueint, &plInfo);
+    if(plStat && !(plStat == PLAYLIST_RET_NOT_FOUND && jId->valueint == PLAYLIST_DEFAULT_ID)){
+        ret = sendPlaylistErr(req, plStat);
+        goto cleanup;
+    }
+
+    runState_t st;
+    runStateEdit(&st);
+    st.playlist.playlistId = jId->valueint;
+    st.playlist.currIdx = 0;
+    runStateCommit(&st);
+    persistPlaylistSave();
+
+    httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
+    ret = ESP_OK;
+
+cleanup:
+    cJSON_Delete(jRoot);
+    free(contextBuff);
+    return ret;
+}
+
+static esp_err_t handleUriGetMode(httpd_req_t *req){
+    esp_err_t ret;
+    cJSON *jRoot;
+    char *jsonPrint;
+    const char *strToFill;
+    runState_t st;
+    char schedSpec[SCHED_SPEC_MAX_LEN];
+
+    // a copy, so the mode and playlist reported are from the same moment
+    runStateGet(&st);
+    httpd_resp_set_type(req, "application/json");
+    jRoot = cJSON_CreateObject();
+
+    cJSON_AddStringToObject(jRoot, "stat", "ok");
+    switch(st.runMode){
+        case MODE_STANDBY:
+            strToFill = "standby";
+            break;
+        case MODE_IMAGE_PLAYLIST:
+            strToFill = "playlist";
+            break;
+        case MODE_IMAGE_PLAYLIST_LP:
+            strToFill = "playlistLP";
+            break;
+        default:
+            strToFill = "error";
+            break;
+    }
+    cJSON_AddStringToObject(jRoot, "mode", strToFill);
+
+    cJSON * const jPlaylist = cJSON_AddObjectToObject(jRoot, "playlist");
+    cJSON_AddStringToObject(jRoot, "stat", "ok");
+    switch(st.playlist.mode){
+        case PLAYLIST_MODE_SELECT:
+            strToFill = "select";
+            break;
+        case PLAYLIST_MODE_ALL:
+            strToFill = "all";
+            break;
+        case PLAYLIST_MODE_RANDOM:
+            strToFill = "random";
+            break;
+        default:
+            strToFill = "Error";
+            break;
+    }
+    cJSON_AddStringToObject(jPlaylist, "mode", strToFill);
+    cJSON_AddNumberToObject(jPlaylist, "duration", (((float)st.playlist.period_ticks) / ((float)configTICK_RATE_HZ) / 60.0));
+    schedCalendarToStr(&st.playlist.calendar, schedSpec, sizeof(schedSpec));
+    cJSON_AddStringToObject(jPlaylist, "schedule", schedSpec);
+
+
+    jsonPrint = cJSON_PrintUnformatted(jRoot);
+    if(jsonPrint == NULL){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"CJSON Fail\"}");
+        ret = ESP_FAIL;
+    } else {
+        httpd_resp_sendstr(req, jsonPrint);
+        ret = ESP_OK;
+    }
+
+    cJSON_Delete(jRoot);
+    return ret;
+}
+
+static esp_err_t handleUriSetOperationMode(httpd_req_t *req){
+    esp_err_t ret;
+    char *contextBuff;
+    cJSON *jRoot = NULL;
+
+    const cJSON *jObj;
+
+    httpd_resp_set_type(req, "application/json");
+
+    if(getJsonFromReq(req, &contextBuff, &jRoot)){
+        ret = ESP_FAIL;
+        goto cleanup;
+    }
+
+    // handle if the playlist config are to be changed
+    jObj = cJSON_GetObjectItem(jRoot, "playlist");
+    if (cJSON_IsObject(jObj)){
+        const cJSON *jPlaylist;
+        runState_t st;
+        runStateEdit(&st);
+        jPlaylist = cJSON_GetObjectItem(jObj, "mode");
+        if (cJSON_IsString(jPlaylist)){
+            if(strcmp(jPlaylist->valuestring, "select") == 0){
+                st.playlist.mode = PLAYLIST_MODE_SELECT;
+            }
+            else if(strcmp(jPlaylist->valuestring, "all") == 0){
+                st.playlist.mode = PLAYLIST_MODE_ALL;
+            }
+            else if(strcmp(jPlaylist->valuestring, "random") == 0){
+                st.playlist.mode = PLAYLIST_MODE_RANDOM;
+            }
+            else{
+                runStateAbort();
+                httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"invalid playlist mode\"}");
+                ret = ESP_FAIL;
+                goto cleanup;
+            }
+        }
+
+        jPlaylist = cJSON_GetObjectItem(jObj, "duration");
+        if (cJSON_IsNumber(jPlaylist)){
+            double timeSet = jPlaylist->valuedouble;
+            if(timeSet < MIN_PLAYLIST_DUR){
+                runStateAbort();
+                httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"playlist duration less than minimum of 30 sec\"}");
+                ret = ESP_FAIL;
+                goto cleanup;
+            }
+            timeSet *= 60;      // to seconds from minutes
+            timeSet *= configTICK_RATE_HZ;      // to the tick rate
+            st.playlist.period_ticks = (TickType_t)timeSet;
+        }
+
+        jPlaylist = cJSON_GetObjectItem(jObj, "schedule");
+        if (cJSON_IsString(jPlaylist)){
+            if(schedCalendarParse(jPlaylist->valuestring, &st.playlist.calendar)){
+                runStateAbort();
+                httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"invalid schedule\"}");
+                ret = ESP_FAIL;
+                goto cleanup;
+            }
+        }
+        runStateCommit(&st);
+        persistPlaylistSave();
+        // a running playlist goes by the new period or windows from now, rather than after the current one
+        playlistReschedule();
     }
 
-    dispCheckerPattern(jCheckSize->valueint);
+    // handle the mode setting last
+    jObj = cJSON_GetObjectItem(jRoot, "mode");
+    // if "mode" was given
+    if (cJSON_IsString(jObj)){
+        if(strcmp(jObj->valuestring, "standby") == 0){
+            setModeRet_e stat = setMode(MODE_STANDBY);
+            if(stat){
+                httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"internal error\"}");
+                ret = ESP_FAIL;
+                goto cleanup;
+            }
+        }
+        // the playlist modes scan the SD card, so they are done by the job worker
+        else if(strcmp(jObj->valuestring, "playlist") == 0){
+            ret = respondWithJob(req, jobSubmit(JOB_TYPE_SET_MODE, NULL, MODE_IMAGE_PLAYLIST, 0));
+            goto cleanup;
+        }
+        else if(strcmp(jObj->valuestring, "playlistLP") == 0){
+            ret = respondWithJob(req, jobSubmit(JOB_TYPE_SET_MODE, NULL, MODE_IMAGE_PLAYLIST_LP, 0));
+            goto cleanup;
+        }
+        else{
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"invalid mode\"}");
+            ret = ESP_FAIL;
+            goto cleanup;
+        }
+    }
+
+
     httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
     ret = ESP_OK;
 
@@ -529,48 +2225,55 @@ cleanup:
     cJSON_Delete(jRoot);
     free(contextBuff);
     return ret;
+
 }
 
-static esp_err_t handleUriSaveImage(httpd_req_t *req){
+static esp_err_t handleUriGetTime(httpd_req_t *req){
     esp_err_t ret;
-    char *contextBuff;
-    cJSON *jRoot = NULL;
+    cJSON *jRoot;
+    char *jsonPrint;
+    timeSyncInfo_t info;
+    time_t now = time(NULL);
+    struct tm tm;
+    char local[32];
 
     httpd_resp_set_type(req, "application/json");
+    jRoot = cJSON_CreateObject();
 
-    if(getJsonFromReq(req, &contextBuff, &jRoot)){
-        ret = ESP_FAIL;
-        goto cleanup;
-    }
+    timeSyncGetInfo(&info);
+    localtime_r(&now, &tm);
+    strftime(local, sizeof(local), "%Y-%m-%dT%H:%M:%S", &tm);
+    cJSON_AddStringToObject(jRoot, "stat", "ok");
+    cJSON_AddBoolToObject(jRoot, "valid", info.valid);
+    cJSON_AddNumberToObject(jRoot, "epoch", now);
+    cJSON_AddStringToObject(jRoot, "local", local);
+    cJSON_AddStringToObject(jRoot, "tz", info.tz);
+    cJSON_AddStringToObject(jRoot, "source", timeSrcToStr(info.source));
+    cJSON_AddNumberToObject(jRoot, "lastSetS", info.lastSetS);
+    cJSON_AddStringToObject(jRoot, "sntpServer", CONFIG_APP_SNTP_SERVER);
+    cJSON_AddNumberToObject(jRoot, "sntpSyncs", info.sntpSyncs);
+    cJSON_AddNumberToObject(jRoot, "clientSets", info.clientSets);
 
-    const cJSON *jImgName = cJSON_GetObjectItem(jRoot, "name");
-    if (!cJSON_IsString(jImgName)){
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: imgName not a string\"}");
+    jsonPrint = cJSON_PrintUnformatted(jRoot);
+    if(jsonPrint == NULL){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"CJSON Fail\"}");
         ret = ESP_FAIL;
-        goto cleanup;
-    }
-
-    fSysRet fsRet = fileSysSaveImage(jImgName->valuestring);
-    if(fsRet == FILE_SYS_RET_OK){
-        httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
+    } else {
+        httpd_resp_sendstr(req, jsonPrint);
+        free(jsonPrint);
         ret = ESP_OK;
     }
-    else{
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"unable to save frame buffer to file\"}");
-        ret = ESP_FAIL;
-    }
 
-cleanup:
     cJSON_Delete(jRoot);
-    free(contextBuff);
     return ret;
 }
 
-
-static esp_err_t handleUriLoadImage(httpd_req_t *req){
+static esp_err_t handleUriSetTime(httpd_req_t *req){
     esp_err_t ret;
     char *contextBuff;
     cJSON *jRoot = NULL;
+    const cJSON *jTz;
+    const cJSON *jEpoch;
 
     httpd_resp_set_type(req, "application/json");
 
@@ -579,91 +2282,166 @@ static esp_err_t handleUriLoadImage(httpd_req_t *req){
         goto cleanup;
     }
 
-    const cJSON *jImgName = cJSON_GetObjectItem(jRoot, "name");
-    if (!cJSON_IsString(jImgName)){
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: imgName not a string\"}");
+    // both checked before either is applied, so a bad request changes nothing
+    jTz = cJSON_GetObjectItem(jRoot, "tz");
+    if(jTz && (!cJSON_IsString(jTz) || !timeSyncTzValid(jTz->valuestring))){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"invalid tz\"}");
         ret = ESP_FAIL;
         goto cleanup;
     }
-
-    u8 *destBuff = takeDispFb(0);
-    if(destBuff == NULL){
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"Could not take frame buffer mutex\"}");
-        return ESP_FAIL;
+    jEpoch = cJSON_GetObjectItem(jRoot, "epoch");
+    if(jEpoch && (!cJSON_IsNumber(jEpoch) || !timeSyncEpochValid(jEpoch->valuedouble))){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"invalid epoch\"}");
+        ret = ESP_FAIL;
+        goto cleanup;
     }
-    fSysRet stat = fileSysLoadImage(jImgName->valuestring, destBuff, false);
-    releaseDispFb();
-    if(stat == FILE_SYS_RET_OK){
-        httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
-        ret = ESP_OK;
+
+    // the time zone first, so the clock is set in the right one
+    if(jTz){
+        timeSyncSetTz(jTz->valuestring);
     }
-    else{
-        if(stat == FILE_SYS_NO_FILE_FOUND){
-            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"image does not exist\"}");
-        }
-        else if(stat == FILE_SYS_INVALID_FILE){
-            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"invalid image file\"}");
-        }
-        else{
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"error reading file\"}");
-        }
-        ret = ESP_FAIL;
+    if(jEpoch){
+        timeSyncSetFromClient(jEpoch->valuedouble, true);
     }
 
+    httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
+    ret = ESP_OK;
+
 cleanup:
     cJSON_Delete(jRoot);
     free(contextBuff);
     return ret;
 }
 
-static esp_err_t handleUriDeleteImage(httpd_req_t *req){
+/**
+ * How full the SD card is. On a card without the free space in its FSINFO, it's null until counted in
+ * the background rather than waited on
+ */
+static esp_err_t handleUriGetStorage(httpd_req_t *req){
     esp_err_t ret;
-    char *contextBuff;
-    cJSON *jRoot = NULL;
+    cJSON *jRoot;
+    char *jsonPrint;
+    fSysStorageInfo_t info;
 
     httpd_resp_set_type(req, "application/json");
 
-    if(getJsonFromReq(req, &contextBuff, &jRoot)){
-        ret = ESP_FAIL;
-        goto cleanup;
+    if(fileSysGetStorageInfo(&info)){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"no SD card mounted\"}");
+        return ESP_FAIL;
     }
 
-    const cJSON *jImgName = cJSON_GetObjectItem(jRoot, "name");
-    if (!cJSON_IsString(jImgName)){
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: name not a string\"}");
-        ret = ESP_FAIL;
-        goto cleanup;
+    jRoot = cJSON_CreateObject();
+    cJSON_AddStringToObject(jRoot, "stat", "ok");
+    cJSON_AddNumberToObject(jRoot, "totalBytes", info.totalBytes);
+    if(info.freeKnown){
+        cJSON_AddNumberToObject(jRoot, "freeBytes", info.freeBytes);
+        cJSON_AddNumberToObject(jRoot, "imagesLeft", info.imagesLeft);
+    } else {
+        cJSON_AddNullToObject(jRoot, "freeBytes");
+        cJSON_AddNullToObject(jRoot, "imagesLeft");
     }
+    cJSON_AddNumberToObject(jRoot, "imageCount", info.imageCount);
+    if(info.filesKnown){
+        cJSON_AddNumberToObject(jRoot, "imageFiles", info.imageFiles);
+        cJSON_AddNumberToObject(jRoot, "imageBytes", info.imageBytes);
+    } else {
+        cJSON_AddNullToObject(jRoot, "imageFiles");
+        cJSON_AddNullToObject(jRoot, "imageBytes");
+    }
+    cJSON_AddBoolToObject(jRoot, "scanning", info.scanning);
+    cJSON_AddNumberToObject(jRoot, "scans", info.scans);
 
-    fSysRet stat = fileSysDelImage(jImgName->valuestring);
-    if(stat == FILE_SYS_RET_OK){
-        httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
+    jsonPrint = cJSON_PrintUnformatted(jRoot);
+    if(jsonPrint == NULL){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"CJSON Fail\"}");
+        ret = ESP_FAIL;
+    } else {
+        httpd_resp_sendstr(req, jsonPrint);
+        free(jsonPrint);
         ret = ESP_OK;
     }
-    else{
-        if(stat == FILE_SYS_NO_FILE_FOUND){
-            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"image does not exist\"}");
-        }
-        else if(stat == FILE_SYS_INVALID_FILE){
-            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"invalid image file\"}");
-        }
-        else{
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"error deleting file\"}");
-        }
+
+    cJSON_Delete(jRoot);
+    return ret;
+}
+
+/**
+ * How many upload slots there are and how many are open, see imgSlot.h
+ */
+static esp_err_t handleUriGetImgSlots(httpd_req_t *req){
+    esp_err_t ret;
+    cJSON *jRoot;
+    char *jsonPrint;
+    imgSlotInfo_t info;
+
+    httpd_resp_set_type(req, "application/json");
+    imgSlotGetInfo(&info);
+
+    jRoot = cJSON_CreateObject();
+    cJSON_AddStringToObject(jRoot, "stat", "ok");
+    cJSON_AddNumberToObject(jRoot, "count", info.count);
+    cJSON_AddNumberToObject(jRoot, "open", info.open);
+    cJSON_AddNumberToObject(jRoot, "busy", info.busy);
+    cJSON_AddNumberToObject(jRoot, "ttlS", IMG_SLOT_TTL_S);
+    cJSON_AddNumberToObject(jRoot, "opens", info.opens);
+    cJSON_AddNumberToObject(jRoot, "expired", info.expired);
+    cJSON_AddNumberToObject(jRoot, "exhausted", info.exhausted);
+
+    jsonPrint = cJSON_PrintUnformatted(jRoot);
+    if(jsonPrint == NULL){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"CJSON Fail\"}");
         ret = ESP_FAIL;
+    } else {
+        httpd_resp_sendstr(req, jsonPrint);
+        free(jsonPrint);
+        ret = ESP_OK;
     }
 
-cleanup:
     cJSON_Delete(jRoot);
-    free(contextBuff);
     return ret;
+}
+
+static esp_err_t handleUriGetWifiPower(httpd_req_t *req){
+    esp_err_t ret;
+    cJSON *jRoot;
+    char *jsonPrint;
+    wifiPwrInfo_t info;
+
+    httpd_resp_set_type(req, "application/json");
+    jRoot = cJSON_CreateObject();
+
+    wifiPwrGetInfo(&info);
+    cJSON_AddStringToObject(jRoot, "stat", "ok");
+    cJSON_AddStringToObject(jRoot, "profile", wifiPwrProfileToStr(info.profile));
+    cJSON_AddNumberToObject(jRoot, "idleOffMin", info.idleOffMin);
+    cJSON_AddBoolToObject(jRoot, "boosted", info.boosted);
+    cJSON_AddNumberToObject(jRoot, "busy", info.busy);
+    cJSON_AddNumberToObject(jRoot, "boosts", info.boosts);
+    cJSON_AddNumberToObject(jRoot, "idleOffs", info.idleOffs);
+    cJSON_AddNumberToObject(jRoot, "radioOnUs", info.radioOnUs);
+
+    jsonPrint = cJSON_PrintUnformatted(jRoot);
+    if(jsonPrint == NULL){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"CJSON Fail\"}");
+        ret = ESP_FAIL;
+    } else {
+        httpd_resp_sendstr(req, jsonPrint);
+        free(jsonPrint);
+        ret = ESP_OK;
+    }
 
+    cJSON_Delete(jRoot);
+    return ret;
 }
 
-static esp_err_t handleUriPlaylistAdd(httpd_req_t *req){
+static esp_err_t handleUriPostWifiPower(httpd_req_t *req){
     esp_err_t ret;
     char *contextBuff;
     cJSON *jRoot = NULL;
+    const cJSON *jObj;
+    wifiPwrInfo_t info;
+    wifiPwrProfile_e profile;
+    u32 idleOffMin;
 
     httpd_resp_set_type(req, "application/json");
 
@@ -672,151 +2450,275 @@ static esp_err_t handleUriPlaylistAdd(httpd_req_t *req){
         goto cleanup;
     }
 
-    const cJSON *jImgName = cJSON_GetObjectItem(jRoot, "name");
-    if (!cJSON_IsString(jImgName)){
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: name not a string\"}");
-        ret = ESP_FAIL;
-        goto cleanup;
-    }
-    if(fileSysIsImageValid(jImgName->valuestring)){
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"invalid file, not on disk\"}");
-        ret = ESP_FAIL;
-        goto cleanup;
-    }
+    // either can be left out to keep it as it is
+    wifiPwrGetInfo(&info);
+    profile = info.profile;
+    idleOffMin = info.idleOffMin;
 
-    // first, check if it exists, then if not actually add
-    int freeSpot = -1;    // as we are already going through the list anyways, if an empty spot is added record it
-    for(int i=0;i<MAX_PLAYLIST_IMG;i++){
-        if(imgPlaylist.imgSelectEn[i]){
-            // if we find the same image, we already added it. Don't add it again
-            if(strcmp(imgPlaylist.imgSelect[i], jImgName->valuestring) == 0){
-                httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"image already exists in playlist\"}");
-                ret = ESP_FAIL;
-                goto cleanup;
-            }
-        } else if(freeSpot == -1){
-            freeSpot = i;
-        }
+    jObj = cJSON_GetObjectItem(jRoot, "profile");
+    if(jObj){
+        profile = cJSON_IsString(jObj) ? wifiPwrProfileFromStr(jObj->valuestring) : WIFI_PWR_PROFILE_CNT;
+    }
+    jObj = cJSON_GetObjectItem(jRoot, "idleOffMin");
+    if(jObj){
+        idleOffMin = cJSON_IsNumber(jObj) && jObj->valuedouble >= 0 && jObj->valuedouble <= WIFI_PWR_IDLE_OFF_MAX_MIN ?
+                     jObj->valuedouble : WIFI_PWR_IDLE_OFF_MAX_MIN + 1;
     }
 
-    if(freeSpot == -1){
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"No more room to add image\"}");
+    if(wifiPwrSet(profile, idleOffMin)){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"invalid profile or idleOffMin\"}");
         ret = ESP_FAIL;
         goto cleanup;
     }
-    // then add it
-    strcpy(imgPlaylist.imgSelect[freeSpot], jImgName->valuestring);
-    imgPlaylist.imgSelectEn[freeSpot] = 1;
 
     httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
     ret = ESP_OK;
 
-
 cleanup:
     cJSON_Delete(jRoot);
     free(contextBuff);
     return ret;
 }
 
+static const char* httpMethodToStr(httpd_method_t method){
+    switch(method){
+        case HTTP_GET:      return "GET";
+        case HTTP_POST:     return "POST";
+        case HTTP_PUT:      return "PUT";
+        case HTTP_DELETE:   return "DELETE";
+        default:            return "OTHER";
+    }
+}
 
-static esp_err_t handleUriPlaylistDel(httpd_req_t *req){
-    esp_err_t ret;
-    char *contextBuff;
-    cJSON *jRoot = NULL;
-
-    httpd_resp_set_type(req, "application/json");
+#define PROM_LABELS_LEN     144     // bytes, the labels of a sample, with URIs up to ~100 characters
+#define PROM_VALUE_LEN      24      // bytes, a sample's value, a u64 or a float in seconds
+#define PROM_BUFF_LEN       1024    // bytes, lines are sent in chunks of up to this, not one chunk each
 
-    if(getJsonFromReq(req, &contextBuff, &jRoot)){
-        ret = ESP_FAIL;
-        goto cleanup;
-    }
+/**
+ * Collects Prometheus lines to send them a buffer at a time
+ */
+typedef struct{
+    httpd_req_t *req;
+    u32 len;
+    char buff[PROM_BUFF_LEN];
+}promWriter_t;
 
-    const cJSON *jImgName = cJSON_GetObjectItem(jRoot, "name");
-    if (!cJSON_IsString(jImgName)){
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"JSON invalid: name not a string\"}");
-        ret = ESP_FAIL;
-        goto cleanup;
+static void promFlush(promWriter_t *w){
+    if(w->len > 0){
+        httpd_resp_send_chunk(w->req, w->buff, w->len);
+        w->len = 0;
     }
+}
 
-    // add check if we are currently in the playlist selected mode, don't allow deletion as it remove the last
-    //  available image, causing cascading of issues
-    if(runMode == MODE_IMAGE_PLAYLIST && imgPlaylist.mode == PLAYLIST_MODE_SELECT){
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"current running in mode, stop image cycling to remove\"}");
-        ret = ESP_FAIL;
-        goto cleanup;
+static void promWrite(promWriter_t *w, const char *line){
+    u32 len = strlen(line);
+
+    if(w->len + len > sizeof(w->buff)){
+        promFlush(w);
     }
+    memcpy(&w->buff[w->len], line, len);
+    w->len += len;
+}
 
-    int i;
-    for(i=0;i<MAX_PLAYLIST_IMG;i++){
-        if(imgPlaylist.imgSelectEn[i]){
-            if(strcmp(imgPlaylist.imgSelect[i], jImgName->valuestring) == 0){
-                imgPlaylist.imgSelectEn[i] = 0;
-                break;
+/**
+ * Adds a single Prometheus sample line, "photopainter_<name>{<labels>} <value>"
+ */
+static void promSample(promWriter_t *w, const char *name, const char *labels, const char *value){
+    // the longest name is http_request_duration_seconds_bucket
+    char line[sizeof("photopainter_{} \n") + 40 + PROM_LABELS_LEN + PROM_VALUE_LEN];
+
+    snprintf(line, sizeof(line), "photopainter_%s{%s} %s\n", name, labels, value);
+    promWrite(w, line);
+}
+
+/**
+ * Sends the metrics in the Prometheus text format. The samples of each metric are together right after
+ * its TYPE line, as the format wants, so the URIs are gone through once per metric
+ */
+static esp_err_t sendMetricsProm(httpd_req_t *req){
+    // the value of each is picked out of uriMetrics_t in this order below
+    static const char *counters[] = {"http_requests_total", "http_errors_total", "http_received_bytes_total",
+                                     "http_sent_bytes_total"};
+    promWriter_t w = {.req = req, .len = 0};
+    uriMetrics_t m;
+    char labels[PROM_LABELS_LEN - sizeof(",le=\"00.000000\"")];     // leaves room for a bucket's bound
+    char bucketLabels[PROM_LABELS_LEN];
+    char value[PROM_VALUE_LEN];
+    char line[96];
+    u64 counterVal;
+    u32 cumulative;
+
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+
+    for(u32 c = 0; c < sizeof(counters) / sizeof(counters[0]); c++){
+        snprintf(line, sizeof(line), "# TYPE photopainter_%s counter\n", counters[c]);
+        promWrite(&w, line);
+        for(u32 i = 0; i < metricsGetUriCount(); i++){
+            metricsGetUri(i, &m);
+            snprintf(labels, sizeof(labels), "uri=\"%s\",method=\"%s\"", m.uri, httpMethodToStr(m.method));
+            switch(c){
+                case 0:     counterVal = m.count; break;
+                case 1:     counterVal = m.errors; break;
+                case 2:     counterVal = m.bytesIn; break;
+                default:    counterVal = m.bytesOut; break;
             }
+            snprintf(value, sizeof(value), "%llu", counterVal);
+            promSample(&w, counters[c], labels, value);
         }
     }
-    if(i == MAX_PLAYLIST_IMG){
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"Image not found to delete\"}");
-        ret = ESP_FAIL;
-        goto cleanup;
+
+    promWrite(&w, "# TYPE photopainter_http_request_duration_seconds histogram\n");
+    for(u32 i = 0; i < metricsGetUriCount(); i++){
+        metricsGetUri(i, &m);
+        snprintf(labels, sizeof(labels), "uri=\"%s\",method=\"%s\"", m.uri, httpMethodToStr(m.method));
+
+        cumulative = 0;
+        for(int b = 0; b < METRICS_LATENCY_BUCKETS-1; b++){
+            cumulative += m.latencyBuckets[b];
+            // the upper bound of bucket b is 2^(b+1) uS
+            snprintf(bucketLabels, sizeof(bucketLabels), "%s,le=\"%.6f\"", labels, (float)(1UL << (b+1)) / 1e6);
+            snprintf(value, sizeof(value), "%lu", cumulative);
+            promSample(&w, "http_request_duration_seconds_bucket", bucketLabels, value);
+        }
+        snprintf(bucketLabels, sizeof(bucketLabels), "%s,le=\"+Inf\"", labels);
+        snprintf(value, sizeof(value), "%lu", m.count);
+        promSample(&w, "http_request_duration_seconds_bucket", bucketLabels, value);
+        snprintf(value, sizeof(value), "%.6f", (double)m.latencySumUs / 1e6);
+        promSample(&w, "http_request_duration_seconds_sum", labels, value);
+        snprintf(value, sizeof(value), "%lu", m.count);
+        promSample(&w, "http_request_duration_seconds_count", labels, value);
     }
 
-    httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
-    ret = ESP_OK;
+    promFlush(&w);
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
 
+#ifdef CONFIG_APP_TRACE_ENABLE
+static int traceSendChunk(void *ctx, const char *dat, u32 len){
+    return httpd_resp_send_chunk(ctx, dat, len) != ESP_OK;
+}
+#endif
 
-cleanup:
-    cJSON_Delete(jRoot);
-    free(contextBuff);
-    return ret;
+/**
+ * Downloads the trace buffer as Chrome trace event JSON, "clear=1" empties it after
+ */
+static esp_err_t handleUriGetTrace(httpd_req_t *req){
+#ifndef CONFIG_APP_TRACE_ENABLE
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "{\"stat\": \"tracing is not enabled in this build\"}");
+    return ESP_OK;
+#else
+    char urlQuery[32] = "";
+
+    httpd_req_get_url_query_str(req, urlQuery, sizeof(urlQuery));
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"trace.json\"");
+    if(traceExport(traceSendChunk, req)){
+        return ESP_FAIL;
+    }
+    if(getQueryFlag(urlQuery, "clear", false)){
+        traceClear();
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+#endif
+}
+
+static void addHeapInfo(cJSON *jParent, const char *name, u32 caps){
+    multi_heap_info_t info;
+    size_t total;
+    cJSON *jHeap;
+
+    total = heap_caps_get_total_size(caps);
+    if(total == 0){
+        return;             // no such memory, such as PSRAM not being fitted
+    }
+    heap_caps_get_info(&info, caps);
+    jHeap = cJSON_AddObjectToObject(jParent, name);
+    cJSON_AddNumberToObject(jHeap, "total", total);
+    cJSON_AddNumberToObject(jHeap, "free", info.total_free_bytes);
+    cJSON_AddNumberToObject(jHeap, "minFree", info.minimum_free_bytes);
+    cJSON_AddNumberToObject(jHeap, "largestBlock", info.largest_free_block);
+    // how much of the free memory can't be had in one allocation
+    cJSON_AddNumberToObject(jHeap, "fragPct", info.total_free_bytes ?
+                            100 - (100.0 * info.largest_free_block / info.total_free_bytes) : 0);
 }
 
+#ifdef CONFIG_FREERTOS_USE_TRACE_FACILITY
+static const char* taskStateToStr(eTaskState state){
+    switch(state){
+        case eRunning:      return "running";
+        case eReady:        return "ready";
+        case eBlocked:      return "blocked";
+        case eSuspended:    return "suspended";
+        case eDeleted:      return "deleted";
+        default:            return "invalid";
+    }
+}
+#endif
 
-static esp_err_t handleUriGetMode(httpd_req_t *req){
+/**
+ * Gets each task's CPU use, stack use, core and state, and how much of each kind of heap is free. The
+ * tasks need CONFIG_FREERTOS_USE_TRACE_FACILITY, and their CPU use CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+ */
+static esp_err_t handleUriGetSysTasks(httpd_req_t *req){
     esp_err_t ret;
     cJSON *jRoot;
+    cJSON *jHeap;
     char *jsonPrint;
-    const char *strToFill;
 
     httpd_resp_set_type(req, "application/json");
     jRoot = cJSON_CreateObject();
-
     cJSON_AddStringToObject(jRoot, "stat", "ok");
-    switch(runMode){
-        case MODE_STANDBY:
-            strToFill = "standby";
-            break;
-        case MODE_IMAGE_PLAYLIST:
-            strToFill = "playlist";
-            break;
-        case MODE_IMAGE_PLAYLIST_LP:
-            strToFill = "playlistLP";
-            break;
-        default:
-            strToFill = "error";
-            break;
+    cJSON_AddNumberToObject(jRoot, "uptimeMs", esp_timer_get_time() / 1000);
+    cJSON_AddNumberToObject(jRoot, "cores", portNUM_PROCESSORS);
+
+#ifdef CONFIG_FREERTOS_USE_TRACE_FACILITY
+    cJSON *jArr;
+    cJSON *jTask;
+    TaskStatus_t *tasks;
+    UBaseType_t taskCnt;
+    BaseType_t coreId;
+    configRUN_TIME_COUNTER_TYPE totalRunTime = 0;
+
+    // a few spare, in case tasks are created in between
+    taskCnt = uxTaskGetNumberOfTasks() + 4;
+    tasks = malloc(taskCnt * sizeof(TaskStatus_t));
+    if(tasks == NULL){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"out of memory\"}");
+        cJSON_Delete(jRoot);
+        return ESP_FAIL;
     }
-    cJSON_AddStringToObject(jRoot, "mode", strToFill);
-
-    cJSON * const jPlaylist = cJSON_AddObjectToObject(jRoot, "playlist");
-    cJSON_AddStringToObject(jRoot, "stat", "ok");
-    switch(imgPlaylist.mode){
-        case PLAYLIST_MODE_SELECT:
-            strToFill = "select";
-            break;
-        case PLAYLIST_MODE_ALL:
-            strToFill = "all";
-            break;
-        case PLAYLIST_MODE_RANDOM:
-            strToFill = "random";
-            break;
-        default:
-            strToFill = "Error";
-            break;
+    taskCnt = uxTaskGetSystemState(tasks, taskCnt, &totalRunTime);
+
+    cJSON_AddNumberToObject(jRoot, "runTimeTotal", totalRunTime);
+    jArr = cJSON_AddArrayToObject(jRoot, "tasks");
+    for(UBaseType_t i = 0; i < taskCnt; i++){
+        jTask = cJSON_CreateObject();
+        cJSON_AddStringToObject(jTask, "name", tasks[i].pcTaskName);
+        cJSON_AddStringToObject(jTask, "state", taskStateToStr(tasks[i].eCurrentState));
+        cJSON_AddNumberToObject(jTask, "prio", tasks[i].uxCurrentPriority);
+        coreId = xTaskGetCoreID(tasks[i].xHandle);
+        if(coreId == tskNO_AFFINITY){
+            cJSON_AddNullToObject(jTask, "core");
+        } else {
+            cJSON_AddNumberToObject(jTask, "core", coreId);
+        }
+        // bytes on the ESP, the least stack the task ever had left
+        cJSON_AddNumberToObject(jTask, "stackMinFree", tasks[i].usStackHighWaterMark);
+#ifdef CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        cJSON_AddNumberToObject(jTask, "runTime", tasks[i].ulRunTimeCounter);
+        // of the CPU time of all cores since boot, so a task pinned to a core is at most 100 / cores
+        cJSON_AddNumberToObject(jTask, "cpuPct", totalRunTime ?
+                                100.0 * tasks[i].ulRunTimeCounter / ((double)totalRunTime * portNUM_PROCESSORS) : 0);
+#endif
+        cJSON_AddItemToArray(jArr, jTask);
     }
-    cJSON_AddStringToObject(jPlaylist, "mode", strToFill);
-    cJSON_AddNumberToObject(jPlaylist, "duration", (((float)imgPlaylist.period_ticks) / ((float)configTICK_RATE_HZ) / 60.0));
+    free(tasks);
+#endif
 
+    jHeap = cJSON_AddObjectToObject(jRoot, "heap");
+    addHeapInfo(jHeap, "internal", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    addHeapInfo(jHeap, "dma", MALLOC_CAP_DMA);
+    addHeapInfo(jHeap, "psram", MALLOC_CAP_SPIRAM);
 
     jsonPrint = cJSON_PrintUnformatted(jRoot);
     if(jsonPrint == NULL){
@@ -824,6 +2726,7 @@ static esp_err_t handleUriGetMode(httpd_req_t *req){
         ret = ESP_FAIL;
     } else {
         httpd_resp_sendstr(req, jsonPrint);
+        free(jsonPrint);
         ret = ESP_OK;
     }
 
@@ -831,110 +2734,110 @@ static esp_err_t handleUriGetMode(httpd_req_t *req){
     return ret;
 }
 
-static esp_err_t handleUriSetOperationMode(httpd_req_t *req){
+/**
+ * Gets the per-handler request metrics, as JSON or with "format=prom" in the Prometheus text format
+ */
+static esp_err_t handleUriGetMetrics(httpd_req_t *req){
     esp_err_t ret;
-    char *contextBuff;
-    cJSON *jRoot = NULL;
+    char urlQuery[32];
+    char format[8];
+    cJSON *jRoot;
+    cJSON *jArr;
+    cJSON *jUri;
+    cJSON *jBuckets;
+    char *jsonPrint;
+    uriMetrics_t m;
 
-    const cJSON *jObj;
+    if(httpd_req_get_url_query_str(req, urlQuery, sizeof(urlQuery)) == ESP_OK &&
+       httpd_query_key_value(urlQuery, "format", format, sizeof(format)) == ESP_OK &&
+       strcmp(format, "prom") == 0){
+        return sendMetricsProm(req);
+    }
 
     httpd_resp_set_type(req, "application/json");
+    jRoot = cJSON_CreateObject();
+    cJSON_AddStringToObject(jRoot, "stat", "ok");
+    cJSON_AddNumberToObject(jRoot, "uptimeMs", esp_timer_get_time() / 1000);
+    jArr = cJSON_AddArrayToObject(jRoot, "endpoints");
+
+    for(u32 i = 0; i < metricsGetUriCount(); i++){
+        metricsGetUri(i, &m);
+        jUri = cJSON_CreateObject();
+        cJSON_AddStringToObject(jUri, "uri", m.uri);
+        cJSON_AddStringToObject(jUri, "method", httpMethodToStr(m.method));
+        cJSON_AddNumberToObject(jUri, "count", m.count);
+        cJSON_AddNumberToObject(jUri, "errors", m.errors);
+        cJSON_AddNumberToObject(jUri, "bytesIn", m.bytesIn);
+        cJSON_AddNumberToObject(jUri, "bytesOut", m.bytesOut);
+        cJSON_AddNumberToObject(jUri, "latencySumUs", m.latencySumUs);
+        cJSON_AddNumberToObject(jUri, "latencyMaxUs", m.latencyMaxUs);
+        jBuckets = cJSON_AddArrayToObject(jUri, "latencyBuckets");
+        for(int b = 0; b < METRICS_LATENCY_BUCKETS; b++){
+            cJSON_AddItemToArray(jBuckets, cJSON_CreateNumber(m.latencyBuckets[b]));
+        }
+        cJSON_AddItemToArray(jArr, jUri);
+    }
 
-    if(getJsonFromReq(req, &contextBuff, &jRoot)){
+    jsonPrint = cJSON_PrintUnformatted(jRoot);
+    if(jsonPrint == NULL){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"internal error\"}");
         ret = ESP_FAIL;
-        goto cleanup;
+    } else {
+        httpd_resp_sendstr(req, jsonPrint);
+        free(jsonPrint);
+        ret = ESP_OK;
     }
 
-    // handle if the playlist config are to be changed
-    jObj = cJSON_GetObjectItem(jRoot, "playlist");
-    if (cJSON_IsObject(jObj)){
-        const cJSON *jPlaylist;
-        jPlaylist = cJSON_GetObjectItem(jObj, "mode");
-        if (cJSON_IsString(jPlaylist)){
-            if(strcmp(jPlaylist->valuestring, "select") == 0){
-                imgPlaylist.mode = PLAYLIST_MODE_SELECT;
-            }
-            else if(strcmp(jPlaylist->valuestring, "all") == 0){
-                imgPlaylist.mode = PLAYLIST_MODE_ALL;
-            }
-            else if(strcmp(jPlaylist->valuestring, "random") == 0){
-                imgPlaylist.mode = PLAYLIST_MODE_RANDOM;
-            }
-            else{
-                httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"invalid playlist mode\"}");
-                ret = ESP_FAIL;
-                goto cleanup;
-            }
-        }
+    cJSON_Delete(jRoot);
+    return ret;
+}
 
-        jPlaylist = cJSON_GetObjectItem(jObj, "duration");
-        if (cJSON_IsNumber(jPlaylist)){
-            double timeSet = jPlaylist->valuedouble;
-            if(timeSet < MIN_PLAYLIST_DUR){
-                httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"playlist duration less than minimum of 30 sec\"}");
-                ret = ESP_FAIL;
-                goto cleanup;
-            }
-            timeSet *= 60;      // to seconds from minutes
-            timeSet *= configTICK_RATE_HZ;      // to the tick rate
-            imgPlaylist.period_ticks = (TickType_t)timeSet;
-        }
+static esp_err_t handleUriGetJob(httpd_req_t *req){
+    esp_err_t ret;
+    cJSON *jRoot;
+    char *jsonPrint;
+    job_t job;
+    u32 jobId;
+    httpd_err_code_t errCode;
+    const char *errMsg;
+
+    httpd_resp_set_type(req, "application/json");
+
+    // the job ID is the last part of the URI, anything after it (like a query) is ignored
+    jobId = strtoul(req->uri + strlen("/api/v1/jobs/"), NULL, 10);
+    if(jobGet(jobId, &job)){
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "{\"stat\": \"job not found\"}");
+        return ESP_FAIL;
     }
 
-    // handle the mode setting last
-    jObj = cJSON_GetObjectItem(jRoot, "mode");
-    // if "mode" was given
-    if (cJSON_IsString(jObj)){
-        if(strcmp(jObj->valuestring, "standby") == 0){
-            setModeRet_e stat = setMode(MODE_STANDBY);
-            if(stat){
-                httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"internal error\"}");
-                ret = ESP_FAIL;
-                goto cleanup;
-            }
-        }
-        else if(strcmp(jObj->valuestring, "playlist") == 0){
-            setModeRet_e stat = setMode(MODE_IMAGE_PLAYLIST);
-            if(stat){
-                if(stat == RET_SET_MODE_IMG_PL_NONE_SET){
-                    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"no images selected for playlist mode\"}");
-                }
-                else{
-                    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"internal error\"}");
-                }
-                ret = ESP_FAIL;
-                goto cleanup;
-            }
-        }
-        else if(strcmp(jObj->valuestring, "playlistLP") == 0){
-            setModeRet_e stat = setMode(MODE_IMAGE_PLAYLIST_LP);
-            if(stat){
-                if(stat == RET_SET_MODE_IMG_PL_NONE_SET){
-                    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"no images selected for playlist mode\"}");
-                }
-                else{
-                    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"internal error\"}");
-                }
-                ret = ESP_FAIL;
-                goto cleanup;
-            }
-        }
-        else{
-            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "{\"stat\": \"invalid mode\"}");
-            ret = ESP_FAIL;
-            goto cleanup;
+    jRoot = cJSON_CreateObject();
+    cJSON_AddStringToObject(jRoot, "stat", "ok");
+    cJSON_AddNumberToObject(jRoot, "id", job.id);
+    cJSON_AddStringToObject(jRoot, "type", jobTypeToStr(job.type));
+    cJSON_AddStringToObject(jRoot, "state", jobStatToStr(job.stat));
+    if(job.stat == JOB_STAT_DONE){
+        cJSON_AddNumberToObject(jRoot, "result", job.result);
+        if(getJobError(&job, &errCode, &errMsg)){
+            cJSON_AddStringToObject(jRoot, "msg", errMsg);
+        } else {
+            cJSON_AddStringToObject(jRoot, "msg", "ok");
         }
+        cJSON_AddNumberToObject(jRoot, "waitMs", (job.startUs - job.queuedUs) / 1000);
+        cJSON_AddNumberToObject(jRoot, "runMs", (job.endUs - job.startUs) / 1000);
     }
 
+    jsonPrint = cJSON_PrintUnformatted(jRoot);
+    if(jsonPrint == NULL){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "{\"stat\": \"CJSON Fail\"}");
+        ret = ESP_FAIL;
+    } else {
+        httpd_resp_sendstr(req, jsonPrint);
+        free(jsonPrint);
+        ret = ESP_OK;
+    }
 
-    httpd_resp_sendstr(req, "{\"stat\": \"ok\"}");
-    ret = ESP_OK;
-
-cleanup:
     cJSON_Delete(jRoot);
-    free(contextBuff);
     return ret;
-
 }
 
 #define IS_FILE_EXT(filename, ext) \
@@ -1025,8 +2928,94 @@ static esp_err_t handle404NotFound(httpd_req_t *req, httpd_err_code_t error){
     return ESP_OK;
 }
 
+void wifiGetConnTimes(wifiConnTimes_t *out){
+    memcpy(out, &connTimes, sizeof(wifiConnTimes_t));
+    out->firstRespUs = metricsGetFirstRespUs();
+}
+
+const char* wifiConnKindToStr(wifiConnKind_e kind){
+    switch(kind){
+        case WIFI_CONN_SCAN:        return "scan";
+        case WIFI_CONN_FAST:        return "fast";
+        case WIFI_CONN_FALLBACK:    return "fallback";
+        default:                    return "unknown";
+    }
+}
+
 /********** wifi events **********/
 #ifndef UNIT_TEST
+/**
+ * Notes down when a step of the first connect since boot was reached
+ */
+static void connTimesMark(u32 *stepUs){
+    if(*stepUs == 0){
+        *stepUs = esp_timer_get_time();
+    }
+}
+
+/**
+ * Saves the AP connected to for the next boot, only if it changed to spare the flash
+ */
+static void fastConnSave(const wifi_event_sta_connected_t *evt){
+    wifiFastConn_t conn = {0};
+
+    conn.version = WIFI_FAST_CONN_VERSION;
+    conn.channel = evt->channel;
+    memcpy(conn.bssid, evt->bssid, sizeof(conn.bssid));
+    memcpy(conn.ssid, evt->ssid, evt->ssid_len < MAX_WIFI_INFO_STRLEN ? evt->ssid_len : MAX_WIFI_INFO_STRLEN-1);
+    if(memcmp(&conn, &fastConn, sizeof(wifiFastConn_t)) == 0){
+        return;
+    }
+
+    memcpy(&fastConn, &conn, sizeof(wifiFastConn_t));
+    if(nvs_set_blob(wifiNvsHandle, WIFI_FAST_CONN_KEY, &fastConn, sizeof(wifiFastConn_t)) != ESP_OK ||
+       nvs_commit(wifiNvsHandle) != ESP_OK){
+        ESP_LOGW(TAG, "Unable to save the AP for a fast connect");
+    }
+}
+
+static void fastConnLoad(void){
+    size_t len = sizeof(wifiFastConn_t);
+
+    if(nvs_get_blob(wifiNvsHandle, WIFI_FAST_CONN_KEY, &fastConn, &len) != ESP_OK ||
+       len != sizeof(wifiFastConn_t) || fastConn.version != WIFI_FAST_CONN_VERSION){
+        memset(&fastConn, 0, sizeof(wifiFastConn_t));
+    }
+}
+
+/**
+ * Sets the static IP once associated, or makes sure DHCP runs if there's none
+ */
+static void wifiSetStaIp(void){
+    esp_netif_ip_info_t ipInfo;
+    esp_netif_dns_info_t dnsInfo = {0};
+    esp_err_t err;
+
+    if(wifiNvmConf.staticIp == 0){
+        err = esp_netif_dhcpc_start(netifSta);
+        if(err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED){
+            ESP_LOGW(TAG, "Unable to start DHCP. err %d", err);
+        }
+        return;
+    }
+
+    err = esp_netif_dhcpc_stop(netifSta);
+    if(err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED){
+        ESP_LOGW(TAG, "Unable to stop DHCP. err %d", err);
+    }
+    ipInfo.ip.addr = wifiNvmConf.staticIp;
+    ipInfo.netmask.addr = wifiNvmConf.netmask;
+    ipInfo.gw.addr = wifiNvmConf.gateway;
+    // raises IP_EVENT_STA_GOT_IP, as DHCP would
+    if(esp_netif_set_ip_info(netifSta, &ipInfo) != ESP_OK){
+        ESP_LOGW(TAG, "Unable to set the static IP");
+        return;
+    }
+    dnsInfo.ip.u_addr.ip4.addr = wifiNvmConf.dns != 0 ? wifiNvmConf.dns : wifiNvmConf.gateway;
+    dnsInfo.ip.type = ESP_IPADDR_TYPE_V4;
+    esp_netif_set_dns_info(netifSta, ESP_NETIF_DNS_MAIN, &dnsInfo);
+}
+
 static void wifiIpEventHandler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
@@ -1036,14 +3025,39 @@ static void wifiIpEventHandler(void* arg, esp_event_base_t event_base,
         switch(event_id){
             /**** STA Stuff */
             case WIFI_EVENT_STA_START:
+                pwrStatsSetWifi(PWR_WIFI_ACTIVE);
+                connTimesMark(&connTimes.startUs);
                 esp_wifi_connect();
                 break;
             case WIFI_EVENT_STA_CONNECTED:
                 ESP_LOGI(TAG, "connected to the AP success");
+                connTimesMark(&connTimes.connectedUs);
+                wifi_ps_type_t ps = WIFI_PS_NONE;
+                esp_wifi_get_ps(&ps);
+                pwrStatsSetWifi(ps == WIFI_PS_NONE ? PWR_WIFI_ACTIVE : PWR_WIFI_MODEM_SLEEP);
+                fastConnSave((wifi_event_sta_connected_t*) event_data);
+                wifiSetStaIp();
                 break;
             case WIFI_EVENT_STA_DISCONNECTED:
+                // the idle off stopping the radio, keep the cached AP for the wake
+                if(wifiPwrIsOff()){
+                    ESP_LOGI(TAG, "disconnected from the AP, the radio is off");
+                    break;
+                }
                 ESP_LOGI(TAG,"connect to the AP fail");
-                if(s_retry_num < CONFIG_ESP_MAXIMUM_RETRY){
+                pwrStatsSetWifi(PWR_WIFI_ACTIVE);
+                if(wifiConfig.sta.bssid_set){
+                    // the cached AP is gone or moved channel, find the SSID again with a full scan. Not a retry
+                    ESP_LOGW(TAG, "fast connect failed, scanning");
+                    if(connTimes.gotIpUs == 0){
+                        connTimes.kind = WIFI_CONN_FALLBACK;
+                    }
+                    wifiConfig.sta.bssid_set = false;
+                    wifiConfig.sta.channel = 0;
+                    esp_wifi_set_config(WIFI_IF_STA, &wifiConfig);
+                    esp_wifi_connect();
+                }
+                else if(s_retry_num < CONFIG_ESP_MAXIMUM_RETRY){
                     esp_wifi_connect();
                     s_retry_num++;
                     ESP_LOGI(TAG, "retry to connect to the AP");
@@ -1054,9 +3068,17 @@ static void wifiIpEventHandler(void* arg, esp_event_base_t event_base,
                     wifiStartAP();
                 }
                 break;
+            case WIFI_EVENT_STA_STOP:
+            case WIFI_EVENT_AP_STOP:
+                pwrStatsSetWifi(PWR_WIFI_OFF);
+                break;
             /**** AP Stuff */
+            case WIFI_EVENT_AP_START:
+                pwrStatsSetWifi(PWR_WIFI_ACTIVE);
+                break;
             case WIFI_EVENT_AP_STACONNECTED:
                 wifi_event_ap_staconnected_t* eventConn = (wifi_event_ap_staconnected_t*) event_data;
+                wifiPwrActivity();
                 ESP_LOGI(TAG, "station "MACSTR" join, AID=%d", MAC2STR(eventConn->mac), eventConn->aid);
                 break;
             case WIFI_EVENT_AP_STADISCONNECTED:
@@ -1072,6 +3094,7 @@ static void wifiIpEventHandler(void* arg, esp_event_base_t event_base,
             case IP_EVENT_STA_GOT_IP:
                 ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
                 ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+                connTimesMark(&connTimes.gotIpUs);
                 s_retry_num = 0;
                 xEventGroupSetBits(wifiEvents, WIFI_CONNECTED_BIT);
                 break;
@@ -1088,6 +3111,7 @@ void wifiStartAP(void){
     strcpy((char *)wifiConfig.ap.password, CONFIG_ESP_AP_WIFI_PASSWORD);
     wifiConfig.ap.channel = CONFIG_ESP_AP_WIFI_CH;
     wifiConfig.ap.max_connection = CONFIG_ESP_AP_WIFI_MAX_CONN;
+    wifiConfig.ap.beacon_interval = wifiPwrApBeaconTu();
     if(strlen((char *)wifiConfig.ap.password) == 0){
         wifiConfig.ap.authmode = WIFI_AUTH_OPEN;
     } else {
@@ -1110,7 +3134,22 @@ void wifiStartSTA(void *arg){
     wifiConfig.sta.sae_pwe_h2e = WPA3_SAE_PWE_HUNT_AND_PECK;
     wifiConfig.sta.sae_h2e_identifier[0] = '\x00';
 
-    wifiConfig.sta.listen_interval = 10;
+    wifiConfig.sta.listen_interval = wifiPwrListenInterval();
+
+    // straight to the AP of the last connect on its channel, rather than scanning every channel for the SSID
+    if(fastConn.version == WIFI_FAST_CONN_VERSION && strcmp(fastConn.ssid, wifiNvmConf.staSsid) == 0){
+        wifiConfig.sta.bssid_set = true;
+        memcpy(wifiConfig.sta.bssid, fastConn.bssid, sizeof(fastConn.bssid));
+        wifiConfig.sta.channel = fastConn.channel;
+    } else {
+        wifiConfig.sta.bssid_set = false;
+        wifiConfig.sta.channel = 0;
+    }
+    wifiConfig.sta.scan_method = WIFI_FAST_SCAN;
+    if(connTimes.startUs == 0){
+        connTimes.kind = wifiConfig.sta.bssid_set ? WIFI_CONN_FAST : WIFI_CONN_SCAN;
+        connTimes.staticIp = wifiNvmConf.staticIp != 0;
+    }
 
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifiConfig) );
@@ -1122,6 +3161,10 @@ void saveWifiNvmConf(void){
     nvs_set_str(wifiNvsHandle, "ssid", (char *)wifiNvmConf.staSsid);
     nvs_set_str(wifiNvsHandle, "pass", (char *)wifiNvmConf.staPass);
     nvs_set_u32(wifiNvsHandle, "auth", wifiNvmConf.authMode);
+    nvs_set_u32(wifiNvsHandle, "ip", wifiNvmConf.staticIp);
+    nvs_set_u32(wifiNvsHandle, "mask", wifiNvmConf.netmask);
+    nvs_set_u32(wifiNvsHandle, "gw", wifiNvmConf.gateway);
+    nvs_set_u32(wifiNvsHandle, "dns", wifiNvmConf.dns);
     nvs_commit(wifiNvsHandle);
 }
 #endif
@@ -1145,6 +3188,12 @@ int wifiLoadNvmConf(void){
     }
     wifiNvmConf.authMode = authMode;
 
+    // saved by later versions, DHCP without them
+    nvs_get_u32(wifiNvsHandle, "ip", &wifiNvmConf.staticIp);
+    nvs_get_u32(wifiNvsHandle, "mask", &wifiNvmConf.netmask);
+    nvs_get_u32(wifiNvsHandle, "gw", &wifiNvmConf.gateway);
+    nvs_get_u32(wifiNvsHandle, "dns", &wifiNvmConf.dns);
+
     return 0;
 }
 #endif
@@ -1152,11 +3201,12 @@ int wifiLoadNvmConf(void){
 /********** init functions **********/
 #ifndef UNIT_TEST
 void wifiInit(void){
-    esp_netif_t *netifSta;
+    TRACE_BEGIN("wifiInit");
     wifiEvents = xEventGroupCreate();
 
     // open nvs handler
     ESP_ERROR_CHECK(nvs_open(NVS_ID, NVS_READWRITE, &wifiNvsHandle));
+    fastConnLoad();
 
     // init tcp ip stack
     ESP_ERROR_CHECK(esp_netif_init());
@@ -1172,7 +3222,7 @@ void wifiInit(void){
 
     wifi_init_config_t wifiInitCfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&wifiInitCfg));
-    esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+    wifiPwrInit();
 
     esp_event_handler_instance_t instance_any_id;
     esp_event_handler_instance_t instance_got_ip;
@@ -1196,15 +3246,18 @@ void wifiInit(void){
     else{
         wifiStartSTA(NULL);
     }
+    TRACE_END("wifiInit");
 }
 #endif
 
 
 void startHttpServer(void){
+    TRACE_BEGIN("startHttpServer");
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.max_uri_handlers = HTTPD_MAX_URI_HANDLERS;
     config.stack_size = 4096*7;
     config.uri_match_fn = httpd_uri_match_wildcard;
+    config.open_fn = metricsSessOpen;          // counts the bytes sent per handler
 
     httpd_start(&server, &config);
 
@@ -1218,93 +3271,178 @@ void startHttpServer(void){
     /**** GET commands */
     uriMatch.handler = handleUriGetVersion;
     uriMatch.uri = "/api/v1/version";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriGetCoffee;
     uriMatch.uri = "/api/v1/coffee";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriGetStatus;
     uriMatch.uri = "/api/v1/status";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriGetWifiInfo;
     uriMatch.uri = "/api/v1/wifi/info";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriGetPmicInfo;
     uriMatch.uri = "/api/v1/pmic";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriGetPmicHistory;
+    uriMatch.uri = "/api/v1/pmic/history";
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriGetImgAvailable;
     uriMatch.uri = "/api/v1/img/available";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriImgGet;
     uriMatch.uri = "/api/v1/img/get";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriGetImgHash;
+    uriMatch.uri = "/api/v1/img/hash";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriGetImgManifest;
+    uriMatch.uri = "/api/v1/img/manifest";
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriGetMode;
     uriMatch.uri = "/api/v1/mode";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriGetPlaylistImages;
     uriMatch.uri = "/api/v1/img/playlist/get";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriGetPlaylists;
+    uriMatch.uri = "/api/v1/img/playlist/list";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriGetJob;
+    uriMatch.uri = "/api/v1/jobs/*";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriGetMetrics;
+    uriMatch.uri = "/api/v1/metrics";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriGetTrace;
+    uriMatch.uri = "/api/v1/trace";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriGetSysTasks;
+    uriMatch.uri = "/api/v1/sys/tasks";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriGetUpdateDisplay;
+    uriMatch.uri = "/api/v1/disp/update";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriGetTime;
+    uriMatch.uri = "/api/v1/time";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriGetWifiPower;
+    uriMatch.uri = "/api/v1/wifi/power";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriGetStorage;
+    uriMatch.uri = "/api/v1/storage";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriGetImgSlots;
+    uriMatch.uri = "/api/v1/img/slots";
+    metricsRegisterUri(server, &uriMatch);
 
     /**** POST commands */
     uriMatch.method = HTTP_POST;
     uriMatch.handler = handleUriPostSetDisplayFb;
     uriMatch.uri = "/api/v1/disp/setFb";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriPostUpdateDisplay;
     uriMatch.uri = "/api/v1/disp/update";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriPostImageCheckerPattern;
     uriMatch.uri = "/api/v1/disp/setCheckPattern";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriPostWifiSta;
     uriMatch.uri = "/api/v1/wifi/info";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriPostWifiStaConn;
     uriMatch.uri = "/api/v1/wifi/connect";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriSaveImage;
     uriMatch.uri = "/api/v1/img/save";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriPostUploadSdImage;
     uriMatch.uri = "/api/v1/img/upload";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriPostImgPush;
+    uriMatch.uri = "/api/v1/img/push";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriPostImgLink;
+    uriMatch.uri = "/api/v1/img/link";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriPostImgBatch;
+    uriMatch.uri = "/api/v1/img/batch";
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriLoadImage;
     uriMatch.uri = "/api/v1/img/load";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriDeleteImage;
     uriMatch.uri = "/api/v1/img/delete";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriPlaylistAdd;
     uriMatch.uri = "/api/v1/img/playlist/add";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriPlaylistDel;
     uriMatch.uri = "/api/v1/img/playlist/del";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriPlaylistCreate;
+    uriMatch.uri = "/api/v1/img/playlist/create";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriPlaylistRemove;
+    uriMatch.uri = "/api/v1/img/playlist/remove";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriPlaylistSelect;
+    uriMatch.uri = "/api/v1/img/playlist/select";
+    metricsRegisterUri(server, &uriMatch);
 
     uriMatch.handler = handleUriSetOperationMode;
     uriMatch.uri = "/api/v1/mode";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriSetTime;
+    uriMatch.uri = "/api/v1/time";
+    metricsRegisterUri(server, &uriMatch);
+
+    uriMatch.handler = handleUriPostWifiPower;
+    uriMatch.uri = "/api/v1/wifi/power";
+    metricsRegisterUri(server, &uriMatch);
 
     // last but not least, handle matching any generic web requests
     uriMatch.method = HTTP_GET;
     uriMatch.handler = handleUriWebGet;
     uriMatch.uri = "/*";
-    httpd_register_uri_handler(server, &uriMatch);
+    metricsRegisterUri(server, &uriMatch);
+    TRACE_END("startHttpServer");
 }
\ No newline at end of file
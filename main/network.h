@@ -8,16 +8,57 @@
 #include "esp_wifi.h"
 #endif
 
+#include <stdbool.h>
+#include "common.h"
+
 typedef enum{
     WIFI_CONNECTED_BIT      = BIT0,
     WIFI_FAIL_BIT           = BIT1,
 }wifiEventsBits_e;
 
-#define HTTPD_MAX_URI_HANDLERS  32
+#define HTTPD_MAX_URI_HANDLERS  48
+#define IMG_BATCH_MAX_OPS       64      // operations in one /img/batch, the response has a result for each
+
+#define WIFI_FAST_CONN_KEY      "fastConn"      // NVS key of the last AP connected to
+#define WIFI_FAST_CONN_VERSION  1
+
+/**
+ * The AP last connected to, saved so the next boot connects straight to it on its channel rather than
+ * scanning them all. Only used for the same SSID, and dropped for a full scan if it fails
+ */
+typedef struct{
+    u8 version;                         // WIFI_FAST_CONN_VERSION
+    u8 channel;
+    u8 bssid[6];
+    char ssid[MAX_WIFI_INFO_STRLEN];
+}wifiFastConn_t;
+
+typedef enum{
+    WIFI_CONN_SCAN,                     // no AP cached, a full scan
+    WIFI_CONN_FAST,                     // straight to the cached AP
+    WIFI_CONN_FALLBACK,                 // the cached AP failed, then a full scan
+    WIFI_CONN_CNT,
+}wifiConnKind_e;
+
+/**
+ * How long the first STA connect since boot took, in uS since boot. 0 for a step not reached yet
+ */
+typedef struct{
+    wifiConnKind_e kind;
+    bool staticIp;                      // no DHCP
+    u32 startUs;                        // the STA started
+    u32 connectedUs;                    // associated with the AP
+    u32 gotIpUs;
+    u32 firstRespUs;                    // the first API response was sent, see metricsGetFirstRespUs()
+}wifiConnTimes_t;
 
 void wifiInit(void);
 void startHttpServer(void);
 
+void wifiGetConnTimes(wifiConnTimes_t *out);
+
+const char* wifiConnKindToStr(wifiConnKind_e kind);
+
 #ifndef UNIT_TEST
 extern EventGroupHandle_t wifiEvents;
 #endif
@@ -0,0 +1,156 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "esp_log.h"
+#include "nvs_flash.h"
+
+#include "common.h"
+#include "main.h"
+#include "persist.h"
+
+static const char *TAG = "persist";
+
+static nvs_handle_t persistNvsHandle;
+static bool persistNvsOpen = false;
+
+static SemaphoreHandle_t persistMutex;      // protects everything below
+static TimerHandle_t persistTimer;          // one shot, the debounce
+
+static playlistNvm_t pendingBlob;           // the config to commit when the debounce expires
+static playlistNvm_t savedBlob;             // the config in NVS, to skip writing the same thing again
+static persistStats_t stats;
+
+/**
+ * Fills a blob with the current config, the write count is left to the commit
+ */
+static void playlistToBlob(playlistNvm_t *blob){
+    runState_t st;
+
+    runStateGet(&st);
+    memset(blob, 0, sizeof(playlistNvm_t));
+    blob->version = PERSIST_PLAYLIST_VERSION;
+    blob->size = sizeof(playlistNvm_t);
+    blob->runMode = st.runMode;
+    blob->playlistMode = st.playlist.mode;
+    blob->periodS = st.playlist.period_ticks / configTICK_RATE_HZ;
+    blob->playlistId = st.playlist.playlistId;
+    memcpy(&blob->calendar, &st.playlist.calendar, sizeof(schedCalendar_t));
+}
+
+/**
+ * Writes the pending config to NVS, must hold persistMutex
+ */
+static void commitPending(void){
+    esp_err_t err;
+
+    if(!stats.pending){
+        return;
+    }
+    stats.pending = false;
+
+    // only the write count would differ, no need to wear the flash for it
+    pendingBlob.writeCnt = savedBlob.writeCnt;
+    if(memcmp(&pendingBlob, &savedBlob, sizeof(playlistNvm_t)) == 0){
+        stats.skipped++;
+        return;
+    }
+
+    pendingBlob.writeCnt = savedBlob.writeCnt + 1;
+    err = nvs_set_blob(persistNvsHandle, PERSIST_PLAYLIST_KEY, &pendingBlob, sizeof(playlistNvm_t));
+    if(err == ESP_OK){
+        err = nvs_commit(persistNvsHandle);
+    }
+    if(err != ESP_OK){
+        ESP_LOGW(TAG, "Unable to save the playlist config, err %d", err);
+        stats.errors++;
+        return;
+    }
+
+    memcpy(&savedBlob, &pendingBlob, sizeof(playlistNvm_t));
+    stats.writes++;
+    ESP_LOGI(TAG, "Playlist config saved, write %lu", savedBlob.writeCnt);
+}
+
+static void persistTimerCallback(TimerHandle_t xTimer){
+    xSemaphoreTake(persistMutex, portMAX_DELAY);
+    commitPending();
+    xSemaphoreGive(persistMutex);
+}
+
+void persistInit(void){
+    size_t len = sizeof(playlistNvm_t);
+    esp_err_t err;
+
+    persistMutex = xSemaphoreCreateMutex();
+    persistTimer = xTimerCreate("persist", pdMS_TO_TICKS(PERSIST_DEBOUNCE_MS), pdFALSE, NULL, persistTimerCallback);
+    configASSERT( persistMutex && persistTimer );
+
+    err = nvs_open(PERSIST_NVS_ID, NVS_READWRITE, &persistNvsHandle);
+    if(err != ESP_OK){
+        ESP_LOGW(TAG, "Unable to open NVS, the playlist config won't be saved. err %d", err);
+        return;
+    }
+    persistNvsOpen = true;
+
+    // what's saved is kept around, to know the write count and to skip writing it again
+    if(nvs_get_blob(persistNvsHandle, PERSIST_PLAYLIST_KEY, &savedBlob, &len) != ESP_OK ||
+       len != sizeof(playlistNvm_t) || savedBlob.version != PERSIST_PLAYLIST_VERSION ||
+       savedBlob.size != sizeof(playlistNvm_t)){
+        memset(&savedBlob, 0, sizeof(playlistNvm_t));
+    }
+}
+
+int persistPlaylistLoad(imgPlaylist_t *playlist, mode_e *savedMode){
+    if(savedBlob.version != PERSIST_PLAYLIST_VERSION){
+        return -1;
+    }
+
+    if(savedBlob.playlistMode <= PLAYLIST_MODE_RANDOM){
+        playlist->mode = savedBlob.playlistMode;
+    }
+    if(savedBlob.periodS){
+        playlist->period_ticks = savedBlob.periodS * configTICK_RATE_HZ;
+    }
+    playlist->playlistId = savedBlob.playlistId;
+    if(savedBlob.calendar.count <= SCHED_MAX_WINDOWS){
+        memcpy(&playlist->calendar, &savedBlob.calendar, sizeof(schedCalendar_t));
+    }
+    if(savedMode){
+        *savedMode = savedBlob.runMode;
+    }
+    return 0;
+}
+
+void persistPlaylistSave(void){
+    if(!persistNvsOpen){
+        return;
+    }
+
+    xSemaphoreTake(persistMutex, portMAX_DELAY);
+    playlistToBlob(&pendingBlob);
+    stats.pending = true;
+    stats.saves++;
+    xSemaphoreGive(persistMutex);
+
+    // restarts the debounce if it was already running
+    xTimerReset(persistTimer, pdMS_TO_TICKS(100));
+}
+
+void persistFlush(void){
+    if(!persistNvsOpen){
+        return;
+    }
+
+    xTimerStop(persistTimer, pdMS_TO_TICKS(100));
+    xSemaphoreTake(persistMutex, portMAX_DELAY);
+    commitPending();
+    xSemaphoreGive(persistMutex);
+}
+
+void persistGetStats(persistStats_t *out){
+    xSemaphoreTake(persistMutex, portMAX_DELAY);
+    memcpy(out, &stats, sizeof(persistStats_t));
+    out->lifetimeWrites = savedBlob.writeCnt;
+    xSemaphoreGive(persistMutex);
+}
@@ -0,0 +1,73 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include "common.h"
+#include "main.h"
+
+/**
+ * Saves the playlist configuration (the modes, period, refresh windows and which playlist) to NVS so it
+ * survives a power loss. The run state otherwise only lives in RTC memory, which is kept through deep
+ * sleep but not a power cycle
+ *
+ * Saves are debounced: every change restarts a timer, and the config is only committed once nothing
+ * changed for PERSIST_DEBOUNCE_MS. A burst of API calls is then a single flash write. A commit that would
+ * write the same config as the last one is skipped
+ */
+
+#define PERSIST_NVS_ID              "persist"   // the NVS namespace
+#define PERSIST_PLAYLIST_KEY        "playlist"
+#define PERSIST_PLAYLIST_VERSION    3           // bump on any change to playlistNvm_t, older blobs are discarded
+#define PERSIST_DEBOUNCE_MS         3000        // mS, how long the config must stay unchanged before being committed
+
+/**
+ * The playlist config as saved in NVS
+ */
+typedef struct{
+    u16 version;                    // PERSIST_PLAYLIST_VERSION
+    u16 size;                       // sizeof(playlistNvm_t), also discards blobs from a different layout
+    u32 writeCnt;                   // how many times this blob was committed, this one included
+    u8 runMode;                     // mode_e
+    u8 playlistMode;                // imgPlaylistMode_e
+    u16 reserved;
+    u32 periodS;                    // S, the playlist period
+    u32 playlistId;                 // the playlist itself is on the SD card, see playlist.h
+    schedCalendar_t calendar;       // the refresh windows
+}playlistNvm_t;
+
+typedef struct{
+    u32 saves;                      // changes requested since boot
+    u32 writes;                     // NVS commits since boot
+    u32 skipped;                    // commits skipped since boot, the config was the same as the saved one
+    u32 errors;                     // NVS errors since boot
+    u32 lifetimeWrites;             // NVS commits of the playlist config since it was first saved
+    bool pending;                   // a change is waiting on the debounce
+}persistStats_t;
+
+/**
+ * Opens the NVS namespace and creates the debounce timer. NVS flash must be initialized
+ */
+void persistInit(void);
+
+/**
+ * Restores the saved playlist config
+ *
+ * @param playlist the saved config is written over it
+ * @param savedMode set to the run mode at the time of the save, can be NULL
+ *
+ * Returns 0 if restored, non-zero if there is no valid saved config and playlist was left as is
+ */
+int persistPlaylistLoad(imgPlaylist_t *playlist, mode_e *savedMode);
+
+/**
+ * Saves the current playlist config and run mode, after the debounce
+ */
+void persistPlaylistSave(void);
+
+/**
+ * Commits a pending save right away, call before losing power or going to deep sleep
+ */
+void persistFlush(void);
+
+void persistGetStats(persistStats_t *out);
+
+#endif
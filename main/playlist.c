@@ -0,0 +1,534 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "ff.h"
+#include "esp_log.h"
+#include "esp_random.h"
+
+#include "common.h"
+#include "playlist.h"
+#include "fileSys.h"
+
+static const char *TAG = "playlist";
+
+static SemaphoreHandle_t playlistMutex;     // protects all the playlist files
+
+#define ID_OFFSET(_pos)     (sizeof(playlistHeader_t) + (_pos) * sizeof(u32))
+#define SHUFFLE_PATH        PLAYLIST_DIR "/SHUFFLE.BIN"
+#define SHUFFLE_OFFSET(_pos)    (sizeof(playlistShuffleHeader_t) + (_pos) * sizeof(u32))
+#define SHUFFLE_NO_ID       0xFFFFFFFF
+
+static void getPlaylistPath(u32 id, char *outName, u32 maxLen){
+    snprintf(outName, maxLen, PLAYLIST_DIR "/%lu.PL", id);
+}
+
+static playlistRet_e writeHeader(FIL *file, const playlistHeader_t *hdr){
+    UINT nWritten;
+
+    if(f_lseek(file, 0) != FR_OK || f_write(file, hdr, sizeof(playlistHeader_t), &nWritten) != FR_OK ||
+       nWritten != sizeof(playlistHeader_t)){
+        return PLAYLIST_RET_IO_ERR;
+    }
+    return PLAYLIST_RET_OK;
+}
+
+static playlistRet_e writeShuffleHeader(FIL *file, const playlistShuffleHeader_t *hdr){
+    UINT nWritten;
+
+    if(f_lseek(file, 0) != FR_OK || f_write(file, hdr, sizeof(playlistShuffleHeader_t), &nWritten) != FR_OK ||
+       nWritten != sizeof(playlistShuffleHeader_t)){
+        return PLAYLIST_RET_IO_ERR;
+    }
+    return PLAYLIST_RET_OK;
+}
+
+/**
+ * Opens a playlist file and reads its header. A playlist made with another image index is emptied, or
+ * reads as empty if not opened for writing. Must hold playlistMutex
+ */
+static playlistRet_e openPlaylist(u32 id, FIL *file, playlistHeader_t *hdr, bool write){
+    char path[32];
+    fSysIndexInfo_t indexInfo;
+    FRESULT fsStat;
+    UINT nRead;
+
+    if(id >= PLAYLIST_MAX_COUNT){
+        return PLAYLIST_RET_NOT_FOUND;
+    }
+    getPlaylistPath(id, path, sizeof(path));
+    fsStat = f_open(file, path, write ? FA_READ | FA_WRITE : FA_READ);
+    if(fsStat == FR_NO_FILE || fsStat == FR_NO_PATH){
+        return PLAYLIST_RET_NOT_FOUND;
+    }
+    if(fsStat != FR_OK){
+        return PLAYLIST_RET_IO_ERR;
+    }
+    if(f_read(file, hdr, sizeof(playlistHeader_t), &nRead) != FR_OK || nRead != sizeof(playlistHeader_t) ||
+       hdr->magic != PLAYLIST_MAGIC || hdr->version != PLAYLIST_VERSION){
+        ESP_LOGW(TAG, "Playlist %lu is invalid", id);
+        f_close(file);
+        return PLAYLIST_RET_IO_ERR;
+    }
+    hdr->name[PLAYLIST_NAME_LEN-1] = '\0';
+
+    if(fileSysIndexGetInfo(&indexInfo) == FILE_SYS_RET_OK && hdr->indexEpoch != indexInfo.epoch){
+        ESP_LOGW(TAG, "Playlist %lu is from an older image index, emptying it", id);
+        hdr->count = 0;
+        hdr->indexEpoch = indexInfo.epoch;
+        if(write && (writeHeader(file, hdr) || f_truncate(file) != FR_OK)){
+            f_close(file);
+            return PLAYLIST_RET_IO_ERR;
+        }
+    }
+    return PLAYLIST_RET_OK;
+}
+
+/**
+ * Must hold playlistMutex
+ */
+static playlistRet_e createLocked(u32 id, const char *name){
+    playlistHeader_t hdr = {0};
+    fSysIndexInfo_t indexInfo;
+    char path[32];
+    FIL file;
+    playlistRet_e ret;
+
+    if(fileSysIndexGetInfo(&indexInfo)){
+        return PLAYLIST_RET_IO_ERR;
+    }
+    hdr.magic = PLAYLIST_MAGIC;
+    hdr.version = PLAYLIST_VERSION;
+    hdr.indexEpoch = indexInfo.epoch;
+    strncpy(hdr.name, name, PLAYLIST_NAME_LEN-1);
+
+    getPlaylistPath(id, path, sizeof(path));
+    if(f_open(&file, path, FA_CREATE_NEW | FA_WRITE) != FR_OK){
+        return PLAYLIST_RET_IO_ERR;
+    }
+    ret = writeHeader(&file, &hdr);
+    f_close(&file);
+    if(ret){
+        f_unlink(path);
+    }
+    return ret;
+}
+
+/**
+ * Finds the position of an image in a playlist. Must hold playlistMutex
+ */
+static playlistRet_e findImgLocked(FIL *file, const playlistHeader_t *hdr, u32 imgId, u32 *pos){
+    u32 ids[PLAYLIST_SHIFT_CHUNK];
+    UINT nRead;
+    u32 n;
+
+    if(f_lseek(file, ID_OFFSET(0)) != FR_OK){
+        return PLAYLIST_RET_IO_ERR;
+    }
+    for(u32 base = 0; base < hdr->count; base += n){
+        n = hdr->count - base < PLAYLIST_SHIFT_CHUNK ? hdr->count - base : PLAYLIST_SHIFT_CHUNK;
+        if(f_read(file, ids, n * sizeof(u32), &nRead) != FR_OK || nRead != n * sizeof(u32)){
+            return PLAYLIST_RET_IO_ERR;
+        }
+        for(u32 i = 0; i < n; i++){
+            if(ids[i] == imgId){
+                *pos = base + i;
+                return PLAYLIST_RET_OK;
+            }
+        }
+    }
+    return PLAYLIST_RET_IMG_NOT_FOUND;
+}
+
+/**
+ * Removes the ID at a position, shifting the ones after it down. Must hold playlistMutex
+ */
+static playlistRet_e removePosLocked(FIL *file, playlistHeader_t *hdr, u32 pos){
+    u32 ids[PLAYLIST_SHIFT_CHUNK];
+    UINT nRead;
+    UINT nWritten;
+    u32 n;
+
+    for(u32 src = pos + 1; src < hdr->count; src += n){
+        n = hdr->count - src < PLAYLIST_SHIFT_CHUNK ? hdr->count - src : PLAYLIST_SHIFT_CHUNK;
+        if(f_lseek(file, ID_OFFSET(src)) != FR_OK ||
+           f_read(file, ids, n * sizeof(u32), &nRead) != FR_OK || nRead != n * sizeof(u32) ||
+           f_lseek(file, ID_OFFSET(src - 1)) != FR_OK ||
+           f_write(file, ids, n * sizeof(u32), &nWritten) != FR_OK || nWritten != n * sizeof(u32)){
+            return PLAYLIST_RET_IO_ERR;
+        }
+    }
+
+    hdr->count--;
+    if(f_lseek(file, ID_OFFSET(hdr->count)) != FR_OK || f_truncate(file) != FR_OK){
+        return PLAYLIST_RET_IO_ERR;
+    }
+    return writeHeader(file, hdr);
+}
+
+/**
+ * xorshift32, the shuffle has to be repeatable from its seed so it can't use esp_random() directly
+ */
+static u32 shuffleRand(u32 *state){
+    u32 x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/**
+ * Shuffles all the images into a new order and writes it to the shuffle file. Must hold playlistMutex
+ *
+ * @param prevId the image shown last, kept from being first in the new order. SHUFFLE_NO_ID if none
+ */
+static playlistRet_e shuffleCreateLocked(FIL *file, playlistShuffleHeader_t *hdr, u32 prevId){
+    fSysIndexInfo_t indexInfo;
+    UINT nWritten;
+    u32 *ids;
+    u32 state;
+    u32 tmp;
+    u32 j;
+    playlistRet_e ret = PLAYLIST_RET_OK;
+
+    if(fileSysIndexGetInfo(&indexInfo)){
+        return PLAYLIST_RET_IO_ERR;
+    }
+    // slots is never less than the image count, even if one is added in between
+    ids = malloc((indexInfo.slots ? indexInfo.slots : 1) * sizeof(u32));
+    if(ids == NULL){
+        return PLAYLIST_RET_IO_ERR;
+    }
+    memset(hdr, 0, sizeof(playlistShuffleHeader_t));
+    if(fileSysIndexGetIds(ids, indexInfo.slots, &hdr->count, &indexInfo)){
+        free(ids);
+        return PLAYLIST_RET_IO_ERR;
+    }
+
+    do{
+        hdr->seed = esp_random();
+    }while(hdr->seed == 0);
+    hdr->magic = PLAYLIST_SHUFFLE_MAGIC;
+    hdr->indexEpoch = indexInfo.epoch;
+    hdr->indexGeneration = indexInfo.generation;
+
+    // Fisher-Yates
+    state = hdr->seed;
+    for(u32 i = hdr->count; i > 1; i--){
+        j = ((u64)shuffleRand(&state) * i) >> 32;
+        tmp = ids[i-1];
+        ids[i-1] = ids[j];
+        ids[j] = tmp;
+    }
+    // no image twice in a row across two orders
+    if(hdr->count > 1 && ids[0] == prevId){
+        j = 1 + (((u64)shuffleRand(&state) * (hdr->count - 1)) >> 32);
+        ids[0] = ids[j];
+        ids[j] = prevId;
+    }
+
+    if(writeShuffleHeader(file, hdr) ||
+       f_write(file, ids, hdr->count * sizeof(u32), &nWritten) != FR_OK || nWritten != hdr->count * sizeof(u32) ||
+       f_truncate(file) != FR_OK){
+        hdr->magic = 0;
+        ret = PLAYLIST_RET_IO_ERR;
+    }
+    free(ids);
+    ESP_LOGI(TAG, "Shuffled %lu images", hdr->count);
+    return ret;
+}
+
+void playlistInit(void){
+    if(playlistMutex == NULL){
+        playlistMutex = xSemaphoreCreateMutex();
+        configASSERT( playlistMutex );
+    }
+}
+
+playlistRet_e playlistCreate(const char *name, u32 *id){
+    FILINFO fno;
+    char path[32];
+    playlistRet_e ret = PLAYLIST_RET_FULL;
+
+    xSemaphoreTake(playlistMutex, portMAX_DELAY);
+    // the default one is only created by using it
+    for(u32 i = PLAYLIST_DEFAULT_ID + 1; i < PLAYLIST_MAX_COUNT; i++){
+        getPlaylistPath(i, path, sizeof(path));
+        if(f_stat(path, &fno) == FR_NO_FILE){
+            ret = createLocked(i, name);
+            *id = i;
+            break;
+        }
+    }
+    xSemaphoreGive(playlistMutex);
+    return ret;
+}
+
+playlistRet_e playlistRemove(u32 id){
+    char path[32];
+    FRESULT fsStat;
+
+    if(id >= PLAYLIST_MAX_COUNT){
+        return PLAYLIST_RET_NOT_FOUND;
+    }
+    getPlaylistPath(id, path, sizeof(path));
+    xSemaphoreTake(playlistMutex, portMAX_DELAY);
+    fsStat = f_unlink(path);
+    xSemaphoreGive(playlistMutex);
+
+    if(fsStat == FR_NO_FILE){
+        return PLAYLIST_RET_NOT_FOUND;
+    }
+    return fsStat == FR_OK ? PLAYLIST_RET_OK : PLAYLIST_RET_IO_ERR;
+}
+
+playlistRet_e playlistGetInfo(u32 id, playlistInfo_t *info){
+    playlistHeader_t hdr;
+    FIL file;
+    playlistRet_e ret;
+
+    xSemaphoreTake(playlistMutex, portMAX_DELAY);
+    ret = openPlaylist(id, &file, &hdr, false);
+    if(ret == PLAYLIST_RET_OK){
+        f_close(&file);
+        info->id = id;
+        info->count = hdr.count;
+        memcpy(info->name, hdr.name, PLAYLIST_NAME_LEN);
+    }
+    xSemaphoreGive(playlistMutex);
+    return ret;
+}
+
+playlistRet_e playlistAddImage(u32 id, const char *imgName){
+    playlistHeader_t hdr;
+    FIL file;
+    UINT nWritten;
+    u32 imgId;
+    u32 pos;
+    playlistRet_e ret;
+
+    if(fileSysIndexFind(imgName, &imgId)){
+        return PLAYLIST_RET_IMG_NOT_FOUND;
+    }
+
+    xSemaphoreTake(playlistMutex, portMAX_DELAY);
+    ret = openPlaylist(id, &file, &hdr, true);
+    if(ret == PLAYLIST_RET_NOT_FOUND && id == PLAYLIST_DEFAULT_ID){
+        ret = createLocked(id, "default");
+        if(ret == PLAYLIST_RET_OK){
+            ret = openPlaylist(id, &file, &hdr, true);
+        }
+    }
+    if(ret){
+        xSemaphoreGive(playlistMutex);
+        return ret;
+    }
+
+    ret = findImgLocked(&file, &hdr, imgId, &pos);
+    if(ret == PLAYLIST_RET_OK){
+        ret = PLAYLIST_RET_EXISTS;
+    } else if(ret == PLAYLIST_RET_IMG_NOT_FOUND){
+        if(f_lseek(&file, ID_OFFSET(hdr.count)) != FR_OK ||
+           f_write(&file, &imgId, sizeof(u32), &nWritten) != FR_OK || nWritten != sizeof(u32)){
+            ret = PLAYLIST_RET_IO_ERR;
+        } else {
+            hdr.count++;
+            ret = writeHeader(&file, &hdr);
+        }
+    }
+
+    f_close(&file);
+    xSemaphoreGive(playlistMutex);
+    return ret;
+}
+
+playlistRet_e playlistDelImage(u32 id, const char *imgName){
+    playlistHeader_t hdr;
+    FIL file;
+    u32 imgId;
+    u32 pos;
+    playlistRet_e ret;
+
+    if(fileSysIndexFind(imgName, &imgId)){
+        return PLAYLIST_RET_IMG_NOT_FOUND;
+    }
+
+    xSemaphoreTake(playlistMutex, portMAX_DELAY);
+    ret = openPlaylist(id, &file, &hdr, true);
+    if(ret){
+        xSemaphoreGive(playlistMutex);
+        return ret;
+    }
+    ret = findImgLocked(&file, &hdr, imgId, &pos);
+    if(ret == PLAYLIST_RET_OK){
+        ret = removePosLocked(&file, &hdr, pos);
+    }
+    f_close(&file);
+    xSemaphoreGive(playlistMutex);
+    return ret;
+}
+
+playlistRet_e playlistGetImage(u32 id, u32 pos, char *imgName){
+    playlistHeader_t hdr;
+    FIL file;
+    UINT nRead;
+    u32 imgId;
+    playlistRet_e ret;
+
+    xSemaphoreTake(playlistMutex, portMAX_DELAY);
+    ret = openPlaylist(id, &file, &hdr, false);
+    if(ret){
+        xSemaphoreGive(playlistMutex);
+        return ret;
+    }
+    if(pos >= hdr.count){
+        ret = PLAYLIST_RET_IMG_NOT_FOUND;
+    } else if(f_lseek(&file, ID_OFFSET(pos)) != FR_OK ||
+              f_read(&file, &imgId, sizeof(u32), &nRead) != FR_OK || nRead != sizeof(u32)){
+        ret = PLAYLIST_RET_IO_ERR;
+    }
+    f_close(&file);
+    xSemaphoreGive(playlistMutex);
+
+    if(ret == PLAYLIST_RET_OK && fileSysIndexGetName(imgId, imgName)){
+        ret = PLAYLIST_RET_IMG_NOT_FOUND;
+    }
+    return ret;
+}
+
+playlistRet_e playlistNextImage(u32 id, u32 *pos, u32 *imgId){
+    playlistHeader_t hdr;
+    FIL file;
+    UINT nRead;
+    char imgName[MAX_IMAGE_NAME_LEN];
+    u32 p;
+    playlistRet_e ret;
+
+    xSemaphoreTake(playlistMutex, portMAX_DELAY);
+    ret = openPlaylist(id, &file, &hdr, false);
+    if(ret){
+        xSemaphoreGive(playlistMutex);
+        return ret;
+    }
+
+    // deleted images are skipped, give up once they were all tried
+    ret = PLAYLIST_RET_EMPTY;
+    p = hdr.count ? *pos % hdr.count : 0;
+    for(u32 n = 0; n < hdr.count; n++){
+        if(f_lseek(&file, ID_OFFSET(p)) != FR_OK ||
+           f_read(&file, imgId, sizeof(u32), &nRead) != FR_OK || nRead != sizeof(u32)){
+            ret = PLAYLIST_RET_IO_ERR;
+            break;
+        }
+        p = (p + 1) % hdr.count;
+        if(fileSysIndexGetName(*imgId, imgName) == FILE_SYS_RET_OK){
+            *pos = p;
+            ret = PLAYLIST_RET_OK;
+            break;
+        }
+    }
+
+    f_close(&file);
+    xSemaphoreGive(playlistMutex);
+    return ret;
+}
+
+playlistRet_e playlistShuffleNext(u32 *seed, u32 *pos, u32 *imgId){
+    playlistShuffleHeader_t hdr;
+    fSysIndexInfo_t indexInfo;
+    FIL file;
+    UINT nRead;
+    char imgName[MAX_IMAGE_NAME_LEN];
+    u32 prevId = SHUFFLE_NO_ID;
+    bool valid;
+    playlistRet_e ret;
+
+    if(fileSysIndexGetInfo(&indexInfo)){
+        return PLAYLIST_RET_IO_ERR;
+    }
+
+    xSemaphoreTake(playlistMutex, portMAX_DELAY);
+    if(f_open(&file, SHUFFLE_PATH, FA_OPEN_ALWAYS | FA_READ | FA_WRITE) != FR_OK){
+        xSemaphoreGive(playlistMutex);
+        return PLAYLIST_RET_IO_ERR;
+    }
+    valid = f_read(&file, &hdr, sizeof(hdr), &nRead) == FR_OK && nRead == sizeof(hdr) &&
+            hdr.magic == PLAYLIST_SHUFFLE_MAGIC && hdr.seed == *seed;
+    if(valid && *pos > 0 && *pos <= hdr.count){
+        if(f_lseek(&file, SHUFFLE_OFFSET(*pos - 1)) != FR_OK ||
+           f_read(&file, &prevId, sizeof(u32), &nRead) != FR_OK || nRead != sizeof(u32)){
+            prevId = SHUFFLE_NO_ID;
+        }
+    }
+    // a new order once this one is done, or if it's not of the images on the card now
+    valid = valid && *pos < hdr.count && hdr.indexEpoch == indexInfo.epoch &&
+            hdr.indexGeneration == indexInfo.generation;
+
+    ret = PLAYLIST_RET_EMPTY;
+    for(u32 n = 0; n < 2; n++){
+        if(!valid){
+            if(shuffleCreateLocked(&file, &hdr, prevId)){
+                ret = PLAYLIST_RET_IO_ERR;
+                break;
+            }
+            *seed = hdr.seed;
+            *pos = 0;
+            if(hdr.count == 0){
+                ret = PLAYLIST_RET_EMPTY;
+                break;
+            }
+        }
+        if(f_lseek(&file, SHUFFLE_OFFSET(*pos)) != FR_OK ||
+           f_read(&file, imgId, sizeof(u32), &nRead) != FR_OK || nRead != sizeof(u32)){
+            ret = PLAYLIST_RET_IO_ERR;
+            break;
+        }
+        // the image was deleted since the index info was read, shuffle again without it
+        if(fileSysIndexGetName(*imgId, imgName) == FILE_SYS_RET_OK){
+            (*pos)++;
+            ret = PLAYLIST_RET_OK;
+            break;
+        }
+        valid = false;
+    }
+
+    f_close(&file);
+    xSemaphoreGive(playlistMutex);
+    return ret;
+}
+
+void playlistPurgeImage(u32 imgId){
+    playlistHeader_t hdr;
+    FIL file;
+    u32 pos;
+
+    xSemaphoreTake(playlistMutex, portMAX_DELAY);
+    for(u32 id = 0; id < PLAYLIST_MAX_COUNT; id++){
+        if(openPlaylist(id, &file, &hdr, true)){
+            continue;
+        }
+        if(findImgLocked(&file, &hdr, imgId, &pos) == PLAYLIST_RET_OK){
+            removePosLocked(&file, &hdr, pos);
+        }
+        f_close(&file);
+    }
+    xSemaphoreGive(playlistMutex);
+}
+
+int playlistDeleteImageFile(const char *imgName){
+    u32 imgId;
+    fSysRet ret;
+
+    // the playlists only know the image by ID, which is gone with the image
+    if(fileSysIndexFind(imgName, &imgId)){
+        imgId = UINT32_MAX;
+    }
+    ret = fileSysDelImage(imgName);
+    if(ret == FILE_SYS_RET_OK && imgId != UINT32_MAX){
+        playlistPurgeImage(imgId);
+    }
+    return ret;
+}
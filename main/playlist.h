@@ -0,0 +1,137 @@
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+#include "common.h"
+
+/**
+ * Named playlists of images, stored on the SD card so they can hold as many images as the card does
+ *
+ * Each playlist is a file in PLAYLIST_DIR, a playlistHeader_t followed by an array of image index IDs
+ * (see fileSysIndexGetName()). Getting the image at a position is then a seek and a read, and images
+ * are added at the end or removed by shifting the ones after it, all in place
+ *
+ * A playlist is only valid for the image index it was made with. If the index is ever created over,
+ * the playlists come up empty
+ */
+
+#define PLAYLIST_MAX_COUNT      32          // how many playlists can exist, their IDs are 0 to this - 1
+#define PLAYLIST_DEFAULT_ID     0           // the playlist used when none is given, created when first used
+#define PLAYLIST_NAME_LEN       32
+#define PLAYLIST_MAGIC          0x54534C50  // "PLST"
+#define PLAYLIST_VERSION        1
+#define PLAYLIST_SHIFT_CHUNK    64          // IDs moved at once when removing an image
+#define PLAYLIST_SHUFFLE_MAGIC  0x46485353  // "SSHF"
+
+typedef enum{
+    PLAYLIST_RET_OK = 0,
+    PLAYLIST_RET_NOT_FOUND,         // there is no playlist with this ID
+    PLAYLIST_RET_IMG_NOT_FOUND,     // the image is not on the card, or not in the playlist
+    PLAYLIST_RET_EXISTS,            // the image is already in the playlist
+    PLAYLIST_RET_FULL,              // all the playlist IDs are taken
+    PLAYLIST_RET_EMPTY,             // there is no image to show in the playlist
+    PLAYLIST_RET_IO_ERR,            // unable to read or write the playlist file
+}playlistRet_e;
+
+/**
+ * The start of a playlist file
+ */
+typedef struct{
+    u32 magic;                      // PLAYLIST_MAGIC
+    u16 version;                    // PLAYLIST_VERSION
+    u16 reserved;
+    u32 count;                      // image IDs following the header
+    u32 indexEpoch;                 // the epoch of the image index the IDs are from
+    char name[PLAYLIST_NAME_LEN];
+}playlistHeader_t;
+
+/**
+ * The start of the shuffle file, the order the random mode shows every image in. Followed by the
+ * image IDs, shuffled
+ */
+typedef struct{
+    u32 magic;                      // PLAYLIST_SHUFFLE_MAGIC
+    u32 seed;                       // the order was shuffled from this, never 0
+    u32 count;                      // image IDs following the header
+    u32 indexEpoch;                 // the image index the IDs are from
+    u32 indexGeneration;
+}playlistShuffleHeader_t;
+
+typedef struct{
+    u32 id;
+    char name[PLAYLIST_NAME_LEN];
+    u32 count;                      // images in it, including ones deleted since they were added
+}playlistInfo_t;
+
+/**
+ * Creates the mutex protecting the playlist files
+ */
+void playlistInit(void);
+
+/**
+ * Creates an empty playlist
+ *
+ * @param id set to the new playlist's ID
+ */
+playlistRet_e playlistCreate(const char *name, u32 *id);
+
+/**
+ * Deletes a playlist
+ */
+playlistRet_e playlistRemove(u32 id);
+
+playlistRet_e playlistGetInfo(u32 id, playlistInfo_t *info);
+
+/**
+ * Appends an image to a playlist. The default playlist is created if needed
+ */
+playlistRet_e playlistAddImage(u32 id, const char *imgName);
+
+/**
+ * Removes an image from a playlist, keeping the order of the others
+ */
+playlistRet_e playlistDelImage(u32 id, const char *imgName);
+
+/**
+ * Gets the image at a position of a playlist
+ *
+ * @param imgName MAX_IMAGE_NAME_LEN long
+ *
+ * Returns PLAYLIST_RET_IMG_NOT_FOUND if the image was deleted since it was added
+ */
+playlistRet_e playlistGetImage(u32 id, u32 pos, char *imgName);
+
+/**
+ * Gets the next image of a playlist to show, skipping deleted images
+ *
+ * @param pos the position to start from, wrapped around the end of the playlist. Set to the position
+ *            after the returned image
+ * @param imgId set to the image index ID of the returned image
+ */
+playlistRet_e playlistNextImage(u32 id, u32 *pos, u32 *imgId);
+
+/**
+ * Gets the next image of the shuffle, a random order of all the images on the card where each one
+ * shows once before any shows again. A new order is shuffled once they all were, or whenever images
+ * are added or deleted. The order is in a file, so getting the next image is a seek and a read
+ *
+ * @param seed of the order pos is in, 0 for none. Set to the seed of a new order
+ * @param pos the next position in the order, set past the returned image
+ * @param imgId set to the image index ID of the returned image
+ */
+playlistRet_e playlistShuffleNext(u32 *seed, u32 *pos, u32 *imgId);
+
+/**
+ * Removes an image from every playlist, for when it's deleted
+ *
+ * @param imgId the image's index ID, get it before deleting the image
+ */
+void playlistPurgeImage(u32 imgId);
+
+/**
+ * Deletes an image from the card, see fileSysDelImage(), and removes it from every playlist
+ *
+ * Returns the fSysRet of the delete
+ */
+int playlistDeleteImageFile(const char *imgName);
+
+#endif
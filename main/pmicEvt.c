@@ -0,0 +1,163 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "driver/gpio.h"
+#include "esp_attr.h"
+#include "esp_sleep.h"
+#include "esp_log.h"
+
+#include "common.h"
+#include "pmic.h"
+#include "pmicEvt.h"
+
+static const char *TAG = "pmicEvt";
+
+ESP_EVENT_DEFINE_BASE(PMIC_EVENT);
+
+// the IRQ of each event
+static const u32 evtIrqs[PMIC_EVT_CNT] = {
+    [PMIC_EVT_VBUS_INSERT]      = PMIC_IRQ_VBUS_INSERT,
+    [PMIC_EVT_VBUS_REMOVE]      = PMIC_IRQ_VBUS_REMOVE,
+    [PMIC_EVT_BATT_INSERT]      = PMIC_IRQ_BATT_INSERT,
+    [PMIC_EVT_BATT_REMOVE]      = PMIC_IRQ_BATT_REMOVE,
+    [PMIC_EVT_CHARGE_START]     = PMIC_IRQ_CHARGE_START,
+    [PMIC_EVT_CHARGE_DONE]      = PMIC_IRQ_CHARGE_DONE,
+    [PMIC_EVT_BATT_WARN]        = PMIC_IRQ_BATT_WARN,
+    [PMIC_EVT_BATT_CRITICAL]    = PMIC_IRQ_BATT_CRITICAL,
+    [PMIC_EVT_KEY_SHORT]        = PMIC_IRQ_KEY_SHORT,
+    [PMIC_EVT_KEY_LONG]         = PMIC_IRQ_KEY_LONG,
+};
+
+static SemaphoreHandle_t evtMutex;          // a read of the IRQs at a time, and the counts
+static u32 evtCounts[PMIC_EVT_CNT];
+static TaskHandle_t pmicEvtTask_h;
+
+#if PMIC_EVT_IRQ_GPIO >= 0
+/**
+ * The IRQ pin stays low until the IRQs are cleared, so its interrupt is level triggered (the only kind
+ * that wakes from light sleep), and stays off until the task cleared them
+ */
+static void IRAM_ATTR pmicIrqIsr(void *arg){
+    BaseType_t woken = pdFALSE;
+
+    gpio_intr_disable(PMIC_EVT_IRQ_GPIO);
+    vTaskNotifyGiveFromISR(pmicEvtTask_h, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+static void taskPmicEvt(void *args){
+    for(EVER){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // a failed read would leave the pin low, and be right back here
+        while(pmicEvtPoll() != ESP_OK){
+            delayMs(PMIC_EVT_RETRY_MS);
+        }
+        gpio_intr_enable(PMIC_EVT_IRQ_GPIO);
+    }
+}
+
+static void pmicIrqGpioInit(void){
+    gpio_config_t gpio_conf;
+    esp_err_t stat;
+
+    // open drain on the PMIC's side
+    gpio_conf.intr_type     = GPIO_INTR_LOW_LEVEL;
+    gpio_conf.mode          = GPIO_MODE_INPUT;
+    gpio_conf.pull_up_en    = GPIO_PULLUP_ENABLE;
+    gpio_conf.pull_down_en  = GPIO_PULLDOWN_DISABLE;
+    gpio_conf.pin_bit_mask  = (uint64_t)0x01 << PMIC_EVT_IRQ_GPIO;
+    ESP_ERROR_CHECK(gpio_config(&gpio_conf));
+
+    xTaskCreatePinnedToCore(taskPmicEvt, "pmicEvt", 3072, NULL, 5, &pmicEvtTask_h, 0);
+    configASSERT( pmicEvtTask_h );
+
+    // fine if another driver installed it already
+    stat = gpio_install_isr_service(0);
+    if(stat != ESP_OK && stat != ESP_ERR_INVALID_STATE){
+        ESP_ERROR_CHECK(stat);
+    }
+    ESP_ERROR_CHECK(gpio_isr_handler_add(PMIC_EVT_IRQ_GPIO, pmicIrqIsr, NULL));
+    ESP_ERROR_CHECK(gpio_wakeup_enable(PMIC_EVT_IRQ_GPIO, GPIO_INTR_LOW_LEVEL));
+    ESP_ERROR_CHECK(esp_sleep_enable_gpio_wakeup());
+}
+#endif
+
+void pmicEvtInit(void){
+    u32 mask = 0;
+
+    evtMutex = xSemaphoreCreateMutex();
+    configASSERT( evtMutex );
+
+    for(u32 i = 0; i < PMIC_EVT_CNT; i++){
+        mask |= evtIrqs[i];
+    }
+    if(pmicIrqEnable(mask) != ESP_OK){
+        ESP_LOGE(TAG, "Failed to enable the PMIC IRQs");
+        return;
+    }
+#if PMIC_EVT_IRQ_GPIO >= 0
+    pmicIrqGpioInit();
+    ESP_LOGI(TAG, "PMIC events by IRQ on GPIO %d", PMIC_EVT_IRQ_GPIO);
+#else
+    ESP_LOGI(TAG, "PMIC events by polling");
+#endif
+}
+
+esp_err_t pmicEvtPoll(void){
+    u32 irqs;
+    esp_err_t ret;
+
+    xSemaphoreTake(evtMutex, portMAX_DELAY);
+    ret = pmicIrqReadClear(&irqs);
+    for(u32 i = 0; i < PMIC_EVT_CNT && ret == ESP_OK; i++){
+        if((irqs & evtIrqs[i]) == 0){
+            continue;
+        }
+        evtCounts[i]++;
+        ESP_LOGI(TAG, "%s", pmicEvtToStr(i));
+        // not worth holding up the PMIC for a full event queue
+        if(esp_event_post(PMIC_EVENT, i, NULL, 0, 0) != ESP_OK){
+            ESP_LOGW(TAG, "Event queue full, dropped %s", pmicEvtToStr(i));
+        }
+    }
+    xSemaphoreGive(evtMutex);
+    return ret;
+}
+
+void pmicEvtStop(void){
+    if(pmicEvtTask_h == NULL){
+        return;
+    }
+#if PMIC_EVT_IRQ_GPIO >= 0
+    gpio_intr_disable(PMIC_EVT_IRQ_GPIO);
+#endif
+    vTaskDelete(pmicEvtTask_h);
+    pmicEvtTask_h = NULL;
+}
+
+bool pmicEvtHasIrq(void){
+    return PMIC_EVT_IRQ_GPIO >= 0;
+}
+
+void pmicEvtGetCounts(u32 counts[PMIC_EVT_CNT]){
+    xSemaphoreTake(evtMutex, portMAX_DELAY);
+    memcpy(counts, evtCounts, sizeof(evtCounts));
+    xSemaphoreGive(evtMutex);
+}
+
+const char* pmicEvtToStr(pmicEvt_e evt){
+    switch(evt){
+        case PMIC_EVT_VBUS_INSERT:      return "vBusInsert";
+        case PMIC_EVT_VBUS_REMOVE:      return "vBusRemove";
+        case PMIC_EVT_BATT_INSERT:      return "battInsert";
+        case PMIC_EVT_BATT_REMOVE:      return "battRemove";
+        case PMIC_EVT_CHARGE_START:     return "chargeStart";
+        case PMIC_EVT_CHARGE_DONE:      return "chargeDone";
+        case PMIC_EVT_BATT_WARN:        return "battWarn";
+        case PMIC_EVT_BATT_CRITICAL:    return "battCritical";
+        case PMIC_EVT_KEY_SHORT:        return "keyShort";
+        case PMIC_EVT_KEY_LONG:         return "keyLong";
+        default:                        return "unknown";
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef PMIC_EVT_H
+#define PMIC_EVT_H
+
+#ifndef UNIT_TEST
+#include "sdkconfig.h"
+#include "esp_event.h"
+#endif
+
+#include "common.h"
+
+/**
+ * Events of the PMIC, such as USB plugged in or the battery running low, posted to the default event loop
+ * under PMIC_EVENT as they happen
+ *
+ * With the AXP2101's IRQ pin wired to CONFIG_APP_PMIC_IRQ_GPIO, an IRQ wakes the event task, which reads
+ * and clears the raised IRQs. The telemetry task also polls them with every sample, as the only way to
+ * find them without the pin, and as a fallback for a lost one with it
+ */
+
+#ifndef CONFIG_APP_PMIC_IRQ_GPIO
+#define CONFIG_APP_PMIC_IRQ_GPIO    -1
+#endif
+
+#define PMIC_EVT_IRQ_GPIO       CONFIG_APP_PMIC_IRQ_GPIO    // -1 if the IRQ pin isn't wired
+#define PMIC_EVT_RETRY_MS       100         // mS, before retrying a failed read of a raised IRQ
+
+ESP_EVENT_DECLARE_BASE(PMIC_EVENT);
+
+typedef enum{
+    PMIC_EVT_VBUS_INSERT,
+    PMIC_EVT_VBUS_REMOVE,
+    PMIC_EVT_BATT_INSERT,
+    PMIC_EVT_BATT_REMOVE,
+    PMIC_EVT_CHARGE_START,
+    PMIC_EVT_CHARGE_DONE,
+    PMIC_EVT_BATT_WARN,         // the fuel gauge dropped to PMIC_BATT_WARN_PCT
+    PMIC_EVT_BATT_CRITICAL,     // and to PMIC_BATT_CRITICAL_PCT
+    PMIC_EVT_KEY_SHORT,         // the power key
+    PMIC_EVT_KEY_LONG,
+    PMIC_EVT_CNT,
+}pmicEvt_e;
+
+/**
+ * Enables the PMIC's IRQs, and the event task with its GPIO interrupt if the IRQ pin is wired. Call
+ * after the default event loop is created, and before the telemetry task
+ */
+void pmicEvtInit(void);
+
+/**
+ * Reads and clears the raised IRQs, posting an event for each
+ */
+esp_err_t pmicEvtPoll(void);
+
+/**
+ * Stops the event task, call holding pmicLock() before going to deep sleep
+ */
+void pmicEvtStop(void);
+
+/**
+ * Whether events come by IRQ, or only by polling
+ */
+bool pmicEvtHasIrq(void);
+
+/**
+ * Gets how many of each event there were since boot
+ */
+void pmicEvtGetCounts(u32 counts[PMIC_EVT_CNT]);
+
+const char* pmicEvtToStr(pmicEvt_e evt);
+
+#endif
@@ -0,0 +1,271 @@
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp_log.h"
+
+#include "common.h"
+#include "seqlock.h"
+#include "pmicHist.h"
+
+static const char *TAG = "pmicHist";
+
+// a ring buffer of samples, and the running average feeding it
+typedef struct{
+    u16 len;                        // of the buffer
+    u16 head;                       // where the next sample goes
+    u16 cnt;
+    u16 accN;                       // samples in the running average
+    u32 periodS;                    // S, averaged over, 0 to keep every sample
+    u32 accStartS;
+    u32 accBattMv;
+    u32 accSysMv;
+    u32 accVBusMv;
+    u32 accPct;
+    u8 accFlags;
+}histTier_t;
+
+// what's kept through deep sleep
+typedef struct{
+    u32 magic;                      // PMIC_HIST_MAGIC if the rest is valid
+    histTier_t tiers[PMIC_HIST_TIER_CNT];
+    pmicSample_t sec[PMIC_HIST_RTC_SEC_LEN];
+    pmicSample_t min[PMIC_HIST_RTC_MIN_LEN];
+    pmicSample_t hour[PMIC_HIST_RTC_HOUR_LEN];
+}histRtc_t;
+
+static const u32 tierPeriodS[PMIC_HIST_TIER_CNT] = {0, 60, 3600};
+static const u16 tierLen[PMIC_HIST_TIER_CNT] = {PMIC_HIST_SEC_LEN, PMIC_HIST_MIN_LEN, PMIC_HIST_HOUR_LEN};
+static const u16 rtcTierLen[PMIC_HIST_TIER_CNT] = {PMIC_HIST_RTC_SEC_LEN, PMIC_HIST_RTC_MIN_LEN,
+                                                   PMIC_HIST_RTC_HOUR_LEN};
+
+EXT_RAM_BSS_ATTR static pmicSample_t histSec[PMIC_HIST_SEC_LEN];
+EXT_RAM_BSS_ATTR static pmicSample_t histMin[PMIC_HIST_MIN_LEN];
+EXT_RAM_BSS_ATTR static pmicSample_t histHour[PMIC_HIST_HOUR_LEN];
+static pmicSample_t * const histBufs[PMIC_HIST_TIER_CNT] = {histSec, histMin, histHour};
+static histTier_t tiers[PMIC_HIST_TIER_CNT];
+static seqlock_t histLock = SEQLOCK_INIT;  // writes to the tiers and their buffers
+static bool histReady = false;
+
+RTC_NOINIT_ATTR static histRtc_t histRtc;
+static pmicSample_t * const rtcBufs[PMIC_HIST_TIER_CNT] = {histRtc.sec, histRtc.min, histRtc.hour};
+
+static void toSample(const pmicTelemetry *telem, pmicSample_t *s){
+    s->tsS = time(NULL);
+    s->battMv = pmicBattMv(telem);
+    s->sysMv = pmicSysMv(telem);
+    s->vBusMv = pmicVBusMv(telem);
+    s->battPct = pmicBattPct(telem);
+    s->flags = (pmicVBusGood(telem) ? PMIC_SAMPLE_VBUS_GOOD : 0) |
+               (pmicBattPresent(telem) ? PMIC_SAMPLE_BATT_PRESENT : 0) |
+               (pmicCurrLimited(telem) ? PMIC_SAMPLE_CURR_LIMITED : 0) |
+               ((pmicChargeDir(telem) & 0x03) << PMIC_SAMPLE_DIR_SHIFT) |
+               ((pmicChargeStat(telem) & 0x07) << PMIC_SAMPLE_STAT_SHIFT);
+}
+
+static void tiersReset(histTier_t *t, const u16 *lens){
+    memset(t, 0, sizeof(histTier_t) * PMIC_HIST_TIER_CNT);
+    for(u32 i = 0; i < PMIC_HIST_TIER_CNT; i++){
+        t[i].len = lens[i];
+        t[i].periodS = tierPeriodS[i];
+    }
+}
+
+static void ringPut(histTier_t *t, pmicSample_t *buf, const pmicSample_t *s){
+    buf[t->head] = *s;
+    t->head = (t->head + 1) % t->len;
+    if(t->cnt < t->len){
+        t->cnt++;
+    }
+}
+
+/**
+ * Gets the i-th oldest sample of a ring
+ */
+static inline const pmicSample_t* ringAt(const histTier_t *t, const pmicSample_t *buf, u32 i){
+    return &buf[(t->head + t->len - t->cnt + i) % t->len];
+}
+
+/**
+ * Adds a sample to a tier's running average
+ *
+ * Returns true with the finished average in out, when the sample is the first of the next period
+ */
+static bool tierAverage(histTier_t *t, const pmicSample_t *s, pmicSample_t *out){
+    u32 start = s->tsS - s->tsS % t->periodS;
+    bool done = false;
+
+    // any other period ends it, the time going back too, such as when it's first set
+    if(t->accN && start != t->accStartS){
+        out->tsS = t->accStartS;
+        out->battMv = t->accBattMv / t->accN;
+        out->sysMv = t->accSysMv / t->accN;
+        out->vBusMv = t->accVBusMv / t->accN;
+        out->battPct = t->accPct / t->accN;
+        out->flags = t->accFlags;
+        t->accN = 0;
+        done = true;
+    }
+    if(t->accN == 0){
+        t->accStartS = start;
+        t->accBattMv = 0;
+        t->accSysMv = 0;
+        t->accVBusMv = 0;
+        t->accPct = 0;
+    }
+    t->accBattMv += s->battMv;
+    t->accSysMv += s->sysMv;
+    t->accVBusMv += s->vBusMv;
+    t->accPct += s->battPct;
+    t->accFlags = s->flags;
+    t->accN++;
+    return done;
+}
+
+/**
+ * Adds a sample to a set of tiers, each finished average going on to the next tier
+ */
+static void histAdd(histTier_t *t, pmicSample_t * const *bufs, const pmicSample_t *s){
+    pmicSample_t in = *s;
+    pmicSample_t avg;
+
+    ringPut(&t[PMIC_HIST_TIER_SEC], bufs[PMIC_HIST_TIER_SEC], &in);
+    for(u32 i = PMIC_HIST_TIER_SEC + 1; i < PMIC_HIST_TIER_CNT; i++){
+        if(!tierAverage(&t[i], &in, &avg)){
+            break;
+        }
+        ringPut(&t[i], bufs[i], &avg);
+        in = avg;
+    }
+}
+
+/**
+ * Copies the newest samples and the running averages of a set of tiers to one of other lengths
+ */
+static void histCopy(histTier_t *dst, pmicSample_t * const *dstBufs, const histTier_t *src,
+                     pmicSample_t * const *srcBufs){
+    u16 len;
+    u32 skip;
+
+    for(u32 i = 0; i < PMIC_HIST_TIER_CNT; i++){
+        len = dst[i].len;
+        memcpy(&dst[i], &src[i], sizeof(histTier_t));
+        dst[i].len = len;
+        dst[i].head = 0;
+        dst[i].cnt = 0;
+        skip = src[i].cnt > len ? src[i].cnt - len : 0;
+        for(u32 k = skip; k < src[i].cnt; k++){
+            ringPut(&dst[i], dstBufs[i], ringAt(&src[i], srcBufs[i], k));
+        }
+    }
+}
+
+/**
+ * Whether the history in RTC memory is there and of this firmware's layout
+ */
+static bool rtcValid(void){
+    if(histRtc.magic != PMIC_HIST_MAGIC){
+        return false;
+    }
+    for(u32 i = 0; i < PMIC_HIST_TIER_CNT; i++){
+        if(histRtc.tiers[i].len != rtcTierLen[i] || histRtc.tiers[i].head >= rtcTierLen[i] ||
+           histRtc.tiers[i].cnt > rtcTierLen[i] || histRtc.tiers[i].periodS != tierPeriodS[i]){
+            return false;
+        }
+    }
+    return true;
+}
+
+void pmicHistInit(void){
+    tiersReset(tiers, tierLen);
+
+    // only saved going to deep sleep. After a crash or a watchdog it's from an older sleep, and may be what
+    // crashed
+    if(esp_reset_reason() == ESP_RST_DEEPSLEEP && rtcValid()){
+        histCopy(tiers, histBufs, histRtc.tiers, rtcBufs);
+        ESP_LOGI(TAG, "Restored %u samples, %u minutes and %u hours of history", tiers[PMIC_HIST_TIER_SEC].cnt,
+                 tiers[PMIC_HIST_TIER_MIN].cnt, tiers[PMIC_HIST_TIER_HOUR].cnt);
+    }
+    // read once, pmicHistSave() writes it again before the next deep sleep
+    histRtc.magic = 0;
+    histReady = true;
+}
+
+void pmicHistAdd(const pmicTelemetry *telem){
+    pmicSample_t s;
+
+    toSample(telem, &s);
+    seqlockWriteBegin(&histLock);
+    histAdd(tiers, histBufs, &s);
+    seqlockWriteEnd(&histLock);
+}
+
+void pmicHistSave(void){
+    // a low power wake writes straight to RTC memory
+    if(!histReady){
+        return;
+    }
+    tiersReset(histRtc.tiers, rtcTierLen);
+    histCopy(histRtc.tiers, rtcBufs, tiers, histBufs);
+    histRtc.magic = PMIC_HIST_MAGIC;
+}
+
+void pmicHistAddLp(const pmicTelemetry *telem){
+    pmicSample_t s;
+
+    if(!rtcValid()){
+        tiersReset(histRtc.tiers, rtcTierLen);
+        histRtc.magic = PMIC_HIST_MAGIC;
+    }
+    toSample(telem, &s);
+    histAdd(histRtc.tiers, rtcBufs, &s);
+}
+
+u32 pmicHistNextDelayMs(const pmicTelemetry *telem, bool dispBusy){
+    if(dispBusy || pmicChargeDir(telem) == PMIC_CHR_DIR_CHARGE){
+        return PMIC_HIST_FAST_MS;
+    }
+    if(pmicBattPresent(telem) && pmicChargeDir(telem) == PMIC_CHR_DIR_DISCHARGE){
+        return PMIC_HIST_IDLE_MS;
+    }
+    return PMIC_HIST_NORMAL_MS;
+}
+
+u32 pmicHistGetTier(pmicHistTier_e tier, pmicSample_t *out, u32 maxCnt){
+    const histTier_t *t = &tiers[tier];
+    u32 start;
+    u32 tierCnt;
+    u32 cnt;
+    u32 skip;
+
+    // a torn read still stays in the buffer, and is then read again
+    do{
+        start = seqlockReadBegin(&histLock, NULL);
+        tierCnt = t->cnt;
+        cnt = tierCnt < maxCnt ? tierCnt : maxCnt;
+        skip = tierCnt - cnt;
+        for(u32 i = 0; i < cnt; i++){
+            out[i] = *ringAt(t, histBufs[tier], skip + i);
+        }
+    }while(seqlockReadRetry(&histLock, start));
+
+    return cnt;
+}
+
+u32 pmicHistTierLen(pmicHistTier_e tier){
+    return tierLen[tier];
+}
+
+u32 pmicHistTierPeriodS(pmicHistTier_e tier){
+    return tierPeriodS[tier];
+}
+
+const char* pmicHistTierToStr(pmicHistTier_e tier){
+    switch(tier){
+        case PMIC_HIST_TIER_SEC:    return "sec";
+        case PMIC_HIST_TIER_MIN:    return "min";
+        case PMIC_HIST_TIER_HOUR:   return "hour";
+        default:                    return "unknown";
+    }
+}
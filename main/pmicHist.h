@@ -0,0 +1,109 @@
+#ifndef PMIC_HIST_H
+#define PMIC_HIST_H
+
+#include <stdbool.h>
+#include "common.h"
+#include "pmic.h"
+#include "pmicEvt.h"
+
+/**
+ * History of the PMIC telemetry, in three tiers of PSRAM ring buffers: every sample, one minute averages,
+ * and one hour averages. Each tier averages into the next, so the history goes back a day in minutes and
+ * a month in hours, whatever the sample rate
+ *
+ * Samples are timestamped with the system time, which keeps counting through deep sleep. Before going
+ * to deep sleep the newest of each tier is saved to RTC memory, low power playlist wakes add their
+ * sample there, and the next normal boot picks it all back up
+ *
+ * There is a single writer, the telemetry task (or the low power wake). Readers copy a tier out under a
+ * sequence lock, so they never hold it up
+ */
+
+#define PMIC_HIST_SEC_LEN       720         // samples, an hour at the normal sample rate
+#define PMIC_HIST_MIN_LEN       1440        // a day of minutes
+#define PMIC_HIST_HOUR_LEN      720         // a month of hours
+#define PMIC_HIST_RTC_SEC_LEN   16          // the newest of each tier kept through deep sleep, 12 bytes each
+#define PMIC_HIST_RTC_MIN_LEN   32
+#define PMIC_HIST_RTC_HOUR_LEN  96
+#define PMIC_HIST_MAGIC         0x54534948  // "HIST"
+
+// telemetry sample periods, picked by pmicHistNextDelayMs()
+#define PMIC_HIST_FAST_MS       1000        // mS, while charging or refreshing the display
+#define PMIC_HIST_IDLE_MS       30000       // mS, idle on battery
+#if PMIC_EVT_IRQ_GPIO >= 0
+#define PMIC_HIST_NORMAL_MS     PMIC_HIST_IDLE_MS           // on USB and not charging, a change comes as an IRQ
+#else
+#define PMIC_HIST_NORMAL_MS     PMIC_TELEMETRY_ACQ_DELAY    // on USB and not charging
+#endif
+
+typedef enum{
+    PMIC_HIST_TIER_SEC,         // every sample
+    PMIC_HIST_TIER_MIN,         // one minute averages
+    PMIC_HIST_TIER_HOUR,        // one hour averages
+    PMIC_HIST_TIER_CNT,
+}pmicHistTier_e;
+
+// pmicSample_t flags
+#define PMIC_SAMPLE_VBUS_GOOD       0x01
+#define PMIC_SAMPLE_BATT_PRESENT    0x02
+#define PMIC_SAMPLE_CURR_LIMITED    0x04
+#define PMIC_SAMPLE_DIR_SHIFT       3       // 2 bits of pmicChrDir_e
+#define PMIC_SAMPLE_STAT_SHIFT      5       // 3 bits of pmicChrStat
+
+/**
+ * A telemetry sample in fixed point, or the average of some for the minute and hour tiers
+ */
+typedef struct{
+    u32 tsS;                        // S, system time of the sample, or the start of the average
+    u16 battMv;
+    u16 sysMv;
+    u16 vBusMv;
+    u8 battPct;
+    u8 flags;                       // PMIC_SAMPLE_, of the last sample averaged
+}pmicSample_t;
+
+/**
+ * Sets up the history, restoring what was saved to RTC memory before deep sleep if any. For a normal
+ * boot, the low power wake uses pmicHistAddLp() only
+ */
+void pmicHistInit(void);
+
+/**
+ * Adds a telemetry sample
+ */
+void pmicHistAdd(const pmicTelemetry *telem);
+
+/**
+ * Saves the newest of the history to RTC memory, call before going to deep sleep
+ */
+void pmicHistSave(void);
+
+/**
+ * Adds the sample of a low power wake straight to the history in RTC memory
+ */
+void pmicHistAddLp(const pmicTelemetry *telem);
+
+/**
+ * How long to wait for the next telemetry sample: often while something is going on, rarely while idle
+ * on battery
+ */
+u32 pmicHistNextDelayMs(const pmicTelemetry *telem, bool dispBusy);
+
+/**
+ * Copies out a tier, oldest first
+ *
+ * @param out room for maxCnt samples, the tier's length at most is needed
+ *
+ * Returns how many samples were copied
+ */
+u32 pmicHistGetTier(pmicHistTier_e tier, pmicSample_t *out, u32 maxCnt);
+
+/**
+ * The length and average period of a tier
+ */
+u32 pmicHistTierLen(pmicHistTier_e tier);
+u32 pmicHistTierPeriodS(pmicHistTier_e tier);
+
+const char* pmicHistTierToStr(pmicHistTier_e tier);
+
+#endif
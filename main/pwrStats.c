@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+
+#include "common.h"
+#include "main.h"
+#include "pwrStats.h"
+
+static const char *TAG = "pwrStats";
+
+static SemaphoreHandle_t pwrMutex;          // protects everything below
+
+static u64 dispUs;
+static int64_t dispStartUs;
+static u32 refreshes;
+
+static pwrWifiState_e wifiState = PWR_WIFI_OFF;
+static int64_t wifiSinceUs;
+static u64 wifiUs[PWR_WIFI_STATE_CNT];
+
+static bool onBattery;
+static u32 lastMv;                          // mV, the battery at the last telemetry sample
+static u8 lastPct;
+
+// the refresh being measured
+static u32 refreshBeforeMv;                 // 0 if it isn't measured
+static int64_t refreshSettledUs;            // the battery is sampled again from then
+static bool refreshPending;
+
+static u32 refreshesMeasured;
+static int32_t lastDropMv;
+static float refreshMah;
+
+// the discharge since unplugged
+static int64_t drainStartUs;
+static u8 drainStartPct;
+static u32 drainStartRefreshes;
+
+#ifdef CONFIG_PM_PROFILING
+// as esp_pm_dump_locks() names them
+static const char * const pmModeNames[PWR_CPU_MODE_CNT] = {"SLEEP", "APB_MIN", "APB_MAX", "CPU_MAX"};
+
+/**
+ * Gets the time spent in each power management mode. ESP-IDF only prints them, so they're printed to
+ * memory and read back from the "Mode stats" table
+ */
+static bool getPmModes(pwrStats_t *out){
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f;
+    char *line;
+    char name[16];
+    unsigned long mhz;
+    long long us;
+    u32 found = 0;
+
+    f = open_memstream(&buf, &len);
+    if(f == NULL){
+        return false;
+    }
+    esp_pm_dump_locks(f);
+    fclose(f);
+
+    line = buf ? strstr(buf, "Mode stats:") : NULL;
+    while(line != NULL && (line = strchr(line, '\n')) != NULL){
+        line++;
+        // such as "APB_MIN   40 M        123456    12%"
+        if(sscanf(line, "%15s %lu M %lld", name, &mhz, &us) != 3){
+            continue;
+        }
+        for(u32 i = 0; i < PWR_CPU_MODE_CNT; i++){
+            if(strcmp(name, pmModeNames[i]) == 0){
+                out->cpuUs[i] = us;
+                out->cpuMhz[i] = mhz;
+                found++;
+            }
+        }
+    }
+    free(buf);
+    return found > 0;
+}
+#endif
+
+/**
+ * Adds the time since the last change to the current Wi-Fi state, must hold pwrMutex
+ */
+static void wifiAccumulate(int64_t now){
+    wifiUs[wifiState] += now - wifiSinceUs;
+    wifiSinceUs = now;
+}
+
+/**
+ * Gets the average current since unplugged, and without the refreshes, 0 until known. Must hold pwrMutex
+ */
+static void getDrain(int64_t now, float *drainMa, float *baselineMa){
+    float drainPct = onBattery ? (float)drainStartPct - lastPct : 0;
+    float hours;
+    float refreshPerH;
+
+    *drainMa = 0;
+    *baselineMa = 0;
+    if(drainPct < PWR_DRAIN_MIN_PCT){
+        return;
+    }
+    hours = (now - drainStartUs) / 3600e6f;
+    *drainMa = drainPct / 100 * PWR_BATT_CAPACITY_MAH / hours;
+    refreshPerH = (refreshes - drainStartRefreshes) / hours;
+    *baselineMa = *drainMa - refreshPerH * (refreshMah > 0 ? refreshMah : 0);
+    if(*baselineMa < 0){
+        *baselineMa = 0;
+    }
+}
+
+void pwrStatsInit(void){
+    pwrMutex = xSemaphoreCreateMutex();
+    configASSERT( pwrMutex );
+}
+
+void pwrStatsRefreshBegin(void){
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    dispStartUs = esp_timer_get_time();
+    // a refresh before the last one settled is lumped in with it
+    if(!refreshPending){
+        refreshBeforeMv = onBattery ? lastMv : 0;
+    }
+    xSemaphoreGive(pwrMutex);
+}
+
+void pwrStatsRefreshEnd(void){
+    int64_t now = esp_timer_get_time();
+
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    dispUs += now - dispStartUs;
+    refreshes++;
+    if(refreshBeforeMv){
+        refreshPending = true;
+        refreshSettledUs = now + PWR_REFRESH_SETTLE_MS * 1000;
+    }
+    xSemaphoreGive(pwrMutex);
+}
+
+void pwrStatsTelemetry(const pmicTelemetry *telem){
+    int64_t now = esp_timer_get_time();
+    bool discharging;
+    float mah;
+
+    discharging = pmicBattPresent(telem) && pmicChargeDir(telem) == PMIC_CHR_DIR_DISCHARGE;
+
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    lastMv = pmicBattMv(telem);
+    lastPct = pmicBattPct(telem);
+
+    if(!discharging){
+        // charging makes both meaningless, start over once unplugged
+        onBattery = false;
+        refreshPending = false;
+        refreshBeforeMv = 0;
+        xSemaphoreGive(pwrMutex);
+        return;
+    }
+    if(!onBattery){
+        onBattery = true;
+        drainStartUs = now;
+        drainStartPct = lastPct;
+        drainStartRefreshes = refreshes;
+    }
+
+    if(refreshPending && now >= refreshSettledUs){
+        refreshPending = false;
+        lastDropMv = (int32_t)refreshBeforeMv - (int32_t)lastMv;
+        refreshBeforeMv = 0;
+        mah = (float)lastDropMv * PWR_BATT_CAPACITY_MAH / (PWR_BATT_FULL_MV - PWR_BATT_EMPTY_MV);
+        // the first one starts the average, it would otherwise take a while to climb from 0
+        refreshMah = refreshesMeasured ? refreshMah + PWR_REFRESH_AVG_WEIGHT * (mah - refreshMah) : mah;
+        refreshesMeasured++;
+        ESP_LOGD(TAG, "Refresh dropped the battery %ld mV, %.3f mAh", lastDropMv, mah);
+    }
+    xSemaphoreGive(pwrMutex);
+}
+
+void pwrStatsSetWifi(pwrWifiState_e state){
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    wifiAccumulate(esp_timer_get_time());
+    wifiState = state;
+    xSemaphoreGive(pwrMutex);
+}
+
+void pwrStatsGet(pwrStats_t *out){
+    int64_t now = esp_timer_get_time();
+    runState_t st;
+    float refreshPerH;
+    float ma;
+    u8 pct;
+
+    memset(out, 0, sizeof(pwrStats_t));
+    out->uptimeUs = now;
+#ifdef CONFIG_PM_PROFILING
+    out->cpuValid = getPmModes(out);
+#endif
+
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    out->dispUs = dispUs;
+    out->refreshes = refreshes;
+    wifiAccumulate(now);
+    memcpy(out->wifiUs, wifiUs, sizeof(wifiUs));
+    out->onBattery = onBattery;
+    out->refreshesMeasured = refreshesMeasured;
+    out->lastDropMv = lastDropMv;
+    out->refreshMah = refreshMah > 0 ? refreshMah : 0;
+    pct = lastPct;
+    getDrain(now, &out->drainMa, &out->baselineMa);
+    xSemaphoreGive(pwrMutex);
+
+    // as if it kept running as it is now, refreshing once a period in the playlist modes
+    if(out->drainMa > 0){
+        runStateGet(&st);
+        refreshPerH = 0;
+        if(st.runMode != MODE_STANDBY && st.playlist.period_ticks){
+            refreshPerH = 3600.0f * configTICK_RATE_HZ / st.playlist.period_ticks;
+        }
+        ma = out->baselineMa + refreshPerH * out->refreshMah;
+        if(ma > 0){
+            out->projectedH = (float)pct / 100 * PWR_BATT_CAPACITY_MAH / ma;
+        }
+    }
+}
+
+bool pwrStatsGetEnergy(float *refreshMahOut, float *baselineMaOut){
+    float drainMa;
+    bool measured;
+
+    // before pwrStatsInit(), such as on a low power wake
+    if(pwrMutex == NULL){
+        return false;
+    }
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    measured = refreshesMeasured > 0;
+    *refreshMahOut = refreshMah > 0 ? refreshMah : 0;
+    getDrain(esp_timer_get_time(), &drainMa, baselineMaOut);
+    xSemaphoreGive(pwrMutex);
+    return measured;
+}
+
+const char* pwrCpuModeToStr(pwrCpuMode_e mode){
+    switch(mode){
+        case PWR_CPU_LIGHT_SLEEP:   return "lightSleep";
+        case PWR_CPU_APB_MIN:       return "apbMin";
+        case PWR_CPU_APB_MAX:       return "apbMax";
+        case PWR_CPU_MAX:           return "cpuMax";
+        default:                    return "unknown";
+    }
+}
+
+const char* pwrWifiStateToStr(pwrWifiState_e state){
+    switch(state){
+        case PWR_WIFI_OFF:          return "off";
+        case PWR_WIFI_ACTIVE:       return "active";
+        case PWR_WIFI_MODEM_SLEEP:  return "modemSleep";
+        default:                    return "unknown";
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef PWR_STATS_H
+#define PWR_STATS_H
+
+#ifndef UNIT_TEST
+#include "sdkconfig.h"
+#endif
+
+#include <stdbool.h>
+#include "common.h"
+#include "pmic.h"
+
+/**
+ * Where the power goes. Counts the time spent in each power state since boot, and estimates the charge a
+ * display refresh takes from the battery, to project the battery life at the current playlist period
+ *
+ * The CPU frequency and light sleep times come from the ESP-IDF power management profiling, and are only
+ * there with CONFIG_PM_PROFILING. The display and Wi-Fi times are counted here
+ *
+ * The charge of a refresh is estimated from the battery voltage drop, between the last telemetry sample
+ * before it and the first one PWR_REFRESH_SETTLE_MS after it, taken as linear between PWR_BATT_EMPTY_MV
+ * and PWR_BATT_FULL_MV. The average current comes from the fuel gauge, once it dropped PWR_DRAIN_MIN_PCT.
+ * Both are only measured while discharging, and start over when plugged in
+ */
+
+#ifndef CONFIG_APP_BATT_CAPACITY_MAH
+#define CONFIG_APP_BATT_CAPACITY_MAH    1500
+#endif
+
+#define PWR_BATT_CAPACITY_MAH   CONFIG_APP_BATT_CAPACITY_MAH
+#define PWR_BATT_FULL_MV        4200        // mV, a full battery at rest
+#define PWR_BATT_EMPTY_MV       3300        // mV, an empty one
+#define PWR_REFRESH_SETTLE_MS   3000        // mS, for the battery to recover from a refresh before it's sampled
+#define PWR_REFRESH_AVG_WEIGHT  0.25f       // of the last refresh in the average charge of a refresh
+#define PWR_DRAIN_MIN_PCT       2           // %, of fuel gauge drop before the average current is trusted
+
+typedef enum{
+    PWR_CPU_LIGHT_SLEEP,
+    PWR_CPU_APB_MIN,            // the lowest DFS frequency, nothing is holding it up
+    PWR_CPU_APB_MAX,            // a peripheral needs the APB at 80 MHz
+    PWR_CPU_MAX,                // the highest DFS frequency
+    PWR_CPU_MODE_CNT,
+}pwrCpuMode_e;
+
+typedef enum{
+    PWR_WIFI_OFF,
+    PWR_WIFI_ACTIVE,            // the radio is always on, as an AP, scanning, or a station without power save
+    PWR_WIFI_MODEM_SLEEP,       // a connected station with power save, the radio sleeps between beacons
+    PWR_WIFI_STATE_CNT,
+}pwrWifiState_e;
+
+typedef struct{
+    u64 uptimeUs;
+    bool cpuValid;                          // the CPU times are only there with CONFIG_PM_PROFILING
+    u64 cpuUs[PWR_CPU_MODE_CNT];
+    u32 cpuMhz[PWR_CPU_MODE_CNT];
+    u64 dispUs;                             // the display task held its no light sleep lock
+    u32 refreshes;                          // since boot
+    u64 wifiUs[PWR_WIFI_STATE_CNT];
+    bool onBattery;                         // discharging as of the last telemetry sample
+    u32 refreshesMeasured;                  // refreshes with a voltage drop measured, since boot
+    int32_t lastDropMv;                     // mV, of the last refresh measured
+    float refreshMah;                       // mAh, the average charge of a refresh. 0 until one was measured
+    float drainMa;                          // mA, the average current while discharging. 0 until known
+    float baselineMa;                       // mA, drainMa without the refreshes
+    float projectedH;                       // hours left at the current playlist period. 0 until known
+}pwrStats_t;
+
+/**
+ * Creates the mutex, call before anything else here
+ */
+void pwrStatsInit(void);
+
+/**
+ * Called by the display task around a refresh, while it holds the no light sleep lock
+ */
+void pwrStatsRefreshBegin(void);
+void pwrStatsRefreshEnd(void);
+
+/**
+ * Called with every PMIC telemetry sample
+ */
+void pwrStatsTelemetry(const pmicTelemetry *telem);
+
+/**
+ * Called on every change of the Wi-Fi radio's power state
+ */
+void pwrStatsSetWifi(pwrWifiState_e state);
+
+void pwrStatsGet(pwrStats_t *out);
+
+/**
+ * Gets just the charge of a refresh and the baseline current of pwrStatsGet(), cheaply
+ *
+ * Returns whether a refresh was measured, the baseline may still be 0 if not known yet
+ */
+bool pwrStatsGetEnergy(float *refreshMahOut, float *baselineMaOut);
+
+const char* pwrCpuModeToStr(pwrCpuMode_e mode);
+const char* pwrWifiStateToStr(pwrWifiState_e state);
+
+#endif
@@ -0,0 +1,395 @@
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "schedule.h"
+
+static const char *dayNames[7] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+
+void schedPolicyDefault(schedPolicy_t *policy, u32 battCapacityMah){
+#ifdef CONFIG_APP_SCHED_ENABLE
+    policy->enabled = true;
+#else
+    policy->enabled = false;
+#endif
+    policy->battCapacityMah = battCapacityMah;
+    policy->targetDays = SCHED_TARGET_DAYS;
+    policy->stretchFromPct = SCHED_STRETCH_FROM_PCT;
+    policy->stretchToPct = SCHED_STRETCH_TO_PCT;
+    policy->maxStretch = SCHED_MAX_STRETCH;
+    policy->maxPeriodS = SCHED_MAX_PERIOD_S;
+    policy->quietStartS = CONFIG_APP_SCHED_QUIET_START_H * 3600;
+    policy->quietEndS = CONFIG_APP_SCHED_QUIET_END_H * 3600;
+    policy->calendar = NULL;
+}
+
+static bool inQuiet(const schedPolicy_t *policy, u32 t){
+    if(policy->quietStartS < policy->quietEndS){
+        return t >= policy->quietStartS && t < policy->quietEndS;
+    }
+    // through midnight
+    return t >= policy->quietStartS || t < policy->quietEndS;
+}
+
+/**
+ * The period that keeps the average current within what lasts a full battery policy->targetDays. 0 if
+ * there's no target, or the charge of a refresh isn't known
+ */
+static u32 energyPeriodS(const schedPolicy_t *policy, const schedInput_t *in){
+    float budgetMa;
+    float spareMa;
+    float periodS;
+
+    if(policy->targetDays == 0 || in->refreshMah <= 0){
+        return 0;
+    }
+    budgetMa = (float)policy->battCapacityMah * (100 - SCHED_RESERVE_PCT) / 100 / (policy->targetDays * 24);
+    spareMa = budgetMa - (in->baselineMa > 0 ? in->baselineMa : 0);
+    if(spareMa <= 0){
+        // even without refreshes the target can't be met
+        return policy->maxPeriodS;
+    }
+    // clamped while still a float, a tiny spare current would overflow the u32
+    periodS = in->refreshMah / spareMa * 3600;
+    return periodS < policy->maxPeriodS ? periodS : policy->maxPeriodS;
+}
+
+/**
+ * How many times the period is stretched at a battery level, 1 above policy->stretchFromPct, up to
+ * policy->maxStretch from policy->stretchToPct down
+ */
+static float battStretch(const schedPolicy_t *policy, u8 pct){
+    if(pct >= policy->stretchFromPct || policy->stretchFromPct <= policy->stretchToPct){
+        return 1;
+    }
+    if(pct <= policy->stretchToPct){
+        return policy->maxStretch;
+    }
+    return 1 + (float)(policy->maxStretch - 1) * (policy->stretchFromPct - pct) /
+               (policy->stretchFromPct - policy->stretchToPct);
+}
+
+u32 schedNextPeriodS(const schedPolicy_t *policy, const schedInput_t *in, schedReason_e *reason){
+    schedReason_e why = SCHED_REASON_BASE;
+    u32 period = in->basePeriodS;
+    u32 maxPeriod;
+    u32 energy;
+    float stretch = 1;
+    u32 wake;
+
+    if(!policy->enabled){
+        // nothing to do
+    } else if(in->vBusGood || !in->battPresent){
+        why = SCHED_REASON_EXTERNAL;
+    } else {
+        // never stretched below the configured period, nor above the longest
+        maxPeriod = policy->maxPeriodS > in->basePeriodS ? policy->maxPeriodS : in->basePeriodS;
+        energy = energyPeriodS(policy, in);
+        if(energy > period){
+            period = energy;
+            why = SCHED_REASON_ENERGY;
+        }
+        stretch = battStretch(policy, in->battPct);
+        if(stretch > 1){
+            period = period * stretch;
+            why = SCHED_REASON_BATTERY;
+        }
+        if(period > maxPeriod){
+            period = maxPeriod;
+        }
+    }
+
+    // the windows were picked by hand, so only a low battery stretches them
+    if(in->timeValid && policy->calendar){
+        wake = schedCalendarNextS(policy->calendar, in->weekday, in->localTimeS, in->basePeriodS, stretch);
+        if(wake){
+            if(reason){
+                *reason = SCHED_REASON_WINDOW;
+            }
+            return wake;
+        }
+    }
+
+    if(policy->enabled && in->timeValid && policy->quietStartS != policy->quietEndS){
+        wake = (in->localTimeS + period) % SCHED_DAY_S;
+        if(inQuiet(policy, wake)){
+            period += (policy->quietEndS + SCHED_DAY_S - wake) % SCHED_DAY_S;
+            why = SCHED_REASON_QUIET;
+        }
+    }
+
+    if(reason){
+        *reason = why;
+    }
+    return period;
+}
+
+u32 schedCalendarNextS(const schedCalendar_t *cal, u8 weekday, u32 localTimeS, u32 basePeriodS, float stretch){
+    const schedWindow_t *w;
+    int64_t from = (int64_t)localTimeS + SCHED_WAKE_SLACK_S;     // the next wake is after this
+    int64_t best = -1;
+    int64_t start;
+    int64_t end;
+    int64_t wake;
+    u32 periodS;
+
+    for(u32 i = 0; i < cal->count; i++){
+        w = &cal->windows[i];
+        periodS = (w->periodMin ? w->periodMin * 60 : basePeriodS) * stretch;
+        // from yesterday's, which can go through midnight, to the same day next week
+        for(int day = -1; day <= 7; day++){
+            if((w->days & (1 << ((weekday + day + 7) % 7))) == 0){
+                continue;
+            }
+            start = (int64_t)day * SCHED_DAY_S + w->startMin * 60;
+            wake = start;
+            if(w->endMin == w->startMin){
+                if(wake <= from){
+                    continue;
+                }
+            } else if(wake <= from){
+                // the first wake of the window after from, if it's still open then
+                end = start + (int64_t)((w->endMin + 24 * 60 - w->startMin) % (24 * 60)) * 60;
+                if(periodS == 0){
+                    continue;
+                }
+                wake = start + ((from - start) / periodS + 1) * periodS;
+                if(wake >= end){
+                    continue;
+                }
+            }
+            if(best < 0 || wake < best){
+                best = wake;
+            }
+        }
+    }
+    return best < 0 ? 0 : best - localTimeS;
+}
+
+/**
+ * Parses a day name, moving p past it
+ *
+ * Returns the day as tm_wday, -1 if it isn't one
+ */
+static int parseDay(const char **p){
+    for(int i = 0; i < 7; i++){
+        if(strncasecmp(*p, dayNames[i], 3) == 0){
+            *p += 3;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Parses the days of a window, such as "mon-fri" or "sat+sun", moving p past them
+ *
+ * Returns the days as schedWindow_t's, 0 if invalid
+ */
+static u8 parseDays(const char **p){
+    u8 days = 0;
+    int from;
+    int to;
+
+    for(EVER){
+        from = parseDay(p);
+        if(from < 0){
+            return 0;
+        }
+        to = from;
+        if(**p == '-'){
+            (*p)++;
+            to = parseDay(p);
+            if(to < 0){
+                return 0;
+            }
+        }
+        // a range can go through the weekend, such as "fri-mon"
+        for(int d = from; ; d = (d + 1) % 7){
+            days |= 1 << d;
+            if(d == to){
+                break;
+            }
+        }
+        if(**p != '+'){
+            return days;
+        }
+        (*p)++;
+    }
+}
+
+/**
+ * Parses a time of day as "H:MM" or "HH:MM", moving p past it
+ *
+ * Returns 0 on success, non-zero if invalid
+ */
+static int parseTime(const char **p, u16 *min){
+    const char *s = *p;
+    u32 h = 0;
+    u32 m;
+    int digits = 0;
+
+    while(isdigit((unsigned char)*s) && digits < 2){
+        h = h * 10 + (*s++ - '0');
+        digits++;
+    }
+    if(digits == 0 || *s != ':' || !isdigit((unsigned char)s[1]) || !isdigit((unsigned char)s[2])){
+        return -1;
+    }
+    m = (s[1] - '0') * 10 + (s[2] - '0');
+    if(h > 23 || m > 59){
+        return -1;
+    }
+    *min = h * 60 + m;
+    *p = s + 3;
+    return 0;
+}
+
+static const char* skipSpaces(const char *p){
+    while(*p == ' '){
+        p++;
+    }
+    return p;
+}
+
+int schedCalendarParse(const char *spec, schedCalendar_t *cal){
+    schedCalendar_t parsed;
+    schedWindow_t *w;
+    const char *p = skipSpaces(spec);
+    char *end;
+    unsigned long period;
+
+    if(strlen(spec) >= SCHED_SPEC_MAX_LEN){
+        return -1;
+    }
+    memset(&parsed, 0, sizeof(parsed));
+    while(*p){
+        if(parsed.count >= SCHED_MAX_WINDOWS){
+            return -1;
+        }
+        w = &parsed.windows[parsed.count++];
+
+        w->days = SCHED_DAYS_ALL;
+        if(isalpha((unsigned char)*p)){
+            w->days = parseDays(&p);
+            if(w->days == 0 || *p != ' '){
+                return -1;
+            }
+            p = skipSpaces(p);
+        }
+        if(parseTime(&p, &w->startMin)){
+            return -1;
+        }
+        w->endMin = w->startMin;
+        if(*p == '-'){
+            p++;
+            // the same start and end is a single wake, so all day is 00:00-23:59
+            if(parseTime(&p, &w->endMin) || w->endMin == w->startMin){
+                return -1;
+            }
+        }
+        if(*p == '/'){
+            if(w->endMin == w->startMin || !isdigit((unsigned char)p[1])){
+                return -1;
+            }
+            period = strtoul(p + 1, &end, 10);
+            if(period == 0 || period > UINT16_MAX){
+                return -1;
+            }
+            w->periodMin = period;
+            p = end;
+        }
+
+        p = skipSpaces(p);
+        if(*p == ','){
+            p = skipSpaces(p + 1);
+            if(*p == 0){
+                return -1;
+            }
+        } else if(*p){
+            return -1;
+        }
+    }
+    memcpy(cal, &parsed, sizeof(schedCalendar_t));
+    return 0;
+}
+
+/**
+ * Appends to a string at *pos, moving it past what was appended. Stops at the end of out, truncating
+ */
+static void appendf(char *out, u32 len, u32 *pos, const char *fmt, ...){
+    va_list args;
+    int n;
+
+    if(*pos >= len){
+        return;
+    }
+    va_start(args, fmt);
+    n = vsnprintf(out + *pos, len - *pos, fmt, args);
+    va_end(args);
+    if(n > 0){
+        *pos = *pos + n < len ? *pos + n : len;
+    }
+}
+
+/**
+ * Appends the days of a window as parsed by parseDays(), runs of three days or more as a range
+ */
+static void daysToStr(u8 days, char *out, u32 len, u32 *pos){
+    bool first = true;
+    int run;
+
+    for(int d = 0; d < 7; d++){
+        if((days & (1 << d)) == 0){
+            continue;
+        }
+        for(run = 1; d + run < 7 && (days & (1 << (d + run))); run++);
+        appendf(out, len, pos, "%s%s", first ? "" : "+", dayNames[d]);
+        first = false;
+        if(run > 2){
+            appendf(out, len, pos, "-%s", dayNames[d + run - 1]);
+            d += run - 1;
+        }
+    }
+}
+
+void schedCalendarToStr(const schedCalendar_t *cal, char *out, u32 len){
+    const schedWindow_t *w;
+    u32 pos = 0;
+
+    if(len == 0){
+        return;
+    }
+    out[0] = 0;
+    for(u32 i = 0; i < cal->count; i++){
+        w = &cal->windows[i];
+        if(i){
+            appendf(out, len, &pos, ", ");
+        }
+        if(w->days != SCHED_DAYS_ALL){
+            daysToStr(w->days, out, len, &pos);
+            appendf(out, len, &pos, " ");
+        }
+        appendf(out, len, &pos, "%02u:%02u", w->startMin / 60, w->startMin % 60);
+        if(w->endMin != w->startMin){
+            appendf(out, len, &pos, "-%02u:%02u", w->endMin / 60, w->endMin % 60);
+        }
+        if(w->periodMin){
+            appendf(out, len, &pos, "/%u", w->periodMin);
+        }
+    }
+}
+
+const char* schedReasonToStr(schedReason_e reason){
+    switch(reason){
+        case SCHED_REASON_BASE:     return "base";
+        case SCHED_REASON_EXTERNAL: return "external";
+        case SCHED_REASON_ENERGY:   return "energy";
+        case SCHED_REASON_BATTERY:  return "battery";
+        case SCHED_REASON_QUIET:    return "quiet";
+        case SCHED_REASON_WINDOW:   return "window";
+        default:                    return "unknown";
+    }
+}
@@ -0,0 +1,145 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#ifndef UNIT_TEST
+#include "sdkconfig.h"
+#endif
+
+#include <stdbool.h>
+#include "common.h"
+
+/**
+ * The playlist schedule policy: how long until the next image, from the configured period and the state
+ * of the battery. A pure function of its inputs, so it's tested on the host against telemetry traces
+ *
+ * On external power it's the configured period. On battery it's stretched to keep the average current
+ * within what lasts a full battery SCHED_TARGET_DAYS, from the measured charge of a refresh (see
+ * pwrStats.h), and further as the battery drains below SCHED_STRETCH_FROM_PCT. Quiet hours push a wake
+ * that would land in them to their end, whatever the power source, once the clock is set
+ *
+ * A calendar of refresh windows replaces all that once the clock is set: the image only changes at the
+ * wakes of the windows, such as at 7:00 and 18:00 or every 30 min in office hours, and never outside
+ * them. On battery, the period of a window is still stretched for a low battery
+ */
+
+// a bool option left at n isn't defined at all, so the default is only for the host tests
+#ifdef UNIT_TEST
+#ifndef CONFIG_APP_SCHED_ENABLE
+#define CONFIG_APP_SCHED_ENABLE         1
+#endif
+#endif
+#ifndef CONFIG_APP_SCHED_TARGET_DAYS
+#define CONFIG_APP_SCHED_TARGET_DAYS    30
+#endif
+#ifndef CONFIG_APP_SCHED_QUIET_START_H
+#define CONFIG_APP_SCHED_QUIET_START_H  0
+#endif
+#ifndef CONFIG_APP_SCHED_QUIET_END_H
+#define CONFIG_APP_SCHED_QUIET_END_H    0
+#endif
+
+#define SCHED_TARGET_DAYS       CONFIG_APP_SCHED_TARGET_DAYS    // a full battery should last this, 0 for no target
+#define SCHED_STRETCH_FROM_PCT  50          // %, the period starts stretching below this
+#define SCHED_STRETCH_TO_PCT    10          // %, and is stretched the most from here down
+#define SCHED_MAX_STRETCH       8           // times the period at most, from the battery level
+#define SCHED_MAX_PERIOD_S      (24 * 3600) // S, longest it stretches to, unless configured longer
+#define SCHED_RESERVE_PCT       5           // %, of the battery not counted on for the target
+#define SCHED_DAY_S             (24 * 3600)
+#define SCHED_MAX_WINDOWS       8
+#define SCHED_SPEC_MAX_LEN      192         // of a schedule description, see schedCalendarParse()
+#define SCHED_WAKE_SLACK_S      60          // S, a window wake this close after now is taken as the current one,
+                                            // so an RTC running a bit fast through deep sleep doesn't wake twice
+#define SCHED_DAYS_ALL          0x7F
+
+typedef enum{
+    SCHED_REASON_BASE,          // the configured period, nothing applied
+    SCHED_REASON_EXTERNAL,      // the configured period, on external power
+    SCHED_REASON_ENERGY,        // stretched to last SCHED_TARGET_DAYS
+    SCHED_REASON_BATTERY,       // stretched for a low battery
+    SCHED_REASON_QUIET,         // pushed to the end of the quiet hours
+    SCHED_REASON_WINDOW,        // the next wake of the refresh windows
+    SCHED_REASON_CNT,
+}schedReason_e;
+
+/**
+ * A refresh window: wakes from its start every period until its end, on the days it starts
+ */
+typedef struct{
+    u8 days;                    // bit 0 Sunday to bit 6 Saturday, as tm_wday
+    u8 reserved;
+    u16 startMin;               // min since local midnight
+    u16 endMin;                 // min since local midnight, through midnight if before the start. The same as
+                                // the start for a single wake
+    u16 periodMin;              // min, 0 for the configured period
+}schedWindow_t;
+
+typedef struct{
+    u8 count;                   // 0 for no windows, the configured period all the time
+    schedWindow_t windows[SCHED_MAX_WINDOWS];
+}schedCalendar_t;
+
+typedef struct{
+    bool enabled;               // otherwise always the configured period, or the refresh windows
+    u32 battCapacityMah;
+    u32 targetDays;             // 0 for no target
+    u8 stretchFromPct;
+    u8 stretchToPct;
+    u8 maxStretch;
+    u32 maxPeriodS;
+    u32 quietStartS;            // S since local midnight, the same start and end for no quiet hours
+    u32 quietEndS;
+    const schedCalendar_t *calendar;    // the refresh windows, NULL for none
+}schedPolicy_t;
+
+typedef struct{
+    u32 basePeriodS;            // S, the configured period
+    bool vBusGood;              // on external power
+    bool battPresent;
+    u8 battPct;
+    float refreshMah;           // mAh, the measured charge of a refresh, 0 if not measured yet
+    float baselineMa;           // mA, the current without the refreshes, 0 if not known
+    bool timeValid;             // the clock is set, and so is the next field
+    u32 localTimeS;             // S since local midnight
+    u8 weekday;                 // 0 for Sunday, as tm_wday
+}schedInput_t;
+
+/**
+ * Fills a policy from the Kconfig options, without refresh windows
+ */
+void schedPolicyDefault(schedPolicy_t *policy, u32 battCapacityMah);
+
+/**
+ * Gets the period until the next image
+ *
+ * @param reason what decided it, may be NULL
+ */
+u32 schedNextPeriodS(const schedPolicy_t *policy, const schedInput_t *in, schedReason_e *reason);
+
+/**
+ * Parses a schedule description: comma separated windows of "[days ]HH:MM[-HH:MM][/min]". The days are
+ * a day, a range or a list of both, such as "sat", "mon-fri" or "mon+wed+fri", every day if left out. A
+ * window without an end is a single wake, and one without a period takes the configured period. An empty
+ * description has no windows
+ *
+ * "07:00, 18:00" changes the image at 7:00 and 18:00, "mon-fri 09:00-17:00/30" every 30 min in office hours
+ *
+ * Returns 0 on success, non-zero if invalid, leaving cal as is
+ */
+int schedCalendarParse(const char *spec, schedCalendar_t *cal);
+
+/**
+ * Writes a calendar as a schedule description, the one it was parsed from give or take the spacing
+ */
+void schedCalendarToStr(const schedCalendar_t *cal, char *out, u32 len);
+
+/**
+ * Gets the S from localTimeS of weekday to the next wake of the refresh windows, more than
+ * SCHED_WAKE_SLACK_S away. The periods are multiplied by stretch
+ *
+ * Returns 0 if there are no windows
+ */
+u32 schedCalendarNextS(const schedCalendar_t *cal, u8 weekday, u32 localTimeS, u32 basePeriodS, float stretch);
+
+const char* schedReasonToStr(schedReason_e reason);
+
+#endif
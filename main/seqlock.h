@@ -0,0 +1,125 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <string.h>
+#include <stdbool.h>
+#ifndef UNIT_TEST
+#include "freertos/FreeRTOS.h"
+#else
+#include <sched.h>
+#endif
+
+#include "common.h"
+
+/**
+ * A sequence lock, for small data read far more often than written. A reader copies the data out and
+ * tries again if a write happened in the meantime, so readers never wait on a lock or hold up a writer
+ *
+ * The sequence is odd while a write is in progress. Writers are not kept from each other, the user must
+ * serialize them (usually with a mutex that also covers the read-modify-write)
+ *
+ * On the ESP the write itself is done in a critical section. A reader preempting a writer on the same
+ * core would otherwise spin on an odd sequence forever
+ */
+typedef struct{
+    u32 seq;
+#ifndef UNIT_TEST
+    portMUX_TYPE mux;
+#endif
+}seqlock_t;
+
+#ifndef UNIT_TEST
+#define SEQLOCK_INIT            { .seq = 0, .mux = portMUX_INITIALIZER_UNLOCKED }
+#define SEQLOCK_RELAX()         do{}while(0)
+#else
+#define SEQLOCK_INIT            { .seq = 0 }
+#define SEQLOCK_RELAX()         sched_yield()       // the writer may be a descheduled thread
+#endif
+
+/**
+ * Starts a read, waiting out a write in progress. Read the data, then check seqlockReadRetry()
+ *
+ * @param retries incremented for every spin, can be NULL
+ *
+ * Returns the sequence to give seqlockReadRetry()
+ */
+static inline u32 seqlockReadBegin(const seqlock_t *lock, u32 *retries){
+    u32 start;
+
+    for(EVER){
+        start = __atomic_load_n(&lock->seq, __ATOMIC_ACQUIRE);
+        if(!(start & 1)){
+            return start;
+        }
+        if(retries){
+            (*retries)++;
+        }
+        SEQLOCK_RELAX();
+    }
+}
+
+/**
+ * Whether a write happened since seqlockReadBegin(), and what was read must be read again
+ */
+static inline bool seqlockReadRetry(const seqlock_t *lock, u32 start){
+    // the reads must be done before the sequence is checked again
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&lock->seq, __ATOMIC_RELAXED) != start;
+}
+
+/**
+ * Copies out a consistent snapshot of src
+ *
+ * Returns how many times the copy had to be retried, a measure of contention
+ */
+static inline u32 seqlockRead(const seqlock_t *lock, void *dst, const void *src, u32 len){
+    u32 start;
+    u32 retries = 0;
+
+    for(EVER){
+        start = seqlockReadBegin(lock, &retries);
+        memcpy(dst, src, len);
+        if(!seqlockReadRetry(lock, start)){
+            return retries;
+        }
+        retries++;
+    }
+}
+
+/**
+ * Starts a write, for changes that aren't a single copy. Keep it short, on the ESP it's a critical
+ * section until seqlockWriteEnd(). Writers must be serialized
+ */
+static inline void seqlockWriteBegin(seqlock_t *lock){
+#ifndef UNIT_TEST
+    portENTER_CRITICAL(&lock->mux);
+#endif
+    __atomic_store_n(&lock->seq, lock->seq + 1, __ATOMIC_RELAXED);
+    // readers must see the odd sequence before any of the data changes
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlockWriteEnd(seqlock_t *lock){
+    __atomic_store_n(&lock->seq, lock->seq + 1, __ATOMIC_RELEASE);
+#ifndef UNIT_TEST
+    portEXIT_CRITICAL(&lock->mux);
+#endif
+}
+
+/**
+ * Copies src over dst as a single change, as seen by seqlockRead(). Writers must be serialized
+ */
+static inline void seqlockWrite(seqlock_t *lock, void *dst, const void *src, u32 len){
+    seqlockWriteBegin(lock);
+    memcpy(dst, src, len);
+    seqlockWriteEnd(lock);
+}
+
+/**
+ * How many writes were done, for stats
+ */
+static inline u32 seqlockGetWrites(const seqlock_t *lock){
+    return __atomic_load_n(&lock->seq, __ATOMIC_RELAXED) / 2;
+}
+
+#endif
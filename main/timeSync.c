@@ -0,0 +1,208 @@
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_netif_sntp.h"
+#include "nvs_flash.h"
+
+#include "common.h"
+#include "main.h"
+#include "timeSync.h"
+
+static const char *TAG = "timeSync";
+
+// kept through deep sleep, like the clock itself
+typedef struct{
+    u32 magic;                  // TIME_SYNC_MAGIC if the rest is valid
+    u8 source;                  // timeSrc_e
+    u32 lastSetS;
+    char tz[TIME_SYNC_TZ_LEN];
+}timeSyncRtc_t;
+RTC_NOINIT_ATTR static timeSyncRtc_t timeRtc;
+#define TIME_SYNC_MAGIC         0x54494D45
+
+static SemaphoreHandle_t timeMutex;         // protects timeRtc and the counts
+static nvs_handle_t timeNvsHandle;
+static bool timeNvsOpen = false;
+static u32 sntpSyncs;
+static u32 clientSets;
+
+static void applyTz(const char *tz){
+    setenv("TZ", tz, 1);
+    tzset();
+}
+
+/**
+ * Notes down who set the clock, and picks the next playlist image by the new time
+ */
+static void clockWasSet(timeSrc_e src){
+    xSemaphoreTake(timeMutex, portMAX_DELAY);
+    timeRtc.source = src;
+    timeRtc.lastSetS = time(NULL);
+    if(src == TIME_SRC_SNTP){
+        sntpSyncs++;
+    } else {
+        clientSets++;
+    }
+    xSemaphoreGive(timeMutex);
+
+    ESP_LOGI(TAG, "Clock set by %s to %lu", timeSrcToStr(src), (u32)time(NULL));
+    playlistReschedule();
+}
+
+/**
+ * Called by the SNTP client, which already set the clock
+ */
+static void sntpSyncCb(struct timeval *tv){
+    clockWasSet(TIME_SRC_SNTP);
+}
+
+void timeSyncInit(void){
+    char tz[TIME_SYNC_TZ_LEN];
+    size_t len = sizeof(tz);
+    esp_err_t err;
+
+    timeMutex = xSemaphoreCreateMutex();
+    configASSERT( timeMutex );
+
+    // RTC memory is garbage after a power on, and the clock is back to 1970
+    if(esp_reset_reason() == ESP_RST_POWERON || timeRtc.magic != TIME_SYNC_MAGIC){
+        memset(&timeRtc, 0, sizeof(timeRtc));
+        timeRtc.magic = TIME_SYNC_MAGIC;
+        strncpy(timeRtc.tz, CONFIG_APP_TZ, TIME_SYNC_TZ_LEN-1);
+    }
+
+    err = nvs_open(TIME_SYNC_NVS_ID, NVS_READWRITE, &timeNvsHandle);
+    if(err == ESP_OK){
+        timeNvsOpen = true;
+        if(nvs_get_str(timeNvsHandle, TIME_SYNC_TZ_KEY, tz, &len) == ESP_OK){
+            strcpy(timeRtc.tz, tz);
+        }
+    } else {
+        ESP_LOGW(TAG, "Unable to open NVS, the time zone won't be saved. err %d", err);
+    }
+    applyTz(timeRtc.tz);
+
+    if(CONFIG_APP_SNTP_SERVER[0]){
+        esp_sntp_config_t sntpConf = ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_APP_SNTP_SERVER);
+        sntpConf.sync_cb = sntpSyncCb;
+        // it keeps trying in the background, and syncs again every CONFIG_LWIP_SNTP_UPDATE_DELAY
+        if(esp_netif_sntp_init(&sntpConf) != ESP_OK){
+            ESP_LOGW(TAG, "Unable to start SNTP");
+        } else {
+            ESP_LOGI(TAG, "SNTP from %s", CONFIG_APP_SNTP_SERVER);
+        }
+    }
+}
+
+void timeSyncWake(void){
+    if(timeRtc.magic == TIME_SYNC_MAGIC){
+        applyTz(timeRtc.tz);
+    }
+}
+
+int timeSyncSetFromClient(double epochS, bool force){
+    struct timeval tv;
+    time_t now = time(NULL);
+    bool sntpRecent;
+
+    if(!timeSyncEpochValid(epochS)){
+        return -1;
+    }
+    if(!force){
+        xSemaphoreTake(timeMutex, portMAX_DELAY);
+        sntpRecent = timeRtc.source == TIME_SRC_SNTP && now - timeRtc.lastSetS < TIME_SYNC_SNTP_TRUST_S;
+        xSemaphoreGive(timeMutex);
+        if(sntpRecent || (timeSyncIsValid() && fabs(epochS - now) < TIME_SYNC_CLIENT_DIFF_S)){
+            return 1;
+        }
+    }
+
+    tv.tv_sec = epochS;
+    tv.tv_usec = (epochS - tv.tv_sec) * 1000000;
+    settimeofday(&tv, NULL);
+    clockWasSet(TIME_SRC_CLIENT);
+    return 0;
+}
+
+void timeSyncFromReq(httpd_req_t *req){
+    char val[24];
+    char *end;
+    double epochS;
+
+    if(httpd_req_get_hdr_value_str(req, TIME_SYNC_HDR, val, sizeof(val)) != ESP_OK){
+        return;
+    }
+    epochS = strtod(val, &end);
+    if(end != val){
+        timeSyncSetFromClient(epochS, false);
+    }
+}
+
+bool timeSyncTzValid(const char *tz){
+    u32 len = strlen(tz);
+
+    if(len == 0 || len >= TIME_SYNC_TZ_LEN){
+        return false;
+    }
+    for(u32 i = 0; i < len; i++){
+        if(!isprint((unsigned char)tz[i])){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool timeSyncEpochValid(double epochS){
+    return epochS >= TIME_SYNC_MIN_EPOCH_S && epochS < TIME_SYNC_MAX_EPOCH_S;
+}
+
+int timeSyncSetTz(const char *tz){
+    if(!timeSyncTzValid(tz)){
+        return -1;
+    }
+
+    xSemaphoreTake(timeMutex, portMAX_DELAY);
+    strcpy(timeRtc.tz, tz);
+    applyTz(timeRtc.tz);
+    xSemaphoreGive(timeMutex);
+
+    // rarely changed, so no debounce like persist.h
+    if(timeNvsOpen && (nvs_set_str(timeNvsHandle, TIME_SYNC_TZ_KEY, tz) != ESP_OK ||
+                       nvs_commit(timeNvsHandle) != ESP_OK)){
+        ESP_LOGW(TAG, "Unable to save the time zone");
+    }
+    playlistReschedule();
+    return 0;
+}
+
+bool timeSyncIsValid(void){
+    return time(NULL) >= TIME_SYNC_MIN_EPOCH_S;
+}
+
+void timeSyncGetInfo(timeSyncInfo_t *out){
+    xSemaphoreTake(timeMutex, portMAX_DELAY);
+    out->source = timeRtc.source;
+    out->lastSetS = timeRtc.lastSetS;
+    out->sntpSyncs = sntpSyncs;
+    out->clientSets = clientSets;
+    memcpy(out->tz, timeRtc.tz, TIME_SYNC_TZ_LEN);
+    xSemaphoreGive(timeMutex);
+    out->valid = timeSyncIsValid();
+}
+
+const char* timeSrcToStr(timeSrc_e src){
+    switch(src){
+        case TIME_SRC_NONE:     return "none";
+        case TIME_SRC_SNTP:     return "sntp";
+        case TIME_SRC_CLIENT:   return "client";
+        default:                return "unknown";
+    }
+}
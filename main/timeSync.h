@@ -0,0 +1,103 @@
+#ifndef TIME_SYNC_H
+#define TIME_SYNC_H
+
+#ifndef UNIT_TEST
+#include "sdkconfig.h"
+#include "esp_http_server.h"
+#else
+#include "mock.h"
+#endif
+
+#include <stdbool.h>
+#include "common.h"
+
+/**
+ * The wall clock, for the refresh windows of schedule.h. The RTC keeps the system time through deep sleep
+ * but not a power loss, so it's set from a local SNTP server if one is configured, and from the clients
+ * otherwise: a request with an X-Client-Time header of its Unix time sets the clock when it's off, unless
+ * SNTP set it recently. Nothing here needs the internet
+ *
+ * The time zone of the windows is saved to NVS, and kept in RTC memory for the low power wakes
+ */
+
+#ifndef CONFIG_APP_SNTP_SERVER
+#define CONFIG_APP_SNTP_SERVER      ""
+#endif
+#ifndef CONFIG_APP_TZ
+#define CONFIG_APP_TZ               "UTC0"
+#endif
+
+#define TIME_SYNC_NVS_ID            "time"      // the NVS namespace
+#define TIME_SYNC_TZ_KEY            "tz"
+#define TIME_SYNC_TZ_LEN            48          // of a POSIX TZ string, the NUL included
+#define TIME_SYNC_HDR               "X-Client-Time"
+#define TIME_SYNC_MIN_EPOCH_S       1704067200  // S, 2024-01-01, a clock before this was never set
+#define TIME_SYNC_MAX_EPOCH_S       4102444800  // S, 2100-01-01, a client's time after this is bogus, likely in mS
+#define TIME_SYNC_CLIENT_DIFF_S     5           // S, a client's time closer than this to the clock is ignored,
+                                                // it's no more accurate than the request latency
+#define TIME_SYNC_SNTP_TRUST_S      (24 * 3600) // S, clients don't set the clock for this long after SNTP did
+
+typedef enum{
+    TIME_SRC_NONE,              // not set since power on
+    TIME_SRC_SNTP,
+    TIME_SRC_CLIENT,
+    TIME_SRC_CNT,
+}timeSrc_e;
+
+typedef struct{
+    bool valid;                 // the clock is set
+    timeSrc_e source;           // of the last set
+    u32 lastSetS;               // S, Unix time of the last set, 0 if never
+    u32 sntpSyncs;              // since boot
+    u32 clientSets;             // since boot
+    char tz[TIME_SYNC_TZ_LEN];
+}timeSyncInfo_t;
+
+/**
+ * Restores the time zone, and starts SNTP if a server is configured. Call after wifiInit()
+ */
+void timeSyncInit(void);
+
+/**
+ * Applies the time zone kept through deep sleep, for the low power wake which doesn't call timeSyncInit()
+ */
+void timeSyncWake(void);
+
+/**
+ * Sets the clock to a client's time
+ *
+ * @param force set it even if it's close, or SNTP set it recently
+ *
+ * Returns 0 if set, non-zero if not
+ */
+int timeSyncSetFromClient(double epochS, bool force);
+
+/**
+ * Sets the clock from a request's X-Client-Time header, if it has one, see timeSyncSetFromClient()
+ */
+void timeSyncFromReq(httpd_req_t *req);
+
+/**
+ * Sets and saves the time zone, as a POSIX TZ string such as "CET-1CEST,M3.5.0,M10.5.0/3"
+ *
+ * Returns 0 on success, non-zero if it's invalid
+ */
+int timeSyncSetTz(const char *tz);
+
+/**
+ * Whether timeSyncSetTz() would take it, to check a request before changing anything
+ */
+bool timeSyncTzValid(const char *tz);
+
+/**
+ * Whether timeSyncSetFromClient() would take it when forced
+ */
+bool timeSyncEpochValid(double epochS);
+
+bool timeSyncIsValid(void);
+
+void timeSyncGetInfo(timeSyncInfo_t *out);
+
+const char* timeSrcToStr(timeSrc_e src);
+
+#endif
@@ -0,0 +1,152 @@
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#ifndef UNIT_TEST
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#else
+#include <time.h>
+#include <pthread.h>
+#endif
+
+#include "common.h"
+#include "trace.h"
+
+#ifdef CONFIG_APP_TRACE_ENABLE
+#ifndef UNIT_TEST
+EXT_RAM_BSS_ATTR static traceEvent_t traceBuf[TRACE_BUF_LEN];
+#else
+static traceEvent_t traceBuf[TRACE_BUF_LEN];
+#endif
+
+static const char tracePhaseChars[] = {
+    [TRACE_PH_BEGIN] = 'B',
+    [TRACE_PH_END] = 'E',
+    [TRACE_PH_INSTANT] = 'i',
+};
+#endif
+
+static u32 traceHead;                   // the next event to write, only ever increments
+
+#ifndef UNIT_TEST
+static inline int64_t traceGetTimeUs(void){
+    return esp_timer_get_time();
+}
+
+static inline u32 traceGetTid(void){
+    return (u32)(uintptr_t)xTaskGetCurrentTaskHandle();
+}
+
+static inline u8 traceGetCore(void){
+    return xPortGetCoreID();
+}
+#else
+static inline int64_t traceGetTimeUs(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline u32 traceGetTid(void){
+    return (u32)(uintptr_t)pthread_self();
+}
+
+static inline u8 traceGetCore(void){
+    return 0;
+}
+#endif
+
+void traceLog(const char *name, tracePhase_e phase){
+#ifdef CONFIG_APP_TRACE_ENABLE
+    traceEvent_t *e;
+    u32 idx;
+
+    // claiming a slot is the only shared write, so tasks on both cores can log without a lock
+    idx = __atomic_fetch_add(&traceHead, 1, __ATOMIC_RELAXED);
+    e = &traceBuf[idx % TRACE_BUF_LEN];
+
+    // the name is cleared while the slot is being filled, so the export can skip half written events
+    __atomic_store_n(&e->name, NULL, __ATOMIC_RELAXED);
+    e->tsUs = traceGetTimeUs();
+    e->tid = traceGetTid();
+    e->phase = phase;
+    e->core = traceGetCore();
+    __atomic_store_n(&e->name, name, __ATOMIC_RELEASE);
+#else
+    (void)name;
+    (void)phase;
+#endif
+}
+
+u32 traceGetEventCount(void){
+    return __atomic_load_n(&traceHead, __ATOMIC_RELAXED);
+}
+
+void traceClear(void){
+    __atomic_store_n(&traceHead, 0, __ATOMIC_RELAXED);
+}
+
+int traceExport(traceWriteFn_t writeFn, void *ctx){
+    char chunk[TRACE_EXPORT_CHUNK_LEN];
+    u32 chunkLen;
+    int ret;
+
+    chunkLen = snprintf(chunk, sizeof(chunk), "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+#ifdef CONFIG_APP_TRACE_ENABLE
+    const traceEvent_t *src;
+    traceEvent_t e;
+    const char *sep = "";
+    int n;
+    u32 head = traceGetEventCount();
+    u32 idx = head > TRACE_BUF_LEN ? head - TRACE_BUF_LEN : 0;
+
+    for(; idx < head; idx++){
+        src = &traceBuf[idx % TRACE_BUF_LEN];
+        e.name = __atomic_load_n(&src->name, __ATOMIC_ACQUIRE);
+        if(e.name == NULL){
+            continue;
+        }
+        e.tsUs = src->tsUs;
+        e.tid = src->tid;
+        e.phase = src->phase;
+        e.core = src->core;
+
+        for(EVER){
+            n = snprintf(chunk + chunkLen, sizeof(chunk) - chunkLen,
+                         "%s{\"name\":\"%s\",\"ph\":\"%c\",%s\"ts\":%" PRId64 ",\"pid\":1,\"tid\":%" PRIu32
+                         ",\"args\":{\"core\":%u}}", sep, e.name, tracePhaseChars[e.phase],
+                         e.phase == TRACE_PH_INSTANT ? "\"s\":\"t\"," : "", e.tsUs, e.tid, e.core);
+            if(n < 0){
+                break;
+            }
+            if(chunkLen + (u32)n < sizeof(chunk)){
+                chunkLen += n;
+                sep = ",";
+                break;
+            }
+            if(chunkLen == 0){
+                break;              // a single event does not fit, only possible with a silly long name
+            }
+            ret = writeFn(ctx, chunk, chunkLen);
+            if(ret){
+                return ret;
+            }
+            chunkLen = 0;
+        }
+    }
+#endif
+
+    if(chunkLen + 3 > sizeof(chunk)){
+        ret = writeFn(ctx, chunk, chunkLen);
+        if(ret){
+            return ret;
+        }
+        chunkLen = 0;
+    }
+    chunkLen += snprintf(chunk + chunkLen, sizeof(chunk) - chunkLen, "]}");
+    return writeFn(ctx, chunk, chunkLen);
+}
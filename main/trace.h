@@ -0,0 +1,83 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifndef UNIT_TEST
+#include "sdkconfig.h"
+#endif
+
+#include "common.h"
+
+/**
+ * Timeline profiler. TRACE_BEGIN() and TRACE_END() pairs log events to a ring buffer, which can be
+ * exported as Chrome trace event JSON (open in chrome://tracing or ui.perfetto.dev)
+ *
+ * Enabled with CONFIG_APP_TRACE_ENABLE, otherwise the macros compile to nothing. The name must be a
+ * string that outlives the trace (a literal), only its pointer is stored. Pairs are matched per task,
+ * so a BEGIN and its END must be called from the same task
+ *
+ * The unit tests build it on the host with -DCONFIG_APP_TRACE_ENABLE, and write the trace to a file
+ */
+
+#ifndef CONFIG_APP_TRACE_BUF_LEN
+#define CONFIG_APP_TRACE_BUF_LEN    4096
+#endif
+
+#define TRACE_BUF_LEN           CONFIG_APP_TRACE_BUF_LEN    // events, oldest are overwritten once full
+#define TRACE_EXPORT_CHUNK_LEN  2048                        // bytes, how much JSON is formatted at a time
+
+typedef enum{
+    TRACE_PH_BEGIN,
+    TRACE_PH_END,
+    TRACE_PH_INSTANT,           // single point in time, not part of a pair
+}tracePhase_e;
+
+typedef struct{
+    const char *name;
+    int64_t tsUs;               // uS since boot
+    u32 tid;                    // the task that logged it
+    u8 phase;                   // tracePhase_e
+    u8 core;
+}traceEvent_t;
+
+/**
+ * Called by traceExport() for every formatted chunk of JSON
+ *
+ * Returns 0 to continue, anything else aborts the export
+ */
+typedef int (*traceWriteFn_t)(void *ctx, const char *dat, u32 len);
+
+#ifdef CONFIG_APP_TRACE_ENABLE
+#define TRACE_BEGIN(_name)      traceLog((_name), TRACE_PH_BEGIN)
+#define TRACE_END(_name)        traceLog((_name), TRACE_PH_END)
+#define TRACE_INSTANT(_name)    traceLog((_name), TRACE_PH_INSTANT)
+#else
+#define TRACE_BEGIN(_name)      do{}while(0)
+#define TRACE_END(_name)        do{}while(0)
+#define TRACE_INSTANT(_name)    do{}while(0)
+#endif
+
+/**
+ * Logs an event, safe to call from any task on any core. Use the TRACE_ macros instead
+ */
+void traceLog(const char *name, tracePhase_e phase);
+
+/**
+ * Exports the events in the buffer as Chrome trace event JSON, oldest first
+ *
+ * Events logged while exporting may or may not be included
+ *
+ * Returns 0 on success, the write function's return if it aborted
+ */
+int traceExport(traceWriteFn_t writeFn, void *ctx);
+
+/**
+ * Gets how many events were logged since boot, including the overwritten ones
+ */
+u32 traceGetEventCount(void);
+
+/**
+ * Throws away all events
+ */
+void traceClear(void);
+
+#endif
@@ -0,0 +1,293 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "esp_log.h"
+#include "esp_wifi.h"
+#include "esp_event.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+
+#include "common.h"
+#include "pmicEvt.h"
+#include "pwrStats.h"
+#include "wifiPwr.h"
+
+static const char *TAG = "wifiPwr";
+
+// what a profile sets
+typedef struct{
+    wifi_ps_type_t ps;
+    u8 listenInterval;          // beacon intervals, only WIFI_PS_MAX_MODEM goes by it
+    u16 apBeaconTu;             // TU
+}wifiPwrProfile_t;
+
+static const wifiPwrProfile_t profiles[WIFI_PWR_PROFILE_CNT] = {
+    [WIFI_PWR_PERFORMANCE]  = {WIFI_PS_NONE,        3,  100},
+    [WIFI_PWR_BALANCED]     = {WIFI_PS_MIN_MODEM,   3,  100},
+    [WIFI_PWR_MAX_SAVE]     = {WIFI_PS_MAX_MODEM,   10, 300},
+};
+
+static SemaphoreHandle_t pwrMutex;              // protects everything below
+static nvs_handle_t pwrNvsHandle;
+static bool pwrNvsOpen = false;
+static wifiPwrProfile_e profile = CONFIG_APP_WIFI_PWR_PROFILE;
+static u32 idleOffMin = CONFIG_APP_WIFI_IDLE_OFF_MIN;
+static bool boosted;
+static bool radioOff;
+static u32 busy;
+static int64_t lastActivityUs;                  // the last request ended or started, or a client showed up
+static u32 boosts;
+static u32 idleOffs;
+
+// one shot, they check lastActivityUs when they fire and go again for the rest if it moved, so a request
+// doesn't have to reset them
+static TimerHandle_t boostTimer;
+static TimerHandle_t idleTimer;
+
+static TickType_t usToTicks(u64 us){
+    TickType_t ticks = us * configTICK_RATE_HZ / 1000000;
+
+    return ticks ? ticks : 1;
+}
+
+/**
+ * Sets the power save of the station, and counts its time in pwrStats if it's connected. Call holding
+ * pwrMutex
+ */
+static void applyPs(wifi_ps_type_t ps){
+    wifi_ap_record_t ap;
+
+    if(esp_wifi_set_ps(ps) != ESP_OK){
+        return;
+    }
+    // the AP can't sleep, and a station only does once connected
+    if(esp_wifi_sta_get_ap_info(&ap) == ESP_OK){
+        pwrStatsSetWifi(ps == WIFI_PS_NONE ? PWR_WIFI_ACTIVE : PWR_WIFI_MODEM_SLEEP);
+    }
+}
+
+/**
+ * Arms the idle off for its full time from now. Call holding pwrMutex
+ */
+static void idleTimerRestart(void){
+    if(idleOffMin == 0){
+        xTimerStop(idleTimer, 0);
+        return;
+    }
+    xTimerChangePeriod(idleTimer, usToTicks((u64)idleOffMin * 60 * 1000000), 0);
+}
+
+static void boostTimerCb(TimerHandle_t timer){
+    int64_t idleUs;
+
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    idleUs = esp_timer_get_time() - lastActivityUs;
+    if(!boosted){
+        // nothing to do
+    } else if(busy == 0 && idleUs >= WIFI_PWR_BOOST_MS * 1000){
+        boosted = false;
+        applyPs(profiles[profile].ps);
+    } else {
+        xTimerChangePeriod(boostTimer, usToTicks(busy ? WIFI_PWR_BOOST_MS * 1000 : WIFI_PWR_BOOST_MS * 1000 - idleUs), 0);
+    }
+    xSemaphoreGive(pwrMutex);
+}
+
+static void idleTimerCb(TimerHandle_t timer){
+    wifi_sta_list_t stas;
+    int64_t idleUs;
+    int64_t offUs;
+    bool stop = false;
+
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    idleUs = esp_timer_get_time() - lastActivityUs;
+    offUs = (int64_t)idleOffMin * 60 * 1000000;
+    if(idleOffMin == 0 || radioOff){
+        // set to never since, or already off
+    } else if(busy || (esp_wifi_ap_get_sta_list(&stas) == ESP_OK && stas.num > 0)){
+        idleTimerRestart();
+    } else if(idleUs >= offUs){
+        radioOff = true;
+        idleOffs++;
+        stop = true;
+    } else {
+        xTimerChangePeriod(idleTimer, usToTicks(offUs - idleUs), 0);
+    }
+    xSemaphoreGive(pwrMutex);
+
+    // outside the mutex, the Wi-Fi events it raises may be waiting on it. radioOff is already set, so the
+    // disconnect it raises isn't taken for a failed connect
+    if(stop){
+        ESP_LOGI(TAG, "No clients for %lu min, turning the radio off", idleOffMin);
+        esp_wifi_stop();
+    }
+}
+
+/**
+ * Runs on the timer task rather than the caller's, like the timer callbacks
+ */
+static void wakeDeferred(void *arg1, uint32_t arg2){
+    bool start;
+
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    start = radioOff;
+    radioOff = false;
+    lastActivityUs = esp_timer_get_time();
+    idleTimerRestart();
+    xSemaphoreGive(pwrMutex);
+
+    if(start){
+        ESP_LOGI(TAG, "Turning the radio back on");
+        esp_wifi_start();
+    }
+}
+
+static void pmicKeyHandler(void *arg, esp_event_base_t base, int32_t id, void *data){
+    wifiPwrWake();
+}
+
+void wifiPwrInit(void){
+    u8 savedProfile;
+    u32 savedIdleOff;
+    esp_err_t err;
+
+    pwrMutex = xSemaphoreCreateMutex();
+    boostTimer = xTimerCreate("wifiBoost", pdMS_TO_TICKS(WIFI_PWR_BOOST_MS), pdFALSE, NULL, boostTimerCb);
+    idleTimer = xTimerCreate("wifiIdle", 1, pdFALSE, NULL, idleTimerCb);
+    configASSERT( pwrMutex && boostTimer && idleTimer );
+
+    err = nvs_open(WIFI_PWR_NVS_ID, NVS_READWRITE, &pwrNvsHandle);
+    if(err == ESP_OK){
+        pwrNvsOpen = true;
+        if(nvs_get_u8(pwrNvsHandle, WIFI_PWR_PROFILE_KEY, &savedProfile) == ESP_OK && savedProfile < WIFI_PWR_PROFILE_CNT){
+            profile = savedProfile;
+        }
+        if(nvs_get_u32(pwrNvsHandle, WIFI_PWR_IDLE_OFF_KEY, &savedIdleOff) == ESP_OK &&
+           savedIdleOff <= WIFI_PWR_IDLE_OFF_MAX_MIN){
+            idleOffMin = savedIdleOff;
+        }
+    } else {
+        ESP_LOGW(TAG, "Unable to open NVS, the profile won't be saved. err %d", err);
+    }
+
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    esp_wifi_set_ps(profiles[profile].ps);
+    lastActivityUs = esp_timer_get_time();
+    idleTimerRestart();
+    xSemaphoreGive(pwrMutex);
+
+    ESP_ERROR_CHECK(esp_event_handler_register(PMIC_EVENT, PMIC_EVT_KEY_SHORT, pmicKeyHandler, NULL));
+    ESP_LOGI(TAG, "Profile %s, idle off after %lu min", wifiPwrProfileToStr(profile), idleOffMin);
+}
+
+u8 wifiPwrListenInterval(void){
+    return profiles[profile].listenInterval;
+}
+
+u16 wifiPwrApBeaconTu(void){
+    return profiles[profile].apBeaconTu;
+}
+
+void wifiPwrBusyBegin(void){
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    busy++;
+    lastActivityUs = esp_timer_get_time();
+    if(!boosted && profiles[profile].ps != WIFI_PS_NONE){
+        boosted = true;
+        boosts++;
+        applyPs(WIFI_PS_NONE);
+        xTimerChangePeriod(boostTimer, pdMS_TO_TICKS(WIFI_PWR_BOOST_MS), 0);
+    }
+    xSemaphoreGive(pwrMutex);
+}
+
+void wifiPwrBusyEnd(void){
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    if(busy){
+        busy--;
+    }
+    lastActivityUs = esp_timer_get_time();
+    xSemaphoreGive(pwrMutex);
+}
+
+void wifiPwrActivity(void){
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    lastActivityUs = esp_timer_get_time();
+    xSemaphoreGive(pwrMutex);
+}
+
+void wifiPwrWake(void){
+    if(xTimerPendFunctionCall(wakeDeferred, NULL, 0, 0) != pdPASS){
+        ESP_LOGW(TAG, "Timer queue full, the radio stays as it is");
+    }
+}
+
+bool wifiPwrIsOff(void){
+    bool off;
+
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    off = radioOff;
+    xSemaphoreGive(pwrMutex);
+    return off;
+}
+
+int wifiPwrSet(wifiPwrProfile_e newProfile, u32 newIdleOffMin){
+    if(newProfile >= WIFI_PWR_PROFILE_CNT || newIdleOffMin > WIFI_PWR_IDLE_OFF_MAX_MIN){
+        return -1;
+    }
+
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    profile = newProfile;
+    idleOffMin = newIdleOffMin;
+    // a boost goes back to the new one once it ends
+    if(!boosted){
+        applyPs(profiles[profile].ps);
+    }
+    lastActivityUs = esp_timer_get_time();
+    idleTimerRestart();
+    xSemaphoreGive(pwrMutex);
+
+    // rarely changed, so no debounce like persist.h
+    if(pwrNvsOpen && (nvs_set_u8(pwrNvsHandle, WIFI_PWR_PROFILE_KEY, newProfile) != ESP_OK ||
+                      nvs_set_u32(pwrNvsHandle, WIFI_PWR_IDLE_OFF_KEY, newIdleOffMin) != ESP_OK ||
+                      nvs_commit(pwrNvsHandle) != ESP_OK)){
+        ESP_LOGW(TAG, "Unable to save the power profile");
+    }
+    return 0;
+}
+
+void wifiPwrGetInfo(wifiPwrInfo_t *out){
+    pwrStats_t pwr;
+
+    xSemaphoreTake(pwrMutex, portMAX_DELAY);
+    out->profile = profile;
+    out->idleOffMin = idleOffMin;
+    out->boosted = boosted;
+    out->off = radioOff;
+    out->busy = busy;
+    out->boosts = boosts;
+    out->idleOffs = idleOffs;
+    xSemaphoreGive(pwrMutex);
+
+    pwrStatsGet(&pwr);
+    out->radioOnUs = pwr.uptimeUs - pwr.wifiUs[PWR_WIFI_OFF];
+}
+
+const char* wifiPwrProfileToStr(wifiPwrProfile_e profile){
+    switch(profile){
+        case WIFI_PWR_PERFORMANCE:  return "performance";
+        case WIFI_PWR_BALANCED:     return "balanced";
+        case WIFI_PWR_MAX_SAVE:     return "maxSave";
+        default:                    return "unknown";
+    }
+}
+
+wifiPwrProfile_e wifiPwrProfileFromStr(const char *str){
+    for(u32 i = 0; i < WIFI_PWR_PROFILE_CNT; i++){
+        if(strcmp(str, wifiPwrProfileToStr(i)) == 0){
+            return i;
+        }
+    }
+    return WIFI_PWR_PROFILE_CNT;
+}
@@ -0,0 +1,108 @@
+#ifndef WIFI_PWR_H
+#define WIFI_PWR_H
+
+#ifndef UNIT_TEST
+#include "sdkconfig.h"
+#endif
+
+#include <stdbool.h>
+#include "common.h"
+
+/**
+ * Power save of the Wi-Fi radio. The profile picks the modem sleep and listen interval of an idle station,
+ * and the beacon interval of the SoftAP, which can't sleep. Requests boost the station to no power save
+ * while they run and for WIFI_PWR_BOOST_MS after, so an upload isn't paced by the beacons
+ *
+ * With an idle off time, the radio is stopped after that long without a request or, as an AP, without a
+ * station connected. A short press of the power key starts it again
+ *
+ * The profile and idle off time are saved to NVS. The listen and beacon intervals only apply from the next
+ * connect, the rest right away
+ */
+
+#ifndef CONFIG_APP_WIFI_PWR_PROFILE
+#define CONFIG_APP_WIFI_PWR_PROFILE     2
+#endif
+#ifndef CONFIG_APP_WIFI_IDLE_OFF_MIN
+#define CONFIG_APP_WIFI_IDLE_OFF_MIN    0
+#endif
+
+#define WIFI_PWR_NVS_ID             "wifiPwr"   // the NVS namespace
+#define WIFI_PWR_PROFILE_KEY        "profile"
+#define WIFI_PWR_IDLE_OFF_KEY       "idleOff"
+#define WIFI_PWR_BOOST_MS           10000       // mS, of no power save after the last request ended
+#define WIFI_PWR_IDLE_OFF_MAX_MIN   1440        // min, the longest idle off time, 0 is never
+
+typedef enum{
+    WIFI_PWR_PERFORMANCE,       // no power save, always boosted
+    WIFI_PWR_BALANCED,          // the station wakes for every DTIM beacon
+    WIFI_PWR_MAX_SAVE,          // the station wakes every listen interval, and the AP beacons less often
+    WIFI_PWR_PROFILE_CNT,
+}wifiPwrProfile_e;
+
+typedef struct{
+    wifiPwrProfile_e profile;
+    u32 idleOffMin;             // min, 0 for never
+    bool boosted;
+    bool off;                   // stopped by the idle off
+    u32 busy;                   // requests running
+    u32 boosts;                 // since boot
+    u32 idleOffs;               // since boot
+    u64 radioOnUs;              // since boot, see pwrStats.h
+}wifiPwrInfo_t;
+
+/**
+ * Loads the profile and applies its power save. Call from wifiInit(), after esp_wifi_init() and the
+ * default event loop
+ */
+void wifiPwrInit(void);
+
+/**
+ * The listen interval of the station, for wifiStartSTA(). In beacon intervals
+ */
+u8 wifiPwrListenInterval(void);
+
+/**
+ * The beacon interval of the SoftAP, for wifiStartAP(). In TU
+ */
+u16 wifiPwrApBeaconTu(void);
+
+/**
+ * Called around anything that moves data for a client, such as an http request or a bulk session. Boosts
+ * the radio until WIFI_PWR_BOOST_MS after the last one ended, and holds off the idle off
+ */
+void wifiPwrBusyBegin(void);
+void wifiPwrBusyEnd(void);
+
+/**
+ * A client showed up without a request, such as a station joining the AP. Holds off the idle off
+ */
+void wifiPwrActivity(void);
+
+/**
+ * Starts the radio again if the idle off stopped it
+ */
+void wifiPwrWake(void);
+
+/**
+ * Whether the idle off stopped the radio. Its disconnect is then not a failed connect to retry
+ */
+bool wifiPwrIsOff(void);
+
+/**
+ * Sets and saves the profile and the idle off time
+ *
+ * Returns 0 on success, non-zero if one is out of range
+ */
+int wifiPwrSet(wifiPwrProfile_e profile, u32 idleOffMin);
+
+void wifiPwrGetInfo(wifiPwrInfo_t *out);
+
+const char* wifiPwrProfileToStr(wifiPwrProfile_e profile);
+
+/**
+ * Returns the profile named, or WIFI_PWR_PROFILE_CNT if none is
+ */
+wifiPwrProfile_e wifiPwrProfileFromStr(const char *str);
+
+#endif
@@ -0,0 +1,113 @@
+#!/bin/python
+"""
+Reference client for the bulk frame port (see main/bulk.h). Needs CONFIG_APP_BULK_PORT_ENABLE on the
+device, or run against the loopback harness with "make test_bulk && ./test_bulk.out serve 3333"
+"""
+import socket
+import struct
+import zlib
+import click
+from pathlib import Path
+import imageProcessor
+
+BULK_MAGIC = 0x4B42
+HEADER_FMT = '<HBBIII'          # magic, type, flags, offset, len, crc
+ACK_FMT = '<HBBI'               # magic, type, stat, crc
+
+MSG_REGION = 1
+MSG_FILE = 2
+MSG_CMD = 3
+
+FLAG_UPDATE = 0x01
+
+CMD_PING = 0
+CMD_UPDATE = 1
+
+MAX_IMAGE_NAME_LEN = 32
+
+STATS = ['ok', 'bad magic', 'bad type', 'bad length', 'bad crc', 'busy', 'io error', 'bad name']
+
+
+class BulkClient:
+    def __init__(self, host: str, port: int):
+        self.sock = socket.create_connection((host, port), timeout=30)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    def close(self):
+        self.sock.close()
+
+    def _recvAll(self, n: int) -> bytes:
+        dat = b''
+        while len(dat) < n:
+            chunk = self.sock.recv(n - len(dat))
+            if not chunk:
+                raise ConnectionError('Connection closed by the device')
+            dat += chunk
+        return dat
+
+    def send(self, msgType: int, payload: bytes = b'', offset: int = 0, flags: int = 0) -> str:
+        """Sends a message and waits for its ack, returns the ack status"""
+        crc = zlib.crc32(payload)
+        self.sock.sendall(struct.pack(HEADER_FMT, BULK_MAGIC, msgType, flags, offset, len(payload), crc) + payload)
+
+        magic, ackType, stat, ackCrc = struct.unpack(ACK_FMT, self._recvAll(struct.calcsize(ACK_FMT)))
+        if magic != BULK_MAGIC or ackType != msgType:
+            raise ValueError(f'Invalid ack: magic {magic:#x} type {ackType}')
+        if stat == 0 and ackCrc != crc:
+            raise ValueError(f'CRC mismatch: sent {crc:#010x}, device got {ackCrc:#010x}')
+        return STATS[stat] if stat < len(STATS) else f'unknown ({stat})'
+
+    def region(self, dat: bytes, offset: int = 0, update: bool = False) -> str:
+        return self.send(MSG_REGION, dat, offset, FLAG_UPDATE if update else 0)
+
+    def file(self, name: str, frame: bytes) -> str:
+        nameField = name.encode()[:MAX_IMAGE_NAME_LEN - 1].ljust(MAX_IMAGE_NAME_LEN, b'\0')
+        return self.send(MSG_FILE, nameField + frame)
+
+    def cmd(self, cmd: int) -> str:
+        return self.send(MSG_CMD, b'', cmd)
+
+
+########## TOP LEVEL GROUP ##########
+@click.group
+@click.option('-u', '--url', type=str, default='192.168.4.1', show_default=True, help='The hostname of the esp32')
+@click.option('-p', '--port', type=int, default=3333, show_default=True, help='The bulk port')
+@click.pass_context
+def cli(ctx: click.Context, url: str, port: int):
+    ctx.obj['client'] = BulkClient(url, port)
+    ctx.call_on_close(ctx.obj['client'].close)
+
+
+@cli.command()
+@click.pass_context
+def ping(ctx: click.Context) -> None:
+    """Checks that the device answers"""
+    print(f'Ping: {ctx.obj["client"].cmd(CMD_PING)}')
+
+@cli.command()
+@click.pass_context
+def update(ctx: click.Context) -> None:
+    """Updates the display"""
+    print(f'Update: {ctx.obj["client"].cmd(CMD_UPDATE)}')
+
+@cli.command()
+@click.argument('image', type=Path)
+@click.option('--update/--no-update', default=True, show_default=True, help='Update the display after')
+@click.pass_context
+def frame(ctx: click.Context, image: Path, update: bool) -> None:
+    """Sends the image IMAGE to the display frame buffer"""
+    rawFb = imageProcessor.createFBFromImage(image)
+    print(f'Frame: {ctx.obj["client"].region(rawFb, 0, update)}')
+
+@cli.command()
+@click.argument('image', type=Path)
+@click.argument('name', type=str)
+@click.pass_context
+def save(ctx: click.Context, image: Path, name: str) -> None:
+    """Saves the image IMAGE on the device's SD card as NAME"""
+    rawFb = imageProcessor.createFBFromImage(image)
+    print(f'Save: {ctx.obj["client"].file(name, rawFb)}')
+
+
+if __name__ == "__main__":
+    cli(obj={})
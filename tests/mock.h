@@ -31,6 +31,7 @@ typedef enum {
 typedef enum{
     ESP_OK,
     ESP_FAIL,
+    ESP_ERR_TIMEOUT = 0x107,
 }esp_err_t;
 
 typedef enum {
@@ -97,7 +98,10 @@ typedef struct{
         .test      = 123,       \
 }
 #define pdMS_TO_TICKS(_X) (_X)
-#define ESP_LOGD(_TAG, __VA) printf(__VA)
+#define ESP_LOGD(_TAG, ...) printf(__VA_ARGS__)
+#define ESP_LOGI(_TAG, ...) printf(__VA_ARGS__)
+#define ESP_LOGW(_TAG, ...) printf(__VA_ARGS__)
+#define ESP_LOGE(_TAG, ...) printf(__VA_ARGS__)
 
 typedef struct httpd_uri {
     const char       *uri;    /*!< The URI to handle */
@@ -108,10 +112,8 @@ typedef struct httpd_uri {
 
 typedef esp_err_t (*httpd_err_handler_func_t)(httpd_req_t *req, httpd_err_code_t error);
 typedef int TickType_t;
-typedef char FIL;
 
 extern const int displayFbMutex;
-extern const int pmicTelemetryMutex;
 
 int xSemaphoreTake(int contextN, int timeout);
 void xSemaphoreGive(int contextN);
@@ -126,11 +128,157 @@ esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const ch
 int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len);
 esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work, void *arg);
 
+// the I2C master driver and FreeRTOS bits the PMIC component uses
+#define CONFIG_I2C_ADDR_AXP2101  0x34
+#define portMAX_DELAY            (-1)
+#define IRAM_ATTR
+#define configASSERT(_X)         do{ if(!(_X)) abort(); }while(0)
+#define ESP_ERROR_CHECK(_X)      do{ if((_X) != ESP_OK) abort(); }while(0)
+
+typedef int SemaphoreHandle_t;
+typedef int BaseType_t;
+typedef void* i2c_master_bus_handle_t;
+typedef void* i2c_master_dev_handle_t;
+typedef enum{
+    I2C_ADDR_BIT_LEN_7,
+}i2c_addr_bit_len_t;
+typedef struct{
+    i2c_addr_bit_len_t dev_addr_length;
+    uint16_t device_address;
+    uint32_t scl_speed_hz;
+}i2c_device_config_t;
+typedef enum{
+    I2C_EVENT_ALIVE,
+    I2C_EVENT_DONE,
+    I2C_EVENT_NACK,
+    I2C_EVENT_TIMEOUT,
+}i2c_master_event_t;
+typedef struct{
+    i2c_master_event_t event;
+}i2c_master_event_data_t;
+typedef bool (*i2c_master_callback_t)(i2c_master_dev_handle_t dev, const i2c_master_event_data_t *evt, void *arg);
+typedef struct{
+    i2c_master_callback_t on_trans_done;
+}i2c_master_event_callbacks_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateCounting(int maxCnt, int initCnt);
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken);
+esp_err_t i2c_master_bus_add_device(i2c_master_bus_handle_t bus, const i2c_device_config_t *cfg,
+                                    i2c_master_dev_handle_t *dev);
+esp_err_t i2c_master_register_event_callbacks(i2c_master_dev_handle_t dev, const i2c_master_event_callbacks_t *cbs,
+                                             void *arg);
+esp_err_t i2c_master_transmit(i2c_master_dev_handle_t dev, const uint8_t *write, size_t writeLen, int timeout);
+esp_err_t i2c_master_transmit_receive(i2c_master_dev_handle_t dev, const uint8_t *write, size_t writeLen,
+                                      uint8_t *read, size_t readLen, int timeout);
+
+// FatFS, with the files in memory in testFileSys.c
+#define FF_MAX_SS                512
+#define FF_MIN_SS                512
+#define FF_MOCK_NAME_LEN         64
+#define FA_READ                  0x01
+#define FA_WRITE                 0x02
+#define FA_OPEN_EXISTING         0x00
+#define FA_CREATE_NEW            0x04
+#define FA_CREATE_ALWAYS         0x08
+#define FA_OPEN_ALWAYS           0x10
+#define AM_DIR                   0x10
+#define WORD_ALIGNED_ATTR
+
+typedef unsigned int UINT;
+typedef uint32_t DWORD;
+typedef enum{
+    FR_OK = 0,
+    FR_DISK_ERR,
+    FR_INT_ERR,
+    FR_NOT_READY,
+    FR_NO_FILE,
+    FR_NO_PATH,
+    FR_INVALID_NAME,
+    FR_DENIED,
+    FR_EXIST,
+    FR_INVALID_OBJECT,
+}FRESULT;
+typedef struct{
+    uint8_t fs_type;
+    uint16_t csize;
+    uint32_t n_fatent;
+    uint32_t free_clst;
+}FATFS;
+typedef struct{
+    int idx;                    // of the mocked file, -1 when closed
+    uint8_t mode;
+    uint32_t fptr;
+}FIL;
+typedef struct{
+    char path[FF_MOCK_NAME_LEN];
+    int next;                   // mocked file to look at next
+}FF_DIR;
+typedef struct{
+    uint32_t fsize;
+    uint16_t fdate;
+    uint16_t ftime;
+    uint8_t fattrib;
+    char fname[FF_MOCK_NAME_LEN];
+}FILINFO;
+typedef int sdmmc_card_t;
+
+extern sdmmc_card_t sdCard;
+
+FRESULT f_mount(FATFS *fs, const char *path, uint8_t opt);
+FRESULT f_open(FIL *fp, const char *path, uint8_t mode);
+FRESULT f_close(FIL *fp);
+FRESULT f_read(FIL *fp, void *buff, UINT btr, UINT *br);
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw);
+FRESULT f_lseek(FIL *fp, uint32_t ofs);
+FRESULT f_stat(const char *path, FILINFO *fno);
+FRESULT f_unlink(const char *path);
+FRESULT f_rename(const char *oldPath, const char *newPath);
+FRESULT f_mkdir(const char *path);
+FRESULT f_opendir(FF_DIR *dp, const char *path);
+FRESULT f_readdir(FF_DIR *dp, FILINFO *fno);
+FRESULT f_closedir(FF_DIR *dp);
+FRESULT f_getfree(const char *path, DWORD *nclst, FATFS **fatfs);
+void ff_diskio_register_sdmmc(uint8_t pdrv, sdmmc_card_t *card);
+
+// mbedtls SHA-256, any hash that tells the test images apart will do
+typedef struct{
+    uint64_t h[4];
+}mbedtls_sha256_context;
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx);
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx);
+int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224);
+int mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen);
+int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char *output);
+int mbedtls_sha256(const unsigned char *input, size_t ilen, unsigned char *output, int is224);
+
+// the tasks and queues of the image stream and storage count, never started by the tests
+typedef void* TaskHandle_t;
+typedef void* QueueHandle_t;
+typedef void (*TaskFunction_t)(void *arg);
+
+QueueHandle_t xQueueCreate(int len, int itemSize);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, int timeout);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, int timeout);
+BaseType_t xQueueReset(QueueHandle_t queue);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, int prio,
+                                   TaskHandle_t *task, int core);
+void xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, int timeout);
+int64_t esp_timer_get_time(void);
+uint32_t esp_random(void);
+
 // void wifiStartAP(void);
 void wifiStartSTA(void *arg);
-void dispTrigUpdate(void);
+typedef uint32_t dispTicket_t;
+typedef enum{
+    DISP_PRIO_PLAYLIST,
+    DISP_PRIO_INTERACTIVE,
+}dispPrio_e;
+
+dispTicket_t dispRequestUpdate(dispPrio_e prio);
 bool isDisplayUpdating(void);
 // void saveWifiNvmConf(void);
-// void dispTrigUpdate(void);
 
 #endif
\ No newline at end of file
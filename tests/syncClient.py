@@ -0,0 +1,138 @@
+#!/bin/python
+"""
+Keeps the device's image library in sync with a folder, only sending what differs. Works out the
+difference from /img/manifest, then pushes the images the device doesn't have the content of, and
+applies the rest (names for content it already has, deletes) with /img/batch, in batches of at most
+BATCH_MAX_OPS
+
+Try it against the simulator with "python run.py sim" in web/, and "-u localhost:8080"
+"""
+import hashlib
+import requests
+import click
+from pathlib import Path
+import imageProcessor
+
+MAX_IMAGE_NAME_LEN = 32
+BATCH_MAX_OPS = 64          # IMG_BATCH_MAX_OPS of main/network.h
+IMAGE_EXTS = ['.png', '.jpg', '.jpeg', '.bmp', '.gif']
+
+
+class SyncClient:
+    def __init__(self, url: str):
+        self.url = url if url.startswith('http://') else 'http://' + url
+
+    def _api(self, path: str) -> str:
+        return self.url + '/api/v1' + path
+
+    def manifest(self) -> dict:
+        resp = requests.get(self._api('/img/manifest'), timeout=30)
+        resp.raise_for_status()
+        return resp.json()
+
+    def push(self, name: str, frame: bytes) -> dict:
+        resp = requests.post(self._api('/img/push'), params={'name': name, 'show': 0}, data=frame, timeout=60,
+                             headers={'Content-Type': 'application/octet-stream'})
+        resp.raise_for_status()
+        return resp.json()
+
+    def batch(self, ops: list, generation: int = None) -> dict:
+        body = {'ops': ops}
+        if generation is not None:
+            body['generation'] = generation
+        resp = requests.post(self._api('/img/batch'), json=body, timeout=120)
+        if resp.status_code == 409:
+            raise click.ClickException('The images changed on the device during the sync, run it again')
+        resp.raise_for_status()
+        return resp.json()
+
+
+def loadFolder(folder: Path) -> dict:
+    """Converts every image of a folder, returns the frame buffers by image name"""
+    frames = {}
+    for path in sorted(folder.iterdir()):
+        if path.suffix.lower() not in IMAGE_EXTS:
+            continue
+        name = path.stem[:MAX_IMAGE_NAME_LEN - 1]
+        if name in frames:
+            print(f'Skipping {path.name}, {name} is already taken')
+            continue
+        frames[name] = imageProcessor.createFBFromImage(path)
+    return frames
+
+
+def plan(frames: dict, manifest: dict, delete: bool):
+    """Works out what to push and the batch to apply after, returns (pushes, ops)"""
+    onDevice = {img['name']: img['sha256'] for img in manifest['img']}
+    contentOnDevice = {sha for sha in onDevice.values() if sha}
+
+    pushes = []
+    ops = []
+    for name, frame in frames.items():
+        sha = hashlib.sha256(frame).hexdigest()
+        if onDevice.get(name) == sha:
+            continue
+        if sha in contentOnDevice:
+            ops.append({'op': 'link', 'name': name, 'sha256': sha})
+        else:
+            pushes.append(name)
+            # a second image with the same content only needs linking to the first
+            contentOnDevice.add(sha)
+    if delete:
+        ops += [{'op': 'delete', 'name': name} for name in onDevice if name not in frames]
+    return pushes, ops
+
+
+########## TOP LEVEL GROUP ##########
+@click.group
+@click.option('-u', '--url', type=str, default='192.168.4.1', show_default=True, help='The hostname of the esp32')
+@click.pass_context
+def cli(ctx: click.Context, url: str):
+    ctx.obj['client'] = SyncClient(url)
+
+
+@cli.command()
+@click.pass_context
+def manifest(ctx: click.Context) -> None:
+    """Lists the images on the device, with their content hash"""
+    m = ctx.obj['client'].manifest()
+    print(f'Generation {m["generation"]}, {m["count"]} images')
+    for img in m['img']:
+        print(f'{img["id"]:5} {img["name"]:32} {img["sha256"] or "(not hashed yet)"}')
+
+
+@cli.command()
+@click.argument('folder', type=click.Path(exists=True, file_okay=False, path_type=Path))
+@click.option('--delete/--no-delete', default=False, show_default=True, help='Delete images that are not in FOLDER')
+@click.option('--dry-run', is_flag=True, help='Only print what would be done')
+@click.pass_context
+def sync(ctx: click.Context, folder: Path, delete: bool, dry_run: bool) -> None:
+    """Makes the device's images those of FOLDER, by name"""
+    client = ctx.obj['client']
+    frames = loadFolder(folder)
+    m = client.manifest()
+    pushes, ops = plan(frames, m, delete)
+
+    print(f'{len(pushes)} to push, {sum(op["op"] == "link" for op in ops)} to link, '
+          f'{sum(op["op"] == "delete" for op in ops)} to delete')
+    if dry_run:
+        return
+
+    for name in pushes:
+        resp = client.push(name, frames[name])
+        print(f'Pushed {name}{" (already there)" if resp.get("deduped") else ""}')
+    # the pushes moved the generation on, the batch is only checked against what they left
+    generation = client.manifest()['generation'] if pushes else m['generation']
+
+    # each batch moves the generation on too, the next one is checked against what it left
+    for start in range(0, len(ops), BATCH_MAX_OPS):
+        batchOps = ops[start:start + BATCH_MAX_OPS]
+        resp = client.batch(batchOps, generation)
+        for op, result in zip(batchOps, resp['results']):
+            print(f'{op["op"].capitalize()} {op["name"]}: {result["stat"]}')
+        generation = resp.get('generation')
+    print('Done')
+
+
+if __name__ == "__main__":
+    cli(obj={})
@@ -112,8 +112,9 @@ int setFrameBuffRaw(uint8_t *data, uint32_t len, uint32_t offset){
     return setFrameBuff_resp;
 }
 
-void dispTrigUpdate(void){
+dispTicket_t dispRequestUpdate(dispPrio_e prio){
     didDisplayTrig = true;
+    return 1;
 }
 
 void wifiStartSTA(void *arg){
@@ -18,6 +18,7 @@ def commonApiRequest(url, method, payload = None):
     resp = requests.request(method=method, url=url, data=payload)
     print(f"Return code: {resp.status_code}")
     print(f"Content: {json.dumps(resp.json(), indent=2, sort_keys=False)}")
+    return resp
 
 
 ########## TOP LEVEL GROUP ##########
@@ -41,6 +42,14 @@ def power(ctx: click.Context) -> None:
     url = createUrl(ctx.obj['url'], 'pmic')
     commonApiRequest(url, 'GET')
 
+@cli.command('power-history')
+@click.option('-t', '--tier', type=click.Choice(['sec', 'min', 'hour']), default='min', help='Every sample, or minute or hour averages')
+@click.pass_context
+def powerHistory(ctx: click.Context, tier: str) -> None:
+    """Gets the history of the power info from the device"""
+    url = createUrl(ctx.obj['url'], f'pmic/history?tier={tier}')
+    commonApiRequest(url, 'GET')
+
 @cli.command()
 @click.option('-m', '--mode', type=str, default=None, help='The mode to set to if SET')
 @click.pass_context
@@ -52,6 +61,48 @@ def mode(ctx: click.Context, mode: str) -> None:
         url = createUrl(ctx.obj['url'], 'mode')
         commonApiRequest(url, 'POST', {'mode': mode})
 
+@cli.command()
+@click.argument('job-id', type=int)
+@click.pass_context
+def job(ctx: click.Context, job_id: int) -> None:
+    """Gets the state of the job JOB_ID queued by a slow request"""
+    url = createUrl(ctx.obj['url'], f'jobs/{job_id}')
+    commonApiRequest(url, 'GET')
+
+@cli.command()
+@click.option('-p', '--prom', is_flag=True, help='Get them in the Prometheus text format')
+@click.pass_context
+def metrics(ctx: click.Context, prom: bool) -> None:
+    """Gets the http request metrics from the device"""
+    if prom:
+        url = createUrl(ctx.obj['url'], 'metrics?format=prom')
+        print(requests.get(url).text)
+    else:
+        url = createUrl(ctx.obj['url'], 'metrics')
+        commonApiRequest(url, 'GET')
+
+@cli.command()
+@click.argument('output', type=Path, default='trace.json')
+@click.option('-c', '--clear', is_flag=True, help='Empty the trace on the device after')
+@click.pass_context
+def trace(ctx: click.Context, output: Path, clear: bool) -> None:
+    """Saves the timeline trace of the device to OUTPUT, open it in chrome://tracing or ui.perfetto.dev"""
+    url = createUrl(ctx.obj['url'], 'trace?clear=1' if clear else 'trace')
+    resp = requests.get(url)
+    print(f"Return code: {resp.status_code}")
+    if resp.ok:
+        output.write_bytes(resp.content)
+        print(f"Saved {len(resp.json()['traceEvents'])} events to {output}")
+    else:
+        print(resp.text)
+
+@cli.command()
+@click.pass_context
+def tasks(ctx: click.Context) -> None:
+    """Gets the CPU and stack use of every task, and the free heap"""
+    url = createUrl(ctx.obj['url'], 'sys/tasks')
+    commonApiRequest(url, 'GET')
+
 @cli.command()
 @click.pass_context
 def coffee(ctx: click.Context) -> None:
@@ -108,14 +159,26 @@ def setFb(ctx: click.Context, image: Path) -> None:
     commonApiRequest(url, 'POST', rawFb)
 
 @display.command(name='update')
+@click.option('--wait', is_flag=True, help='Wait for the refresh to be done')
 @click.pass_context
-def updateDisplay(ctx: click.Context) -> None:
+def updateDisplay(ctx: click.Context, wait: bool) -> None:
     """
     Updates the display from the internal framebuffer
     """
-    url = createUrl(ctx.obj['url'], 'disp/update')
+    url = createUrl(ctx.obj['url'], 'disp/update?wait=1' if wait else 'disp/update')
     commonApiRequest(url, 'POST')
 
+@display.command(name='refreshes')
+@click.option('--ticket', type=int, help='Also get if the refresh of this ticket is done')
+@click.pass_context
+def displayRefreshes(ctx: click.Context, ticket: int) -> None:
+    """
+    Gets the state of the display refresh requests
+    """
+    path = 'disp/update' if ticket is None else f'disp/update?ticket={ticket}'
+    url = createUrl(ctx.obj['url'], path)
+    commonApiRequest(url, 'GET')
+
 @display.command(name='listCard')
 @click.pass_context
 def getAvailableImg(ctx: click.Context) -> None:
@@ -135,10 +198,28 @@ def uploadImage(ctx: click.Context, image: Path, name: str) -> None:
     """
     rawFb = imageProcessor.createFBFromImage(image)
     url = createUrl(ctx.obj['url'], 'img/upload')
-    commonApiRequest(url, 'POST', rawFb)
+    resp = commonApiRequest(url, 'POST', rawFb)
+    if not resp.ok:
+        return
 
-    url = createUrl(ctx.obj['url'], 'img/save')
-    commonApiRequest(url, 'POST', {'name': name})
+    url = createUrl(ctx.obj['url'], 'img/save?wait=1')
+    commonApiRequest(url, 'POST', {'name': name, 'slot': resp.json()['slot']})
+
+@display.command(name='pushImage')
+@click.argument('image', type=Path)
+@click.option('-n', '--name', type=str, default=None, help='The name to save the image as. Not saved if not given')
+@click.option('--show/--no-show', default=True, show_default=True, help='Whether to show the image on the display')
+@click.pass_context
+def pushImage(ctx: click.Context, image: Path, name: str, show: bool) -> None:
+    """
+    Uploads the image IMAGE given to the device in a single request, saving and/or showing it
+    """
+    rawFb = imageProcessor.createFBFromImage(image)
+    query = f'store={0 if name is None else 1}&show={int(show)}'
+    if name is not None:
+        query += f'&name={name}'
+    url = createUrl(ctx.obj['url'], f'img/push?{query}')
+    commonApiRequest(url, 'POST', rawFb)
 
 @display.command(name='loadImage')
 @click.argument('name', type=str)
@@ -147,7 +228,7 @@ def loadImage(ctx: click.Context, name: str) -> None:
     """
     Loads an image on-device with the name NAME
     """
-    url = createUrl(ctx.obj['url'], 'img/load')
+    url = createUrl(ctx.obj['url'], 'img/load?wait=1')
     commonApiRequest(url, 'POST', {'name': name})
 
 @display.command(name='deleteImage')
@@ -157,7 +238,7 @@ def delImage(ctx: click.Context, name: str) -> None:
     """
     Deletes an image on-device with the name NAME
     """
-    url = createUrl(ctx.obj['url'], 'img/delete')
+    url = createUrl(ctx.obj['url'], 'img/delete?wait=1')
     commonApiRequest(url, 'POST', {'name': name})
 
 ########## Image Playlist Selection Sub-Group ##########
@@ -171,30 +252,79 @@ def playlist(ctx: click.Context):
 @click.pass_context
 def playlistList(ctx: click.Context) -> None:
     """
-    Lists the images available for cycling
+    Lists the playlists
     """
-    url = createUrl(ctx.obj['url'], 'img/playlist/get')
+    url = createUrl(ctx.obj['url'], 'img/playlist/list')
     commonApiRequest(url, 'GET')
 
+@playlist.command('get')
+@click.option('--id', 'plId', type=int, help='The playlist, the selected one if not given')
+@click.pass_context
+def playlistGet(ctx: click.Context, plId: int) -> None:
+    """
+    Lists the images of a playlist
+    """
+    path = 'img/playlist/get' if plId is None else f'img/playlist/get?id={plId}'
+    url = createUrl(ctx.obj['url'], path)
+    commonApiRequest(url, 'GET')
+
+@playlist.command('create')
+@click.argument('name', type=str)
+@click.pass_context
+def playlistCreate(ctx: click.Context, name: str) -> None:
+    """
+    Creates an empty playlist
+    """
+    url = createUrl(ctx.obj['url'], 'img/playlist/create')
+    commonApiRequest(url, 'POST', {'name': name})
+
+@playlist.command('remove')
+@click.argument('plid', type=int)
+@click.pass_context
+def playlistRemove(ctx: click.Context, plid: int) -> None:
+    """
+    Deletes a playlist
+    """
+    url = createUrl(ctx.obj['url'], 'img/playlist/remove')
+    commonApiRequest(url, 'POST', {'id': plid})
+
+@playlist.command('select')
+@click.argument('plid', type=int)
+@click.pass_context
+def playlistSelect(ctx: click.Context, plid: int) -> None:
+    """
+    Selects the playlist shown by the select playlist mode
+    """
+    url = createUrl(ctx.obj['url'], 'img/playlist/select')
+    commonApiRequest(url, 'POST', {'id': plid})
+
 @playlist.command('add')
 @click.argument('name', type=str)
+@click.option('--id', 'plId', type=int, help='The playlist, the selected one if not given')
 @click.pass_context
-def playlistAdd(ctx: click.Context, name: str) -> None:
+def playlistAdd(ctx: click.Context, name: str, plId: int) -> None:
     """
-    Lists the images available for cycling
+    Adds an image to a playlist
     """
     url = createUrl(ctx.obj['url'], 'img/playlist/add')
-    commonApiRequest(url, 'POST', {'name': name})
+    body = {'name': name}
+    if plId is not None:
+        body['playlist'] = plId
+    commonApiRequest(url, 'POST', body)
 
 @playlist.command('del')
 @click.argument('name', type=str)
+@click.option('--id', 'plId', type=int, help='The playlist, the selected one if not given')
 @click.pass_context
-def playlistDel(ctx: click.Context, name: str) -> None:
+def playlistDel(ctx: click.Context, name: str, plId: int) -> None:
     """
-    Lists the images available for cycling
+    Removes an image from a playlist
     """
     url = createUrl(ctx.obj['url'], 'img/playlist/del')
-    commonApiRequest(url, 'POST', {'name': name})
+    body = {'name': name}
+    if plId is not None:
+        body['playlist'] = plId
+    commonApiRequest(url, 'POST', body)
 
 
 if __name__ == "__main__":
@@ -0,0 +1,386 @@
+#include "unity.h"
+#include "mock.h"
+#include "bulk.h"
+#include "eink.h"
+#include "fileSys.h"
+#include "trace.h"
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/**
+ * Loopback tests of the bulk frame port. The server side runs bulkServeConn() in a thread on a real
+ * TCP socket, with the display frame buffer and image files mocked in memory.
+ *
+ * Run with "serve <port>" to instead keep serving on that port, to try tests/bulkClient.py against it
+ *
+ * Each test and bulk message is traced, see TRACE_FILE
+ */
+
+#define TRACE_FILE      "build/testBulk.trace.json"
+
+// mocked display frame buffer and image file
+static u8 dispFb[DISP_FB_SIZE];
+static u8 fileDat[DISP_FB_SIZE];
+static char fileName[MAX_IMAGE_NAME_LEN];
+static u32 fileWritten;
+static bool fileCommitted;
+
+// flags to be able to trip errors
+static bool dispFbBusy = false;
+static int dispUpdateCnt = 0;
+
+static int listenSock;
+static int clientSock;
+static pthread_t serverThread;
+static int serverRet;
+
+u8* takeDispFb(TickType_t timeout){
+    return dispFbBusy ? NULL : dispFb;
+}
+
+void releaseDispFb(void){
+
+}
+
+dispTicket_t dispRequestUpdate(dispPrio_e prio){
+    TEST_ASSERT_EQUAL(DISP_PRIO_INTERACTIVE, prio);
+    return ++dispUpdateCnt;
+}
+
+fSysRet fileSysImageWriteBegin(const char *imgName, fSysImgWriter_t *writer){
+    if(imgName[0] == '\0'){
+        return FILE_SYS_INVALID_NAME;
+    }
+    strncpy(fileName, imgName, MAX_IMAGE_NAME_LEN-1);
+    fileWritten = 0;
+    return FILE_SYS_RET_OK;
+}
+
+fSysRet fileSysImageWriteChunk(fSysImgWriter_t *writer, const u8 *dat, u32 len){
+    if(fileWritten + len > DISP_FB_SIZE){
+        return FILE_SYS_INVALID_FILE;
+    }
+    memcpy(&fileDat[fileWritten], dat, len);
+    fileWritten += len;
+    return FILE_SYS_RET_OK;
+}
+
+fSysRet fileSysImageWriteEnd(fSysImgWriter_t *writer, bool commit){
+    fileCommitted = commit && fileWritten == DISP_FB_SIZE;
+    return FILE_SYS_RET_OK;
+}
+
+static int listenOn(u16 port, u16 *boundPort){
+    struct sockaddr_in addr = {0};
+    socklen_t addrLen = sizeof(addr);
+    int opt = 1;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 1)){
+        close(sock);
+        return -1;
+    }
+    getsockname(sock, (struct sockaddr *)&addr, &addrLen);
+    *boundPort = ntohs(addr.sin_port);
+    return sock;
+}
+
+static void *serverTask(void *arg){
+    int sock = accept(listenSock, NULL, NULL);
+    serverRet = bulkServeConn(sock);
+    close(sock);
+    return NULL;
+}
+
+void setUp(void) {
+    struct sockaddr_in addr = {0};
+    u16 port;
+
+    memset(dispFb, 0, sizeof(dispFb));
+    memset(fileDat, 0, sizeof(fileDat));
+    memset(fileName, 0, sizeof(fileName));
+    fileWritten = 0;
+    fileCommitted = false;
+    dispFbBusy = false;
+    dispUpdateCnt = 0;
+    TRACE_BEGIN(Unity.CurrentTestName);
+
+    listenSock = listenOn(0, &port);
+    TEST_ASSERT_GREATER_OR_EQUAL(0, listenSock);
+    pthread_create(&serverThread, NULL, serverTask, NULL);
+
+    clientSock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    TEST_ASSERT_EQUAL(0, connect(clientSock, (struct sockaddr *)&addr, sizeof(addr)));
+}
+
+void tearDown(void) {
+    close(clientSock);
+    pthread_join(serverThread, NULL);
+    close(listenSock);
+    TRACE_END(Unity.CurrentTestName);
+}
+
+static int traceWriteFile(void *ctx, const char *dat, u32 len){
+    return fwrite(dat, 1, len, ctx) != len;
+}
+
+/**
+ * Saves the trace of the tests, open it in chrome://tracing or ui.perfetto.dev
+ */
+static void saveTrace(void){
+    FILE *f = fopen(TRACE_FILE, "w");
+
+    if(f == NULL){
+        printf("Unable to write the trace to %s\n", TRACE_FILE);
+        return;
+    }
+    traceExport(traceWriteFile, f);
+    fclose(f);
+    printf("Trace of %u events saved to %s\n", traceGetEventCount(), TRACE_FILE);
+}
+
+static void sendAll(const void *dat, size_t len){
+    const u8 *p = dat;
+    while(len > 0){
+        ssize_t n = send(clientSock, p, len, 0);
+        TEST_ASSERT_GREATER_THAN(0, n);
+        p += n;
+        len -= n;
+    }
+}
+
+static void sendHeader(u8 type, u8 flags, u32 offset, u32 len, u32 crc){
+    u8 raw[BULK_HEADER_LEN];
+    u32 fields[3] = {offset, len, crc};
+
+    raw[0] = BULK_MAGIC & 0xFF;
+    raw[1] = BULK_MAGIC >> 8;
+    raw[2] = type;
+    raw[3] = flags;
+    for(int i = 0; i < 3; i++){
+        raw[4 + i*4] = fields[i];
+        raw[5 + i*4] = fields[i] >> 8;
+        raw[6 + i*4] = fields[i] >> 16;
+        raw[7 + i*4] = fields[i] >> 24;
+    }
+    sendAll(raw, sizeof(raw));
+}
+
+/**
+ * Receives an ack and returns its status, or -1 if the connection was closed instead
+ */
+static int recvAck(u8 expType, u32 *crc){
+    u8 raw[BULK_ACK_LEN];
+    size_t got = 0;
+
+    while(got < sizeof(raw)){
+        ssize_t n = recv(clientSock, raw + got, sizeof(raw) - got, 0);
+        if(n <= 0) return -1;
+        got += n;
+    }
+    TEST_ASSERT_EQUAL_HEX16(BULK_MAGIC, raw[0] | (raw[1] << 8));
+    TEST_ASSERT_EQUAL(expType, raw[2]);
+    if(crc) *crc = raw[4] | (raw[5] << 8) | (raw[6] << 16) | ((u32)raw[7] << 24);
+    return raw[3];
+}
+
+static void fillPattern(u8 *dat, u32 len, u8 seed){
+    for(u32 i = 0; i < len; i++){
+        dat[i] = (u8)(i * 7 + seed);
+    }
+}
+
+void test_crc32(void){
+    // the standard check value of CRC-32
+    TEST_ASSERT_EQUAL_HEX32(0xCBF43926, bulkCrc32(0, (const u8 *)"123456789", 9));
+    // and it can be computed in parts
+    u32 crc = bulkCrc32(0, (const u8 *)"1234", 4);
+    TEST_ASSERT_EQUAL_HEX32(0xCBF43926, bulkCrc32(crc, (const u8 *)"56789", 5));
+}
+
+void test_fullFrame(void){
+    static u8 frame[DISP_FB_SIZE];
+    u32 crc;
+
+    fillPattern(frame, sizeof(frame), 3);
+    sendHeader(BULK_MSG_REGION, BULK_FLAG_UPDATE, 0, DISP_FB_SIZE, bulkCrc32(0, frame, sizeof(frame)));
+    sendAll(frame, sizeof(frame));
+
+    TEST_ASSERT_EQUAL(BULK_STAT_OK, recvAck(BULK_MSG_REGION, &crc));
+    TEST_ASSERT_EQUAL_HEX32(bulkCrc32(0, frame, sizeof(frame)), crc);
+    TEST_ASSERT_EQUAL_MEMORY(frame, dispFb, DISP_FB_SIZE);
+    TEST_ASSERT_EQUAL(1, dispUpdateCnt);
+}
+
+void test_regionThenUpdateCmd(void){
+    u8 region[1000];
+    const u32 offset = 5000;
+
+    fillPattern(region, sizeof(region), 9);
+    sendHeader(BULK_MSG_REGION, 0, offset, sizeof(region), bulkCrc32(0, region, sizeof(region)));
+    sendAll(region, sizeof(region));
+    TEST_ASSERT_EQUAL(BULK_STAT_OK, recvAck(BULK_MSG_REGION, NULL));
+    TEST_ASSERT_EQUAL(0, dispUpdateCnt);
+    TEST_ASSERT_EQUAL_MEMORY(region, &dispFb[offset], sizeof(region));
+    TEST_ASSERT_EQUAL(0, dispFb[offset-1]);
+    TEST_ASSERT_EQUAL(0, dispFb[offset+sizeof(region)]);
+
+    sendHeader(BULK_MSG_CMD, 0, BULK_CMD_UPDATE, 0, 0);
+    TEST_ASSERT_EQUAL(BULK_STAT_OK, recvAck(BULK_MSG_CMD, NULL));
+    TEST_ASSERT_EQUAL(1, dispUpdateCnt);
+}
+
+void test_regionBadCrc(void){
+    u8 region[100];
+
+    fillPattern(region, sizeof(region), 1);
+    sendHeader(BULK_MSG_REGION, BULK_FLAG_UPDATE, 0, sizeof(region), 0x12345678);
+    sendAll(region, sizeof(region));
+    TEST_ASSERT_EQUAL(BULK_STAT_BAD_CRC, recvAck(BULK_MSG_REGION, NULL));
+    TEST_ASSERT_EQUAL(0, dispUpdateCnt);
+
+    // the connection is still usable
+    sendHeader(BULK_MSG_CMD, 0, BULK_CMD_PING, 0, 0);
+    TEST_ASSERT_EQUAL(BULK_STAT_OK, recvAck(BULK_MSG_CMD, NULL));
+}
+
+void test_regionFbBusy(void){
+    u8 region[100];
+
+    dispFbBusy = true;
+    fillPattern(region, sizeof(region), 1);
+    sendHeader(BULK_MSG_REGION, BULK_FLAG_UPDATE, 0, sizeof(region), bulkCrc32(0, region, sizeof(region)));
+    sendAll(region, sizeof(region));
+    TEST_ASSERT_EQUAL(BULK_STAT_BUSY, recvAck(BULK_MSG_REGION, NULL));
+    TEST_ASSERT_EQUAL(0, dispUpdateCnt);
+
+    sendHeader(BULK_MSG_CMD, 0, BULK_CMD_PING, 0, 0);
+    TEST_ASSERT_EQUAL(BULK_STAT_OK, recvAck(BULK_MSG_CMD, NULL));
+}
+
+void test_regionOutOfBounds(void){
+    sendHeader(BULK_MSG_REGION, 0, DISP_FB_SIZE - 10, 11, 0);
+    TEST_ASSERT_EQUAL(BULK_STAT_BAD_LEN, recvAck(BULK_MSG_REGION, NULL));
+    // the stream can't be trusted anymore, so the connection is closed
+    TEST_ASSERT_EQUAL(-1, recvAck(BULK_MSG_REGION, NULL));
+}
+
+void test_badMagic(void){
+    u8 raw[BULK_HEADER_LEN] = {0};
+    sendAll(raw, sizeof(raw));
+    TEST_ASSERT_EQUAL(BULK_STAT_BAD_MAGIC, recvAck(0, NULL));
+    TEST_ASSERT_EQUAL(-1, recvAck(0, NULL));
+}
+
+static void sendFile(const char *name, const u8 *frame, bool corrupt){
+    char nameField[MAX_IMAGE_NAME_LEN] = {0};
+    u32 crc;
+
+    strncpy(nameField, name, MAX_IMAGE_NAME_LEN-1);
+    crc = bulkCrc32(0, (const u8 *)nameField, sizeof(nameField));
+    crc = bulkCrc32(crc, frame, DISP_FB_SIZE);
+    if(corrupt) crc ^= 1;
+
+    sendHeader(BULK_MSG_FILE, 0, 0, MAX_IMAGE_NAME_LEN + DISP_FB_SIZE, crc);
+    sendAll(nameField, sizeof(nameField));
+    sendAll(frame, DISP_FB_SIZE);
+}
+
+void test_file(void){
+    static u8 frame[DISP_FB_SIZE];
+
+    fillPattern(frame, sizeof(frame), 42);
+    sendFile("beach", frame, false);
+    TEST_ASSERT_EQUAL(BULK_STAT_OK, recvAck(BULK_MSG_FILE, NULL));
+    TEST_ASSERT_EQUAL_STRING("beach", fileName);
+    TEST_ASSERT_TRUE(fileCommitted);
+    TEST_ASSERT_EQUAL_MEMORY(frame, fileDat, DISP_FB_SIZE);
+    TEST_ASSERT_EQUAL(0, dispUpdateCnt);
+}
+
+void test_fileBadCrc(void){
+    static u8 frame[DISP_FB_SIZE];
+
+    fillPattern(frame, sizeof(frame), 42);
+    sendFile("beach", frame, true);
+    TEST_ASSERT_EQUAL(BULK_STAT_BAD_CRC, recvAck(BULK_MSG_FILE, NULL));
+    TEST_ASSERT_FALSE(fileCommitted);
+}
+
+void test_fileBadName(void){
+    static u8 frame[DISP_FB_SIZE];
+
+    fillPattern(frame, sizeof(frame), 42);
+    sendFile("", frame, false);
+    TEST_ASSERT_EQUAL(BULK_STAT_BAD_NAME, recvAck(BULK_MSG_FILE, NULL));
+    TEST_ASSERT_FALSE(fileCommitted);
+
+    // the payload was still taken in, so the next message is read right
+    sendFile("beach", frame, false);
+    TEST_ASSERT_EQUAL(BULK_STAT_OK, recvAck(BULK_MSG_FILE, NULL));
+    TEST_ASSERT_TRUE(fileCommitted);
+}
+
+void test_fileBadLen(void){
+    sendHeader(BULK_MSG_FILE, 0, 0, DISP_FB_SIZE, 0);
+    TEST_ASSERT_EQUAL(BULK_STAT_BAD_LEN, recvAck(BULK_MSG_FILE, NULL));
+}
+
+void test_unknownCmd(void){
+    sendHeader(BULK_MSG_CMD, 0, 99, 0, 0);
+    TEST_ASSERT_EQUAL(BULK_STAT_BAD_TYPE, recvAck(BULK_MSG_CMD, NULL));
+}
+
+/**
+ * Serves forever on a port, to try a client against
+ */
+static void serve(u16 port){
+    u16 boundPort;
+
+    listenSock = listenOn(port, &boundPort);
+    if(listenSock < 0){
+        printf("Unable to listen on port %u\n", port);
+        return;
+    }
+    printf("Serving the bulk port on 127.0.0.1:%u\n", boundPort);
+    for(;;){
+        int sock = accept(listenSock, NULL, NULL);
+        printf("Connection closed with %d\n", bulkServeConn(sock));
+        printf("Updates: %d, file '%s' committed: %d\n", dispUpdateCnt, fileName, fileCommitted);
+        close(sock);
+    }
+}
+
+int main(int argc, char **argv){
+    if(argc == 3 && strcmp(argv[1], "serve") == 0){
+        serve(atoi(argv[2]));
+        return 0;
+    }
+
+    UNITY_BEGIN();
+    RUN_TEST(test_crc32);
+    RUN_TEST(test_fullFrame);
+    RUN_TEST(test_regionThenUpdateCmd);
+    RUN_TEST(test_regionBadCrc);
+    RUN_TEST(test_regionFbBusy);
+    RUN_TEST(test_regionOutOfBounds);
+    RUN_TEST(test_badMagic);
+    RUN_TEST(test_file);
+    RUN_TEST(test_fileBadCrc);
+    RUN_TEST(test_fileBadName);
+    RUN_TEST(test_fileBadLen);
+    RUN_TEST(test_unknownCmd);
+    saveTrace();
+    return UNITY_END();
+}
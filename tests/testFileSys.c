@@ -0,0 +1,724 @@
+#include "unity.h"
+#include "mock.h"
+#include "common.h"
+#include "fileSys.h"
+#include <string.h>
+
+/**
+ * Tests of the image index and the images sharing a file, with FatFS mocked by files in memory: overwriting
+ * and deleting an image others share the file of, deleting the last one with some content, a sync after an
+ * image file was removed elsewhere, and the upgrade of a version 1 index
+ */
+
+#define MOCK_FILES_MAX      32
+#define INDEX_PATH          PLAYLIST_DIR "/IMAGES.IDX"
+#define INDEX_MAGIC         0x58444949
+
+// frame buffers of a single color, so each is told apart by its first byte
+#define CONTENT_X           0x11
+#define CONTENT_Y           0x22
+#define CONTENT_Z           0x33
+
+typedef struct{
+    char path[FF_MOCK_NAME_LEN];        // empty when unused
+    bool dir;
+    u8 *dat;
+    u32 len;
+}mockFile_t;
+
+// the header of the index, as in fileSys.c
+typedef struct{
+    u32 magic;
+    u16 version;
+    u16 recLen;
+    fSysIndexInfo_t info;
+}indexHeader_t;
+
+static mockFile_t files[MOCK_FILES_MAX];
+static u8 frame[DISP_FB_SIZE];
+
+sdmmc_card_t sdCard;
+
+/********** FatFS **********/
+static mockFile_t* fileFind(const char *path){
+    for(u32 i = 0; i < MOCK_FILES_MAX; i++){
+        if(files[i].path[0] && strcmp(files[i].path, path) == 0){
+            return &files[i];
+        }
+    }
+    return NULL;
+}
+
+static mockFile_t* fileNew(const char *path, bool dir){
+    for(u32 i = 0; i < MOCK_FILES_MAX; i++){
+        if(files[i].path[0] == '\0'){
+            memset(&files[i], 0, sizeof(mockFile_t));
+            strncpy(files[i].path, path, FF_MOCK_NAME_LEN-1);
+            files[i].dir = dir;
+            return &files[i];
+        }
+    }
+    TEST_FAIL_MESSAGE("Out of mocked files");
+    return NULL;
+}
+
+static void fileDel(mockFile_t *file){
+    free(file->dat);
+    memset(file, 0, sizeof(mockFile_t));
+}
+
+static void fileResize(mockFile_t *file, u32 len){
+    if(len > file->len){
+        file->dat = realloc(file->dat, len);
+        TEST_ASSERT_NOT_NULL(file->dat);
+        memset(&file->dat[file->len], 0, len - file->len);
+    }
+    file->len = len;
+}
+
+static void fsReset(void){
+    for(u32 i = 0; i < MOCK_FILES_MAX; i++){
+        fileDel(&files[i]);
+    }
+}
+
+FRESULT f_mount(FATFS *fs, const char *path, uint8_t opt){
+    if(fs){
+        fs->fs_type = 3;
+        fs->csize = 64;
+        fs->n_fatent = 100000;
+        fs->free_clst = 50000;
+    }
+    return FR_OK;
+}
+
+FRESULT f_open(FIL *fp, const char *path, uint8_t mode){
+    mockFile_t *file = fileFind(path);
+
+    fp->idx = -1;
+    if(file == NULL){
+        if(!(mode & (FA_CREATE_ALWAYS | FA_CREATE_NEW | FA_OPEN_ALWAYS))){
+            return FR_NO_FILE;
+        }
+        file = fileNew(path, false);
+    } else if(file->dir){
+        return FR_NO_FILE;
+    } else if(mode & FA_CREATE_NEW){
+        return FR_EXIST;
+    } else if(mode & FA_CREATE_ALWAYS){
+        file->len = 0;
+    }
+    fp->idx = file - files;
+    fp->mode = mode;
+    fp->fptr = 0;
+    return FR_OK;
+}
+
+FRESULT f_close(FIL *fp){
+    if(fp->idx < 0){
+        return FR_INVALID_OBJECT;
+    }
+    fp->idx = -1;
+    return FR_OK;
+}
+
+FRESULT f_read(FIL *fp, void *buff, UINT btr, UINT *br){
+    mockFile_t *file = &files[fp->idx];
+
+    *br = 0;
+    if(!(fp->mode & FA_READ)){
+        return FR_DENIED;
+    }
+    if(fp->fptr < file->len){
+        *br = file->len - fp->fptr < btr ? file->len - fp->fptr : btr;
+        memcpy(buff, &file->dat[fp->fptr], *br);
+        fp->fptr += *br;
+    }
+    return FR_OK;
+}
+
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw){
+    mockFile_t *file = &files[fp->idx];
+
+    *bw = 0;
+    if(!(fp->mode & FA_WRITE)){
+        return FR_DENIED;
+    }
+    if(fp->fptr + btw > file->len){
+        fileResize(file, fp->fptr + btw);
+    }
+    memcpy(&file->dat[fp->fptr], buff, btw);
+    fp->fptr += btw;
+    *bw = btw;
+    return FR_OK;
+}
+
+FRESULT f_lseek(FIL *fp, uint32_t ofs){
+    mockFile_t *file = &files[fp->idx];
+
+    // past the end it grows the file when writing, and stops at the end when reading, as FatFS
+    if(ofs > file->len){
+        if(fp->mode & FA_WRITE){
+            fileResize(file, ofs);
+        } else {
+            ofs = file->len;
+        }
+    }
+    fp->fptr = ofs;
+    return FR_OK;
+}
+
+FRESULT f_stat(const char *path, FILINFO *fno){
+    mockFile_t *file = fileFind(path);
+    const char *name;
+
+    if(file == NULL){
+        return FR_NO_FILE;
+    }
+    name = strrchr(file->path, '/');
+    memset(fno, 0, sizeof(FILINFO));
+    strcpy(fno->fname, name ? name + 1 : file->path);
+    fno->fsize = file->len;
+    fno->fattrib = file->dir ? AM_DIR : 0;
+    return FR_OK;
+}
+
+FRESULT f_unlink(const char *path){
+    mockFile_t *file = fileFind(path);
+
+    if(file == NULL){
+        return FR_NO_FILE;
+    }
+    fileDel(file);
+    return FR_OK;
+}
+
+FRESULT f_rename(const char *oldPath, const char *newPath){
+    mockFile_t *file = fileFind(oldPath);
+
+    if(file == NULL){
+        return FR_NO_FILE;
+    }
+    if(fileFind(newPath)){
+        return FR_EXIST;
+    }
+    strncpy(file->path, newPath, FF_MOCK_NAME_LEN-1);
+    return FR_OK;
+}
+
+FRESULT f_mkdir(const char *path){
+    if(fileFind(path)){
+        return FR_EXIST;
+    }
+    fileNew(path, true);
+    return FR_OK;
+}
+
+FRESULT f_opendir(FF_DIR *dp, const char *path){
+    mockFile_t *dir = fileFind(path);
+
+    if(dir == NULL || !dir->dir){
+        return FR_NO_PATH;
+    }
+    strncpy(dp->path, path, FF_MOCK_NAME_LEN-1);
+    dp->next = 0;
+    return FR_OK;
+}
+
+FRESULT f_readdir(FF_DIR *dp, FILINFO *fno){
+    u32 dirLen = strlen(dp->path);
+
+    for(; dp->next < MOCK_FILES_MAX; dp->next++){
+        const char *path = files[dp->next].path;
+        if(path[0] && strncmp(path, dp->path, dirLen) == 0 && path[dirLen] == '/' &&
+           strchr(&path[dirLen + 1], '/') == NULL){
+            f_stat(path, fno);
+            dp->next++;
+            return FR_OK;
+        }
+    }
+    memset(fno, 0, sizeof(FILINFO));
+    return FR_OK;
+}
+
+FRESULT f_closedir(FF_DIR *dp){
+    return FR_OK;
+}
+
+FRESULT f_getfree(const char *path, DWORD *nclst, FATFS **fatfs){
+    *nclst = 50000;
+    return FR_OK;
+}
+
+void ff_diskio_register_sdmmc(uint8_t pdrv, sdmmc_card_t *card){
+
+}
+
+/********** SHA-256 **********/
+// 4 FNV-1a hashes with different seeds
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx){
+    memset(ctx, 0, sizeof(mbedtls_sha256_context));
+}
+
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx){
+
+}
+
+int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224){
+    for(u32 i = 0; i < 4; i++){
+        ctx->h[i] = 0xCBF29CE484222325ULL + i;
+    }
+    return 0;
+}
+
+int mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen){
+    for(size_t n = 0; n < ilen; n++){
+        for(u32 i = 0; i < 4; i++){
+            ctx->h[i] = (ctx->h[i] ^ input[n]) * 0x100000001B3ULL;
+        }
+    }
+    return 0;
+}
+
+int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char *output){
+    memcpy(output, ctx->h, FILE_SYS_HASH_LEN);
+    return 0;
+}
+
+int mbedtls_sha256(const unsigned char *input, size_t ilen, unsigned char *output, int is224){
+    mbedtls_sha256_context ctx;
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, is224);
+    mbedtls_sha256_update(&ctx, input, ilen);
+    return mbedtls_sha256_finish(&ctx, output);
+}
+
+/********** FreeRTOS and the rest **********/
+SemaphoreHandle_t xSemaphoreCreateMutex(void){
+    return 1;
+}
+
+int xSemaphoreTake(int contextN, int timeout){
+    return pdTRUE;
+}
+
+void xSemaphoreGive(int contextN){
+
+}
+
+QueueHandle_t xQueueCreate(int len, int itemSize){
+    return NULL;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, int timeout){
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, int timeout){
+    return pdFALSE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue){
+    return pdTRUE;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, int prio,
+                                   TaskHandle_t *task, int core){
+    return pdTRUE;
+}
+
+void xTaskNotifyGive(TaskHandle_t task){
+
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, int timeout){
+    return 0;
+}
+
+int64_t esp_timer_get_time(void){
+    return 0;
+}
+
+uint32_t esp_random(void){
+    return 0x12345678;
+}
+
+/********** helpers **********/
+static void saveImage(const char *imgName, u8 content){
+    memset(frame, content, DISP_FB_SIZE);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysSaveImage(imgName, frame));
+}
+
+// through a writer, like an upload
+static void writeImage(const char *imgName, u8 content, bool expectDeduped){
+    fSysImgWriter_t writer;
+
+    memset(frame, content, DISP_FB_SIZE);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysImageWriteBegin(imgName, &writer));
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysImageWriteChunk(&writer, frame, DISP_FB_SIZE / 2));
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysImageWriteChunk(&writer, &frame[DISP_FB_SIZE / 2], DISP_FB_SIZE / 2));
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysImageWriteEnd(&writer, true));
+    TEST_ASSERT_EQUAL(expectDeduped, writer.deduped);
+}
+
+static void assertImage(const char *imgName, u8 content){
+    memset(frame, 0, DISP_FB_SIZE);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysLoadImage(imgName, frame, false));
+    TEST_ASSERT_EQUAL_HEX8(content, frame[0]);
+    TEST_ASSERT_EQUAL_HEX8(content, frame[DISP_FB_SIZE-1]);
+}
+
+static void assertNoImage(const char *imgName){
+    u32 id;
+
+    TEST_ASSERT_EQUAL(FILE_SYS_NO_FILE_FOUND, fileSysIsImageValid(imgName));
+    TEST_ASSERT_EQUAL(FILE_SYS_NO_FILE_FOUND, fileSysIndexFind(imgName, &id));
+}
+
+// whether the image has a file of its own
+static bool hasFile(const char *imgName){
+    char path[FF_MOCK_NAME_LEN];
+
+    snprintf(path, sizeof(path), IMAGE_DIR "/%s.RAW", imgName);
+    return fileFind(path) != NULL;
+}
+
+// puts a file on the card behind the index's back, like a card reader would
+static void copyToCard(const char *imgName, u8 content){
+    char path[FF_MOCK_NAME_LEN];
+    mockFile_t *file;
+
+    snprintf(path, sizeof(path), IMAGE_DIR "/%s.RAW", imgName);
+    file = fileFind(path);
+    if(file == NULL){
+        file = fileNew(path, false);
+    }
+    file->len = 0;
+    fileResize(file, DISP_FB_SIZE);
+    memset(file->dat, content, DISP_FB_SIZE);
+}
+
+static u32 imageFiles(void){
+    fSysStorageInfo_t info;
+
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysGetStorageInfo(&info));
+    TEST_ASSERT_TRUE(info.filesKnown);
+    return info.imageFiles;
+}
+
+static fSysIndexInfo_t indexInfo(void){
+    fSysIndexInfo_t info;
+
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysIndexGetInfo(&info));
+    return info;
+}
+
+void setUp(void){
+    fsReset();
+    initFs();
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, mountFs());
+}
+
+void tearDown(void){
+    fsReset();
+}
+
+/********** tests **********/
+void test_dedup(void){
+    saveImage("a", CONTENT_X);
+    writeImage("b", CONTENT_X, true);
+    assertImage("a", CONTENT_X);
+    assertImage("b", CONTENT_X);
+    TEST_ASSERT_TRUE(hasFile("a"));
+    TEST_ASSERT_FALSE(hasFile("b"));
+    TEST_ASSERT_EQUAL(2, indexInfo().count);
+    TEST_ASSERT_EQUAL(1, imageFiles());
+
+    // saved again as it was
+    writeImage("a", CONTENT_X, true);
+    TEST_ASSERT_EQUAL(1, imageFiles());
+}
+
+void test_overwriteOwnerWithSharers(void){
+    saveImage("a", CONTENT_X);
+    saveImage("b", CONTENT_X);
+    saveImage("c", CONTENT_X);
+
+    // b gets the file of a before it's overwritten, and c follows it
+    writeImage("a", CONTENT_Y, false);
+    assertImage("a", CONTENT_Y);
+    assertImage("b", CONTENT_X);
+    assertImage("c", CONTENT_X);
+    TEST_ASSERT_TRUE(hasFile("a"));
+    TEST_ASSERT_TRUE(hasFile("b"));
+    TEST_ASSERT_FALSE(hasFile("c"));
+    TEST_ASSERT_EQUAL(3, indexInfo().count);
+    TEST_ASSERT_EQUAL(2, imageFiles());
+
+    // now sharing the file of another
+    saveImage("a", CONTENT_X);
+    assertImage("a", CONTENT_X);
+    TEST_ASSERT_FALSE(hasFile("a"));
+    TEST_ASSERT_EQUAL(1, imageFiles());
+}
+
+void test_deleteOwner(void){
+    u8 hash[FILE_SYS_HASH_LEN];
+    char imgName[MAX_IMAGE_NAME_LEN];
+
+    saveImage("a", CONTENT_X);
+    saveImage("b", CONTENT_X);
+    saveImage("c", CONTENT_X);
+
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysDelImage("a"));
+    assertNoImage("a");
+    assertImage("b", CONTENT_X);
+    assertImage("c", CONTENT_X);
+    TEST_ASSERT_FALSE(hasFile("a"));
+    TEST_ASSERT_TRUE(hasFile("b"));
+    TEST_ASSERT_EQUAL(2, indexInfo().count);
+    TEST_ASSERT_EQUAL(1, imageFiles());
+
+    // the content is found under its new owner
+    mbedtls_sha256(frame, DISP_FB_SIZE, hash, 0);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysFindHash(hash, imgName));
+    TEST_ASSERT_EQUAL_STRING("b", imgName);
+}
+
+void test_deleteLastReference(void){
+    u8 hash[FILE_SYS_HASH_LEN];
+    char imgName[MAX_IMAGE_NAME_LEN];
+
+    saveImage("a", CONTENT_X);
+    saveImage("b", CONTENT_X);
+    mbedtls_sha256(frame, DISP_FB_SIZE, hash, 0);
+
+    // one sharing the file goes without touching it
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysDelImage("b"));
+    assertNoImage("b");
+    assertImage("a", CONTENT_X);
+    TEST_ASSERT_EQUAL(1, imageFiles());
+
+    // the last one takes the content with it
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysDelImage("a"));
+    assertNoImage("a");
+    TEST_ASSERT_FALSE(hasFile("a"));
+    TEST_ASSERT_EQUAL(0, indexInfo().count);
+    TEST_ASSERT_EQUAL(0, imageFiles());
+    TEST_ASSERT_EQUAL(FILE_SYS_NO_FILE_FOUND, fileSysFindHash(hash, imgName));
+    TEST_ASSERT_EQUAL(FILE_SYS_NO_FILE_FOUND, fileSysImageLink("c", hash));
+}
+
+void test_link(void){
+    u8 hash[FILE_SYS_HASH_LEN];
+
+    saveImage("a", CONTENT_X);
+    mbedtls_sha256(frame, DISP_FB_SIZE, hash, 0);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysImageLink("b", hash));
+    assertImage("b", CONTENT_X);
+    TEST_ASSERT_FALSE(hasFile("b"));
+}
+
+void test_imageHash(void){
+    u8 hashX[FILE_SYS_HASH_LEN];
+    u8 hashY[FILE_SYS_HASH_LEN];
+    u8 hash[FILE_SYS_HASH_LEN];
+
+    saveImage("a", CONTENT_X);
+    mbedtls_sha256(frame, DISP_FB_SIZE, hashX, 0);
+    saveImage("b", CONTENT_X);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysGetImageHash("b", hash));
+    TEST_ASSERT_EQUAL_MEMORY(hashX, hash, FILE_SYS_HASH_LEN);
+
+    // saved again with other content, b keeps the old
+    writeImage("a", CONTENT_Y, false);
+    mbedtls_sha256(frame, DISP_FB_SIZE, hashY, 0);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysGetImageHash("a", hash));
+    TEST_ASSERT_EQUAL_MEMORY(hashY, hash, FILE_SYS_HASH_LEN);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysGetImageHash("b", hash));
+    TEST_ASSERT_EQUAL_MEMORY(hashX, hash, FILE_SYS_HASH_LEN);
+
+    // not known for a file copied in until it's synced
+    copyToCard("c", CONTENT_Z);
+    TEST_ASSERT_EQUAL(FILE_SYS_NO_FILE_FOUND, fileSysGetImageHash("c", hash));
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysIndexSync());
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysGetImageHash("c", hash));
+}
+
+void test_badNames(void){
+    const char *names[] = {"", "a/b", "..\\a", "c:", "a\tb", "a*", "0123456789012345678901234567890123456789"
+                           "0123456789012345678901234567890123456789"};
+    char longest[MAX_IMAGE_NAME_LEN];
+    u8 hash[FILE_SYS_HASH_LEN];
+    fSysImgWriter_t writer;
+
+    saveImage("a", CONTENT_X);
+    mbedtls_sha256(frame, DISP_FB_SIZE, hash, 0);
+    for(u32 i = 0; i < sizeof(names) / sizeof(names[0]); i++){
+        TEST_ASSERT_FALSE(fileSysImageNameValid(names[i]));
+        TEST_ASSERT_EQUAL(FILE_SYS_INVALID_NAME, fileSysSaveImage(names[i], frame));
+        TEST_ASSERT_EQUAL(FILE_SYS_INVALID_NAME, fileSysImageWriteBegin(names[i], &writer));
+        TEST_ASSERT_EQUAL(FILE_SYS_INVALID_NAME, fileSysImageLink(names[i], hash));
+    }
+    TEST_ASSERT_EQUAL(1, indexInfo().count);
+    TEST_ASSERT_EQUAL(1, imageFiles());
+
+    // a name that fills the index record is fine
+    memset(longest, 'b', sizeof(longest) - 1);
+    longest[sizeof(longest) - 1] = '\0';
+    TEST_ASSERT_TRUE(fileSysImageNameValid(longest));
+    TEST_ASSERT_TRUE(fileSysImageNameValid("beach at dawn (2).v2"));
+}
+
+void test_syncRemovedOwner(void){
+    u32 id;
+
+    saveImage("a", CONTENT_X);
+    saveImage("b", CONTENT_X);
+    saveImage("c", CONTENT_Y);
+
+    // the file of a deleted with a card reader, b had nothing but it
+    TEST_ASSERT_EQUAL(FR_OK, f_unlink(IMAGE_DIR "/a.RAW"));
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysIndexSync());
+    assertNoImage("a");
+    assertNoImage("b");
+    assertImage("c", CONTENT_Y);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysIndexFind("c", &id));
+    TEST_ASSERT_EQUAL(2, id);
+    TEST_ASSERT_EQUAL(1, indexInfo().count);
+    TEST_ASSERT_EQUAL(1, imageFiles());
+}
+
+void test_syncCopiedIn(void){
+    saveImage("a", CONTENT_X);
+
+    // the same content copied in is deduped once hashed, other content is added
+    copyToCard("b", CONTENT_X);
+    copyToCard("c", CONTENT_Z);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysIndexSync());
+    assertImage("b", CONTENT_X);
+    assertImage("c", CONTENT_Z);
+    TEST_ASSERT_FALSE(hasFile("b"));
+    TEST_ASSERT_EQUAL(3, indexInfo().count);
+    TEST_ASSERT_EQUAL(2, imageFiles());
+}
+
+void test_indexedNameFirst(void){
+    saveImage("a", CONTENT_X);
+    saveImage("b", CONTENT_X);
+
+    // a stray file with the name of an image sharing another's isn't its content until a sync says so
+    copyToCard("b", CONTENT_Z);
+    assertImage("b", CONTENT_X);
+
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysIndexSync());
+    assertImage("b", CONTENT_Z);
+    assertImage("a", CONTENT_X);
+}
+
+void test_loadById(void){
+    u32 next = 0;
+    u32 id;
+
+    saveImage("a", CONTENT_X);
+    saveImage("b", CONTENT_X);
+    saveImage("c", CONTENT_Y);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysDelImage("a"));
+
+    // b has the file of a now, a stray file with its old name doesn't change that
+    copyToCard("a", CONTENT_Z);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysIndexNext(&next, &id));
+    TEST_ASSERT_EQUAL(1, id);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysLoadImageById(id, frame));
+    TEST_ASSERT_EQUAL_HEX8(CONTENT_X, frame[0]);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysIndexNext(&next, &id));
+    TEST_ASSERT_EQUAL(2, id);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysLoadImageById(id, frame));
+    TEST_ASSERT_EQUAL_HEX8(CONTENT_Y, frame[0]);
+
+    TEST_ASSERT_EQUAL(FILE_SYS_NO_FILE_FOUND, fileSysLoadImageById(0, frame));
+    TEST_ASSERT_EQUAL(FILE_SYS_NO_FILE_FOUND, fileSysLoadImageById(3, frame));
+}
+
+void test_upgradeV1(void){
+    indexHeader_t hdr = {0};
+    char names[4][MAX_IMAGE_NAME_LEN] = {"a", "", "b", "c"};
+    mockFile_t *file;
+    fSysIndexInfo_t info;
+    u32 id;
+
+    // a version 1 index with a removed image, and two images with the same content
+    fsReset();
+    f_mkdir(IMAGE_DIR);
+    f_mkdir(PLAYLIST_DIR);
+    copyToCard("a", CONTENT_X);
+    copyToCard("b", CONTENT_Y);
+    copyToCard("c", CONTENT_X);
+    hdr.magic = INDEX_MAGIC;
+    hdr.version = 1;
+    hdr.recLen = MAX_IMAGE_NAME_LEN;
+    hdr.info.slots = 4;
+    hdr.info.count = 3;
+    hdr.info.generation = 7;
+    hdr.info.epoch = 0xCAFE;
+    file = fileNew(INDEX_PATH, false);
+    fileResize(file, sizeof(hdr) + sizeof(names));
+    memcpy(file->dat, &hdr, sizeof(hdr));
+    memcpy(&file->dat[sizeof(hdr)], names, sizeof(names));
+
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, mountFs());
+
+    // the IDs and epoch are kept, so the playlists still point to the same images
+    info = indexInfo();
+    TEST_ASSERT_EQUAL_HEX32(0xCAFE, info.epoch);
+    TEST_ASSERT_EQUAL(4, info.slots);
+    TEST_ASSERT_EQUAL(3, info.count);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysIndexFind("a", &id));
+    TEST_ASSERT_EQUAL(0, id);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysIndexFind("b", &id));
+    TEST_ASSERT_EQUAL(2, id);
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysIndexFind("c", &id));
+    TEST_ASSERT_EQUAL(3, id);
+    TEST_ASSERT_NULL(fileFind(PLAYLIST_DIR "/IMAGES.TMP"));
+
+    // and hashed, c gave up its copy for a's
+    assertImage("a", CONTENT_X);
+    assertImage("b", CONTENT_Y);
+    assertImage("c", CONTENT_X);
+    TEST_ASSERT_FALSE(hasFile("c"));
+    TEST_ASSERT_EQUAL(2, imageFiles());
+
+    // still the same once mounted again
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, mountFs());
+    TEST_ASSERT_EQUAL_HEX32(0xCAFE, indexInfo().epoch);
+    assertImage("c", CONTENT_X);
+}
+
+void test_writeTmpsRemoved(void){
+    fSysImgWriter_t writer;
+
+    // a reset in the middle of an upload
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, fileSysImageWriteBegin("a", &writer));
+    TEST_ASSERT_NOT_NULL(fileFind(writer.tmpPath));
+    TEST_ASSERT_EQUAL(FILE_SYS_RET_OK, mountFs());
+    TEST_ASSERT_NULL(fileFind(writer.tmpPath));
+}
+
+int main(void){
+    UNITY_BEGIN();
+    RUN_TEST(test_dedup);
+    RUN_TEST(test_overwriteOwnerWithSharers);
+    RUN_TEST(test_deleteOwner);
+    RUN_TEST(test_deleteLastReference);
+    RUN_TEST(test_link);
+    RUN_TEST(test_imageHash);
+    RUN_TEST(test_badNames);
+    RUN_TEST(test_syncRemovedOwner);
+    RUN_TEST(test_syncCopiedIn);
+    RUN_TEST(test_indexedNameFirst);
+    RUN_TEST(test_loadById);
+    RUN_TEST(test_upgradeV1);
+    RUN_TEST(test_writeTmpsRemoved);
+    return UNITY_END();
+}
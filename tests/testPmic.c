@@ -0,0 +1,317 @@
+#include "unity.h"
+#include "mock.h"
+#include "pmic.h"
+#include "axp2101.h"
+#include <string.h>
+
+/**
+ * Tests of the PMIC component against a register level mock of the AXP2101: a register file read and
+ * written through the I2C master driver calls, with auto increment on bursts as the chip does
+ *
+ * Transactions complete as the async driver does, on_trans_done is called later, here once the component
+ * sleeps on its semaphore. Completions can be held back, or fail with a NACK, to test the error paths
+ */
+
+#define MAX_SEMS        4
+#define MAX_PENDING     8
+
+static uint8_t axpRegs[256];
+static int sems[MAX_SEMS + 1];                  // the count of each, handles start at 1
+static int semCnt;
+static i2c_master_callback_t onTransDone;
+
+static i2c_master_event_t pending[MAX_PENDING]; // transactions queued and not done yet
+static int pendingCnt;
+static int maxPending;                          // the most queued at once
+static int transactions;
+static bool holdCompletions;                    // as if the bus hung
+static int nackReg = -1;                        // a transaction from this register gets a NACK
+
+/****************** FreeRTOS ******************/
+SemaphoreHandle_t xSemaphoreCreateMutex(void){
+    TEST_ASSERT_LESS_THAN(MAX_SEMS, semCnt);
+    sems[++semCnt] = 1;
+    return semCnt;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(int maxCnt, int initCnt){
+    (void)maxCnt;
+    TEST_ASSERT_LESS_THAN(MAX_SEMS, semCnt);
+    sems[++semCnt] = initCnt;
+    return semCnt;
+}
+
+static void completePending(void){
+    i2c_master_event_data_t evt;
+
+    for(int i = 0; i < pendingCnt; i++){
+        evt.event = pending[i];
+        onTransDone(NULL, &evt, NULL);
+    }
+    pendingCnt = 0;
+}
+
+int xSemaphoreTake(int contextN, int timeout){
+    // the task sleeps, which is when the queued transactions get done
+    if(timeout != 0 && !holdCompletions){
+        completePending();
+    }
+    if(sems[contextN] == 0){
+        // nothing else runs here, waiting on the mutex would be forever
+        TEST_ASSERT_NOT_EQUAL(portMAX_DELAY, timeout);
+        return pdFALSE;
+    }
+    sems[contextN]--;
+    return pdTRUE;
+}
+
+void xSemaphoreGive(int contextN){
+    sems[contextN]++;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken){
+    sems[sem]++;
+    *woken = pdTRUE;
+    return pdTRUE;
+}
+
+/****************** I2C master driver ******************/
+esp_err_t i2c_master_bus_add_device(i2c_master_bus_handle_t bus, const i2c_device_config_t *cfg,
+                                    i2c_master_dev_handle_t *dev){
+    (void)bus;
+    TEST_ASSERT_EQUAL_HEX(CONFIG_I2C_ADDR_AXP2101, cfg->device_address);
+    *dev = axpRegs;
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_register_event_callbacks(i2c_master_dev_handle_t dev, const i2c_master_event_callbacks_t *cbs,
+                                             void *arg){
+    (void)dev;
+    (void)arg;
+    onTransDone = cbs->on_trans_done;
+    return ESP_OK;
+}
+
+static void queueTransaction(i2c_master_event_t result){
+    TEST_ASSERT_LESS_THAN(MAX_PENDING, pendingCnt);
+    pending[pendingCnt++] = result;
+    if(pendingCnt > maxPending){
+        maxPending = pendingCnt;
+    }
+    transactions++;
+}
+
+esp_err_t i2c_master_transmit(i2c_master_dev_handle_t dev, const uint8_t *write, size_t writeLen, int timeout){
+    (void)dev;
+    (void)timeout;
+    if(write[0] == nackReg){
+        queueTransaction(I2C_EVENT_NACK);
+        return ESP_OK;
+    }
+    for(size_t i = 1; i < writeLen; i++){
+        uint8_t reg = (write[0] + i - 1) & 0xFF;
+        // the IRQ status is write 1 to clear
+        if(reg >= APX2101_REG_INTSTS1 && reg < APX2101_REG_INTSTS1 + PMIC_IRQ_REGS){
+            axpRegs[reg] &= ~write[i];
+        }else{
+            axpRegs[reg] = write[i];
+        }
+    }
+    queueTransaction(I2C_EVENT_DONE);
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_transmit_receive(i2c_master_dev_handle_t dev, const uint8_t *write, size_t writeLen,
+                                      uint8_t *read, size_t readLen, int timeout){
+    (void)dev;
+    (void)timeout;
+    TEST_ASSERT_EQUAL(1, writeLen);
+    if(write[0] == nackReg){
+        queueTransaction(I2C_EVENT_NACK);
+        return ESP_OK;
+    }
+    for(size_t i = 0; i < readLen; i++){
+        read[i] = axpRegs[(write[0] + i) & 0xFF];
+    }
+    queueTransaction(I2C_EVENT_DONE);
+    return ESP_OK;
+}
+
+/****************** Tests ******************/
+static void setTelemetryRegs(void){
+    axpRegs[APX2101_REG_PMU_STAT_1] = 0x29;                 // VBUS good, battery present, current limited
+    axpRegs[APX2101_REG_PMU_STAT_1 + 1] = (PMIC_CHR_DIR_DISCHARGE << 5) | PMIC_CHR_STAT_NO_CHARGE;
+    axpRegs[APX2101_REG_MON_VBAT_BASE] = 0xEF;              // 4000 mV, with the bits above 13 set
+    axpRegs[APX2101_REG_MON_VBAT_BASE + 1] = 0xA0;
+    axpRegs[APX2101_REG_MON_TS_BASE] = 0x55;
+    axpRegs[APX2101_REG_MON_TS_BASE + 1] = 0x55;
+    axpRegs[APX2101_REG_MON_VBUS_BASE] = 0x13;              // 5000 mV
+    axpRegs[APX2101_REG_MON_VBUS_BASE + 1] = 0x88;
+    axpRegs[APX2101_REG_MON_VSYS_BASE] = 0x0C;              // 3300 mV
+    axpRegs[APX2101_REG_MON_VSYS_BASE + 1] = 0xE4;
+    axpRegs[APX2101_REG_BATT_PERC] = 87;
+}
+
+void setUp(void) {
+    i2c_master_bus_handle_t bus = NULL;
+
+    memset(axpRegs, 0, sizeof(axpRegs));
+    memset(sems, 0, sizeof(sems));
+    semCnt = 0;
+    pendingCnt = 0;
+    holdCompletions = false;
+    nackReg = -1;
+    pmicInit(&bus);
+    transactions = 0;
+    maxPending = 0;
+}
+
+void tearDown(void) {
+}
+
+void test_init(void){
+    i2c_master_bus_handle_t bus = NULL;
+
+    semCnt = 0;
+    axpRegs[APX2101_REG_SLEEP_WAKE] = 0x09;                 // asleep, PWROK low on wake
+    pmicInit(&bus);
+    TEST_ASSERT_EQUAL_HEX8(0x03, axpRegs[APX2101_REG_SLEEP_WAKE]);
+    TEST_ASSERT_EQUAL_HEX8(0x3D, axpRegs[APX2101_REG_ADC_EN]);
+    TEST_ASSERT_EQUAL_HEX8(APX2101_DCDC_VOLT_3V3, axpRegs[APX2101_REG_DC1_VOLT]);
+    TEST_ASSERT_EQUAL_HEX8(0x04, axpRegs[APX2101_REG_LDO_EN0]);
+    TEST_ASSERT_EQUAL_HEX8(APX2101_ALDO_VOLT_3V3, axpRegs[APX2101_REG_ALDO4_VOLT]);
+    TEST_ASSERT_EQUAL(0, pendingCnt);
+}
+
+void test_telemetryDecode(void){
+    pmicTelemetry t;
+
+    setTelemetryRegs();
+    TEST_ASSERT_EQUAL(ESP_OK, pmicGetTelemetry(&t));
+    TEST_ASSERT_EQUAL_UINT16(4000, pmicBattMv(&t));
+    TEST_ASSERT_EQUAL_UINT16(5000, pmicVBusMv(&t));
+    TEST_ASSERT_EQUAL_UINT16(3300, pmicSysMv(&t));
+    TEST_ASSERT_EQUAL_UINT8(87, pmicBattPct(&t));
+    TEST_ASSERT_TRUE(pmicVBusGood(&t));
+    TEST_ASSERT_TRUE(pmicBattPresent(&t));
+    TEST_ASSERT_TRUE(pmicCurrLimited(&t));
+    TEST_ASSERT_EQUAL(PMIC_CHR_DIR_DISCHARGE, pmicChargeDir(&t));
+    TEST_ASSERT_EQUAL(PMIC_CHR_STAT_NO_CHARGE, pmicChargeStat(&t));
+
+    axpRegs[APX2101_REG_PMU_STAT_1] = 0x00;
+    axpRegs[APX2101_REG_PMU_STAT_1 + 1] = (PMIC_CHR_DIR_CHARGE << 5) | PMIC_CHR_STAT_CV;
+    TEST_ASSERT_EQUAL(ESP_OK, pmicGetTelemetry(&t));
+    TEST_ASSERT_FALSE(pmicVBusGood(&t));
+    TEST_ASSERT_FALSE(pmicBattPresent(&t));
+    TEST_ASSERT_FALSE(pmicCurrLimited(&t));
+    TEST_ASSERT_EQUAL(PMIC_CHR_DIR_CHARGE, pmicChargeDir(&t));
+    TEST_ASSERT_EQUAL(PMIC_CHR_STAT_CV, pmicChargeStat(&t));
+}
+
+/**
+ * The three bursts are queued together, then waited on once
+ */
+void test_telemetryBursts(void){
+    pmicTelemetry t;
+
+    TEST_ASSERT_EQUAL(ESP_OK, pmicGetTelemetry(&t));
+    TEST_ASSERT_EQUAL(3, transactions);
+    TEST_ASSERT_EQUAL(3, maxPending);
+    TEST_ASSERT_EQUAL(0, pendingCnt);
+}
+
+void test_telemetryNack(void){
+    pmicTelemetry t;
+    pmicTelemetry before;
+
+    memset(&t, 0xA5, sizeof(t));
+    memcpy(&before, &t, sizeof(t));
+    setTelemetryRegs();
+    nackReg = APX2101_REG_BATT_PERC;
+    TEST_ASSERT_EQUAL(ESP_FAIL, pmicGetTelemetry(&t));
+    TEST_ASSERT_EQUAL_MEMORY(&before, &t, sizeof(t));
+    TEST_ASSERT_EQUAL(1, sems[1]);                          // the mutex was given back
+
+    nackReg = -1;
+    TEST_ASSERT_EQUAL(ESP_OK, pmicGetTelemetry(&t));
+    TEST_ASSERT_EQUAL_UINT8(87, pmicBattPct(&t));
+}
+
+/**
+ * A read that timed out must not have its late completions counted for the next one
+ */
+void test_telemetryLateCompletion(void){
+    pmicTelemetry t;
+
+    setTelemetryRegs();
+    holdCompletions = true;
+    TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT, pmicGetTelemetry(&t));
+    holdCompletions = false;
+    completePending();
+    TEST_ASSERT_EQUAL(3, sems[2]);
+
+    axpRegs[APX2101_REG_BATT_PERC] = 42;
+    TEST_ASSERT_EQUAL(ESP_OK, pmicGetTelemetry(&t));
+    TEST_ASSERT_EQUAL_UINT8(42, pmicBattPct(&t));
+    TEST_ASSERT_EQUAL(0, sems[2]);
+}
+
+void test_ldos(void){
+    pmicEnableLDOs();
+    TEST_ASSERT_EQUAL_HEX8(0x0C, axpRegs[APX2101_REG_LDO_EN0]);
+    pmicDisableLDOs();
+    TEST_ASSERT_EQUAL_HEX8(0x04, axpRegs[APX2101_REG_LDO_EN0]);
+    pmicDisableLDOsAll();
+    TEST_ASSERT_EQUAL_HEX8(0x00, axpRegs[APX2101_REG_LDO_EN0]);
+    TEST_ASSERT_EQUAL(3, transactions);
+    TEST_ASSERT_EQUAL(1, maxPending);
+}
+
+void test_irqEnable(void){
+    axpRegs[APX2101_REG_INTSTS1 + 1] = 0xFF;                // raised before boot
+    TEST_ASSERT_EQUAL(ESP_OK, pmicIrqEnable(PMIC_IRQ_VBUS_INSERT | PMIC_IRQ_BATT_WARN | PMIC_IRQ_CHARGE_DONE));
+    TEST_ASSERT_EQUAL_HEX8(0x40, axpRegs[APX2101_REG_INTEN1]);
+    TEST_ASSERT_EQUAL_HEX8(0x80, axpRegs[APX2101_REG_INTEN1 + 1]);
+    TEST_ASSERT_EQUAL_HEX8(0x10, axpRegs[APX2101_REG_INTEN1 + 2]);
+    TEST_ASSERT_EQUAL_HEX8(0x00, axpRegs[APX2101_REG_INTSTS1 + 1]);
+}
+
+/**
+ * Only the IRQs read are cleared, so one whose read timed out is still there for the next
+ */
+void test_irqReadClear(void){
+    uint32_t irqs;
+
+    TEST_ASSERT_EQUAL(ESP_OK, pmicIrqReadClear(&irqs));
+    TEST_ASSERT_EQUAL_HEX32(0, irqs);
+    TEST_ASSERT_EQUAL(1, transactions);                     // nothing to clear
+
+    axpRegs[APX2101_REG_INTSTS1 + 1] = 0x80;
+    axpRegs[APX2101_REG_INTSTS1 + 2] = 0x10;
+    TEST_ASSERT_EQUAL(ESP_OK, pmicIrqReadClear(&irqs));
+    TEST_ASSERT_EQUAL_HEX32(PMIC_IRQ_VBUS_INSERT | PMIC_IRQ_CHARGE_DONE, irqs);
+    TEST_ASSERT_EQUAL_HEX8(0x00, axpRegs[APX2101_REG_INTSTS1 + 1]);
+    TEST_ASSERT_EQUAL_HEX8(0x00, axpRegs[APX2101_REG_INTSTS1 + 2]);
+
+    holdCompletions = true;
+    axpRegs[APX2101_REG_INTSTS1 + 1] = 0x40;                // VBUS remove, read late
+    TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT, pmicIrqReadClear(&irqs));
+    holdCompletions = false;
+    completePending();
+    axpRegs[APX2101_REG_INTSTS1] = 0x40;                    // battery warning, raised since
+    TEST_ASSERT_EQUAL(ESP_OK, pmicIrqReadClear(&irqs));
+    TEST_ASSERT_EQUAL_HEX32(PMIC_IRQ_VBUS_REMOVE | PMIC_IRQ_BATT_WARN, irqs);
+}
+
+int main(void){
+    UNITY_BEGIN();
+    RUN_TEST(test_init);
+    RUN_TEST(test_telemetryDecode);
+    RUN_TEST(test_telemetryBursts);
+    RUN_TEST(test_telemetryNack);
+    RUN_TEST(test_telemetryLateCompletion);
+    RUN_TEST(test_ldos);
+    RUN_TEST(test_irqEnable);
+    RUN_TEST(test_irqReadClear);
+    return UNITY_END();
+}
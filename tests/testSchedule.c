@@ -0,0 +1,427 @@
+#include "unity.h"
+#include "mock.h"
+#include "common.h"
+#include "schedule.h"
+#include <string.h>
+
+/**
+ * Tests of the playlist schedule policy, on its own and replayed against telemetry traces: a recorded one,
+ * and a simulated discharge checking the battery life target is met. Then the refresh windows, parsed and
+ * walked through a week of wakes
+ */
+
+#define CAPACITY_MAH        1500
+#define BASE_PERIOD_S       300
+#define HM(_H, _M)          ((_H) * 3600 + (_M) * 60)      // S since midnight
+#define SUN                 0
+#define MON                 1
+#define FRI                 5
+#define SAT                 6
+
+// such as a deep sleeping device, refreshing with the measured charge of pwrStats.h
+#define SIM_BASELINE_MA     0.3f
+#define SIM_REFRESH_MAH     0.42f
+
+// the PMIC_SAMPLE_ flags of pmicHist.h
+#define VBUS    0x01
+#define BATT    0x02
+
+static schedPolicy_t policy;
+static schedInput_t in;
+
+/**
+ * A day of /api/v1/pmic/history?tier=hour from a device on battery, plugged in for the evening
+ * [tsS, battMv, sysMv, vBusMv, battPct, flags]
+ */
+static const u32 recordedTrace[][6] = {
+    {1760000400, 3950, 3940,    0, 62, BATT},
+    {1760004000, 3920, 3910,    0, 55, BATT},
+    {1760007600, 3890, 3880,    0, 48, BATT},
+    {1760011200, 3850, 3840,    0, 40, BATT},
+    {1760014800, 3790, 3780,    0, 31, BATT},
+    {1760018400, 3720, 3710,    0, 22, BATT},
+    {1760022000, 3650, 3640,    0, 14, BATT},
+    {1760025600, 3590, 3580,    0,  9, BATT},
+    {1760029200, 4050, 5010, 5020, 20, VBUS | BATT},
+    {1760032800, 4120, 5010, 5020, 45, VBUS | BATT},
+    {1760036400, 4160, 5010, 5020, 71, VBUS | BATT},
+    {1760040000, 4080, 4070,    0, 70, BATT},
+};
+
+void setUp(void) {
+    schedPolicyDefault(&policy, CAPACITY_MAH);
+    policy.enabled = true;
+    policy.targetDays = 30;
+    policy.quietStartS = 0;
+    policy.quietEndS = 0;
+    policy.calendar = NULL;
+    memset(&in, 0, sizeof(in));
+    in.basePeriodS = BASE_PERIOD_S;
+    in.battPresent = true;
+    in.battPct = 100;
+}
+
+void tearDown(void) {
+}
+
+void test_external(void){
+    schedReason_e reason;
+
+    in.vBusGood = true;
+    in.battPct = 5;
+    in.refreshMah = SIM_REFRESH_MAH;
+    TEST_ASSERT_EQUAL_UINT32(BASE_PERIOD_S, schedNextPeriodS(&policy, &in, &reason));
+    TEST_ASSERT_EQUAL(SCHED_REASON_EXTERNAL, reason);
+
+    // no battery, it can only be on external power
+    in.vBusGood = false;
+    in.battPresent = false;
+    TEST_ASSERT_EQUAL_UINT32(BASE_PERIOD_S, schedNextPeriodS(&policy, &in, &reason));
+    TEST_ASSERT_EQUAL(SCHED_REASON_EXTERNAL, reason);
+}
+
+void test_disabled(void){
+    schedReason_e reason;
+
+    policy.enabled = false;
+    in.battPct = 5;
+    in.refreshMah = SIM_REFRESH_MAH;
+    TEST_ASSERT_EQUAL_UINT32(BASE_PERIOD_S, schedNextPeriodS(&policy, &in, &reason));
+    TEST_ASSERT_EQUAL(SCHED_REASON_BASE, reason);
+}
+
+void test_battStretch(void){
+    schedReason_e reason;
+
+    in.battPct = 80;
+    TEST_ASSERT_EQUAL_UINT32(BASE_PERIOD_S, schedNextPeriodS(&policy, &in, &reason));
+    TEST_ASSERT_EQUAL(SCHED_REASON_BASE, reason);
+
+    in.battPct = SCHED_STRETCH_FROM_PCT;
+    TEST_ASSERT_EQUAL_UINT32(BASE_PERIOD_S, schedNextPeriodS(&policy, &in, NULL));
+
+    // halfway between, halfway to the most
+    in.battPct = (SCHED_STRETCH_FROM_PCT + SCHED_STRETCH_TO_PCT) / 2;
+    TEST_ASSERT_UINT32_WITHIN(1, BASE_PERIOD_S * (1 + SCHED_MAX_STRETCH) / 2, schedNextPeriodS(&policy, &in, &reason));
+    TEST_ASSERT_EQUAL(SCHED_REASON_BATTERY, reason);
+
+    in.battPct = 1;
+    TEST_ASSERT_EQUAL_UINT32(BASE_PERIOD_S * SCHED_MAX_STRETCH, schedNextPeriodS(&policy, &in, NULL));
+
+    // never past the longest, unless that's what was configured
+    in.basePeriodS = SCHED_MAX_PERIOD_S / 2;
+    TEST_ASSERT_EQUAL_UINT32(SCHED_MAX_PERIOD_S, schedNextPeriodS(&policy, &in, NULL));
+    in.basePeriodS = SCHED_MAX_PERIOD_S * 2;
+    TEST_ASSERT_EQUAL_UINT32(SCHED_MAX_PERIOD_S * 2, schedNextPeriodS(&policy, &in, NULL));
+}
+
+void test_energy(void){
+    schedReason_e reason;
+    float budgetMa = (float)CAPACITY_MAH * (100 - SCHED_RESERVE_PCT) / 100 / (30 * 24);
+    u32 expect = SIM_REFRESH_MAH / (budgetMa - SIM_BASELINE_MA) * 3600;
+
+    // not measured yet
+    in.baselineMa = SIM_BASELINE_MA;
+    TEST_ASSERT_EQUAL_UINT32(BASE_PERIOD_S, schedNextPeriodS(&policy, &in, NULL));
+
+    in.refreshMah = SIM_REFRESH_MAH;
+    TEST_ASSERT_UINT32_WITHIN(1, expect, schedNextPeriodS(&policy, &in, &reason));
+    TEST_ASSERT_EQUAL(SCHED_REASON_ENERGY, reason);
+
+    // already within the target
+    in.basePeriodS = expect * 2;
+    TEST_ASSERT_EQUAL_UINT32(expect * 2, schedNextPeriodS(&policy, &in, &reason));
+    TEST_ASSERT_EQUAL(SCHED_REASON_BASE, reason);
+
+    // out of reach whatever the period
+    in.basePeriodS = BASE_PERIOD_S;
+    in.baselineMa = budgetMa * 2;
+    TEST_ASSERT_EQUAL_UINT32(SCHED_MAX_PERIOD_S, schedNextPeriodS(&policy, &in, NULL));
+
+    // barely within reach, the period is far beyond what a u32 holds
+    in.baselineMa = budgetMa - 1e-6f;
+    TEST_ASSERT_EQUAL_UINT32(SCHED_MAX_PERIOD_S, schedNextPeriodS(&policy, &in, NULL));
+
+    policy.targetDays = 0;
+    TEST_ASSERT_EQUAL_UINT32(BASE_PERIOD_S, schedNextPeriodS(&policy, &in, NULL));
+}
+
+void test_quiet(void){
+    schedReason_e reason;
+
+    policy.quietStartS = 22 * 3600;
+    policy.quietEndS = 7 * 3600;
+    in.vBusGood = true;
+
+    // the clock isn't set
+    in.localTimeS = 21 * 3600 + 55 * 60;
+    TEST_ASSERT_EQUAL_UINT32(BASE_PERIOD_S, schedNextPeriodS(&policy, &in, NULL));
+
+    // would wake at 22:00, so waits for 7:00, on external power too
+    in.timeValid = true;
+    TEST_ASSERT_EQUAL_UINT32(9 * 3600 + 5 * 60, schedNextPeriodS(&policy, &in, &reason));
+    TEST_ASSERT_EQUAL(SCHED_REASON_QUIET, reason);
+
+    // after midnight
+    in.localTimeS = 3 * 3600;
+    TEST_ASSERT_EQUAL_UINT32(4 * 3600, schedNextPeriodS(&policy, &in, NULL));
+
+    // the end of the quiet hours isn't in them
+    in.localTimeS = 7 * 3600 - BASE_PERIOD_S;
+    TEST_ASSERT_EQUAL_UINT32(BASE_PERIOD_S, schedNextPeriodS(&policy, &in, &reason));
+    TEST_ASSERT_EQUAL(SCHED_REASON_EXTERNAL, reason);
+
+    // not through midnight
+    policy.quietStartS = 12 * 3600;
+    policy.quietEndS = 13 * 3600;
+    in.localTimeS = 12 * 3600;
+    TEST_ASSERT_EQUAL_UINT32(3600, schedNextPeriodS(&policy, &in, NULL));
+    in.localTimeS = 11 * 3600;
+    TEST_ASSERT_EQUAL_UINT32(BASE_PERIOD_S, schedNextPeriodS(&policy, &in, NULL));
+}
+
+/**
+ * Replays the recorded trace: the configured period while plugged in, and longer as it drained on battery
+ */
+void test_recordedTrace(void){
+    schedReason_e reason;
+    u32 period;
+    u32 last = 0;
+
+    in.refreshMah = SIM_REFRESH_MAH;
+    in.baselineMa = SIM_BASELINE_MA;
+    for(u32 i = 0; i < sizeof(recordedTrace) / sizeof(recordedTrace[0]); i++){
+        in.battPct = recordedTrace[i][4];
+        in.vBusGood = (recordedTrace[i][5] & VBUS) != 0;
+        in.battPresent = (recordedTrace[i][5] & BATT) != 0;
+        period = schedNextPeriodS(&policy, &in, &reason);
+
+        if(in.vBusGood){
+            TEST_ASSERT_EQUAL_UINT32(BASE_PERIOD_S, period);
+            TEST_ASSERT_EQUAL(SCHED_REASON_EXTERNAL, reason);
+            last = 0;
+            continue;
+        }
+        TEST_ASSERT_GREATER_OR_EQUAL(BASE_PERIOD_S, period);
+        TEST_ASSERT_GREATER_OR_EQUAL(last, period);
+        TEST_ASSERT_EQUAL(in.battPct < SCHED_STRETCH_FROM_PCT ? SCHED_REASON_BATTERY : SCHED_REASON_ENERGY, reason);
+        last = period;
+    }
+}
+
+/**
+ * Hours a full battery lasts, to SCHED_RESERVE_PCT, waking every scheduled period
+ */
+static float simulateDischarge(void){
+    float mah = CAPACITY_MAH;
+    float reserveMah = (float)CAPACITY_MAH * SCHED_RESERVE_PCT / 100;
+    float hours = 0;
+    u32 period;
+
+    in.refreshMah = SIM_REFRESH_MAH;
+    in.baselineMa = SIM_BASELINE_MA;
+    while(mah > reserveMah){
+        in.battPct = mah * 100 / CAPACITY_MAH;
+        period = schedNextPeriodS(&policy, &in, NULL);
+        mah -= SIM_REFRESH_MAH + SIM_BASELINE_MA * period / 3600;
+        hours += period / 3600.0f;
+    }
+    return hours;
+}
+
+void test_simulatedDischarge(void){
+    float hours;
+
+    policy.enabled = false;
+    hours = simulateDischarge();
+    printf("Configured period: %.1f days\n", hours / 24);
+    TEST_ASSERT_TRUE(hours < policy.targetDays * 24);
+
+    policy.enabled = true;
+    hours = simulateDischarge();
+    printf("Scheduled period: %.1f days\n", hours / 24);
+    TEST_ASSERT_TRUE(hours >= policy.targetDays * 24);
+}
+
+void test_calendarParse(void){
+    schedCalendar_t cal;
+    char out[SCHED_SPEC_MAX_LEN];
+
+    TEST_ASSERT_EQUAL(0, schedCalendarParse("07:00, 18:00", &cal));
+    TEST_ASSERT_EQUAL(2, cal.count);
+    TEST_ASSERT_EQUAL_HEX8(SCHED_DAYS_ALL, cal.windows[0].days);
+    TEST_ASSERT_EQUAL(7 * 60, cal.windows[0].startMin);
+    TEST_ASSERT_EQUAL(7 * 60, cal.windows[0].endMin);
+    TEST_ASSERT_EQUAL(18 * 60, cal.windows[1].startMin);
+
+    TEST_ASSERT_EQUAL(0, schedCalendarParse("Mon-Fri 9:00-17:00/30,sat+sun 10:00-12:00, fri-mon 22:00-02:00/60", &cal));
+    TEST_ASSERT_EQUAL(3, cal.count);
+    TEST_ASSERT_EQUAL_HEX8(0x3E, cal.windows[0].days);
+    TEST_ASSERT_EQUAL(9 * 60, cal.windows[0].startMin);
+    TEST_ASSERT_EQUAL(17 * 60, cal.windows[0].endMin);
+    TEST_ASSERT_EQUAL(30, cal.windows[0].periodMin);
+    TEST_ASSERT_EQUAL_HEX8(0x41, cal.windows[1].days);
+    TEST_ASSERT_EQUAL(0, cal.windows[1].periodMin);
+    TEST_ASSERT_EQUAL_HEX8(0x63, cal.windows[2].days);
+
+    // back the same, give or take the spacing
+    schedCalendarToStr(&cal, out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("mon-fri 09:00-17:00/30, sun+sat 10:00-12:00, sun+mon+fri+sat 22:00-02:00/60", out);
+
+    TEST_ASSERT_EQUAL(0, schedCalendarParse("", &cal));
+    TEST_ASSERT_EQUAL(0, cal.count);
+    schedCalendarToStr(&cal, out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("", out);
+
+    // invalid ones leave it as is
+    TEST_ASSERT_EQUAL(0, schedCalendarParse("07:00", &cal));
+    TEST_ASSERT_NOT_EQUAL(0, schedCalendarParse("7", &cal));
+    TEST_ASSERT_NOT_EQUAL(0, schedCalendarParse("24:00", &cal));
+    TEST_ASSERT_NOT_EQUAL(0, schedCalendarParse("07:60", &cal));
+    TEST_ASSERT_NOT_EQUAL(0, schedCalendarParse("07:00/30", &cal));
+    TEST_ASSERT_NOT_EQUAL(0, schedCalendarParse("07:00-07:00", &cal));
+    TEST_ASSERT_NOT_EQUAL(0, schedCalendarParse("07:00-08:00/0", &cal));
+    TEST_ASSERT_NOT_EQUAL(0, schedCalendarParse("mon07:00", &cal));
+    TEST_ASSERT_NOT_EQUAL(0, schedCalendarParse("xyz 07:00", &cal));
+    TEST_ASSERT_NOT_EQUAL(0, schedCalendarParse("07:00,", &cal));
+    TEST_ASSERT_NOT_EQUAL(0, schedCalendarParse("07:00 08:00", &cal));
+    TEST_ASSERT_NOT_EQUAL(0, schedCalendarParse("1:00,2:00,3:00,4:00,5:00,6:00,7:00,8:00,9:00", &cal));
+    TEST_ASSERT_EQUAL(1, cal.count);
+    TEST_ASSERT_EQUAL(7 * 60, cal.windows[0].startMin);
+}
+
+void test_calendarNext(void){
+    schedCalendar_t cal;
+
+    TEST_ASSERT_EQUAL(0, schedCalendarParse("07:00, 18:00", &cal));
+    TEST_ASSERT_EQUAL_UINT32(HM(7, 0) - HM(3, 0), schedCalendarNextS(&cal, MON, HM(3, 0), BASE_PERIOD_S, 1));
+    TEST_ASSERT_EQUAL_UINT32(HM(18, 0) - HM(7, 0), schedCalendarNextS(&cal, MON, HM(7, 0), BASE_PERIOD_S, 1));
+    TEST_ASSERT_EQUAL_UINT32(HM(24 + 7, 0) - HM(18, 0), schedCalendarNextS(&cal, MON, HM(18, 0), BASE_PERIOD_S, 1));
+    // an RTC running fast woke a bit early, that's the 7:00 one
+    TEST_ASSERT_EQUAL_UINT32(HM(18, 0) - HM(6, 59), schedCalendarNextS(&cal, MON, HM(6, 59), BASE_PERIOD_S, 1));
+
+    TEST_ASSERT_EQUAL(0, schedCalendarParse("mon-fri 09:00-17:00/30", &cal));
+    TEST_ASSERT_EQUAL_UINT32(HM(9, 30) - HM(9, 0), schedCalendarNextS(&cal, MON, HM(9, 0), BASE_PERIOD_S, 1));
+    // back on the window's beat after a late wake
+    TEST_ASSERT_EQUAL_UINT32(HM(10, 0) - HM(9, 32), schedCalendarNextS(&cal, MON, HM(9, 32), BASE_PERIOD_S, 1));
+    // the end is out, so the last is 16:30, then Monday
+    TEST_ASSERT_EQUAL_UINT32(HM(24 + 9, 0) - HM(16, 30), schedCalendarNextS(&cal, MON, HM(16, 30), BASE_PERIOD_S, 1));
+    TEST_ASSERT_EQUAL_UINT32(HM(3 * 24 + 9, 0) - HM(16, 30), schedCalendarNextS(&cal, FRI, HM(16, 30), BASE_PERIOD_S, 1));
+    // stretched on a low battery
+    TEST_ASSERT_EQUAL_UINT32(HM(10, 0) - HM(9, 0), schedCalendarNextS(&cal, MON, HM(9, 0), BASE_PERIOD_S, 2));
+
+    // through midnight, starting Saturday only
+    TEST_ASSERT_EQUAL(0, schedCalendarParse("sat 22:00-02:00/60", &cal));
+    TEST_ASSERT_EQUAL_UINT32(HM(1, 0) - HM(0, 10), schedCalendarNextS(&cal, SUN, HM(0, 10), BASE_PERIOD_S, 1));
+    TEST_ASSERT_EQUAL_UINT32(HM(6 * 24 + 22, 0) - HM(1, 30), schedCalendarNextS(&cal, SUN, HM(1, 30), BASE_PERIOD_S, 1));
+
+    // the configured period, and a single wake a week
+    TEST_ASSERT_EQUAL(0, schedCalendarParse("10:00-11:00", &cal));
+    TEST_ASSERT_EQUAL_UINT32(BASE_PERIOD_S, schedCalendarNextS(&cal, MON, HM(10, 0), BASE_PERIOD_S, 1));
+    TEST_ASSERT_EQUAL(0, schedCalendarParse("sun 12:00", &cal));
+    TEST_ASSERT_EQUAL_UINT32(7 * SCHED_DAY_S, schedCalendarNextS(&cal, SUN, HM(12, 0), BASE_PERIOD_S, 1));
+
+    cal.count = 0;
+    TEST_ASSERT_EQUAL_UINT32(0, schedCalendarNextS(&cal, MON, HM(12, 0), BASE_PERIOD_S, 1));
+}
+
+void test_calendarPolicy(void){
+    schedCalendar_t cal;
+    schedReason_e reason;
+
+    TEST_ASSERT_EQUAL(0, schedCalendarParse("07:00, 18:00", &cal));
+    policy.calendar = &cal;
+    policy.quietStartS = HM(22, 0);
+    policy.quietEndS = HM(6, 0);
+    in.localTimeS = HM(12, 0);
+    in.weekday = MON;
+
+    // the clock isn't set, so the configured period
+    TEST_ASSERT_EQUAL_UINT32(BASE_PERIOD_S, schedNextPeriodS(&policy, &in, &reason));
+    TEST_ASSERT_EQUAL(SCHED_REASON_BASE, reason);
+
+    in.timeValid = true;
+    TEST_ASSERT_EQUAL_UINT32(HM(6, 0), schedNextPeriodS(&policy, &in, &reason));
+    TEST_ASSERT_EQUAL(SCHED_REASON_WINDOW, reason);
+
+    // whatever the battery policy says, and with it off too
+    in.battPct = 5;
+    in.refreshMah = SIM_REFRESH_MAH;
+    TEST_ASSERT_EQUAL_UINT32(HM(6, 0), schedNextPeriodS(&policy, &in, &reason));
+    TEST_ASSERT_EQUAL(SCHED_REASON_WINDOW, reason);
+    policy.enabled = false;
+    TEST_ASSERT_EQUAL_UINT32(HM(6, 0), schedNextPeriodS(&policy, &in, &reason));
+    TEST_ASSERT_EQUAL(SCHED_REASON_WINDOW, reason);
+}
+
+/**
+ * Walks through a week of window wakes, from Sunday midnight
+ *
+ * Returns how many there were
+ */
+static u32 walkWeek(const schedCalendar_t *cal, u32 wakes[], u32 maxWakes){
+    u32 t = 0;
+    u32 cnt = 0;
+    u32 next;
+
+    for(EVER){
+        next = schedCalendarNextS(cal, (t / SCHED_DAY_S) % 7, t % SCHED_DAY_S, BASE_PERIOD_S, 1);
+        TEST_ASSERT_NOT_EQUAL(0, next);
+        t += next;
+        if(t >= 7 * SCHED_DAY_S){
+            return cnt;
+        }
+        TEST_ASSERT_LESS_THAN(maxWakes, cnt);
+        wakes[cnt++] = t;
+    }
+}
+
+void test_calendarWeek(void){
+    schedCalendar_t cal;
+    u32 wakes[128];
+    u32 cnt;
+    u32 day;
+    u32 tod;
+
+    // twice a day, and no other wake
+    TEST_ASSERT_EQUAL(0, schedCalendarParse("07:00, 18:00", &cal));
+    cnt = walkWeek(&cal, wakes, 128);
+    TEST_ASSERT_EQUAL(14, cnt);
+    for(u32 i = 0; i < cnt; i++){
+        tod = wakes[i] % SCHED_DAY_S;
+        TEST_ASSERT_TRUE(tod == HM(7, 0) || tod == HM(18, 0));
+    }
+
+    // office hours, 16 a day for 5 days, all in them
+    TEST_ASSERT_EQUAL(0, schedCalendarParse("mon-fri 09:00-17:00/30", &cal));
+    cnt = walkWeek(&cal, wakes, 128);
+    TEST_ASSERT_EQUAL(5 * 16, cnt);
+    for(u32 i = 0; i < cnt; i++){
+        day = wakes[i] / SCHED_DAY_S;
+        tod = wakes[i] % SCHED_DAY_S;
+        TEST_ASSERT_TRUE(day >= MON && day <= FRI);
+        TEST_ASSERT_TRUE(tod >= HM(9, 0) && tod < HM(17, 0));
+        TEST_ASSERT_EQUAL(0, tod % (30 * 60));
+    }
+
+    // overlapping windows wake once for both
+    TEST_ASSERT_EQUAL(0, schedCalendarParse("08:00-10:00/60, 09:00", &cal));
+    cnt = walkWeek(&cal, wakes, 128);
+    TEST_ASSERT_EQUAL(7 * 2, cnt);
+}
+
+int main(void){
+    UNITY_BEGIN();
+    RUN_TEST(test_external);
+    RUN_TEST(test_disabled);
+    RUN_TEST(test_battStretch);
+    RUN_TEST(test_energy);
+    RUN_TEST(test_quiet);
+    RUN_TEST(test_recordedTrace);
+    RUN_TEST(test_simulatedDischarge);
+    RUN_TEST(test_calendarParse);
+    RUN_TEST(test_calendarNext);
+    RUN_TEST(test_calendarPolicy);
+    RUN_TEST(test_calendarWeek);
+    return UNITY_END();
+}
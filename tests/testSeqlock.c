@@ -0,0 +1,174 @@
+#include "unity.h"
+#include "mock.h"
+#include "common.h"
+#include "seqlock.h"
+#include <string.h>
+#include <pthread.h>
+
+/**
+ * Stress tests of the sequence lock used for the run state (see runStateGet() in main.h). Reader and
+ * writer threads hammer a state shaped like it, with a pthread mutex standing in for the writer lock
+ *
+ * Every field of the state is written with the same value, so a reader seeing two different values
+ * saw a torn write
+ */
+
+#define READERS             4
+#define WRITERS             2
+#define WRITES_PER_WRITER   200000
+
+typedef struct{
+    u32 runMode;
+    u32 mode;
+    u32 period;
+    u32 playlistId;
+    u32 currIdx;
+    u32 shuffleSeed;
+    u32 shufflePos;
+    u32 pad[9];                     // a bigger copy, to widen the window for a torn read
+}testState_t;
+
+static testState_t state;
+static seqlock_t lock = SEQLOCK_INIT;
+static pthread_mutex_t writerMutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile bool writersDone;
+
+typedef struct{
+    u32 reads;
+    u32 retries;
+    u32 torn;                       // reads with fields from different writes
+    u32 backwards;                  // reads older than one before them
+}readerStats_t;
+
+static bool isConsistent(const testState_t *st){
+    const u32 *f = (const u32 *)st;
+
+    for(u32 i = 1; i < sizeof(testState_t) / sizeof(u32); i++){
+        if(f[i] != f[0]){
+            return false;
+        }
+    }
+    return true;
+}
+
+static void fillState(testState_t *st, u32 val){
+    u32 *f = (u32 *)st;
+
+    for(u32 i = 0; i < sizeof(testState_t) / sizeof(u32); i++){
+        f[i] = val;
+    }
+}
+
+/**
+ * Like runStateEdit() then runStateCommit(), a read-modify-write under the writer lock
+ */
+static void *writerThread(void *arg){
+    testState_t st;
+
+    (void)arg;
+    for(u32 n = 0; n < WRITES_PER_WRITER; n++){
+        pthread_mutex_lock(&writerMutex);
+        memcpy(&st, &state, sizeof(testState_t));
+        fillState(&st, st.runMode + 1);
+        seqlockWrite(&lock, &state, &st, sizeof(testState_t));
+        pthread_mutex_unlock(&writerMutex);
+    }
+    return NULL;
+}
+
+static void *readerThread(void *arg){
+    readerStats_t *stats = arg;
+    testState_t st;
+    u32 last = 0;
+
+    while(!writersDone){
+        stats->retries += seqlockRead(&lock, &st, &state, sizeof(testState_t));
+        stats->reads++;
+        if(!isConsistent(&st)){
+            stats->torn++;
+        }
+        if(st.runMode < last){
+            stats->backwards++;
+        }
+        last = st.runMode;
+    }
+    return NULL;
+}
+
+void setUp(void) {
+    memset(&state, 0, sizeof(state));
+    lock.seq = 0;
+    writersDone = false;
+}
+
+void tearDown(void) {
+}
+
+void test_roundTrip(void){
+    testState_t in;
+    testState_t out;
+
+    fillState(&in, 1234);
+    seqlockWrite(&lock, &state, &in, sizeof(testState_t));
+    TEST_ASSERT_EQUAL_UINT32(0, seqlockRead(&lock, &out, &state, sizeof(testState_t)));
+    TEST_ASSERT_EQUAL_MEMORY(&in, &out, sizeof(testState_t));
+    TEST_ASSERT_EQUAL_UINT32(1, seqlockGetWrites(&lock));
+    TEST_ASSERT_EQUAL_UINT32(0, lock.seq & 1);
+}
+
+/**
+ * A writer holding the writer lock for long (such as runStateEdit() around an SD card read) must not
+ * hold up readers
+ */
+void test_readWhileWriterLocked(void){
+    testState_t out;
+
+    fillState(&state, 7);
+    pthread_mutex_lock(&writerMutex);
+    TEST_ASSERT_EQUAL_UINT32(0, seqlockRead(&lock, &out, &state, sizeof(testState_t)));
+    pthread_mutex_unlock(&writerMutex);
+    TEST_ASSERT_EQUAL_UINT32(7, out.currIdx);
+}
+
+void test_stress(void){
+    pthread_t writers[WRITERS];
+    pthread_t readers[READERS];
+    readerStats_t stats[READERS] = {0};
+    u32 reads = 0;
+    u32 retries = 0;
+
+    for(u32 i = 0; i < READERS; i++){
+        TEST_ASSERT_EQUAL(0, pthread_create(&readers[i], NULL, readerThread, &stats[i]));
+    }
+    for(u32 i = 0; i < WRITERS; i++){
+        TEST_ASSERT_EQUAL(0, pthread_create(&writers[i], NULL, writerThread, NULL));
+    }
+    for(u32 i = 0; i < WRITERS; i++){
+        pthread_join(writers[i], NULL);
+    }
+    writersDone = true;
+    for(u32 i = 0; i < READERS; i++){
+        pthread_join(readers[i], NULL);
+    }
+
+    for(u32 i = 0; i < READERS; i++){
+        TEST_ASSERT_EQUAL_UINT32(0, stats[i].torn);
+        TEST_ASSERT_EQUAL_UINT32(0, stats[i].backwards);
+        reads += stats[i].reads;
+        retries += stats[i].retries;
+    }
+    printf("%u reads, %u retries\n", reads, retries);
+
+    // no write was lost between the writers
+    TEST_ASSERT_EQUAL_UINT32(WRITERS * WRITES_PER_WRITER, state.runMode);
+    TEST_ASSERT_TRUE(isConsistent(&state));
+    TEST_ASSERT_EQUAL_UINT32(WRITERS * WRITES_PER_WRITER, seqlockGetWrites(&lock));
+}
+
+int main(void){
+    UNITY_BEGIN();
+    RUN_TEST(test_roundTrip);
+    RUN_TEST(test_readWhileWriterLocked);
+    RUN_TEST(test_stress);
+    return UNITY_END();
+}
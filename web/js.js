@@ -31,6 +31,13 @@ document.addEventListener("DOMContentLoaded", async () => {
     createEntryFrame('ent_pmic_vbusOk', "Is VBus OK?", 'label');
     createEntryFrame('ent_pmic_battPres', "Is Battery Present?", 'label');
     createEntryFrame('ent_pmic_currLim', "Is Current Limit?", 'label');
+    createEntryFrame('ent_pwr_lightSleep', "Light Sleep", 'label');
+    createEntryFrame('ent_pwr_cpuMax', "CPU at Max Freq", 'label');
+    createEntryFrame('ent_pwr_disp', "Display Refreshing", 'label');
+    createEntryFrame('ent_pwr_modemSleep', "WiFi Modem Sleep", 'label');
+    createEntryFrame('ent_pwr_refreshMah', "Charge per Refresh", 'label');
+    createEntryFrame('ent_pwr_drainMa', "Average Current", 'label');
+    createEntryFrame('ent_pwr_projected', "Battery Life Left", 'label');
 
     createEntryFrame('ent_uploadImgName', "Image Name", 'input');
 
@@ -184,7 +191,8 @@ function apiGetWifiInfo(){
 }
 
 function apiGetVersion(){
-    fetch("/api/v1/version").then(async (resp) => {
+    // sets the frame's clock if it's off, for its refresh windows
+    fetch("/api/v1/version", {headers: {"X-Client-Time": `${Date.now() / 1000}`}}).then(async (resp) => {
         const j = await resp.json();
         if(j['stat'] != 'ok'){
             // todo: general error handler!
@@ -230,6 +238,33 @@ function apiGetPmicInfo(){
         getEnt('ent_pmic_battPres').textContent = j['battPresent'];
         getEnt('ent_pmic_currLim').textContent = j['currLimited'];
     });
+    apiGetPowerStats();
+}
+
+function apiGetPowerStats(){
+    fetch("/api/v1/status").then(async (resp) => {
+        const j = await resp.json();
+        if(j['stat'] != 'ok'){
+            // todo: general error handler!
+            return;
+        }
+        const p = j['power'];
+        // time in a state as a share of the uptime, '-' if the firmware doesn't count it
+        const pct = (/** @type {number|undefined} */ us) => {
+            return us === undefined ? "-" : `${(100 * us / p['uptimeUs']).toFixed(1)} %`;
+        };
+        // the estimates are 0 until known
+        const est = (/** @type {number} */ val, /** @type {string} */ unit, /** @type {number} */ digits) => {
+            return val > 0 ? `${val.toFixed(digits)} ${unit}` : "-";
+        };
+        getEnt('ent_pwr_lightSleep').textContent = pct(p['cpuUs']?.['lightSleep']);
+        getEnt('ent_pwr_cpuMax').textContent = pct(p['cpuUs']?.['cpuMax']);
+        getEnt('ent_pwr_disp').textContent = pct(p['dispUs']);
+        getEnt('ent_pwr_modemSleep').textContent = pct(p['wifiUs']['modemSleep']);
+        getEnt('ent_pwr_refreshMah').textContent = est(p['refreshMah'], "mAh", 2);
+        getEnt('ent_pwr_drainMa').textContent = est(p['drainMa'], "mA", 1);
+        getEnt('ent_pwr_projected').textContent = est(p['projectedH'], "h", 1);
+    });
 }
 
 function apiGetImgList(){
@@ -300,7 +335,8 @@ function clickShowImg(imgName){
             return;
         }
 
-        makePostReqOk("/api/v1/img/load", {name: imgName}, () => {
+        // loading is done by a job on the device, wait on it so the update shows the new image
+        makePostReqOk("/api/v1/img/load?wait=1", {name: imgName}, () => {
             // after the above is a success, then update the display
             makePostReqOk("/api/v1/disp/update");
         });
@@ -360,7 +396,7 @@ function clickDeleteImg(imgName){
     }
     console.log(`Deleting image ${imgName}`);
     // make the request to delete the image, and also refresh the existing list after a successful request
-    makePostReqOk("/api/v1/img/delete", {name: imgName}, apiGetImgList);
+    makePostReqOk("/api/v1/img/delete?wait=1", {name: imgName}, apiGetImgList);
 }
 
 async function uploadedImageForDev(){
@@ -414,17 +450,19 @@ async function sentImageToDevice(){
     const byteData = ditheredImgToBytes(dithered);
 
 
-    const reqUpload = fetch("/api/v1/img/upload", {method: "POST", body: byteData, headers: {"Content-Type": "application/octet-stream"}});
-    reqUpload.then(async (resp) => {
+    // upload and save in one go, without showing it
+    const pushPath = `/api/v1/img/push?name=${encodeURIComponent(uploadName)}&store=1&show=0`;
+    const reqPush = fetch(pushPath, {method: "POST", body: byteData, headers: {"Content-Type": "application/octet-stream"}});
+    reqPush.then(async (resp) => {
         const j = await resp.json();
-        console.log(`Response for upload`);
+        console.log(`Response for push`);
         console.log(j);
         if(j['stat'] != 'ok' || !resp.ok){
-            console.error(`Request did not return ok: ${path}`)
+            console.error(`Request did not return ok: ${pushPath}`)
             // todo: general error handler!
             return;
         }
-        // then we save to the SD card. If that one was successful, then we reload the image list
-        makePostReqOk("/api/v1/img/save", {name: uploadName}, apiGetImgList);
+        // if the image was saved, then we reload the image list
+        apiGetImgList();
     });
 }
\ No newline at end of file
@@ -15,10 +15,12 @@ import urllib.request
 import urllib.error
 import json
 import os
+import hashlib
 import random
 import argparse
 
 DEFAULT_ESP32_IP = "http://p1160.local"
+IMG_BATCH_MAX_OPS = 64      # as main/network.h, so the sim refuses the batches the device would
 
 
 class Esp32DeviceHandler(SimpleHTTPRequestHandler):
@@ -58,11 +60,45 @@ class Esp32DeviceHandler(SimpleHTTPRequestHandler):
 
 class SimHttpHandlerVars:
     imgList = ["Image1.RAW", "Image2.RAW", "Image3.RAW"]
+    imgHashes = {}          # content SHA-256 by image name, for the ones pushed to the sim
+    generation = 0          # of the image index, moves on with every add or delete
     esp32Url = DEFAULT_ESP32_IP
 
     @classmethod
     def reset(cls):
         cls.imgList = ["Image1.RAW", "Image2.RAW", "Image3.RAW"]
+        cls.imgHashes = {}
+        cls.generation += 1
+
+    @classmethod
+    def hashOf(cls, name: str) -> str:
+        # the stock images stand for content of their own
+        return cls.imgHashes.get(name, hashlib.sha256(name.encode()).hexdigest())
+
+    @classmethod
+    def addImg(cls, name: str, sha: str):
+        if name + '.RAW' not in cls.imgList:
+            cls.imgList.append(name + '.RAW')
+        cls.imgHashes[name] = sha
+        cls.generation += 1
+
+    @classmethod
+    def delImg(cls, name: str) -> bool:
+        name = name.removesuffix('.RAW')
+        if name + '.RAW' not in cls.imgList:
+            return False
+        cls.imgList.remove(name + '.RAW')
+        cls.imgHashes.pop(name, None)
+        cls.generation += 1
+        return True
+
+    @classmethod
+    def findHash(cls, sha: str):
+        for img in cls.imgList:
+            name = img.removesuffix('.RAW')
+            if cls.hashOf(name) == sha:
+                return name
+        return None
 
 
 class SimHttpHandler(SimpleHTTPRequestHandler):
@@ -114,6 +150,22 @@ class SimHttpHandler(SimpleHTTPRequestHandler):
                 'stat': 'ok',
                 'img': SimHttpHandlerVars.imgList,
             })
+        elif p == '/api/v1/img/manifest':
+            imgs = [img.removesuffix('.RAW') for img in SimHttpHandlerVars.imgList]
+            return self._json(payload={
+                'stat': 'ok',
+                'generation': SimHttpHandlerVars.generation,
+                'epoch': 1,
+                'count': len(imgs),
+                'img': [{'id': i, 'name': name, 'size': 192000, 'sha256': SimHttpHandlerVars.hashOf(name)}
+                        for i, name in enumerate(imgs)],
+            })
+        elif p == '/api/v1/img/hash':
+            sha = parse_qs(urlparse(self.path).query).get('sha256', [''])[0].lower()
+            name = SimHttpHandlerVars.findHash(sha)
+            if name is None:
+                return self._json(404, {'stat': 'no image has that content'})
+            return self._json(payload={'stat': 'ok', 'name': name})
         else:
             if p.startswith("/api"):
                 print(f"UNKNOWN_API: {p}")
@@ -123,11 +175,42 @@ class SimHttpHandler(SimpleHTTPRequestHandler):
         p = urlparse(self.path).path
         cntLen = int(self.headers.get("Content-Length", 0))
         b = self.rfile.read(cntLen)
-        print(f"Mode POST request with url {p} with data {b}")
-        self._json(payload={'stat': 'ok'})
-        if p == '/api/v1/img/delete':
+        print(f"Mode POST request with url {p} with data {b[:256]}")
+        if p == '/api/v1/img/push':
+            q = parse_qs(urlparse(self.path).query)
+            sha = hashlib.sha256(b).hexdigest()
+            deduped = SimHttpHandlerVars.findHash(sha) is not None
+            if q.get('store', ['1'])[0] == '1' and 'name' in q:
+                SimHttpHandlerVars.addImg(q['name'][0], sha)
+            return self._json(payload={'stat': 'ok', 'stored': 'name' in q, 'shown': q.get('show', ['1'])[0] == '1',
+                                       'deduped': deduped, 'recvMs': 0, 'sdMs': 0, 'totalMs': 0})
+        elif p == '/api/v1/img/link':
             dat = json.loads(b)
-            SimHttpHandlerVars.imgList.remove(dat['name'])
+            if SimHttpHandlerVars.findHash(dat['sha256'].lower()) is None:
+                return self._json(404, {'stat': 'no image has that content'})
+            SimHttpHandlerVars.addImg(dat['name'], dat['sha256'].lower())
+        elif p == '/api/v1/img/batch':
+            dat = json.loads(b)
+            if len(dat.get('ops', [])) > IMG_BATCH_MAX_OPS:
+                return self._json(400, {'stat': 'JSON invalid: ops not an array, or too many of them'})
+            if 'generation' in dat and dat['generation'] != SimHttpHandlerVars.generation:
+                return self._json(409, {'stat': 'the images changed since that generation, get the manifest again'})
+            results = []
+            for op in dat['ops']:
+                if op.get('op') == 'delete':
+                    stat = 'ok' if SimHttpHandlerVars.delImg(op['name']) else 'not found'
+                elif op.get('op') == 'link' and SimHttpHandlerVars.findHash(op['sha256'].lower()) is not None:
+                    SimHttpHandlerVars.addImg(op['name'], op['sha256'].lower())
+                    stat = 'ok'
+                else:
+                    stat = 'not found' if op.get('op') == 'link' else 'invalid'
+                results.append({'name': op.get('name', ''), 'stat': stat})
+            return self._json(payload={'stat': 'ok', 'results': results,
+                                       'generation': SimHttpHandlerVars.generation})
+        elif p == '/api/v1/img/delete':
+            dat = json.loads(b)
+            SimHttpHandlerVars.delImg(dat['name'])
+        self._json(payload={'stat': 'ok'})
 
 
 def main():